@@ -0,0 +1,962 @@
+#include "PetSpace.h"
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cstdio>
+
+/**
+ * @class TimedCommand
+ * @brief Logs a message and records when it was dispatched
+ */
+class TimedCommand : public LogMessageCommand {
+private:
+    std::chrono::steady_clock::time_point* dispatched;
+
+public:
+    TimedCommand(ChatRoom* room, User* user, const std::string& msg,
+                 std::chrono::steady_clock::time_point* when)
+        : LogMessageCommand(room, user, msg), dispatched(when) {
+    }
+
+    void execute() override {
+        if (dispatched) {
+            *dispatched = std::chrono::steady_clock::now();
+        }
+        LogMessageCommand::execute();
+    }
+};
+
+/**
+ * @brief Floods a room with one member's traffic, then measures how long a
+ *        moderator's command waits when the room dispatches both queues
+ * @param floodSize Number of ordinary commands queued ahead of the admin command
+ * @param prioritised false forces every command to Normal, i.e. plain FIFO
+ * @return Microseconds between the start of the drain and the admin command running
+ */
+long long floodLatency(int floodSize, bool prioritised) {
+    CtrlCat room;
+    User1 member("Member");
+    User1 moderator("Moderator");
+    moderator.setAdmin(true);
+    member.joinChatRoom(&room);
+    moderator.joinChatRoom(&room);
+
+    for (int i = 0; i < floodSize; i++) {
+        member.addCommand(new TimedCommand(&room, &member, "Flood " + std::to_string(i), nullptr));
+    }
+    std::chrono::steady_clock::time_point dispatched;
+    TimedCommand* moderation = new TimedCommand(&room, &moderator, "Slow down please", &dispatched);
+    if (!prioritised) {
+        moderation->setPriority(CommandPriority::Normal);
+    }
+    moderator.addCommand(moderation);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    room.dispatchCommands();
+    member.leaveChatRoom(&room);
+    moderator.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(dispatched - start).count();
+}
+
+/**
+ * @brief Times sending a run of messages one by one or as a single batch
+ * @param count Number of messages sent
+ * @param batched true to use User::sendBatch()
+ * @return Microseconds spent sending
+ */
+long long sendThroughput(int count, bool batched) {
+    Dogorithm room;
+    User1 bot("Bot");
+    User2 reader("Reader");
+    User3 lurker("Lurker");
+    bot.joinChatRoom(&room);
+    reader.joinChatRoom(&room);
+    lurker.joinChatRoom(&room);
+
+    std::vector<std::string> messages;
+    for (int i = 0; i < count; i++) {
+        messages.push_back("Bridged message number " + std::to_string(i));
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (batched) {
+        bot.sendBatch(messages, &room);
+    } else {
+        for (const std::string& message : messages) {
+            bot.send(message, &room);
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    bot.leaveChatRoom(&room);
+    reader.leaveChatRoom(&room);
+    lurker.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times a bot feeding a room that already has history in small batches
+ * @param history Messages sent before timing starts
+ * @param batches Two-message batches sent while timed
+ * @return Microseconds spent sending the batches
+ */
+long long smallBatchCost(int history, int batches) {
+    Dogorithm room;
+    User1 bot("Bot");
+    User2 reader("Reader");
+    bot.joinChatRoom(&room);
+    reader.joinChatRoom(&room);
+    for (int i = 0; i < history; i++) {
+        bot.send("Earlier message " + std::to_string(i), &room);
+    }
+
+    std::vector<std::string> batch = {"Bridged line one", "Bridged line two"};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < batches; i++) {
+        bot.sendBatch(batch, &room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    bot.leaveChatRoom(&room);
+    reader.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times an announcement to many overlapping rooms
+ * @param roomCount Number of rooms the announcer is in
+ * @param deduplicated true to use User::broadcast(), false to send() per room
+ * @return Microseconds spent announcing
+ *
+ * Every listener joins eight rooms, so per-room sends deliver each
+ * listener the announcement eight times.
+ */
+long long broadcastCost(int roomCount, bool deduplicated) {
+    const int listenerCount = 200;
+    std::vector<CustomChatRoom*> rooms;
+    std::vector<User2*> listeners;
+    User1 announcer("Announcer");
+    for (int i = 0; i < roomCount; i++) {
+        rooms.push_back(new CustomChatRoom("Room " + std::to_string(i)));
+        announcer.joinChatRoom(rooms.back());
+    }
+    for (int i = 0; i < listenerCount; i++) {
+        listeners.push_back(new User2("Listener " + std::to_string(i)));
+        for (int j = 0; j < 8; j++) {
+            listeners.back()->joinChatRoom(rooms[(i + j * 37) % roomCount]);
+        }
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (deduplicated) {
+        announcer.broadcast("Scheduled maintenance tonight");
+    } else {
+        for (CustomChatRoom* room : rooms) {
+            announcer.send("Scheduled maintenance tonight", room);
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    for (User2* listener : listeners) {
+        delete listener;
+    }
+    for (CustomChatRoom* room : rooms) {
+        delete room;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times a private exchange via sendDirect() or a two-person room
+ * @param count Number of messages exchanged
+ * @param direct true to use User::sendDirect()
+ * @return Microseconds spent, including setting up the room
+ */
+long long directCost(int count, bool direct) {
+    User1 alice("Alice");
+    User2 bob("Bob");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (direct) {
+        for (int i = 0; i < count; i++) {
+            alice.sendDirect(bob.getHandle(), "Private note " + std::to_string(i));
+        }
+    } else {
+        CustomChatRoom room("Alice & Bob");
+        alice.joinChatRoom(&room);
+        bob.joinChatRoom(&room);
+        for (int i = 0; i < count; i++) {
+            alice.send("Private note " + std::to_string(i), &room);
+        }
+        alice.leaveChatRoom(&room);
+        bob.leaveChatRoom(&room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times scanning messages for mentions in a room of a given size
+ * @param memberCount Number of room members (one pattern each)
+ * @param scans Number of messages scanned
+ * @return Nanoseconds per scanned message
+ */
+long long mentionScanCost(int memberCount, int scans) {
+    CustomChatRoom room("Town Hall");
+    std::vector<User3*> members;
+    for (int i = 0; i < memberCount; i++) {
+        members.push_back(new User3("member_" + std::to_string(i)));
+        members.back()->joinChatRoom(&room);
+    }
+    MentionMatcher matcher;
+    matcher.rebuild(room.getUsers());
+    std::string text = "Reminder for @member_7 and @member_3: the @everyone meeting moved to 15:00, bring notes";
+    std::size_t hits = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < scans; i++) {
+        hits += matcher.match(text).size();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (User3* member : members) {
+        member->leaveChatRoom(&room);
+        delete member;
+    }
+    return hits ? std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / scans : 0;
+}
+
+/**
+ * @brief Times guests joining, mentioning a member and leaving again
+ * @param memberCount Number of long-standing room members
+ * @param cycles Number of join + mention + leave cycles
+ * @return Microseconds for all cycles
+ */
+long long mentionChurnCost(int memberCount, int cycles) {
+    CustomChatRoom room("Town Hall");
+    std::vector<User3*> members;
+    for (int i = 0; i < memberCount; i++) {
+        members.push_back(new User3("member_" + std::to_string(i)));
+        members.back()->joinChatRoom(&room);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < cycles; i++) {
+        User1 guest("guest_" + std::to_string(i));
+        guest.joinChatRoom(&room);
+        guest.send("Hello @member_3", &room);
+        guest.leaveChatRoom(&room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (User3* member : members) {
+        delete member;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times creating, looking up and tearing down many custom rooms
+ * @param roomCount Number of rooms
+ * @return Microseconds for the whole cycle
+ */
+long long registryCycleCost(int roomCount) {
+    ChatRoomRegistry registry;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < roomCount; i++) {
+        registry.create("Room " + std::to_string(i));
+    }
+    for (int i = 0; i < roomCount; i++) {
+        registry.find("Room " + std::to_string(i));
+    }
+    registry.teardown();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Times a snapshot round trip of a synthetic deployment
+ * @param userCount Number of users
+ * @param roomCount Number of rooms (each user joins four)
+ * @param messages Number of messages spread over the rooms
+ * @param saveMicros Receives the time to write the snapshot
+ * @return Microseconds to restore the snapshot
+ */
+long long snapshotCost(int userCount, int roomCount, int messages, long long& saveMicros) {
+    std::vector<User*> users;
+    std::vector<ChatRoom*> rooms;
+    for (int i = 0; i < roomCount; i++) {
+        rooms.push_back(new CustomChatRoom("Room " + std::to_string(i)));
+    }
+    for (int i = 0; i < userCount; i++) {
+        users.push_back(new User1("User " + std::to_string(i)));
+        for (int j = 0; j < 4; j++) {
+            users.back()->joinChatRoom(rooms[(i + j * 7) % roomCount]);
+        }
+    }
+    for (int i = 0; i < messages; i++) {
+        User* sender = users[i % userCount];
+        sender->send("Status update number " + std::to_string(i), sender->getChatRooms()[i % 4]);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PetSpaceSnapshot::save("bench.snap", users, rooms);
+    std::chrono::steady_clock::time_point saved = std::chrono::steady_clock::now();
+    std::vector<User*> restoredUsers;
+    std::vector<ChatRoom*> restoredRooms;
+    PetSpaceSnapshot::load("bench.snap", restoredUsers, restoredRooms);
+    std::chrono::steady_clock::time_point restored = std::chrono::steady_clock::now();
+    std::remove("bench.snap");
+
+    for (std::vector<ChatRoom*>* list : {&rooms, &restoredRooms}) {
+        for (ChatRoom* room : *list) {
+            std::vector<User*> members(room->getUsers().begin(), room->getUsers().end());
+            for (User* member : members) {
+                member->leaveChatRoom(room);
+            }
+            delete room;
+        }
+    }
+    for (std::vector<User*>* list : {&users, &restoredUsers}) {
+        for (User* user : *list) {
+            delete user;
+        }
+    }
+    saveMicros = std::chrono::duration_cast<std::chrono::microseconds>(saved - start).count();
+    return std::chrono::duration_cast<std::chrono::microseconds>(restored - saved).count();
+}
+
+/**
+ * @brief Measures send throughput with the command journal off or on
+ * @param count Number of messages sent
+ * @param group Records per group commit (0 = journal disabled)
+ * @return Messages per second
+ */
+long long journalThroughput(int count, std::size_t group) {
+    CtrlCat room;
+    User1 writer("Writer");
+    User2 reader("Reader");
+    writer.joinChatRoom(&room);
+    reader.joinChatRoom(&room);
+    CommandJournal* journal = nullptr;
+    if (group) {
+        std::remove("bench.wal");
+        journal = new CommandJournal("bench.wal", group, 1.0);
+        journal->setCatalog({&writer, &reader}, {&room});
+        CommandJournal::install(journal);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        writer.send("Durable message " + std::to_string(i), &room);
+    }
+    if (journal) {
+        journal->sync();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    CommandJournal::install(nullptr);
+    delete journal;
+    std::remove("bench.wal");
+    writer.leaveChatRoom(&room);
+    reader.leaveChatRoom(&room);
+    long long micros = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    return micros ? count * 1000000LL / micros : 0;
+}
+
+/**
+ * @brief Records a synthetic workload, then replays it as fast as possible
+ * @param messages Number of sends in the workload
+ * @param events Receives the number of events replayed
+ * @return Microseconds spent replaying
+ */
+long long traceReplayCost(int messages, std::size_t& events) {
+    TraceRecorder* recorder = new TraceRecorder("bench.trace");
+    TraceRecorder::install(recorder);
+    {
+        Dogorithm room;
+        std::vector<User*> users;
+        for (int i = 0; i < 50; i++) {
+            users.push_back(new User2("Traced " + std::to_string(i)));
+            users.back()->joinChatRoom(&room);
+        }
+        for (int i = 0; i < messages; i++) {
+            users[i % users.size()]->send("Traced message " + std::to_string(i), &room);
+        }
+        for (User* user : users) {
+            user->leaveChatRoom(&room);
+            delete user;
+        }
+    }
+    TraceRecorder::install(nullptr);
+    delete recorder;
+
+    TraceReplayer replayer;
+    replayer.load("bench.trace");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    events = replayer.run();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::remove("bench.trace");
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @class RenderingUser
+ * @brief Recipient that consumes the display form of every message
+ */
+class RenderingUser : public User1 {
+public:
+    std::size_t bytes;
+    RenderingUser(const std::string& name) : User1(name), bytes(0) {}
+    void receiveEnvelope(const MessageEnvelope& envelope) override {
+        bytes += envelope.view().size();
+    }
+};
+
+/**
+ * @brief Sends messages into a room whose members all render them
+ * @param members Number of rendering recipients
+ * @param messages Number of messages sent
+ * @return Microseconds spent sending
+ */
+long long renderCost(int members, int messages) {
+    CtrlCat room;
+    User1 sender("Render sender");
+    sender.joinChatRoom(&room);
+    std::vector<User*> users;
+    for (int i = 0; i < members; i++) {
+        users.push_back(new RenderingUser("Render " + std::to_string(i)));
+        users.back()->joinChatRoom(&room);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++) {
+        sender.send("Rendered message " + std::to_string(i), &room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (User* user : users) {
+        user->leaveChatRoom(&room);
+        delete user;
+    }
+    sender.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @struct LoopClient
+ * @brief Inbox consumer that re-arms itself each time the loop wakes it
+ */
+struct LoopClient {
+    UserInbox* inbox;
+    std::vector<InboxMessage> batch;
+    std::size_t received;
+
+    static void wake(void* self) {
+        LoopClient* client = static_cast<LoopClient*>(self);
+        while (client->inbox->drainOrWait(client->batch, 64, &LoopClient::wake, client) && !client->batch.empty()) {
+            client->received += client->batch.size();
+            client->batch.clear();
+        }
+    }
+};
+
+/**
+ * @brief Fans messages out to inbox clients driven by one event loop
+ * @param clients Number of inbox clients in the room
+ * @param messages Number of messages sent
+ * @param received Receives the number of messages consumed
+ * @return Microseconds spent sending and running the loop
+ */
+long long inboxLoopCost(int clients, int messages, std::size_t& received) {
+    EventLoop loop;
+    CtrlCat room;
+    User1 sender("Inbox sender");
+    sender.joinChatRoom(&room);
+    std::vector<User*> users;
+    std::vector<LoopClient> loopClients(clients);
+    for (int i = 0; i < clients; i++) {
+        users.push_back(new User2("Inbox " + std::to_string(i)));
+        users.back()->setState(new Offline());
+        users.back()->joinChatRoom(&room);
+        loopClients[i].inbox = new UserInbox(users.back(), loop);
+        loopClients[i].received = 0;
+        LoopClient::wake(&loopClients[i]);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++) {
+        sender.send("Inbox message " + std::to_string(i), &room);
+        if (i % 16 == 15) {
+            loop.run();
+        }
+    }
+    loop.run();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    received = 0;
+    for (int i = 0; i < clients; i++) {
+        received += loopClients[i].received;
+        delete loopClients[i].inbox;
+        users[i]->leaveChatRoom(&room);
+        delete users[i];
+    }
+    sender.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Sends a skewed workload, where a few bots send most messages
+ * @param workers Executor worker count, or 0 to send synchronously
+ * @return Microseconds until every command has run
+ */
+long long executorCost(std::size_t workers) {
+    std::vector<ChatRoom*> rooms;
+    std::vector<User*> users;
+    for (int r = 0; r < 16; r++) {
+        rooms.push_back(new CtrlCat());
+    }
+    for (int i = 0; i < 64; i++) {
+        users.push_back(new User2("Executor " + std::to_string(i)));
+        users.back()->setState(new Offline());
+        users.back()->joinChatRoom(rooms[i % rooms.size()]);
+    }
+    WorkStealingExecutor* executor = workers ? new WorkStealingExecutor(workers, 32) : nullptr;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 20000; i++) {
+        for (std::size_t u = 0; u < users.size(); u++) {
+            if (u < 4 || i % 100 == 0) {
+                ChatRoom* room = rooms[u % rooms.size()];
+                if (executor) {
+                    users[u]->sendAsync("Executor message", room, *executor);
+                } else {
+                    users[u]->send("Executor message", room);
+                }
+            }
+        }
+    }
+    if (executor) {
+        executor->waitIdle();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    delete executor;
+    for (std::size_t u = 0; u < users.size(); u++) {
+        users[u]->leaveChatRoom(rooms[u % rooms.size()]);
+        delete users[u];
+    }
+    for (ChatRoom* room : rooms) {
+        delete room;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @class SlowUser
+ * @brief Recipient that takes about 20us to handle each message
+ */
+class SlowUser : public User1 {
+public:
+    SlowUser(const std::string& name) : User1(name) {}
+    void receive(const Message&, User*, ChatRoom*) override {
+        std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+        while (std::chrono::steady_clock::now() < until) {
+        }
+    }
+};
+
+/**
+ * @brief Sends into a room where one member is slow
+ * @param members Number of members besides the sender
+ * @param rings Whether members get ring mailboxes
+ * @return Microseconds spent sending 1000 messages
+ */
+long long slowFanoutCost(int members, bool rings) {
+    CtrlCat room;
+    User1 sender("Fanout sender");
+    sender.joinChatRoom(&room);
+    std::vector<User*> users;
+    std::vector<RingMailbox*> mailboxes;
+    for (int i = 0; i < members; i++) {
+        if (i == 0) {
+            users.push_back(new SlowUser("Slow member"));
+        } else {
+            users.push_back(new User2("Fanout " + std::to_string(i)));
+            users.back()->setState(new Offline());
+        }
+        users.back()->joinChatRoom(&room);
+        if (rings) {
+            mailboxes.push_back(new RingMailbox(users.back(), 2048, OverflowPolicy::Reject));
+        }
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1000; i++) {
+        sender.send("Fanout message", &room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (RingMailbox* mailbox : mailboxes) {
+        delete mailbox;
+    }
+    for (User* user : users) {
+        user->leaveChatRoom(&room);
+        delete user;
+    }
+    sender.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Sends into a room with an optional history memory cap
+ * @param cap History memory cap in bytes (0 = unbounded)
+ * @param held Receives the history and index bytes the room reports afterwards
+ * @return Microseconds spent sending 20000 messages
+ */
+long long memoryCapCost(std::size_t cap, std::size_t& held) {
+    CtrlCat room;
+    User1 sender("Capped sender");
+    sender.joinChatRoom(&room);
+    if (cap) {
+        room.setMemoryCap(cap);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 20000; i++) {
+        sender.send("Capped message " + std::to_string(i), &room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    RoomMemoryUsage usage = room.getMemoryUsage();
+    held = usage.history + usage.index;
+    sender.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Member that the user table cannot classify, so fanout visits it
+ */
+class VisitedUser : public User2 {
+public:
+    VisitedUser(const std::string& name) : User2(name) {}
+};
+
+/**
+ * @brief Sends into a large room of offline members
+ * @param members Number of members besides the sender
+ * @param scanned Whether members are plain facades the user table can skip
+ * @return Microseconds spent sending 100 messages
+ */
+long long tableFanoutCost(int members, bool scanned) {
+    CtrlCat room;
+    User1 sender("Table sender");
+    sender.joinChatRoom(&room);
+    std::vector<User*> users;
+    for (int i = 0; i < members; i++) {
+        if (scanned) {
+            users.push_back(new User2("Member " + std::to_string(i)));
+        } else {
+            users.push_back(new VisitedUser("Member " + std::to_string(i)));
+        }
+        users.back()->setState(new Offline());
+        users.back()->joinChatRoom(&room);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+        sender.send("Table message", &room);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (User* user : users) {
+        delete user;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Catches a reader up on a long history after ten new messages
+ * @param history Messages already read
+ * @param cursor Whether the reader fetches from its read cursor instead of re-reading everything
+ * @return Microseconds spent catching up
+ */
+long long catchUpCost(int history, bool cursor) {
+    CtrlCat room;
+    User1 sender("Catch-up sender");
+    User2 reader("Catch-up reader");
+    sender.joinChatRoom(&room);
+    reader.joinChatRoom(&room);
+    for (int i = 0; i < history; i++) {
+        sender.send("Old message", &room);
+    }
+    reader.acknowledge(&room);
+    for (int i = 0; i < 10; i++) {
+        sender.send("New message", &room);
+    }
+    std::size_t seen = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Iterator* iterator = cursor ? reader.fetchUnread(&room) : room.createIterator();
+    while (iterator->hasNext()) {
+        seen += iterator->next().size();
+    }
+    delete iterator;
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    sender.leaveChatRoom(&room);
+    reader.leaveChatRoom(&room);
+    return seen ? std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() : -1;
+}
+
+/**
+ * @brief Searches a history that has mostly gone cold
+ * @param history Messages sent into a room keeping 256 of them in memory
+ * @param found Receives the number of positions the last search returned
+ * @return Microseconds spent on 100 keyword and sender searches
+ */
+long long coldSearchCost(int history, std::size_t& found) {
+    CtrlCat room;
+    User1 sender("Archive sender");
+    sender.joinChatRoom(&room);
+    room.setHistoryRetention(HistoryRetention(256, 0, 64));
+    for (int i = 0; i < history; i++) {
+        sender.send("Archived message " + std::to_string(i) + " topic" + std::to_string(i % 50), &room);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+        found = room.searchHistory("topic" + std::to_string(i % 50), i % 2 ? "Archive sender" : "").size();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    sender.leaveChatRoom(&room);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Posts the same announcements into many rooms
+ * @param rooms Number of rooms
+ * @param shared Whether a payload store de-duplicates the histories
+ * @param saved Receives the payload bytes the store saved
+ * @return Microseconds spent posting
+ */
+long long announcementCost(int rooms, bool shared, std::size_t& saved) {
+    PayloadStore store;
+    if (shared) {
+        PayloadStore::install(&store);
+    }
+    User1 bot("Announcer");
+    std::vector<ChatRoom*> targets;
+    for (int r = 0; r < rooms; r++) {
+        targets.push_back(new CtrlCat());
+        bot.joinChatRoom(targets.back());
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+        std::string text = "Announcement " + std::to_string(i % 10) + ": " + std::string(200, '*');
+        for (ChatRoom* room : targets) {
+            bot.send(text, room);
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    saved = store.getSavedBytes();
+    for (ChatRoom* room : targets) {
+        bot.leaveChatRoom(room);
+        delete room;
+    }
+    PayloadStore::install(nullptr);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+/**
+ * @brief Flaps users across shared rooms and ticks the presence hub periodically
+ * @param flaps Number of state changes
+ * @param delivered Receives the number of presence updates delivered
+ * @return Microseconds spent changing state and ticking
+ */
+long long presenceCost(int flaps, unsigned long long& delivered) {
+    PresenceHub hub;
+    PresenceHub::install(&hub);
+    std::vector<ChatRoom*> rooms;
+    std::vector<User*> users;
+    for (int r = 0; r < 10; r++) {
+        rooms.push_back(new CtrlCat());
+    }
+    for (int i = 0; i < 200; i++) {
+        users.push_back(new User1("Present " + std::to_string(i)));
+        for (ChatRoom* room : rooms) {
+            users.back()->joinChatRoom(room);
+            hub.subscribe(users.back(), room);
+        }
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < flaps; i++) {
+        User* user = users[i % 20];
+        if (i % 2) {
+            user->setState(new Online());
+        } else {
+            user->setState(new Busy());
+        }
+        if (i % 1000 == 999) {
+            hub.tick();
+        }
+    }
+    hub.tick();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    delivered = hub.getDeliveredCount();
+    PresenceHub::install(nullptr);
+    for (User* user : users) {
+        for (ChatRoom* room : rooms) {
+            user->leaveChatRoom(room);
+        }
+        delete user;
+    }
+    for (ChatRoom* room : rooms) {
+        delete room;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+int main() {
+    const int sizes[] = {1000, 10000, 50000};
+    std::cout << "flood size | FIFO admin latency (us) | priority admin latency (us)" << std::endl;
+    for (int size : sizes) {
+        std::cout.setstate(std::ios::badbit);
+        long long fifo = floodLatency(size, false);
+        long long priority = floodLatency(size, true);
+        std::cout.clear();
+        std::cout << size << " | " << fifo << " | " << priority << std::endl;
+    }
+
+    std::cout << std::endl << "messages | send() loop (us) | sendBatch() (us)" << std::endl;
+    for (int size : sizes) {
+        std::cout.setstate(std::ios::badbit);
+        long long single = sendThroughput(size, false);
+        long long batch = sendThroughput(size, true);
+        std::cout.clear();
+        std::cout << size << " | " << single << " | " << batch << std::endl;
+    }
+
+    std::cout << std::endl << "existing history | 20000 two-message batches (us)" << std::endl;
+    for (int history : {1000, 50000}) {
+        std::cout.setstate(std::ios::badbit);
+        long long cost = smallBatchCost(history, 20000);
+        std::cout.clear();
+        std::cout << history << " | " << cost << std::endl;
+    }
+
+    const int roomCounts[] = {50, 200, 500};
+    std::cout << std::endl << "rooms | send() per room (us) | broadcast() (us)" << std::endl;
+    for (int rooms : roomCounts) {
+        std::cout.setstate(std::ios::badbit);
+        long long perRoom = broadcastCost(rooms, false);
+        long long deduplicated = broadcastCost(rooms, true);
+        std::cout.clear();
+        std::cout << rooms << " | " << perRoom << " | " << deduplicated << std::endl;
+    }
+    std::cout << std::endl << "messages | private room (us) | sendDirect() (us)" << std::endl;
+    for (int size : sizes) {
+        std::cout.setstate(std::ios::badbit);
+        long long room = directCost(size, false);
+        long long direct = directCost(size, true);
+        std::cout.clear();
+        std::cout << size << " | " << room << " | " << direct << std::endl;
+    }
+    const int memberCounts[] = {10, 1000, 10000};
+    std::cout << std::endl << "members | mention scan per message (ns) | 200 join + mention + leave (us)" << std::endl;
+    for (int members : memberCounts) {
+        std::cout.setstate(std::ios::badbit);
+        long long cost = mentionScanCost(members, 20000);
+        long long churn = mentionChurnCost(members, 200);
+        std::cout.clear();
+        std::cout << members << " | " << cost << " | " << churn << std::endl;
+    }
+    const int roomTotals[] = {1000, 10000, 100000};
+    std::cout << std::endl << "rooms | registry create + find + teardown (us)" << std::endl;
+    for (int rooms : roomTotals) {
+        std::cout.setstate(std::ios::badbit);
+        long long cost = registryCycleCost(rooms);
+        std::cout.clear();
+        std::cout << rooms << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "users/rooms/messages | snapshot save (us) | restore (us)" << std::endl;
+    for (int scale : {1, 10}) {
+        long long saveMicros = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long restoreMicros = snapshotCost(1000 * scale, 100 * scale, 20000 * scale, saveMicros);
+        std::cout.clear();
+        std::cout << 1000 * scale << "/" << 100 * scale << "/" << 20000 * scale << " | " << saveMicros << " | "
+                  << restoreMicros << std::endl;
+    }
+    std::cout << std::endl << "journal | messages per second" << std::endl;
+    const std::size_t groups[] = {0, 1, 64, 1024};
+    for (std::size_t group : groups) {
+        std::cout.setstate(std::ios::badbit);
+        long long rate = journalThroughput(group == 1 ? 2000 : 20000, group);
+        std::cout.clear();
+        std::cout << (group ? "group " + std::to_string(group) : std::string("off")) << " | " << rate << std::endl;
+    }
+    std::cout << std::endl << "trace events | fast replay (us)" << std::endl;
+    for (int size : sizes) {
+        std::size_t events = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long cost = traceReplayCost(size, events);
+        std::cout.clear();
+        std::cout << events << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "rendering members | 1000 sends (us)" << std::endl;
+    for (int members : {10, 100, 1000}) {
+        std::cout.setstate(std::ios::badbit);
+        long long cost = renderCost(members, 1000);
+        std::cout.clear();
+        std::cout << members << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "inbox clients | messages consumed | 1000 sends + loop (us)" << std::endl;
+    for (int clients : {10, 1000, 10000}) {
+        std::size_t received = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long cost = inboxLoopCost(clients, 1000, received);
+        std::cout.clear();
+        std::cout << clients << " | " << received << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "workers | skewed workload, 92000 sends (us)" << std::endl;
+    for (std::size_t workers : {0, 1, 2, 4}) {
+        std::cout.setstate(std::ios::badbit);
+        long long cost = executorCost(workers);
+        std::cout.clear();
+        std::cout << (workers ? std::to_string(workers) : std::string("sync")) << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "members (one slow) | synchronous 1000 sends (us) | ring mailboxes (us)" << std::endl;
+    for (int members : {10, 100, 1000}) {
+        std::cout.setstate(std::ios::badbit);
+        long long sync = slowFanoutCost(members, false);
+        long long rings = slowFanoutCost(members, true);
+        std::cout.clear();
+        std::cout << members << " | " << sync << " | " << rings << std::endl;
+    }
+    std::cout << std::endl << "history cap (bytes) | history held (bytes) | 20000 sends (us)" << std::endl;
+    for (std::size_t cap : {0, 1 << 20, 1 << 16}) {
+        std::size_t held = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long cost = memoryCapCost(cap, held);
+        std::cout.clear();
+        std::cout << (cap ? std::to_string(cap) : std::string("none")) << " | " << held << " | " << cost << std::endl;
+    }
+    std::cout << std::endl << "offline members | per-member fanout, 100 sends (us) | table scan (us)" << std::endl;
+    for (int members : {1000, 10000, 100000}) {
+        std::cout.setstate(std::ios::badbit);
+        long long visited = tableFanoutCost(members, false);
+        long long scanned = tableFanoutCost(members, true);
+        std::cout.clear();
+        std::cout << members << " | " << visited << " | " << scanned << std::endl;
+    }
+    std::cout << std::endl << "history | full re-read of 10 new messages (us) | from read cursor (us)" << std::endl;
+    for (int history : {1000, 10000, 100000}) {
+        std::cout.setstate(std::ios::badbit);
+        long long full = catchUpCost(history, false);
+        long long unread = catchUpCost(history, true);
+        std::cout.clear();
+        std::cout << history << " | " << full << " | " << unread << std::endl;
+    }
+    std::cout << std::endl << "history (256 hot) | 100 searches (us) | hits per search" << std::endl;
+    for (int history : {10000, 100000}) {
+        std::size_t found = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long cost = coldSearchCost(history, found);
+        std::cout.clear();
+        std::cout << history << " | " << cost << " | " << found << std::endl;
+    }
+    std::cout << std::endl << "rooms | 100 announcements each, copied (us) | shared (us) | bytes saved" << std::endl;
+    for (int rooms : {10, 100}) {
+        std::size_t saved = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long copied = announcementCost(rooms, false, saved);
+        long long shared = announcementCost(rooms, true, saved);
+        std::cout.clear();
+        std::cout << rooms << " | " << copied << " | " << shared << " | " << saved << std::endl;
+    }
+    std::cout << std::endl << "flaps | naive updates | coalesced updates | cost (us)" << std::endl;
+    for (int flaps : {1000, 10000, 100000}) {
+        unsigned long long delivered = 0;
+        std::cout.setstate(std::ios::badbit);
+        long long cost = presenceCost(flaps, delivered);
+        std::cout.clear();
+        std::cout << flaps << " | " << flaps * 10ULL * 199 << " | " << delivered << " | " << cost << std::endl;
+    }
+    return 0;
+}
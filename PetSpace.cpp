@@ -11,16 +11,335 @@
 #include "PetSpace.h"
 #include <iostream>
 #include <algorithm>
+#include <cassert>
+#include <functional>
+#include <fstream>
+#include <cctype>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <charconv>
+#include <typeinfo>
+#include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// ============= extra : SHARED MESSAGE BUFFER IMPLEMENTATIONS =============
+
+/**
+ * @brief Gets the characters stored after the buffer header
+ * @return Pointer to the first character
+ */
+char* Message::Buffer::bytes() {
+    return reinterpret_cast<char*>(this + 1);
+}
+
+/**
+ * @brief Constructs an empty message
+ */
+Message::Message() : length(0) {
+    small[0] = '\0';
+}
+
+/**
+ * @brief Constructs a message from a C string
+ * @param text NUL-terminated text (nullptr is treated as empty)
+ */
+Message::Message(const char* text) : length(0) {
+    assign(text, text ? std::strlen(text) : 0);
+}
+
+/**
+ * @brief Constructs a message from a character range
+ * @param text Pointer to the characters
+ * @param size Number of characters
+ */
+Message::Message(const char* text, std::size_t size) : length(0) {
+    assign(text, size);
+}
+
+/**
+ * @brief Constructs a message from a string
+ * @param text The message text
+ */
+Message::Message(const std::string& text) : length(0) {
+    assign(text.data(), text.size());
+}
+
+/**
+ * @brief Constructs a message from a string view
+ * @param text The message text
+ */
+Message::Message(std::string_view text) : length(0) {
+    assign(text.data(), text.size());
+}
+
+/**
+ * @brief Copies a message, sharing its buffer
+ * @param other The message to copy
+ */
+Message::Message(const Message& other) : length(other.length) {
+    if (other.isInline()) {
+        std::memcpy(small, other.small, sizeof(small));
+    } else {
+        shared = other.shared;
+        shared->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Moves a message, leaving the source empty
+ * @param other The message to move from
+ */
+Message::Message(Message&& other) noexcept : length(other.length) {
+    if (other.isInline()) {
+        std::memcpy(small, other.small, sizeof(small));
+    } else {
+        shared = other.shared;
+        other.length = 0;
+        other.small[0] = '\0';
+    }
+}
+
+/**
+ * @brief Copy-assigns a message, sharing its buffer
+ * @param other The message to copy
+ * @return This message
+ */
+Message& Message::operator=(const Message& other) {
+    if (this != &other) {
+        Message copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+/**
+ * @brief Move-assigns a message, leaving the source empty
+ * @param other The message to move from
+ * @return This message
+ */
+Message& Message::operator=(Message&& other) noexcept {
+    if (this != &other) {
+        release();
+        length = other.length;
+        if (other.isInline()) {
+            std::memcpy(small, other.small, sizeof(small));
+        } else {
+            shared = other.shared;
+            other.length = 0;
+            other.small[0] = '\0';
+        }
+    }
+    return *this;
+}
+
+/**
+ * @brief Releases this message's reference to a shared buffer
+ */
+Message::~Message() {
+    release();
+}
+
+/**
+ * @brief Checks whether the characters are stored inline
+ * @return true for short messages
+ */
+bool Message::isInline() const {
+    return length <= INLINE_CAPACITY;
+}
+
+/**
+ * @brief Stores the characters inline or in a new shared buffer
+ * @param text Pointer to the characters
+ * @param size Number of characters
+ */
+void Message::assign(const char* text, std::size_t size) {
+    length = size;
+    char* target = small;
+    if (!isInline()) {
+        void* memory = ::operator new(sizeof(Buffer) + size + 1);
+        shared = new (memory) Buffer();
+        shared->refs.store(1, std::memory_order_relaxed);
+        target = shared->bytes();
+    }
+    if (size > 0) {
+        std::memcpy(target, text, size);
+    }
+    target[size] = '\0';
+}
+
+/**
+ * @brief Drops the shared buffer reference, freeing it when last
+ */
+void Message::release() {
+    if (!isInline() && shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        shared->~Buffer();
+        ::operator delete(shared);
+    }
+    length = 0;
+    small[0] = '\0';
+}
+
+/**
+ * @brief Gets the message characters (NUL-terminated)
+ * @return Pointer to the first character
+ */
+const char* Message::data() const {
+    return isInline() ? small : shared->bytes();
+}
+
+/**
+ * @brief Gets the message length
+ * @return Length in bytes
+ */
+std::size_t Message::size() const {
+    return length;
+}
+
+/**
+ * @brief Checks whether the message is empty
+ * @return true if the message has no characters
+ */
+bool Message::empty() const {
+    return length == 0;
+}
+
+/**
+ * @brief Gets a non-owning view of the message
+ * @return View over the message characters
+ */
+std::string_view Message::view() const {
+    return std::string_view(data(), length);
+}
+
+/**
+ * @brief Copies the message into a std::string
+ * @return The message text
+ */
+std::string Message::str() const {
+    return std::string(data(), length);
+}
+
+/**
+ * @brief Gets the number of Messages sharing this message's buffer
+ * @return The reference count, or 0 for inline messages
+ */
+std::size_t Message::useCount() const {
+    return isInline() ? 0 : shared->refs.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Compares message contents
+ * @param other The message to compare with
+ * @return true if both hold the same text
+ */
+bool Message::operator==(const Message& other) const {
+    return view() == other.view();
+}
+
+/**
+ * @brief Compares message contents
+ * @param other The message to compare with
+ * @return true if the texts differ
+ */
+bool Message::operator!=(const Message& other) const {
+    return !(*this == other);
+}
+
+/**
+ * @brief Streams the message text
+ * @param out The output stream
+ * @param message The message to write
+ * @return The output stream
+ */
+std::ostream& operator<<(std::ostream& out, const Message& message) {
+    return out.write(message.data(), static_cast<std::streamsize>(message.size()));
+}
+
+namespace {
+
+/**
+ * @brief Joins messages into console lines under a common prefix
+ * @param prefix Text written before each message
+ * @param messages The messages, oldest first
+ * @return The lines, without a trailing newline
+ */
+std::string joinLines(const std::string& prefix, const std::vector<Message>& messages) {
+    std::string out;
+    for (const Message& message : messages) {
+        if (!out.empty()) {
+            out += '\n';
+        }
+        out.append(prefix).append(message.data(), message.size());
+    }
+    return out;
+}
+
+/**
+ * @brief Describes a presence batch for the console
+ * @param updates The updates
+ * @return " name is State;" for each update
+ */
+std::string describePresence(const std::vector<PresenceUpdate>& updates) {
+    std::string out;
+    for (const PresenceUpdate& update : updates) {
+        out.append(" ").append(update.name).append(" is ").append(update.state).append(";");
+    }
+    return out;
+}
+
+}
 
 // ============= STATE PATTERN IMPLEMENTATIONS =============
 
+/**
+ * @brief Handles a batch of messages one at a time
+ * @param user Pointer to the user receiving the messages
+ * @param messages The messages, oldest first
+ */
+void UserState::handleBatch(User* user, const std::vector<Message>& messages) {
+    for (const Message& message : messages) {
+        handleMessage(user, message);
+    }
+}
+
 /**
  * @brief Handles message reception when user is online
  * @param user Pointer to the user receiving the message
  * @param message The message content
  */
-void Online::handleMessage(User* user, const std::string& message) {
-    std::cout<<user->getName() << " [Online] received: "<<message <<std::endl;
+void Online::handleMessage(User* user, const Message& message) {
+    PETSPACE_LOG(INFO, DELIVERY, user->getName(), " [Online] received: ", message);
+}
+
+/**
+ * @brief Reacts to a mention after the message itself was received
+ * 
+ * Nothing beyond the normal delivery happens by default
+ */
+void UserState::handleMention(User*, const Message&) {
+}
+
+/**
+ * @brief Handles a batch of messages when user is online
+ * @param user Pointer to the user receiving the messages
+ * @param messages The messages, oldest first
+ * 
+ * The lines are built up first and written with a single flush
+ */
+void Online::handleBatch(User* user, const std::vector<Message>& messages) {
+    PETSPACE_LOG(INFO, DELIVERY, joinLines(user->getName() + " [Online] received: ", messages));
 }
 
 /**
@@ -30,7 +349,7 @@ void Online::handleMessage(User* user, const std::string& message) {
  */
 void Online::changeState(User* user, UserState* newState) {
     user->setState(newState);
-    std::cout<< user->getName() <<"'s state changed to "<<newState->getStateName()<< std::endl;
+    PETSPACE_LOG(INFO, PRESENCE, user->getName(), "'s state changed to ", newState->getStateName());
 }
 
 /**
@@ -48,9 +367,9 @@ std::string Online::getStateName() const {
  * @param user Pointer to the user
  * @param message The message content (unused)
  */
-void Offline::handleMessage(User* user, const std::string& message) {
+void Offline::handleMessage(User* user, const Message& message) {
     (void)message; // Silence unused parameter warning
-    std::cout << user->getName() << " [Offline] cannot receive messages. " << std::endl;
+    PETSPACE_LOG(INFO, DELIVERY, user->getName(), " [Offline] cannot receive messages. ");
 }
 
 
@@ -61,7 +380,7 @@ void Offline::handleMessage(User* user, const std::string& message) {
  */
 void Offline::changeState(User* user, UserState* newState) {
     user->setState(newState);
-    std::cout<< user->getName() <<"'s state changed to "<<newState->getStateName()<< std::endl;
+    PETSPACE_LOG(INFO, PRESENCE, user->getName(), "'s state changed to ", newState->getStateName());
 }
 
 
@@ -80,11 +399,20 @@ std::string Offline::getStateName() const {
  * @param user Pointer to the user
  * @param message The message content
  */
-void Busy::handleMessage(User* user, const std::string& message) {
-    std::cout<<user->getName() << " [Busy] unavailable. Message stored: " << message <<std::endl;
+void Busy::handleMessage(User* user, const Message& message) {
+    PETSPACE_LOG(INFO, DELIVERY, user->getName(), " [Busy] unavailable. Message stored: ", message);
 }
 
 
+/**
+ * @brief Notifies a busy user that they were mentioned
+ * @param user Pointer to the mentioned user
+ * @param message The message content
+ */
+void Busy::handleMention(User* user, const Message& message) {
+    PETSPACE_LOG(INFO, DELIVERY, user->getName(), " [Busy] notified of mention: ", message);
+}
+
 /**
  * @brief Changes user state from busy to another state
  * @param user Pointer to the user
@@ -92,7 +420,7 @@ void Busy::handleMessage(User* user, const std::string& message) {
  */
 void Busy::changeState(User* user, UserState* newState) {
     user->setState(newState);
-    std::cout<< user->getName() <<"'s state changed to "<<newState->getStateName()<< std::endl;
+    PETSPACE_LOG(INFO, PRESENCE, user->getName(), "'s state changed to ", newState->getStateName());
 }
 
 /**
@@ -105,19 +433,106 @@ std::string Busy::getStateName() const {
 
 // ============= ITERATOR PATTERN IMPLEMENTATIONS =============
 
+/**
+ * @brief Constructs an invalid (seq 0) history entry
+ */
+HistoryEntry::HistoryEntry() : seq(0), timestamp(0), deduplicated(false) {
+}
+
+/**
+ * @brief Constructs an invalid (seq 0) history entry using an allocator
+ * @param alloc Allocator for the sender name
+ */
+HistoryEntry::HistoryEntry(const allocator_type& alloc) : seq(0), timestamp(0), sender(alloc), deduplicated(false) {
+}
+
+/**
+ * @brief Constructs a history entry
+ * @param sequence Per-room sequence number
+ * @param time Milliseconds since the epoch
+ * @param from Name of the sending user
+ * @param message The message content
+ * @param alloc Allocator for the sender name
+ */
+HistoryEntry::HistoryEntry(unsigned long long sequence, long long time, std::string_view from, const Message& message,
+                           const allocator_type& alloc)
+    : seq(sequence), timestamp(time), sender(from, alloc), text(message), deduplicated(false) {
+}
+
+/**
+ * @brief Copies an entry into storage owned by another allocator
+ * @param other The entry to copy
+ * @param alloc Allocator for the sender name
+ */
+HistoryEntry::HistoryEntry(const HistoryEntry& other, const allocator_type& alloc)
+    : seq(other.seq), timestamp(other.timestamp), sender(other.sender, alloc), text(other.text),
+      deduplicated(other.deduplicated) {
+}
+
+/**
+ * @brief Moves an entry into storage owned by another allocator
+ * @param other The entry to move from
+ * @param alloc Allocator for the sender name
+ */
+HistoryEntry::HistoryEntry(HistoryEntry&& other, const allocator_type& alloc)
+    : seq(other.seq), timestamp(other.timestamp), sender(std::move(other.sender), alloc), text(std::move(other.text)),
+      deduplicated(other.deduplicated) {
+}
+
+/**
+ * @brief Renders the entry in history display form
+ * @return "sender: text"
+ */
+std::string HistoryEntry::str() const {
+    std::string line;
+    line.reserve(sender.size() + 2 + text.size());
+    line.append(sender.data(), sender.size()).append(": ").append(text.data(), text.size());
+    return line;
+}
+
 /**
  * @brief Constructs a ChatHistoryIterator
  * @param history Pointer to the vector of chat messages
  */
-ChatHistoryIterator::ChatHistoryIterator(std::vector<std::string>* history)
-    : chatHistory(history), currentIndex(0){}
+ChatHistoryIterator::ChatHistoryIterator(std::pmr::vector<HistoryEntry>* history)
+    : chatHistory(history), room(nullptr), currentIndex(0){}
+
+/**
+ * @brief Constructs a ChatHistoryIterator over a room's full history
+ * @param room Pointer to the chat room whose history is traversed
+ */
+ChatHistoryIterator::ChatHistoryIterator(ChatRoom* room)
+    : chatHistory(nullptr), room(room), currentIndex(0){}
+
+/**
+ * @brief Gets the length of the traversed history
+ * @return Number of messages
+ */
+std::size_t ChatHistoryIterator::size() const {
+    if (room) {
+        return room->historySize();
+    }
+    return chatHistory ? chatHistory->size() : 0;
+}
+
+/**
+ * @brief Gets the entry at a history position
+ * @param position Position in the history
+ * @return The entry
+ */
+HistoryEntry ChatHistoryIterator::entryAt(std::size_t position) const {
+    if (room) {
+        return room->entryAt(position);
+    }
+    return (*chatHistory)[position];
+}
    
 /**
  * @brief Checks if there are more messages to iterate
  * @return true if more messages exist, false otherwise
  */
 bool ChatHistoryIterator::hasNext() {
-    return chatHistory && currentIndex < static_cast<int>(chatHistory->size());
+    return currentIndex < size();
 }
 
 /**
@@ -129,7 +544,7 @@ std::string ChatHistoryIterator::next() {
     {
         return"";
     }
-    return (*chatHistory)[currentIndex++];
+    return entryAt(currentIndex++).str();
 }
 
 /**
@@ -139,6 +554,78 @@ void ChatHistoryIterator::reset() {
     currentIndex = 0;
 }
 
+/**
+ * @brief Returns the next entry with its sequence number and timestamp
+ * @return The next entry, or an entry with seq 0 if none
+ */
+HistoryEntry ChatHistoryIterator::nextEntry() {
+    if (!hasNext()) {
+        return HistoryEntry();
+    }
+    return entryAt(currentIndex++);
+}
+
+/**
+ * @brief Checks if there are older messages before the current position
+ * @return true if previous() would return a message
+ */
+bool ChatHistoryIterator::hasPrevious() {
+    return currentIndex > 0 && currentIndex <= size();
+}
+
+/**
+ * @brief Steps backwards and returns the previous message
+ * @return The previous message string, or empty string if none
+ */
+std::string ChatHistoryIterator::previous() {
+    if (!hasPrevious()) {
+        return "";
+    }
+    return entryAt(--currentIndex).str();
+}
+
+/**
+ * @brief Steps backwards and returns the previous entry
+ * @return The previous entry, or an entry with seq 0 if none
+ */
+HistoryEntry ChatHistoryIterator::previousEntry() {
+    if (!hasPrevious()) {
+        return HistoryEntry();
+    }
+    return entryAt(--currentIndex);
+}
+
+/**
+ * @brief Positions the iterator so next() returns the given sequence
+ * @param seq Sequence number to seek to (clamped to the history end)
+ */
+void ChatHistoryIterator::seekSequence(unsigned long long seq) {
+    std::size_t position = seq > 0 ? static_cast<std::size_t>(seq - 1) : 0;
+    currentIndex = std::min(position, size());
+}
+
+/**
+ * @brief Positions the iterator at the first message at or after a time
+ * @param timestamp Milliseconds since the epoch
+ */
+void ChatHistoryIterator::seekTime(long long timestamp) {
+    if (room) {
+        currentIndex = room->findTimePosition(timestamp);
+        return;
+    }
+    currentIndex = 0;
+    while (currentIndex < size() && entryAt(currentIndex).timestamp < timestamp) {
+        currentIndex++;
+    }
+}
+
+/**
+ * @brief Positions the iterator after the newest message
+ */
+void ChatHistoryIterator::seekEnd() {
+    currentIndex = size();
+}
+
 // ============= COMMAND PATTERN IMPLEMENTATIONS =============
 
 /**
@@ -147,8 +634,34 @@ void ChatHistoryIterator::reset() {
  * @param user Pointer to the user initiating the command
  * @param msg The message content
  */
-Command::Command(ChatRoom* room, User* user, const std::string& msg) 
-    : chatRoom(room), fromUser(user), message(msg) {
+Command::Command(ChatRoom* room, User* user, const Message& msg) 
+    : chatRoom(room), fromUser(user), message(msg),
+      priority(user && user->getAdmin() ? CommandPriority::Admin : CommandPriority::Normal), sequence(0),
+      textShared(false) {
+}
+
+/**
+ * @brief Gets when the command was queued relative to all others
+ * @return The queueing sequence number (0 if never queued)
+ */
+unsigned long long Command::getSequence() const {
+    return sequence;
+}
+
+/**
+ * @brief Gets the command's scheduling class
+ * @return The command priority
+ */
+CommandPriority Command::getPriority() const {
+    return priority;
+}
+
+/**
+ * @brief Overrides the command's scheduling class
+ * @param newPriority The priority to use
+ */
+void Command::setPriority(CommandPriority newPriority) {
+    priority = newPriority;
 }
 
 /**
@@ -157,7 +670,7 @@ Command::Command(ChatRoom* room, User* user, const std::string& msg)
  * @param user Pointer to the user sending the message
  * @param msg The message to send
  */
-SendMessageCommand::SendMessageCommand(ChatRoom* room, User* user, const std::string& msg) 
+SendMessageCommand::SendMessageCommand(ChatRoom* room, User* user, const Message& msg) 
     : Command(room, user, msg) {
 }
 
@@ -168,6 +681,7 @@ SendMessageCommand::SendMessageCommand(ChatRoom* room, User* user, const std::st
  */
 void SendMessageCommand::execute() {
     if (chatRoom && fromUser) {
+        std::lock_guard<std::mutex> guard(chatRoom->getDeliveryLock());
         chatRoom->sendMessage(message, fromUser);
     }
 }
@@ -178,7 +692,7 @@ void SendMessageCommand::execute() {
  * @param user Pointer to the user whose message is being logged
  * @param msg The message to log
  */
-LogMessageCommand::LogMessageCommand(ChatRoom* room, User* user, const std::string& msg) 
+LogMessageCommand::LogMessageCommand(ChatRoom* room, User* user, const Message& msg) 
     : Command(room, user, msg) {
 }
 
@@ -189,513 +703,7654 @@ LogMessageCommand::LogMessageCommand(ChatRoom* room, User* user, const std::stri
  */
 void LogMessageCommand::execute() {
     if (chatRoom && fromUser) {
+        std::lock_guard<std::mutex> guard(chatRoom->getDeliveryLock());
         chatRoom->saveMessage(message, fromUser);
     }
 }
 
-// ============= MEDIATOR PATTERN IMPLEMENTATIONS =============
-
 /**
- * @brief Gets the list of users in the chat room
- * @return Reference to the users vector
+ * @brief Constructs a SendBatchCommand
+ * @param room Pointer to the chat room
+ * @param user Pointer to the user sending the messages
+ * @param batch The messages to send
  */
-std::vector<User*>& ChatRoom::getUsers() {
-   return users;
+SendBatchCommand::SendBatchCommand(ChatRoom* room, User* user, const std::vector<Message>& batch)
+    : Command(room, user, Message()), messages(batch) {
 }
 
 /**
- * @brief Gets the chat history
- * @return Reference to the chat history vector
+ * @brief Executes the send batch command
+ * 
+ * Sends every message in the batch to the room's users via the mediator
  */
-std::vector<std::string>& ChatRoom::getChatHistory() {
-    return chatHistory;
+void SendBatchCommand::execute() {
+    if (chatRoom && fromUser) {
+        std::lock_guard<std::mutex> guard(chatRoom->getDeliveryLock());
+        chatRoom->sendBatch(messages, fromUser);
+    }
 }
 
-// CtrlCat Implementation
+/**
+ * @brief Constructs a LogBatchCommand
+ * @param room Pointer to the chat room
+ * @param user Pointer to the user whose messages are being logged
+ * @param batch The messages to log
+ */
+LogBatchCommand::LogBatchCommand(ChatRoom* room, User* user, const std::vector<Message>& batch)
+    : Command(room, user, Message()), messages(batch) {
+}
 
 /**
- * @brief Registers a user with the CtrlCat room
- * @param user Pointer to the user to register
+ * @brief Executes the log batch command
  * 
- * Prevents duplicate registrations
+ * Saves every message in the batch to the chat room's history
  */
-void CtrlCat::registerUser(User* user) {
-      if (user && std::find(users.begin(), users.end(), user) == users.end()) {
-        users.push_back(user);
-        std::cout << user->getName() << " joined CtrlCat room!" << std::endl;
+void LogBatchCommand::execute() {
+    if (chatRoom && fromUser) {
+        std::lock_guard<std::mutex> guard(chatRoom->getDeliveryLock());
+        chatRoom->saveBatch(messages, fromUser);
     }
 }
 
 /**
- * @brief Removes a user from the CtrlCat room
- * @param user Pointer to the user to remove
+ * @brief Marks a handle
+ * @param handle The user's handle
+ * @return true if the handle was not marked before
  */
-void CtrlCat::removeUser(User* user) {
-     auto it = std::find(users.begin(), users.end(), user);
-    if (it != users.end()) {
-        users.erase(it);
-        std::cout << user->getName() << " left CtrlCat room!" << std::endl;
+bool HandleMarks::mark(unsigned int handle) {
+    std::size_t word = handle / 64;
+    std::uint64_t bit = std::uint64_t(1) << (handle % 64);
+    if (word >= bits.size()) {
+        bits.resize(std::max(word + 1, 2 * bits.size()), 0);
     }
+    if (bits[word] & bit) {
+        return false;
+    }
+    if (!bits[word]) {
+        touched.push_back(word);
+    }
+    bits[word] |= bit;
+    return true;
 }
 
 /**
- * @brief Sends a message to all users in the CtrlCat room
- * @param message The message content
+ * @brief Unmarks every handle
+ */
+void HandleMarks::clear() {
+    for (std::size_t word : touched) {
+        bits[word] = 0;
+    }
+    touched.clear();
+}
+
+/**
+ * @brief Constructs a BroadcastCommand
+ * @param targets The rooms to deliver to
+ * @param user Pointer to the user broadcasting
+ * @param msg The message to deliver
+ */
+BroadcastCommand::BroadcastCommand(const std::vector<ChatRoom*>& targets, User* user, const Message& msg,
+                                   std::size_t* report)
+    : Command(nullptr, user, msg), rooms(targets), delivered(0), report(report) {
+}
+
+/**
+ * @brief Executes the broadcast command
+ * 
+ * Hands the message to each target room in turn, under that room's
+ * delivery lock. A per-thread bitmap of handles carries over between
+ * rooms, so a user is delivered to once, along with the first shared
+ * room; only the words it set are cleared afterwards.
+ */
+void BroadcastCommand::execute() {
+    delivered = 0;
+    if (!fromUser || rooms.empty()) {
+        return;
+    }
+    PETSPACE_LOG(INFO, DELIVERY, "[Broadcast] ", fromUser->getName(), " -> ", rooms.size(), " rooms: ", message);
+    thread_local HandleMarks seen;
+    for (ChatRoom* room : rooms) {
+        std::lock_guard<std::mutex> guard(room->getDeliveryLock());
+        delivered += room->deliverBroadcast(message, fromUser, seen);
+    }
+    seen.clear();
+    if (report) {
+        *report = delivered;
+    }
+}
+
+/**
+ * @brief Gets how many distinct users the broadcast reached
+ * @return The recipient count
+ */
+std::size_t BroadcastCommand::getDelivered() const {
+    return delivered;
+}
+
+/**
+ * @brief Constructs a DirectMessageCommand
+ * @param toHandle Handle of the receiving user
+ * @param user Pointer to the user sending the message
+ * @param msg The message to deliver
+ */
+DirectMessageCommand::DirectMessageCommand(unsigned int toHandle, User* user, const Message& msg)
+    : Command(nullptr, user, msg), recipient(toHandle) {
+}
+
+/**
+ * @brief Executes the direct message command
+ * 
+ * Looks the recipient up by handle, records the message in the pair's
+ * conversation and hands it to the recipient. Nothing happens if the
+ * recipient has gone away since the command was queued.
+ */
+void DirectMessageCommand::execute() {
+    User* toUser = UserDirectory::find(recipient);
+    if (!fromUser || !toUser) {
+        return;
+    }
+    PETSPACE_LOG(INFO, DELIVERY, "[Direct] ", fromUser->getName(), " -> ", toUser->getName(), ": ", message);
+    UserDirectory::conversation(fromUser->getHandle(), recipient, true)->append(fromUser->getHandle(), message);
+    if (RingMailbox* box = toUser->getMailbox()) {
+        box->enqueueShared(message, fromUser->getHandle(), 0);
+        return;
+    }
+    toUser->deliverToInbox(message, fromUser, nullptr);
+    toUser->receive(message, fromUser, nullptr);
+}
+
+/**
+ * @brief Constructs an empty scheduler
+ * @param resource Memory resource for the queues
+ * @param limit Bypasses tolerated before a lower level is served
+ */
+std::atomic<unsigned long long> CommandScheduler::nextSequence(0);
+
+CommandScheduler::CommandScheduler(std::pmr::memory_resource* resource, std::size_t limit)
+    : levels{std::pmr::list<Command*>(resource), std::pmr::list<Command*>(resource), std::pmr::list<Command*>(resource)},
+      bypassed{0, 0, 0}, starvationLimit(limit), count(0) {
+}
+
+/**
+ * @brief Queues a command at its priority level
+ * @param command The command to queue (ignored if nullptr)
+ */
+void CommandScheduler::push(Command* command) {
+    if (command) {
+        command->sequence = ++nextSequence;
+        levels[static_cast<std::size_t>(command->getPriority())].push_back(command);
+        count++;
+    }
+}
+
+/**
+ * @brief Removes the next command to run
+ * @return The command, or nullptr if the scheduler is empty
+ * 
+ * Picks the highest non-empty level unless a lower waiting level has
+ * reached the starvation limit, in which case the most urgent such level
+ * is served instead.
+ */
+Command* CommandScheduler::pop() {
+    std::size_t chosen = nextLevel();
+    if (chosen == LEVELS) {
+        return nullptr;
+    }
+    for (std::size_t level = chosen + 1; level < LEVELS; level++) {
+        if (!levels[level].empty()) {
+            bypassed[level]++;
+        }
+    }
+    bypassed[chosen] = 0;
+    Command* command = levels[chosen].front();
+    levels[chosen].pop_front();
+    count--;
+    return command;
+}
+
+/**
+ * @brief Gets the command pop() would return, without removing it
+ * @return The command, or nullptr if the scheduler is empty
+ */
+Command* CommandScheduler::peek() const {
+    std::size_t chosen = nextLevel();
+    return chosen == LEVELS ? nullptr : levels[chosen].front();
+}
+
+/**
+ * @brief Picks the level pop() would serve next
+ * @return The level index (LEVELS if the scheduler is empty)
+ * 
+ * The highest non-empty level wins unless a lower waiting level has
+ * reached the starvation limit.
+ */
+std::size_t CommandScheduler::nextLevel() const {
+    std::size_t chosen = LEVELS;
+    for (std::size_t level = 0; level < LEVELS && count; level++) {
+        if (levels[level].empty()) {
+            continue;
+        }
+        if (chosen == LEVELS) {
+            chosen = level;
+        } else if (starvationLimit && bypassed[level] >= starvationLimit) {
+            chosen = level;
+            break;
+        }
+    }
+    return chosen;
+}
+
+/**
+ * @brief Checks whether any command is queued
+ * @return true if no commands are queued
+ */
+bool CommandScheduler::empty() const {
+    return count == 0;
+}
+
+/**
+ * @brief Gets the number of queued commands
+ * @return The queued command count
+ */
+std::size_t CommandScheduler::size() const {
+    return count;
+}
+
+/**
+ * @brief Gets the number of queued commands at one priority
+ * @param level The priority level
+ * @return The queued command count for that level
+ */
+std::size_t CommandScheduler::size(CommandPriority level) const {
+    return levels[static_cast<std::size_t>(level)].size();
+}
+
+/**
+ * @brief Sets how many bypasses a waiting level tolerates
+ * @param limit Bypass limit (0 disables starvation protection)
+ */
+void CommandScheduler::setStarvationLimit(std::size_t limit) {
+    starvationLimit = limit;
+}
+
+// ============= extra : CHAT HISTORY SEARCH INDEX IMPLEMENTATIONS =============
+
+namespace {
+
+const char INDEX_MAGIC[4] = {'P', 'S', 'I', 'X'};
+const unsigned int INDEX_VERSION = 2;
+
+/**
+ * @brief Appends an unsigned value as a LEB128 varint
+ * @param out Destination byte buffer
+ * @param value The value to encode
+ */
+template <typename Allocator>
+void putVarint(std::vector<unsigned char, Allocator>& out, unsigned long long value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+/**
+ * @brief Decodes a LEB128 varint
+ * @param data Pointer to the encoded bytes
+ * @param size Number of bytes available
+ * @param pos Read offset, advanced past the varint
+ * @param value Receives the decoded value
+ * @return true on success, false if the input is truncated
+ */
+bool getVarint(const unsigned char* data, std::size_t size, std::size_t& pos, unsigned long long& value) {
+    value = 0;
+    for (int shift = 0; pos < size && shift < 64; shift += 7) {
+        unsigned char byte = data[pos++];
+        value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void writeString(std::vector<unsigned char>& out, std::string_view text) {
+    putVarint(out, text.size());
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+bool readString(const unsigned char* data, std::size_t size, std::size_t& pos, std::string& text) {
+    unsigned long long length = 0;
+    if (!getVarint(data, size, pos, length) || length > size - pos) {
+        return false;
+    }
+    text.assign(reinterpret_cast<const char*>(data + pos), static_cast<std::size_t>(length));
+    pos += static_cast<std::size_t>(length);
+    return true;
+}
+
+/**
+ * @brief Reads a whole file into memory
+ * @param path The file to read
+ * @param out Receives the file contents
+ * @return true if the file could be read
+ */
+bool readFile(const std::string& path, std::vector<unsigned char>& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    std::streamoff length = in.tellg();
+    in.seekg(0, std::ios::beg);
+    out.resize(length > 0 ? static_cast<std::size_t>(length) : 0);
+    if (!out.empty()) {
+        in.read(reinterpret_cast<char*>(out.data()), static_cast<std::streamsize>(out.size()));
+    }
+    return static_cast<bool>(in);
+}
+
+bool writeFile(const std::string& path, const std::vector<unsigned char>& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(out);
+}
+
+/**
+ * @class MappedFile
+ * @brief Read-only view of a whole file
+ *
+ * The file is mapped into memory, so decoding reads it page by page
+ * without a second copy. Where mapping is unavailable it is read instead.
+ */
+class MappedFile {
+private:
+    const unsigned char* bytes;       ///< Start of the file contents
+    std::size_t length;               ///< Size of the file
+    bool opened;                      ///< Whether the file could be read
+    std::vector<unsigned char> copy;  ///< Contents when the file is not mapped
+
+public:
+    /**
+     * @brief Maps a file
+     * @param path The file to map
+     */
+    explicit MappedFile(const std::string& path) : bytes(nullptr), length(0), opened(false) {
+#ifndef _WIN32
+        int descriptor = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (descriptor >= 0 && fstat(descriptor, &info) == 0) {
+            length = static_cast<std::size_t>(info.st_size);
+            void* mapped = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0) : nullptr;
+            if (mapped != MAP_FAILED) {
+                bytes = static_cast<const unsigned char*>(mapped);
+                opened = true;
+            }
+        }
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        if (opened) {
+            return;
+        }
+        length = 0;
+#endif
+        opened = readFile(path, copy);
+        bytes = copy.data();
+        length = copy.size();
+    }
+
+    /**
+     * @brief Unmaps the file
+     */
+    ~MappedFile() {
+#ifndef _WIN32
+        if (copy.empty() && length) {
+            munmap(const_cast<unsigned char*>(bytes), length);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * @brief Checks whether the file could be read
+     * @return true if it was mapped or read
+     */
+    bool isOpen() const { return opened; }
+    /**
+     * @brief Gets the file contents
+     * @return Start of the contents
+     */
+    const unsigned char* data() const { return bytes; }
+    /**
+     * @brief Gets the file size
+     * @return Size in bytes
+     */
+    std::size_t size() const { return length; }
+};
+
+void writePostings(std::vector<unsigned char>& out, const ChatHistoryIndex::PostingMap& lists) {
+    putVarint(out, lists.size());
+    for (const auto& entry : lists) {
+        writeString(out, entry.first);
+        std::vector<std::size_t> positions = entry.second.decode();
+        putVarint(out, positions.size());
+        std::size_t previous = 0;
+        for (std::size_t position : positions) {
+            putVarint(out, position - previous);
+            previous = position;
+        }
+    }
+}
+
+bool readPostings(const unsigned char* data, std::size_t size, std::size_t& pos,
+                  ChatHistoryIndex::PostingMap& lists) {
+    unsigned long long listCount = 0;
+    if (!getVarint(data, size, pos, listCount)) {
+        return false;
+    }
+    for (unsigned long long i = 0; i < listCount; i++) {
+        std::string key;
+        unsigned long long count = 0;
+        if (!readString(data, size, pos, key) || !getVarint(data, size, pos, count)) {
+            return false;
+        }
+        PostingList& list = lists[std::pmr::string(key, lists.get_allocator())];
+        unsigned long long position = 0;
+        for (unsigned long long j = 0; j < count; j++) {
+            unsigned long long delta = 0;
+            if (!getVarint(data, size, pos, delta)) {
+                return false;
+            }
+            position += delta;
+            list.append(static_cast<std::size_t>(position));
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Constructs an empty posting list
+ */
+PostingList::PostingList() : last(0), count(0) {
+}
+
+/**
+ * @brief Constructs an empty posting list using an allocator
+ * @param alloc Allocator for the encoded bytes
+ */
+PostingList::PostingList(const allocator_type& alloc) : bytes(alloc), last(0), count(0) {
+}
+
+/**
+ * @brief Copies a posting list into another allocator
+ * @param other The list to copy
+ * @param alloc Allocator for the encoded bytes
+ */
+PostingList::PostingList(const PostingList& other, const allocator_type& alloc)
+    : bytes(other.bytes, alloc), last(other.last), count(other.count) {
+}
+
+/**
+ * @brief Moves a posting list into another allocator
+ * @param other The list to move from
+ * @param alloc Allocator for the encoded bytes
+ */
+PostingList::PostingList(PostingList&& other, const allocator_type& alloc)
+    : bytes(std::move(other.bytes), alloc), last(other.last), count(other.count) {
+}
+
+/**
+ * @brief Appends a position as a delta from the previous one
+ * @param position History position of the message
+ */
+void PostingList::append(std::size_t position) {
+    if (count > 0 && position <= last) {
+        return;
+    }
+    putVarint(bytes, count == 0 ? position : position - last);
+    last = position;
+    count++;
+}
+
+/**
+ * @brief Decodes every stored delta back into absolute positions
+ * @return Ascending history positions
+ */
+std::vector<std::size_t> PostingList::decode() const {
+    std::vector<std::size_t> positions;
+    positions.reserve(count);
+    std::size_t pos = 0;
+    unsigned long long value = 0;
+    std::size_t current = 0;
+    while (getVarint(bytes.data(), bytes.size(), pos, value)) {
+        current += static_cast<std::size_t>(value);
+        positions.push_back(current);
+    }
+    return positions;
+}
+
+/**
+ * @brief Gets the number of positions in the list
+ * @return The position count
+ */
+std::size_t PostingList::size() const {
+    return count;
+}
+
+/**
+ * @brief Gets the size of the compressed representation
+ * @return Number of encoded bytes
+ */
+std::size_t PostingList::byteSize() const {
+    return bytes.size();
+}
+
+/**
+ * @brief Constructs an empty history index
+ * @param resource Memory resource for the maps and posting lists
+ */
+ChatHistoryIndex::ChatHistoryIndex(std::pmr::memory_resource* resource)
+    : tokens(resource), senders(resource), indexedCount(0), floor(0), entryBytes(0) {
+}
+
+/**
+ * @brief Splits text into lower-cased alphanumeric tokens
+ * @param text The text to tokenize
+ * @return Tokens in order of appearance
+ */
+std::vector<std::string> ChatHistoryIndex::tokenize(std::string_view text) {
+    std::vector<std::string> result;
+    std::string current;
+    for (char c : text) {
+        unsigned char uc = static_cast<unsigned char>(c);
+        if (std::isalnum(uc)) {
+            current.push_back(static_cast<char>(std::tolower(uc)));
+        } else if (!current.empty()) {
+            result.push_back(current);
+            current.clear();
+        }
+    }
+    if (!current.empty()) {
+        result.push_back(current);
+    }
+    return result;
+}
+
+/**
+ * @brief Indexes a newly saved message
+ * @param position History position of the message
+ * @param sender Name of the user who sent the message
+ * @param message The raw message content
+ *
+ * Repeated tokens within one message are recorded once.
+ */
+void ChatHistoryIndex::addMessage(std::size_t position, std::string_view sender, std::string_view message) {
+    for (const std::string& token : tokenize(message)) {
+        appendPosting(tokens, token, position);
+    }
+    appendPosting(senders, sender, position);
+    indexedCount++;
+}
+
+/**
+ * @brief Appends a position to a key's list, keeping the memory estimate current
+ * @param lists The map holding the list
+ * @param key The token or sender name
+ * @param position History position of the message
+ */
+void ChatHistoryIndex::appendPosting(PostingMap& lists, std::string_view key, std::size_t position) {
+    std::pair<PostingMap::iterator, bool> slot = lists.try_emplace(std::pmr::string(key, lists.get_allocator()));
+    if (slot.second) {
+        entryBytes += footprintOf(*slot.first);
+    }
+    std::size_t before = slot.first->second.bytes.capacity();
+    slot.first->second.append(position);
+    entryBytes += slot.first->second.bytes.capacity() - before;
+}
+
+/**
+ * @brief Estimates the memory held by one map entry
+ * @param entry The key and its posting list
+ * @return Node, heap-allocated key and encoded posting bytes
+ */
+std::size_t ChatHistoryIndex::footprintOf(const PostingMap::value_type& entry) {
+    // A node holds the value, the next pointer and the cached hash
+    std::size_t bytes = sizeof(PostingMap::value_type) + 2 * sizeof(void*) + entry.second.bytes.capacity();
+    if (entry.first.capacity() > std::pmr::string().capacity()) {
+        bytes += entry.first.capacity() + 1;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Recomputes the memory estimate from every entry
+ */
+void ChatHistoryIndex::recount() {
+    entryBytes = 0;
+    for (const PostingMap* lists : {&tokens, &senders}) {
+        for (const PostingMap::value_type& entry : *lists) {
+            entryBytes += footprintOf(entry);
+        }
+    }
+}
+
+/**
+ * @brief Estimates the memory held by the index
+ * @return Bytes for the bucket arrays, map nodes, keys and posting lists
+ */
+std::size_t ChatHistoryIndex::memoryUsage() const {
+    return entryBytes + (tokens.bucket_count() + senders.bucket_count()) * sizeof(void*);
+}
+
+/**
+ * @brief Intersects two ascending position lists
+ * @param a First list
+ * @param b Second list
+ * @return Positions present in both lists
+ */
+std::vector<std::size_t> ChatHistoryIndex::intersect(const std::vector<std::size_t>& a,
+                                                     const std::vector<std::size_t>& b) {
+    std::vector<std::size_t> result;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+/**
+ * @brief Finds messages containing every token of the given keywords
+ * @param keywords The keywords to look up
+ * @return Ascending history positions, empty if any token is unknown
+ *
+ * Lists are intersected from the shortest upwards to keep work minimal.
+ */
+std::vector<std::size_t> ChatHistoryIndex::findKeyword(const std::string& keywords) const {
+    std::vector<const PostingList*> lists;
+    for (const std::string& token : tokenize(keywords)) {
+        auto it = tokens.find(std::pmr::string(token));
+        if (it == tokens.end()) {
+            return {};
+        }
+        lists.push_back(&it->second);
+    }
+    if (lists.empty()) {
+        return {};
+    }
+    std::sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+        return a->size() < b->size();
+    });
+    std::vector<std::size_t> result = lists[0]->decode();
+    for (std::size_t i = 1; i < lists.size() && !result.empty(); i++) {
+        result = intersect(result, lists[i]->decode());
+    }
+    return result;
+}
+
+/**
+ * @brief Finds messages sent by the given user
+ * @param sender The sender's name
+ * @return Ascending history positions
+ */
+std::vector<std::size_t> ChatHistoryIndex::findSender(const std::string& sender) const {
+    auto it = senders.find(std::pmr::string(sender));
+    if (it == senders.end()) {
+        return {};
+    }
+    return it->second.decode();
+}
+
+/**
+ * @brief Combined keyword and sender query
+ * @param keywords Keywords that must all appear (empty to ignore)
+ * @param sender Sender name to match (empty to ignore)
+ * @return Ascending history positions
+ */
+std::vector<std::size_t> ChatHistoryIndex::find(const std::string& keywords, const std::string& sender) const {
+    if (keywords.empty()) {
+        return sender.empty() ? std::vector<std::size_t>() : findSender(sender);
+    }
+    std::vector<std::size_t> result = findKeyword(keywords);
+    if (!sender.empty() && !result.empty()) {
+        result = intersect(result, findSender(sender));
+    }
+    return result;
+}
+
+/**
+ * @brief Gets the number of messages indexed
+ * @return The indexed message count
+ */
+std::size_t ChatHistoryIndex::size() const {
+    return indexedCount;
+}
+
+/**
+ * @brief Removes every entry from the index
+ */
+void ChatHistoryIndex::clear() {
+    tokens.clear();
+    senders.clear();
+    indexedCount = 0;
+    floor = 0;
+    entryBytes = 0;
+}
+
+/**
+ * @brief Drops every position below a history position
+ * @param position New floor; positions below it are no longer indexed
+ */
+void ChatHistoryIndex::dropBefore(std::size_t position) {
+    if (position <= floor) {
+        return;
+    }
+    trimPostings(tokens, position);
+    trimPostings(senders, position);
+    recount();
+    floor = position;
+    // Positions below the floor count as indexed even if they never were
+    indexedCount = std::max(indexedCount, position);
+}
+
+/**
+ * @brief Gets the first position still indexed
+ * @return The floor (0 if nothing was dropped)
+ */
+std::size_t ChatHistoryIndex::getFloor() const {
+    return floor;
+}
+
+/**
+ * @brief Re-encodes posting lists without the positions below a floor
+ * @param lists The lists to trim; lists left empty are erased
+ * @param position First position to keep
+ */
+void ChatHistoryIndex::trimPostings(PostingMap& lists, std::size_t position) {
+    for (auto it = lists.begin(); it != lists.end();) {
+        std::vector<std::size_t> kept = it->second.decode();
+        kept.erase(kept.begin(), std::lower_bound(kept.begin(), kept.end(), position));
+        if (kept.empty()) {
+            it = lists.erase(it);
+            continue;
+        }
+        PostingList rebuilt(lists.get_allocator());
+        for (std::size_t value : kept) {
+            rebuilt.append(value);
+        }
+        it->second = std::move(rebuilt);
+        ++it;
+    }
+}
+
+/**
+ * @brief Writes the index to a binary file
+ * @param path Destination file path
+ * @return true on success, false otherwise
+ */
+bool ChatHistoryIndex::save(const std::string& path) const {
+    std::vector<unsigned char> out(INDEX_MAGIC, INDEX_MAGIC + 4);
+    putVarint(out, INDEX_VERSION);
+    putVarint(out, indexedCount);
+    putVarint(out, floor);
+    writePostings(out, tokens);
+    writePostings(out, senders);
+    return writeFile(path, out);
+}
+
+/**
+ * @brief Replaces the index with the contents of a binary file
+ * @param path Source file path
+ * @return true on success; the index is left empty on failure
+ */
+bool ChatHistoryIndex::load(const std::string& path) {
+    clear();
+    std::vector<unsigned char> data;
+    if (!readFile(path, data) || data.size() < 4 || !std::equal(INDEX_MAGIC, INDEX_MAGIC + 4, data.begin())) {
+        return false;
+    }
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    unsigned long long count = 0;
+    unsigned long long first = 0;
+    // Version 1 files predate the floor and always index everything
+    if (!getVarint(data.data(), data.size(), pos, version) || version == 0 || version > INDEX_VERSION ||
+        !getVarint(data.data(), data.size(), pos, count) ||
+        (version >= 2 && !getVarint(data.data(), data.size(), pos, first)) ||
+        !readPostings(data.data(), data.size(), pos, tokens) ||
+        !readPostings(data.data(), data.size(), pos, senders)) {
+        clear();
+        return false;
+    }
+    indexedCount = static_cast<std::size_t>(count);
+    floor = static_cast<std::size_t>(first);
+    recount();
+    return true;
+}
+
+// ============= extra : HISTORY RETENTION IMPLEMENTATIONS =============
+
+namespace {
+
+const std::size_t LZ_MIN_MATCH = 4;
+const std::size_t LZ_MAX_OFFSET = 0xFFFF;
+const std::size_t NO_BLOCK = static_cast<std::size_t>(-1);
+
+/**
+ * @brief Compresses a buffer with a small greedy LZ77 coder
+ * @param input The bytes to compress
+ * @return Sequence of (literal run, match length, match offset) varints
+ */
+std::vector<unsigned char> compressBlock(const std::vector<unsigned char>& input) {
+    std::vector<unsigned char> out;
+    std::vector<std::size_t> table(1 << 12, NO_BLOCK);
+    const unsigned char* in = input.data();
+    std::size_t n = input.size();
+    std::size_t anchor = 0;
+    std::size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= n) {
+        std::uint32_t sequence;
+        std::memcpy(&sequence, in + pos, sizeof(sequence));
+        std::size_t slot = static_cast<std::uint32_t>(sequence * 2654435761u) >> 20;
+        std::size_t candidate = table[slot];
+        table[slot] = pos;
+        if (candidate != NO_BLOCK && pos - candidate <= LZ_MAX_OFFSET &&
+            std::memcmp(in + candidate, in + pos, LZ_MIN_MATCH) == 0) {
+            std::size_t length = LZ_MIN_MATCH;
+            while (pos + length < n && in[candidate + length] == in[pos + length]) {
+                length++;
+            }
+            putVarint(out, pos - anchor);
+            out.insert(out.end(), in + anchor, in + pos);
+            putVarint(out, length - LZ_MIN_MATCH);
+            putVarint(out, pos - candidate);
+            pos += length;
+            anchor = pos;
+        } else {
+            pos++;
+        }
+    }
+    putVarint(out, n - anchor);
+    out.insert(out.end(), in + anchor, in + n);
+    return out;
+}
+
+/**
+ * @brief Reverses compressBlock()
+ * @param data Compressed bytes
+ * @param size Number of compressed bytes
+ * @param expected Number of bytes the block decompresses to
+ * @param out Receives the decompressed bytes
+ * @return true on success, false if the input is corrupt or would exceed expected
+ */
+bool decompressBlock(const unsigned char* data, std::size_t size, std::size_t expected, std::vector<unsigned char>& out) {
+    out.clear();
+    out.reserve(expected);
+    std::size_t pos = 0;
+    while (pos < size) {
+        unsigned long long literals = 0;
+        if (!getVarint(data, size, pos, literals) || literals > size - pos || literals > expected - out.size()) {
+            return false;
+        }
+        out.insert(out.end(), data + pos, data + pos + literals);
+        pos += static_cast<std::size_t>(literals);
+        if (pos == size) {
+            return true;
+        }
+        unsigned long long length = 0;
+        unsigned long long offset = 0;
+        if (!getVarint(data, size, pos, length) || !getVarint(data, size, pos, offset) ||
+            offset == 0 || offset > out.size() || length > expected - out.size() ||
+            length + LZ_MIN_MATCH > expected - out.size()) {
+            return false;
+        }
+        std::size_t from = out.size() - static_cast<std::size_t>(offset);
+        for (unsigned long long i = 0; i < length + LZ_MIN_MATCH; i++) {
+            out.push_back(out[from + static_cast<std::size_t>(i)]);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Builds the token and sender posting lists of one cold block
+ * @param entries First message of the block
+ * @param count Number of messages in the block
+ * @return A 32-bit token section size, then the token and sender sections
+ *
+ * Each section is a 32-bit list count and a table of 32-bit list offsets,
+ * followed by the lists sorted by key: key, position count, encoded size
+ * and position deltas relative to the block.
+ */
+std::vector<unsigned char> encodeBlockPostings(const HistoryEntry* entries, std::size_t count) {
+    std::vector<std::pair<std::string, std::size_t>> tokens;
+    std::vector<std::pair<std::string, std::size_t>> senders;
+    for (std::size_t i = 0; i < count; i++) {
+        for (std::string& token : ChatHistoryIndex::tokenize(entries[i].text.view())) {
+            tokens.emplace_back(std::move(token), i);
+        }
+        senders.emplace_back(std::string(entries[i].sender), i);
+    }
+    std::vector<unsigned char> out(sizeof(std::uint32_t));
+    std::vector<unsigned char> deltas;
+    for (std::vector<std::pair<std::string, std::size_t>>* keyed : {&tokens, &senders}) {
+        // Sorting by key then position groups each list; repeats within a message collapse
+        std::sort(keyed->begin(), keyed->end());
+        keyed->erase(std::unique(keyed->begin(), keyed->end()), keyed->end());
+        std::uint32_t listCount = 0;
+        for (std::size_t i = 0; i < keyed->size(); i++) {
+            listCount += i == 0 || (*keyed)[i].first != (*keyed)[i - 1].first;
+        }
+        std::size_t section = out.size();
+        out.resize(section + sizeof(listCount) * (1 + listCount));
+        std::memcpy(out.data() + section, &listCount, sizeof(listCount));
+        std::size_t list = 0;
+        for (std::size_t i = 0; i < keyed->size();) {
+            std::size_t next = i;
+            std::size_t previous = 0;
+            deltas.clear();
+            for (; next < keyed->size() && (*keyed)[next].first == (*keyed)[i].first; next++) {
+                putVarint(deltas, (*keyed)[next].second - previous);
+                previous = (*keyed)[next].second;
+            }
+            std::uint32_t offset = static_cast<std::uint32_t>(out.size() - section);
+            std::memcpy(out.data() + section + sizeof(listCount) * (1 + list++), &offset, sizeof(offset));
+            writeString(out, (*keyed)[i].first);
+            putVarint(out, next - i);
+            putVarint(out, deltas.size());
+            out.insert(out.end(), deltas.begin(), deltas.end());
+            i = next;
+        }
+        if (keyed == &tokens) {
+            std::uint32_t tokenBytes = static_cast<std::uint32_t>(out.size() - section);
+            std::memcpy(out.data(), &tokenBytes, sizeof(tokenBytes));
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Looks up one key in a posting section written by encodeBlockPostings()
+ * @param section Start of the section
+ * @param size Bytes available from the section start
+ * @param key The key to find
+ * @param positions Receives the key's block-relative positions (empty if absent)
+ * @return false if the section is corrupt
+ *
+ * The sorted offset table is binary searched, so other lists are never read.
+ */
+bool findBlockPosting(const unsigned char* section, std::size_t size, std::string_view key,
+                      std::vector<std::size_t>& positions) {
+    positions.clear();
+    std::uint32_t listCount = 0;
+    if (size < sizeof(listCount)) {
+        return false;
+    }
+    std::memcpy(&listCount, section, sizeof(listCount));
+    if ((size - sizeof(listCount)) / sizeof(listCount) < listCount) {
+        return false;
+    }
+    std::size_t low = 0;
+    std::size_t high = listCount;
+    while (low < high) {
+        std::size_t middle = (low + high) / 2;
+        std::uint32_t offset = 0;
+        std::memcpy(&offset, section + sizeof(offset) * (1 + middle), sizeof(offset));
+        std::size_t pos = offset;
+        unsigned long long length = 0;
+        if (pos >= size || !getVarint(section, size, pos, length) || length > size - pos) {
+            return false;
+        }
+        std::string_view found(reinterpret_cast<const char*>(section + pos), static_cast<std::size_t>(length));
+        if (found < key) {
+            low = middle + 1;
+            continue;
+        }
+        if (key < found) {
+            high = middle;
+            continue;
+        }
+        pos += static_cast<std::size_t>(length);
+        unsigned long long count = 0;
+        unsigned long long listBytes = 0;
+        if (!getVarint(section, size, pos, count) || !getVarint(section, size, pos, listBytes) || listBytes > size - pos) {
+            return false;
+        }
+        std::size_t end = pos + static_cast<std::size_t>(listBytes);
+        unsigned long long position = 0;
+        for (unsigned long long j = 0; j < count; j++) {
+            unsigned long long delta = 0;
+            if (!getVarint(section, end, pos, delta)) {
+                return false;
+            }
+            position += delta;
+            positions.push_back(static_cast<std::size_t>(position));
+        }
+        return true;
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Constructs retention limits
+ * @param messages Maximum in-memory messages (0 = unbounded)
+ * @param bytes Maximum in-memory message bytes (0 = unbounded)
+ * @param block Messages per compressed cold block
+ * @param directory Directory for cold-storage files
+ */
+HistoryRetention::HistoryRetention(std::size_t messages, std::size_t bytes,
+                                   std::size_t block, const std::string& directory)
+    : maxMessages(messages), maxBytes(bytes), blockMessages(block ? block : 1), coldDirectory(directory) {
+}
+
+/**
+ * @brief Constructs a cold store backed by the given file
+ * @param filePath Path of the cold-storage file (truncated)
+ * @param block Number of messages per compressed block
+ * @param resource Memory resource for the pending and cached blocks
+ */
+HistoryColdStore::HistoryColdStore(const std::string& filePath, std::size_t block, std::pmr::memory_resource* resource)
+    : path(filePath), directoryPath(filePath + ".dir"), postingsPath(filePath + ".pst"), blockMessages(block ? block : 1),
+      blockCount(0), pending(resource), fileBytes(0), postingBytes(0), cachedBlock(NO_BLOCK), cache(resource) {
+    std::ofstream truncate(path, std::ios::binary | std::ios::trunc);
+    std::ofstream truncateDirectory(directoryPath, std::ios::binary | std::ios::trunc);
+    std::ofstream truncatePostings(postingsPath, std::ios::binary | std::ios::trunc);
+    pending.reserve(blockMessages);
+}
+
+/**
+ * @brief Destroys the store and removes its cold-storage files
+ */
+HistoryColdStore::~HistoryColdStore() {
+    std::remove(path.c_str());
+    std::remove(directoryPath.c_str());
+    std::remove(postingsPath.c_str());
+}
+
+/**
+ * @brief Compresses full pending blocks and appends them to the cold file
+ *
+ * Each block is written as two 32-bit sizes (raw, compressed) followed by
+ * the compressed bytes, its posting lists go to the postings file, and
+ * both offsets are appended to the directory file. A failed write is cut
+ * off again, so the files only ever hold whole blocks; the messages stay
+ * pending and are retried on the next push.
+ */
+void HistoryColdStore::flushBlock() {
+    while (pending.size() >= blockMessages) {
+        std::vector<unsigned char> raw;
+        for (std::size_t i = 0; i < blockMessages; i++) {
+            const HistoryEntry& entry = pending[i];
+            putVarint(raw, entry.seq);
+            putVarint(raw, static_cast<unsigned long long>(entry.timestamp));
+            writeString(raw, entry.sender);
+            writeString(raw, entry.text.view());
+        }
+        std::vector<unsigned char> packed = compressBlock(raw);
+        std::uint32_t header[2] = {static_cast<std::uint32_t>(raw.size()), static_cast<std::uint32_t>(packed.size())};
+        std::vector<unsigned char> block(sizeof(header) + packed.size());
+        std::memcpy(block.data(), header, sizeof(header));
+        std::copy(packed.begin(), packed.end(), block.begin() + sizeof(header));
+        if (!appendBlock(block.data(), block.size(), encodeBlockPostings(pending.data(), blockMessages))) {
+            return;
+        }
+        pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(blockMessages));
+    }
+}
+
+/**
+ * @brief Appends one block (header and compressed bytes), its postings and their offsets
+ * @param data The block
+ * @param size Size of the block
+ * @param postings The block's posting lists
+ * @return false if a write failed; all three files are cut back then
+ */
+bool HistoryColdStore::appendBlock(const unsigned char* data, std::size_t size, const std::vector<unsigned char>& postings) {
+    bool written = false;
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+        out.flush();
+        written = static_cast<bool>(out);
+    }
+    if (written) {
+        std::ofstream out(postingsPath, std::ios::binary | std::ios::app);
+        out.write(reinterpret_cast<const char*>(postings.data()), static_cast<std::streamsize>(postings.size()));
+        out.flush();
+        written = static_cast<bool>(out);
+    }
+    if (written) {
+        unsigned long long offsets[2] = {fileBytes, postingBytes};
+        std::ofstream directory(directoryPath, std::ios::binary | std::ios::app);
+        directory.write(reinterpret_cast<const char*>(offsets), sizeof(offsets));
+        directory.flush();
+        written = static_cast<bool>(directory);
+    }
+    if (!written) {
+        std::error_code error;
+        std::filesystem::resize_file(path, fileBytes, error);
+        std::filesystem::resize_file(postingsPath, postingBytes, error);
+        std::filesystem::resize_file(directoryPath, blockCount * 2 * sizeof(unsigned long long), error);
+        PETSPACE_LOG(ERROR, HISTORY, "Cold storage write failed: ", path);
+        return false;
+    }
+    fileBytes += size;
+    postingBytes += postings.size();
+    blockCount++;
+    return true;
+}
+
+/**
+ * @brief Decodes a block produced by flushBlock()
+ * @param data The block's header and compressed bytes
+ * @param size Size of the block
+ * @param out Receives the block's messages
+ * @return false if the block is corrupt
+ */
+bool HistoryColdStore::unpackBlock(const unsigned char* data, std::size_t size, std::pmr::vector<HistoryEntry>& out) {
+    std::uint32_t header[2] = {0, 0};
+    std::vector<unsigned char> raw;
+    out.clear();
+    if (size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(header, data, sizeof(header));
+    if (!decompressBlock(data + sizeof(header), size - sizeof(header), header[0], raw) || raw.size() != header[0]) {
+        return false;
+    }
+    std::size_t pos = 0;
+    HistoryEntry entry;
+    unsigned long long timestamp = 0;
+    std::string sender;
+    std::string text;
+    while (pos < raw.size() && getVarint(raw.data(), raw.size(), pos, entry.seq) &&
+           getVarint(raw.data(), raw.size(), pos, timestamp) &&
+           readString(raw.data(), raw.size(), pos, sender) &&
+           readString(raw.data(), raw.size(), pos, text)) {
+        entry.timestamp = static_cast<long long>(timestamp);
+        entry.sender.assign(sender);
+        entry.text = Message(text);
+        out.push_back(entry);
+    }
+    return true;
+}
+
+/**
+ * @brief Appends an evicted message, writing a block once enough accumulate
+ * @param entry The history entry to store
+ */
+void HistoryColdStore::push(HistoryEntry&& entry) {
+    pending.push_back(std::move(entry));
+    if (pending.size() >= blockMessages) {
+        flushBlock();
+    }
+}
+
+/**
+ * @brief Gets the message at a cold position
+ * @param position Position within the cold tier
+ * @return The stored entry, or an entry with seq 0 if out of range
+ *
+ * The last decoded block is cached, so sequential reads decompress each
+ * block only once.
+ */
+HistoryEntry HistoryColdStore::at(std::size_t position) const {
+    std::size_t block = position / blockMessages;
+    if (block >= blockCount) {
+        std::size_t index = position - blockCount * blockMessages;
+        return index < pending.size() ? pending[index] : HistoryEntry();
+    }
+    if (cachedBlock != block) {
+        cache.clear();
+        cachedBlock = NO_BLOCK;
+        std::vector<unsigned char> packed;
+        if (!copyBlock(block, packed) || !unpackBlock(packed.data(), packed.size(), cache)) {
+            cache.clear();
+            return HistoryEntry();
+        }
+        cachedBlock = block;
+    }
+    std::size_t index = position % blockMessages;
+    return index < cache.size() ? cache[index] : HistoryEntry();
+}
+
+/**
+ * @brief Finds written cold messages through their on-disk posting lists
+ * @param keywords Tokens that must all appear (empty to match any text)
+ * @param sender Sender name to match (empty to match any sender)
+ * @param limit Positions at or above this are left out
+ * @param out Receives ascending cold positions
+ * @return false if the postings could not be read; out is empty then
+ *
+ * Each block's lists are looked up in the mapped postings file and
+ * intersected there, so no message text is decompressed.
+ */
+bool HistoryColdStore::search(const std::vector<std::string>& keywords, const std::string& sender, std::size_t limit,
+                              std::vector<std::size_t>& out) const {
+    out.clear();
+    std::size_t blocks = std::min(blockCount, (limit + blockMessages - 1) / blockMessages);
+    if (blocks == 0) {
+        return true;
+    }
+    std::vector<std::string> wanted(keywords);
+    std::sort(wanted.begin(), wanted.end());
+    wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+    MappedFile directory(directoryPath);
+    MappedFile postings(postingsPath);
+    unsigned long long offsets[2] = {0, 0};
+    if (!directory.isOpen() || !postings.isOpen() || directory.size() < blocks * sizeof(offsets)) {
+        PETSPACE_LOG(ERROR, HISTORY, "Cold postings unreadable: ", postingsPath);
+        return false;
+    }
+    std::vector<std::size_t> matched;
+    std::vector<std::size_t> list;
+    std::vector<std::size_t> both;
+    for (std::size_t b = 0; b < blocks; b++) {
+        std::memcpy(offsets, directory.data() + b * sizeof(offsets), sizeof(offsets));
+        std::uint32_t tokenBytes = 0;
+        std::size_t at = static_cast<std::size_t>(offsets[1]);
+        bool readable = offsets[1] <= postings.size() && postings.size() - at >= sizeof(tokenBytes);
+        if (readable) {
+            std::memcpy(&tokenBytes, postings.data() + at, sizeof(tokenBytes));
+            at += sizeof(tokenBytes);
+            readable = tokenBytes <= postings.size() - at;
+        }
+        matched.clear();
+        for (std::size_t i = 0; readable && i < wanted.size() && (i == 0 || !matched.empty()); i++) {
+            readable = findBlockPosting(postings.data() + at, tokenBytes, wanted[i], i == 0 ? matched : list);
+            if (i > 0) {
+                both.clear();
+                std::set_intersection(matched.begin(), matched.end(), list.begin(), list.end(), std::back_inserter(both));
+                matched.swap(both);
+            }
+        }
+        if (readable && !sender.empty() && (wanted.empty() || !matched.empty())) {
+            readable = findBlockPosting(postings.data() + at + tokenBytes, postings.size() - at - tokenBytes, sender,
+                                        wanted.empty() ? matched : list);
+            if (!wanted.empty()) {
+                both.clear();
+                std::set_intersection(matched.begin(), matched.end(), list.begin(), list.end(), std::back_inserter(both));
+                matched.swap(both);
+            }
+        }
+        if (!readable) {
+            PETSPACE_LOG(ERROR, HISTORY, "Cold postings unreadable: ", postingsPath);
+            out.clear();
+            return false;
+        }
+        for (std::size_t local : matched) {
+            if (b * blockMessages + local < limit) {
+                out.push_back(b * blockMessages + local);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Gets the number of messages in the cold tier
+ * @return Messages in written blocks plus pending ones
+ */
+std::size_t HistoryColdStore::size() const {
+    return blockCount * blockMessages + pending.size();
+}
+
+/**
+ * @brief Gets the number of messages in written blocks
+ * @return Messages no longer pending
+ */
+std::size_t HistoryColdStore::writtenSize() const {
+    return blockCount * blockMessages;
+}
+
+/**
+ * @brief Gets the number of compressed bytes written to disk
+ * @return The cold file size
+ */
+unsigned long long HistoryColdStore::diskBytes() const {
+    return fileBytes;
+}
+
+/**
+ * @brief Gets the cold-storage file path
+ * @return The file path
+ */
+std::string HistoryColdStore::getPath() const {
+    return path;
+}
+
+/**
+ * @brief Gets the number of blocks written to the cold file
+ * @return The block count
+ */
+std::size_t HistoryColdStore::getBlockCount() const {
+    return blockCount;
+}
+
+/**
+ * @brief Gets the number of messages per block
+ * @return Messages per block
+ */
+std::size_t HistoryColdStore::getBlockMessages() const {
+    return blockMessages;
+}
+
+/**
+ * @brief Appends a written block, still compressed, to a buffer
+ * @param block Block index
+ * @param out Buffer to append the block's header and bytes to
+ * @return false if the block could not be read; out is unchanged then
+ */
+bool HistoryColdStore::copyBlock(std::size_t block, std::vector<unsigned char>& out) const {
+    unsigned long long offset = 0;
+    std::ifstream directory(directoryPath, std::ios::binary);
+    directory.seekg(static_cast<std::streamoff>(block * 2 * sizeof(offset)));
+    directory.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+    if (block >= blockCount || !directory) {
+        return false;
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::uint32_t header[2] = {0, 0};
+    in.seekg(static_cast<std::streamoff>(offset));
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!in) {
+        return false;
+    }
+    std::size_t start = out.size();
+    out.resize(start + sizeof(header) + header[1]);
+    std::memcpy(out.data() + start, header, sizeof(header));
+    in.read(reinterpret_cast<char*>(out.data() + start + sizeof(header)), static_cast<std::streamsize>(header[1]));
+    if (!in) {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Appends a block produced by copyBlock() to the cold file
+ * @param data The block's header and compressed bytes
+ * @param size Size of the block
+ * @return false if the block is malformed, messages are pending, or the write failed
+ *
+ * The block is stored as is; it is decompressed once here to build its
+ * posting lists.
+ */
+bool HistoryColdStore::adoptBlock(const unsigned char* data, std::size_t size) {
+    std::uint32_t header[2] = {0, 0};
+    if (!pending.empty() || size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(header, data, sizeof(header));
+    std::pmr::vector<HistoryEntry> entries(pending.get_allocator());
+    if (size != sizeof(header) + header[1] || !unpackBlock(data, size, entries) || entries.size() != blockMessages) {
+        return false;
+    }
+    return appendBlock(data, size, encodeBlockPostings(entries.data(), entries.size()));
+}
+
+// ============= extra : RATE LIMITING IMPLEMENTATIONS =============
+
+/**
+ * @brief Constructs a full token bucket
+ * @param messagesPerSecond Sustained message rate
+ * @param burstSize Maximum number of messages sent back to back
+ * @param onLimit What to do when the bucket is empty
+ * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+ */
+RateLimiter::RateLimiter(double messagesPerSecond, double burstSize, RateLimitAction onLimit, double maxDelay)
+    : rate(messagesPerSecond > 0 ? messagesPerSecond : 0), burst(burstSize >= 1 ? burstSize : 1), tokens(burst),
+      action(onLimit), maxDelaySeconds(maxDelay), lastRefill(std::chrono::steady_clock::now()), stats() {
+}
+
+/**
+ * @brief Adds the tokens earned since the last refill
+ */
+void RateLimiter::refill() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    lastRefill = now;
+}
+
+/**
+ * @brief Gets the time until a token is available
+ * @return Seconds to wait, 0 if a token is available now
+ */
+double RateLimiter::secondsUntilAvailable() {
+    refill();
+    if (tokens >= 1.0) {
+        return 0.0;
+    }
+    if (rate <= 0) {
+        return 1e9;
+    }
+    return (1.0 - tokens) / rate;
+}
+
+/**
+ * @brief Takes one token
+ * @param waited Whether the caller waited for the token
+ */
+void RateLimiter::consume(bool waited) {
+    refill();
+    tokens -= 1.0;
+    if (waited) {
+        stats.delayed++;
+    } else {
+        stats.allowed++;
+    }
+}
+
+/**
+ * @brief Records a message that was not admitted
+ */
+void RateLimiter::recordLimited() {
+    if (action == RateLimitAction::Coalesce) {
+        stats.coalesced++;
+    } else {
+        stats.rejected++;
+    }
+}
+
+/**
+ * @brief Gets the number of tokens available now
+ * @return The token count
+ */
+double RateLimiter::available() {
+    refill();
+    return tokens;
+}
+
+/**
+ * @brief Gets the action applied when the bucket is empty
+ * @return The configured action
+ */
+RateLimitAction RateLimiter::getAction() const {
+    return action;
+}
+
+/**
+ * @brief Gets the longest wait for the Delay action
+ * @return Maximum delay in seconds
+ */
+double RateLimiter::getMaxDelay() const {
+    return maxDelaySeconds;
+}
+
+/**
+ * @brief Gets the limiter's counters
+ * @return Copy of the counters
+ */
+RateLimiterStats RateLimiter::getStats() const {
+    return stats;
+}
+
+// ============= extra : MENTION MATCHING IMPLEMENTATIONS =============
+
+/**
+ * @brief Constructs a matcher with no patterns
+ */
+MentionMatcher::MentionMatcher() : nodes(1, Node{{}, 0, -1, {}}), patterns(0), removed(0), linked(true) {
+}
+
+/**
+ * @brief Follows a trie edge
+ * @param node The node to leave
+ * @param c The edge label
+ * @return The child node, or -1 if there is no such edge
+ */
+int MentionMatcher::child(int node, unsigned char c) const {
+    for (const std::pair<unsigned char, int>& edge : nodes[node].next) {
+        if (edge.first == c) {
+            return edge.second;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Follows a whole pattern down the trie
+ * @param pattern The pattern, including the leading '@'
+ * @return The node where it ends, or -1 if the trie has no such path
+ */
+int MentionMatcher::find(const std::string& pattern) const {
+    int node = 0;
+    for (std::size_t i = 0; i < pattern.size() && node >= 0; i++) {
+        node = child(node, static_cast<unsigned char>(pattern[i]));
+    }
+    return node;
+}
+
+/**
+ * @brief Rebuilds the automaton for a set of members
+ * @param users The room's members
+ * 
+ * Starts from an empty trie, which also drops the paths of removed names.
+ */
+void MentionMatcher::rebuild(const std::pmr::vector<User*>& users) {
+    nodes.assign(1, Node{{}, 0, -1, {}});
+    patterns = 0;
+    removed = 0;
+    for (User* user : users) {
+        add(user->getHandle(), user->getName());
+    }
+    link();
+}
+
+/**
+ * @brief Adds a member's name
+ * @param handle The member's handle
+ * @param name The member's name
+ */
+void MentionMatcher::add(unsigned int handle, const std::string& name) {
+    if (name.empty()) {
+        return;
+    }
+    std::string pattern = "@" + name;
+    int node = 0;
+    for (char ch : pattern) {
+        unsigned char c = static_cast<unsigned char>(ch);
+        int next = child(node, c);
+        if (next < 0) {
+            next = static_cast<int>(nodes.size());
+            nodes.push_back(Node{{}, 0, -1, {}});
+            nodes[node].next.push_back(std::make_pair(c, next));
+            linked = false;
+        }
+        node = next;
+    }
+    // A node that just gained its first output changes other nodes' output links
+    if (nodes[node].outputs.empty()) {
+        linked = false;
+    }
+    nodes[node].outputs.push_back(handle);
+    patterns++;
+}
+
+/**
+ * @brief Removes a member's name
+ * @param handle The member's handle
+ * @param name The member's name
+ * 
+ * The trie path stays; the node simply stops reporting the handle, so
+ * links stay valid and nothing has to be rebuilt.
+ */
+void MentionMatcher::remove(unsigned int handle, const std::string& name) {
+    if (name.empty()) {
+        return;
+    }
+    int node = find("@" + name);
+    if (node < 0) {
+        return;
+    }
+    std::vector<unsigned int>& outputs = nodes[node].outputs;
+    auto it = std::find(outputs.begin(), outputs.end(), handle);
+    if (it != outputs.end()) {
+        outputs.erase(it);
+        patterns--;
+        removed++;
+    }
+}
+
+/**
+ * @brief Checks whether removals have left the trie mostly dead paths
+ * @return true if more names were removed than remain
+ */
+bool MentionMatcher::isSparse() const {
+    return removed > 64 && removed > patterns;
+}
+
+/**
+ * @brief Sets fail and output links for every trie node
+ * 
+ * Breadth first, so matching never has to back up in the text. A node
+ * whose outputs were all removed still counts as an output node; match()
+ * just finds nothing there.
+ */
+void MentionMatcher::link() {
+    linked = true;
+    std::vector<int> queue;
+    for (const std::pair<unsigned char, int>& edge : nodes[0].next) {
+        queue.push_back(edge.second);
+    }
+    for (std::size_t head = 0; head < queue.size(); head++) {
+        int node = queue[head];
+        for (const std::pair<unsigned char, int>& edge : nodes[node].next) {
+            int fail = nodes[node].fail;
+            while (fail && child(fail, edge.first) < 0) {
+                fail = nodes[fail].fail;
+            }
+            int target = child(fail, edge.first);
+            Node& next = nodes[edge.second];
+            next.fail = target >= 0 && target != edge.second ? target : 0;
+            next.outputLink = nodes[next.fail].outputs.empty() ? nodes[next.fail].outputLink : next.fail;
+            queue.push_back(edge.second);
+        }
+    }
+}
+
+/**
+ * @brief Finds the members mentioned in a message
+ * @param text The message text
+ * @return Handle of each mentioned member once, in order of first mention
+ * 
+ * Messages mention few people, so repeats are filtered against the
+ * result itself rather than a per-member table.
+ */
+std::vector<unsigned int> MentionMatcher::match(std::string_view text) {
+    if (!linked) {
+        link();
+    }
+    std::vector<unsigned int> found;
+    int node = 0;
+    for (std::size_t i = 0; i < text.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        int next = child(node, c);
+        while (node && next < 0) {
+            node = nodes[node].fail;
+            next = child(node, c);
+        }
+        node = next < 0 ? 0 : next;
+        // A name must end at a word boundary: "@Al" does not match "@Alice"
+        bool boundary = i + 1 == text.size() ||
+                        !(std::isalnum(static_cast<unsigned char>(text[i + 1])) || text[i + 1] == '_');
+        if (!boundary) {
+            continue;
+        }
+        for (int hit = nodes[node].outputs.empty() ? nodes[node].outputLink : node; hit >= 0; hit = nodes[hit].outputLink) {
+            for (unsigned int member : nodes[hit].outputs) {
+                if (std::find(found.begin(), found.end(), member) == found.end()) {
+                    found.push_back(member);
+                }
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Gets the number of names the automaton recognises
+ * @return The pattern count
+ */
+std::size_t MentionMatcher::patternCount() const {
+    return patterns;
+}
+
+// ============= MEDIATOR PATTERN IMPLEMENTATIONS =============
+
+namespace {
+
+const char HISTORY_MAGIC[4] = {'P', 'S', 'H', 'S'};
+const unsigned int HISTORY_VERSION = 2;
+const std::size_t HISTORY_TIME_STRIDE = 32; ///< Messages between time index samples
+const std::size_t INDEX_TRIM_SLACK = 16;     ///< Cold messages tolerated in the index before it is trimmed
+
+/**
+ * @brief Builds the cold-storage file name for a room
+ * @param directory Directory holding the file
+ * @param roomId ID of the room
+ * @return Path that is unique per process and room
+ */
+std::string coldFileName(const std::string& directory, unsigned int roomId) {
+#ifdef _WIN32
+    long long process = _getpid();
+#else
+    long long process = getpid();
+#endif
+    return directory + "/room_" + std::to_string(process) + "_" + std::to_string(roomId) + ".cold";
+}
+
+} // namespace
+
+std::atomic<unsigned int> ChatRoom::nextRoomId(1);
+thread_local long long ChatRoom::pinnedTime = 0;
+
+/**
+ * @brief Constructs a ChatRoom with an unbounded history and a unique ID
+ * @param resource Memory resource for the member list and history
+ */
+ChatRoom::ChatRoom(std::pmr::memory_resource* resource)
+    : roomId(nextRoomId++), users(resource), memberHandles(resource), chatHistory(resource), historyIndex(resource), retentionEnabled(false), ringHead(0), hotCount(0), hotBytes(0), coldStore(nullptr),
+      rateLimiter(nullptr), lastTimestamp(0), timeIndex(resource), mentionBits(resource), historyBytes(0), dedupBytes(0), memoryCap(0) {
+}
+
+/**
+ * @brief Destroys the ChatRoom, its cold-storage tier and rate limiter
+ */
+ChatRoom::~ChatRoom() {
+    for (User* user : users) {
+        user->forgetRoom(this);
+    }
+    delete coldStore;
+    delete rateLimiter;
+    if (CommandJournal* journal = CommandJournal::current()) {
+        journal->forget(this);
+    }
+    if (TraceRecorder* trace = TraceRecorder::current()) {
+        trace->forget(this);
+    }
+    if (PresenceHub* hub = PresenceHub::current()) {
+        hub->forget(this);
+    }
+}
+
+/**
+ * @brief Limits how fast messages may be sent to this room by anyone
+ * @param messagesPerSecond Sustained message rate
+ * @param burst Maximum number of messages sent back to back
+ * @param action What to do with a message when the room is over its rate
+ * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+ */
+void ChatRoom::setRateLimit(double messagesPerSecond, double burst, RateLimitAction action, double maxDelay) {
+    delete rateLimiter;
+    rateLimiter = new RateLimiter(messagesPerSecond, burst, action, maxDelay);
+}
+
+/**
+ * @brief Removes the room's rate limit
+ */
+void ChatRoom::clearRateLimit() {
+    delete rateLimiter;
+    rateLimiter = nullptr;
+}
+
+/**
+ * @brief Gets the room's rate limiter
+ * @return Pointer to the limiter, or nullptr if unlimited
+ */
+RateLimiter* ChatRoom::getRateLimiter() const {
+    return rateLimiter;
+}
+
+/**
+ * @brief Gets the list of users in the chat room
+ * @return Reference to the users vector
+ */
+std::pmr::vector<User*>& ChatRoom::getUsers() {
+   return users;
+}
+
+/**
+ * @brief Gets the chat history
+ * @return Reference to the chat history vector
+ */
+std::pmr::vector<HistoryEntry>& ChatRoom::getChatHistory() {
+    return chatHistory;
+}
+
+/**
+ * @brief Gets the memory resource backing the room's containers
+ * @return The room's memory resource
+ */
+std::pmr::memory_resource* ChatRoom::getMemoryResource() const {
+    return chatHistory.get_allocator().resource();
+}
+
+/**
+ * @brief Appends a message to the history and indexes it
+ * @param message The message content (its buffer is shared, not copied)
+ * @param fromUser Pointer to the user who sent the message
+ *
+ * Timestamps never go backwards, so the time index stays sorted even if
+ * the wall clock is adjusted.
+ */
+void ChatRoom::appendHistory(const Message& message, User* fromUser) {
+    appendHistory(message, fromUser->getName());
+}
+
+/**
+ * @brief Appends a message to the history under a sender name
+ * @param message The message content
+ * @param sender Name of the user who sent the message
+ */
+void ChatRoom::appendHistory(const Message& message, std::string_view sender) {
+    long long now = pinnedTime ? pinnedTime : std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    Message text = message;
+    bool reused = false;
+    if (PayloadStore* store = PayloadStore::current()) {
+        text = store->intern(message, reused);
+        if (reused) {
+            dedupBytes += text.size();
+        }
+    }
+    HistoryEntry entry(getHeadSequence() + 1, std::max(now, lastTimestamp), sender, text,
+                       chatHistory.get_allocator());
+    entry.deduplicated = reused;
+    historyIndex.addMessage(historySize(), entry.sender, message.view());
+    recordHistoryEntry(std::move(entry));
+}
+
+/**
+ * @brief Delivers a message to every member except the sender
+ * @param envelope The message with its room and sender
+ * @param seen Handles already reached by the same broadcast (nullptr = none)
+ * @return Number of members reached, including passive ones
+ */
+std::size_t ChatRoom::deliverMessage(const MessageEnvelope& envelope, HandleMarks* seen) {
+    const Message& message = envelope.getPayload();
+    User* fromUser = envelope.getSender();
+    std::size_t reached = 0;
+    std::vector<unsigned int> mentioned;
+    if (std::memchr(message.data(), '@', message.size())) {
+        if (mentionMatcher.isSparse()) {
+            mentionMatcher.rebuild(users);
+        }
+        mentioned = mentionMatcher.match(message.view());
+        if (!mentioned.empty() && mentionBits.size() < (User::getHandleLimit() + 63) / 64) {
+            mentionBits.resize((User::getHandleLimit() + 63) / 64, 0);
+        }
+        // Mark the mentioned handles so the fan-out below skips them in O(1)
+        for (unsigned int handle : mentioned) {
+            mentionBits[handle / 64] |= std::uint64_t(1) << (handle % 64);
+            User* user = UserDirectory::find(handle);
+            if (!user || user == fromUser || (seen && !seen->mark(handle))) {
+                continue;
+            }
+            reached++;
+            if (RingMailbox* box = user->getMailbox()) {
+                box->enqueue(shardFor(user, box), message, envelope.getSenderHandle(), true);
+            } else {
+                user->receiveMention(message, fromUser, this);
+            }
+        }
+    }
+    // Members whose delivery would only print are skipped straight from the user table
+    bool visible = UserTable::deliveryVisible();
+    for (std::size_t i = 0; i < memberHandles.size(); i++) {
+        unsigned int handle = memberHandles[i];
+        User* user = users[i];
+        if (user == fromUser || (!mentioned.empty() && (mentionBits[handle / 64] >> (handle % 64)) & 1)) {
+            continue;
+        }
+        if (seen && !seen->mark(handle)) {
+            continue;
+        }
+        reached++;
+        if (!visible && (UserTable::flagsOf(handle) & UserTable::Passive)) {
+            continue;
+        }
+        if (RingMailbox* box = user->getMailbox()) {
+            box->enqueue(shardFor(user, box), message, envelope.getSenderHandle());
+        } else {
+            user->receiveEnvelope(envelope);
+        }
+    }
+    for (unsigned int handle : mentioned) {
+        mentionBits[handle / 64] = 0;
+    }
+    return reached;
+}
+
+/**
+ * @brief Writes a message's display form to the console
+ * @param envelope The message with its room and sender
+ */
+void ChatRoom::echoMessage(const MessageEnvelope& envelope) const {
+    PETSPACE_LOG(INFO, DELIVERY, envelope.view());
+}
+
+/**
+ * @brief Makes room for a number of upcoming history entries
+ * @param count Number of entries about to be appended
+ *
+ * Grows geometrically, so a stream of small batches costs amortised O(1)
+ * per entry instead of reallocating the whole history every batch.
+ */
+void ChatRoom::reserveHistory(std::size_t count) {
+    if (!retentionEnabled && chatHistory.capacity() < chatHistory.size() + count) {
+        chatHistory.reserve(std::max(2 * chatHistory.capacity(), chatHistory.size() + count));
+    }
+}
+
+/**
+ * @brief Sends a batch of messages to all users in the room
+ * @param messages The messages to send, oldest first
+ * @param fromUser Pointer to the user sending the messages
+ * 
+ * The batch is delivered to all users except the sender
+ */
+void ChatRoom::sendBatch(const std::vector<Message>& messages, User* fromUser) {
+    if (messages.empty() || !fromUser) {
+        return;
+    }
+    PETSPACE_LOG(INFO, DELIVERY, joinLines("[" + getRoomName() + "] " + fromUser->getName() + ": ", messages));
+    // Snapshot members so a receiver leaving mid-batch cannot disturb delivery
+    std::vector<User*> recipients;
+    recipients.reserve(users.size());
+    bool visible = UserTable::deliveryVisible();
+    for (std::size_t i = 0; i < memberHandles.size(); i++) {
+        if (visible || !(UserTable::flagsOf(memberHandles[i]) & UserTable::Passive)) {
+            recipients.push_back(users[i]);
+        }
+    }
+    for (User* user : recipients) {
+        if (user == fromUser) {
+            continue;
+        }
+        if (RingMailbox* box = user->getMailbox()) {
+            MailboxShard* shard = shardFor(user, box);
+            for (const Message& message : messages) {
+                box->enqueue(shard, message, fromUser->getHandle());
+            }
+        } else {
+            user->receiveBatch(messages, fromUser, this);
+        }
+    }
+}
+
+/**
+ * @brief Delivers one leg of a multi-room broadcast
+ * @param message The message content
+ * @param fromUser Pointer to the user broadcasting
+ * @param seen Handles reached by earlier rooms of the broadcast; updated
+ * @return Number of members reached that no earlier room had reached
+ */
+std::size_t ChatRoom::deliverBroadcast(const Message& message, User* fromUser, HandleMarks& seen) {
+    MessageEnvelope envelope(this, fromUser, message);
+    return deliverMessage(envelope, &seen);
+}
+
+/**
+ * @brief Saves a batch of messages to the chat history
+ * @param messages The messages to save, oldest first
+ * @param fromUser Pointer to the user who sent the messages
+ */
+void ChatRoom::saveBatch(const std::vector<Message>& messages, User* fromUser) {
+    if (messages.empty() || !fromUser) {
+        return;
+    }
+    std::string sender = fromUser->getName();
+    reserveHistory(messages.size());
+    for (const Message& message : messages) {
+        appendHistory(message, sender);
+    }
+    PETSPACE_LOG(INFO, HISTORY, joinLines("[" + getRoomName() + "] Message saved to history: " + sender + ": ", messages));
+}
+
+/**
+ * @brief Stores a new entry and samples it into the sparse time index
+ * @param entry The entry to store (must be the next sequence)
+ */
+void ChatRoom::recordHistoryEntry(HistoryEntry&& entry) {
+    std::size_t position = historySize();
+    if (position % HISTORY_TIME_STRIDE == 0) {
+        timeIndex.push_back(std::make_pair(entry.timestamp, position));
+    }
+    lastTimestamp = entry.timestamp;
+    storeHistoryEntry(std::move(entry));
+    trimIndexes();
+}
+
+/**
+ * @brief Drops index entries for history that has gone cold
+ * @param underCap Trim after a smaller batch, because the indexes count
+ *        against the memory cap; an eighth of the hot ring keeps the
+ *        trim amortised while bounding the stale share of the cap
+ *
+ * Keeps the search and time indexes proportional to the hot ring. Only
+ * positions in written cold blocks are dropped, since those blocks keep
+ * their posting lists on disk. The trim is batched so its cost is
+ * amortised over many evictions.
+ */
+void ChatRoom::trimIndexes(bool underCap) {
+    std::size_t cold = coldStore ? coldStore->writtenSize() : 0;
+    std::size_t slack = std::max(underCap ? hotCount / 8 : hotCount, INDEX_TRIM_SLACK);
+    if (!retentionEnabled || cold < historyIndex.getFloor() + slack) {
+        return;
+    }
+    historyIndex.dropBefore(cold);
+    auto firstHot = std::lower_bound(timeIndex.begin(), timeIndex.end(), cold,
+                                     [](const std::pair<long long, std::size_t>& sample, std::size_t position) {
+                                         return sample.second < position;
+                                     });
+    timeIndex.erase(timeIndex.begin(), firstHot);
+}
+
+/**
+ * @brief Stores a history entry, evicting the oldest ones if over limit
+ * @param entry The history entry to store
+ *
+ * Without retention the entry is simply appended. With retention the ring
+ * only grows while no message limit is set; evicted entries go cold.
+ */
+void ChatRoom::storeHistoryEntry(HistoryEntry&& entry) {
+    std::size_t entryMemory = sizeof(HistoryEntry) + entry.sender.size() + entry.text.size();
+    if (!retentionEnabled) {
+        historyBytes += entryMemory;
+        chatHistory.push_back(std::move(entry));
+        return;
+    }
+    std::size_t entryBytes = entry.sender.size() + entry.text.size();
+    for (;;) {
+        // A full ring would double, and its new empty slots count against the cap too
+        std::size_t growth =
+            hotCount == chatHistory.size() ? std::max<std::size_t>(8, chatHistory.size() * 2) - chatHistory.size() : 0;
+        if (hotCount == 0 || !((retention.maxMessages && hotCount >= retention.maxMessages) ||
+                               (retention.maxBytes && hotBytes + entryBytes > retention.maxBytes) ||
+                               (memoryCap && heldBytes() + entryBytes + growth * sizeof(HistoryEntry) > memoryCap))) {
+            break;
+        }
+        HistoryEntry& oldest = chatHistory[ringHead];
+        hotBytes -= oldest.sender.size() + oldest.text.size();
+        historyBytes -= sizeof(HistoryEntry) + oldest.sender.size() + oldest.text.size();
+        // Cold entries are read back as private copies, so they no longer share a payload
+        if (oldest.deduplicated) {
+            dedupBytes -= oldest.text.size();
+        }
+        if (!coldStore) {
+            coldStore = new HistoryColdStore(coldFileName(retention.coldDirectory, roomId), retention.blockMessages,
+                                             chatHistory.get_allocator().resource());
+        }
+        coldStore->push(std::move(oldest));
+        oldest = HistoryEntry();
+        ringHead = (ringHead + 1) % chatHistory.size();
+        hotCount--;
+        if (memoryCap) {
+            trimIndexes(true);
+        }
+    }
+    if (hotCount == chatHistory.size()) {
+        std::pmr::vector<HistoryEntry> grown(std::max<std::size_t>(8, chatHistory.size() * 2), chatHistory.get_allocator());
+        for (std::size_t i = 0; i < hotCount; i++) {
+            grown[i] = std::move(chatHistory[(ringHead + i) % chatHistory.size()]);
+        }
+        chatHistory.swap(grown);
+        ringHead = 0;
+    }
+    hotBytes += entryBytes;
+    historyBytes += entryMemory;
+    chatHistory[(ringHead + hotCount) % chatHistory.size()] = std::move(entry);
+    hotCount++;
+}
+
+/**
+ * @brief Drops every message from all history tiers
+ */
+void ChatRoom::resetHistory() {
+    chatHistory.clear();
+    delete coldStore;
+    coldStore = nullptr;
+    ringHead = 0;
+    hotCount = 0;
+    hotBytes = 0;
+    historyBytes = 0;
+    dedupBytes = 0;
+    lastTimestamp = 0;
+    timeIndex.clear();
+    if (retentionEnabled && retention.maxMessages) {
+        chatHistory.resize(retention.maxMessages);
+    }
+    // Sequence numbers restart, so cursors into the old history are meaningless
+    rebaseCursors(0);
+}
+
+/**
+ * @brief Moves every member's read cursor after the history was replaced
+ * @param cursor The new cursor
+ */
+void ChatRoom::rebaseCursors(unsigned long long cursor) {
+    for (User* user : users) {
+        user->rebaseCursor(this, cursor);
+    }
+}
+
+/**
+ * @brief Gets the room's unique ID
+ * @return The room ID
+ */
+unsigned int ChatRoom::getRoomId() const {
+    return roomId;
+}
+
+/**
+ * @brief Bounds the in-memory history, spilling older messages to disk
+ * @param policy The retention limits to apply
+ *
+ * With a message limit the ring is allocated once at its full size, so
+ * memory per room stays constant from here on.
+ */
+void ChatRoom::setHistoryRetention(const HistoryRetention& policy) {
+    std::vector<HistoryEntry> hot;
+    hot.reserve(getHotHistoryCount());
+    for (std::size_t i = 0; i < getHotHistoryCount(); i++) {
+        std::size_t slot = retentionEnabled ? (ringHead + i) % chatHistory.size() : i;
+        hot.push_back(std::move(chatHistory[slot]));
+    }
+    retention = policy;
+    retentionEnabled = true;
+    chatHistory.clear();
+    chatHistory.shrink_to_fit();
+    if (retention.maxMessages) {
+        chatHistory.resize(retention.maxMessages);
+    }
+    ringHead = 0;
+    hotCount = 0;
+    hotBytes = 0;
+    historyBytes = 0;
+    for (HistoryEntry& entry : hot) {
+        storeHistoryEntry(std::move(entry));
+    }
+}
+
+/**
+ * @brief Stamps history saved on this thread with a fixed time
+ * @param millis Milliseconds since the epoch, or 0 to use the wall clock again
+ */
+void ChatRoom::pinClock(long long millis) {
+    pinnedTime = millis;
+}
+
+/**
+ * @brief Gets the active retention limits
+ * @param policy Receives the limits
+ * @return true if retention is enabled
+ */
+bool ChatRoom::getHistoryRetention(HistoryRetention& policy) const {
+    policy = retention;
+    return retentionEnabled;
+}
+
+/**
+ * @brief Gets the total number of messages ever saved (all tiers)
+ * @return The history length
+ */
+std::size_t ChatRoom::historySize() const {
+    return getColdHistoryCount() + getHotHistoryCount();
+}
+
+/**
+ * @brief Gets a history line by position, from whichever tier holds it
+ * @param position Position in the history (0 = oldest)
+ * @return The history line, or empty string if out of range
+ */
+std::string ChatRoom::historyAt(std::size_t position) const {
+    if (position >= historySize()) {
+        return "";
+    }
+    return entryAt(position).str();
+}
+
+/**
+ * @brief Gets a history entry by position, from whichever tier holds it
+ * @param position Position in the history (0 = oldest)
+ * @return The entry, or an entry with seq 0 if out of range
+ */
+HistoryEntry ChatRoom::entryAt(std::size_t position) const {
+    if (!retentionEnabled) {
+        return position < chatHistory.size() ? chatHistory[position] : HistoryEntry();
+    }
+    std::size_t cold = getColdHistoryCount();
+    if (position < cold) {
+        return coldStore->at(position);
+    }
+    position -= cold;
+    if (position >= hotCount) {
+        return HistoryEntry();
+    }
+    return chatHistory[(ringHead + position) % chatHistory.size()];
+}
+
+/**
+ * @brief Gets the sequence number of the newest message
+ * @return The head sequence, or 0 if the history is empty
+ */
+unsigned long long ChatRoom::getHeadSequence() const {
+    return historySize();
+}
+
+/**
+ * @brief Finds the first history position at or after a time
+ * @param timestamp Milliseconds since the epoch
+ * @return The position, or historySize() if every message is older
+ */
+std::size_t ChatRoom::findTimePosition(long long timestamp) const {
+    auto sample = std::lower_bound(timeIndex.begin(), timeIndex.end(), timestamp,
+                                   [](const std::pair<long long, std::size_t>& entry, long long time) {
+                                       return entry.first < time;
+                                   });
+    if (sample == timeIndex.begin() && historyIndex.getFloor() > 0) {
+        // Samples for the cold tier were trimmed; binary search it instead
+        std::size_t low = 0;
+        std::size_t high = sample == timeIndex.end() ? historySize() : sample->second;
+        while (low < high) {
+            std::size_t middle = low + (high - low) / 2;
+            if (entryAt(middle).timestamp < timestamp) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+    std::size_t position = sample == timeIndex.begin() ? 0 : std::prev(sample)->second;
+    std::size_t end = historySize();
+    while (position < end && entryAt(position).timestamp < timestamp) {
+        position++;
+    }
+    return position;
+}
+
+/**
+ * @brief Gets every message newer than a sequence number
+ * @param seq Last sequence the caller has seen (0 for everything)
+ * @return Entries with seq greater than the given one, oldest first
+ */
+std::vector<HistoryEntry> ChatRoom::getHistorySince(unsigned long long seq) const {
+    std::vector<HistoryEntry> result;
+    for (std::size_t position = static_cast<std::size_t>(seq); position < historySize(); position++) {
+        result.push_back(entryAt(position));
+    }
+    return result;
+}
+
+/**
+ * @brief Gets the messages saved within a time range
+ * @param fromTime Inclusive start, in milliseconds since the epoch
+ * @param toTime Inclusive end, in milliseconds since the epoch
+ * @return Matching entries, oldest first
+ */
+std::vector<HistoryEntry> ChatRoom::getHistoryBetween(long long fromTime, long long toTime) const {
+    std::vector<HistoryEntry> result;
+    for (std::size_t position = findTimePosition(fromTime); position < historySize(); position++) {
+        HistoryEntry entry = entryAt(position);
+        if (entry.timestamp > toTime) {
+            break;
+        }
+        result.push_back(entry);
+    }
+    return result;
+}
+
+/**
+ * @brief Creates an iterator whose next() is the first message after seq
+ * @param seq Last sequence the caller has seen (0 for everything)
+ * @return Pointer to a new ChatHistoryIterator
+ */
+ChatHistoryIterator* ChatRoom::createIteratorSince(unsigned long long seq) {
+    ChatHistoryIterator* iterator = new ChatHistoryIterator(this);
+    if (seq >= getHeadSequence()) {
+        iterator->seekEnd();
+    } else {
+        iterator->seekSequence(seq + 1);
+    }
+    return iterator;
+}
+
+/**
+ * @brief Gets the number of messages held in memory
+ * @return The in-memory message count
+ */
+std::size_t ChatRoom::getHotHistoryCount() const {
+    return retentionEnabled ? hotCount : chatHistory.size();
+}
+
+/**
+ * @brief Gets the number of messages spilled to cold storage
+ * @return The cold message count
+ */
+std::size_t ChatRoom::getColdHistoryCount() const {
+    return coldStore ? coldStore->size() : 0;
+}
+
+/**
+ * @brief Gets the search index over the chat history
+ * @return Reference to the history index
+ */
+ChatHistoryIndex& ChatRoom::getHistoryIndex() {
+    return historyIndex;
+}
+
+/**
+ * @brief Searches the chat history by keywords and/or sender
+ * @param keywords Keywords that must all appear (empty to ignore)
+ * @param sender Sender name to match (empty to ignore)
+ * @return Ascending positions into the chat history
+ */
+std::vector<std::size_t> ChatRoom::searchHistory(const std::string& keywords, const std::string& sender) const {
+    std::vector<std::size_t> indexed = historyIndex.find(keywords, sender);
+    std::vector<std::string> wanted = ChatHistoryIndex::tokenize(keywords);
+    if (historyIndex.getFloor() == 0 || (keywords.empty() && sender.empty()) || (!keywords.empty() && wanted.empty())) {
+        return indexed;
+    }
+    // Written cold blocks are searched through their own posting lists
+    std::vector<std::size_t> result;
+    std::size_t scanned = 0;
+    if (coldStore && coldStore->search(wanted, sender, historyIndex.getFloor(), result)) {
+        scanned = std::min(historyIndex.getFloor(), coldStore->writtenSize());
+    }
+    // Anything else below the floor is read back entry by entry
+    for (std::size_t position = scanned; position < historyIndex.getFloor(); position++) {
+        HistoryEntry entry = entryAt(position);
+        if (!sender.empty() && std::string_view(entry.sender) != sender) {
+            continue;
+        }
+        std::vector<std::string> found = ChatHistoryIndex::tokenize(entry.text.view());
+        bool matches = std::all_of(wanted.begin(), wanted.end(), [&found](const std::string& token) {
+            return std::find(found.begin(), found.end(), token) != found.end();
+        });
+        if (matches) {
+            result.push_back(position);
+        }
+    }
+    result.insert(result.end(), indexed.begin(), indexed.end());
+    return result;
+}
+
+/**
+ * @brief Gets the cold-storage file path
+ * @return The path, or an empty string if nothing has gone cold
+ */
+std::string ChatRoom::getColdPath() const {
+    return coldStore ? coldStore->getPath() : std::string();
+}
+
+/**
+ * @brief Writes the chat history to a file and its index next to it
+ * @param path History file path; the index goes to path + ".idx"
+ * @return true if both files were written
+ */
+bool ChatRoom::saveHistory(const std::string& path) const {
+    std::vector<unsigned char> out(HISTORY_MAGIC, HISTORY_MAGIC + 4);
+    putVarint(out, HISTORY_VERSION);
+    encodeHistory(out);
+    return writeFile(path, out) && historyIndex.save(path + ".idx");
+}
+
+/**
+ * @brief Replaces the chat history with the contents of a history file
+ * @param path History file path written by saveHistory()
+ * @return true on success, false if the history file is missing or malformed
+ *
+ * Sequence numbers are reassigned from 1 in file order, and members'
+ * read cursors move to the new head, as on a join. A missing or stale
+ * index is rebuilt from the loaded entries. Files written before cold
+ * blocks were copied (version 1) are still accepted.
+ */
+bool ChatRoom::loadHistory(const std::string& path) {
+    std::vector<unsigned char> data;
+    if (!readFile(path, data) || data.size() < 4 || !std::equal(HISTORY_MAGIC, HISTORY_MAGIC + 4, data.begin())) {
+        return false;
+    }
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    if (!getVarint(data.data(), data.size(), pos, version) || (version != 1 && version != HISTORY_VERSION) ||
+        !decodeRecords(data.data(), data.size(), pos, false, version == HISTORY_VERSION)) {
+        return false;
+    }
+    if (!historyIndex.load(path + ".idx") || historyIndex.size() != historySize()) {
+        historyIndex.clear();
+        for (std::size_t i = 0; i < historySize(); i++) {
+            HistoryEntry entry = entryAt(i);
+            historyIndex.addMessage(i, std::string_view(entry.sender), entry.text.view());
+        }
+    }
+    trimIndexes();
+    return true;
+}
+
+/**
+ * @brief Appends the history's binary records to a buffer
+ * @param out Buffer to append to
+ *
+ * Layout: block count, messages per block, the cold blocks as stored, then
+ * a count and (timestamp, sender, text) for every message after them. If a
+ * block cannot be read back, every message is written as a record instead.
+ */
+void ChatRoom::encodeHistory(std::vector<unsigned char>& out) const {
+    std::size_t start = out.size();
+    std::size_t blocks = coldStore ? coldStore->getBlockCount() : 0;
+    putVarint(out, blocks);
+    putVarint(out, coldStore ? coldStore->getBlockMessages() : 0);
+    for (std::size_t b = 0; b < blocks; b++) {
+        if (!coldStore->copyBlock(b, out)) {
+            PETSPACE_LOG(WARN, HISTORY, "[", getRoomName(), "] Cold block ", b, " unreadable; writing records instead");
+            out.resize(start);
+            blocks = 0;
+            putVarint(out, 0);
+            putVarint(out, 0);
+            break;
+        }
+    }
+    std::size_t first = blocks ? blocks * coldStore->getBlockMessages() : 0;
+    putVarint(out, historySize() - first);
+    for (std::size_t i = first; i < historySize(); i++) {
+        HistoryEntry entry = entryAt(i);
+        putVarint(out, static_cast<unsigned long long>(entry.timestamp));
+        writeString(out, entry.sender);
+        writeString(out, entry.text.view());
+    }
+}
+
+/**
+ * @brief Replaces the history with records read from a buffer
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param pos Read position, advanced past the records
+ * @param buildIndex Whether to rebuild the search index from the records
+ * @return true on success; the history is unchanged if the buffer is malformed
+ *
+ * Sequence numbers are reassigned from 1 in record order. Cold blocks are
+ * adopted into a new cold file without being decompressed; a room without
+ * retention gets an unbounded one so the blocks stay reachable.
+ */
+bool ChatRoom::decodeHistory(const unsigned char* data, std::size_t size, std::size_t& pos, bool buildIndex) {
+    return decodeRecords(data, size, pos, buildIndex, true);
+}
+
+/**
+ * @brief Replaces the history with cold blocks and records read from a buffer
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param pos Read position, advanced past the history
+ * @param buildIndex Whether to rebuild the search index from the records
+ * @param coldBlocks Whether the records are preceded by cold blocks (version 2)
+ * @return true on success; the history is unchanged if the buffer is
+ *         malformed, and empty if the cold blocks could not be written
+ */
+bool ChatRoom::decodeRecords(const unsigned char* data, std::size_t size, std::size_t& pos, bool buildIndex,
+                             bool coldBlocks) {
+    // First pass: check the layout without keeping anything
+    std::size_t scan = pos;
+    unsigned long long blocks = 0;
+    unsigned long long blockMessages = 0;
+    std::size_t blockStart = 0;
+    if (coldBlocks && (!getVarint(data, size, scan, blocks) || !getVarint(data, size, scan, blockMessages) ||
+                       (blocks && !blockMessages))) {
+        return false;
+    }
+    blockStart = scan;
+    for (unsigned long long b = 0; b < blocks; b++) {
+        std::uint32_t header[2] = {0, 0};
+        if (size - scan < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(header, data + scan, sizeof(header));
+        if (size - scan - sizeof(header) < header[1]) {
+            return false;
+        }
+        scan += sizeof(header) + header[1];
+    }
+    std::size_t recordStart = scan;
+    unsigned long long count = 0;
+    if (!getVarint(data, size, scan, count)) {
+        return false;
+    }
+    for (unsigned long long i = 0; i < count; i++) {
+        unsigned long long timestamp = 0;
+        unsigned long long length = 0;
+        for (int field = 0; field < 2; field++) {
+            if ((field == 0 && !getVarint(data, size, scan, timestamp)) || !getVarint(data, size, scan, length) ||
+                length > size - scan) {
+                return false;
+            }
+            scan += static_cast<std::size_t>(length);
+        }
+    }
+
+    // Second pass: adopt the cold blocks, then store the records directly
+    if (blocks && !retentionEnabled) {
+        setHistoryRetention(HistoryRetention(0, 0, static_cast<std::size_t>(blockMessages), retention.coldDirectory));
+    }
+    resetHistory();
+    if (blocks) {
+        // The old store is gone, so the new one can reuse the room's cold file
+        coldStore = new HistoryColdStore(coldFileName(retention.coldDirectory, roomId), static_cast<std::size_t>(blockMessages),
+                                         chatHistory.get_allocator().resource());
+        std::size_t at = blockStart;
+        for (unsigned long long b = 0; b < blocks; b++) {
+            std::uint32_t header[2] = {0, 0};
+            std::memcpy(header, data + at, sizeof(header));
+            if (!coldStore->adoptBlock(data + at, sizeof(header) + header[1])) {
+                resetHistory();
+                return false;
+            }
+            at += sizeof(header) + header[1];
+        }
+    }
+    std::size_t cold = getColdHistoryCount();
+    if (buildIndex) {
+        historyIndex.clear();
+        historyIndex.dropBefore(cold);
+    }
+    if (cold) {
+        lastTimestamp = coldStore->at(cold - 1).timestamp;
+    }
+    scan = recordStart;
+    getVarint(data, size, scan, count);
+    for (unsigned long long i = 0; i < count; i++) {
+        unsigned long long timestamp = 0;
+        std::string_view sender;
+        std::string_view text;
+        unsigned long long length = 0;
+        getVarint(data, size, scan, timestamp);
+        getVarint(data, size, scan, length);
+        sender = std::string_view(reinterpret_cast<const char*>(data + scan), static_cast<std::size_t>(length));
+        scan += static_cast<std::size_t>(length);
+        getVarint(data, size, scan, length);
+        text = std::string_view(reinterpret_cast<const char*>(data + scan), static_cast<std::size_t>(length));
+        scan += static_cast<std::size_t>(length);
+        std::size_t position = cold + static_cast<std::size_t>(i);
+        if (buildIndex) {
+            historyIndex.addMessage(position, sender, text);
+        }
+        recordHistoryEntry(HistoryEntry(position + 1, static_cast<long long>(timestamp), sender, Message(text),
+                                        chatHistory.get_allocator()));
+    }
+    rebaseCursors(getHeadSequence());
+    pos = scan;
+    return true;
+}
+
+/**
+ * @brief Adds members restored from a snapshot in one pass
+ * @param members Each member with its read cursor; none may already be in the room
+ */
+void ChatRoom::restoreMembers(const std::vector<std::pair<User*, unsigned long long>>& members) {
+    users.reserve(users.size() + members.size());
+    memberHandles.reserve(memberHandles.size() + members.size());
+    for (const auto& member : members) {
+        User* user = member.first;
+        users.push_back(user);
+        memberHandles.push_back(user->getHandle());
+        UserTable::refresh(user);
+        mentionMatcher.add(user->getHandle(), user->getName());
+        user->restoreRoom(this, member.second);
+    }
+}
+
+// CtrlCat Implementation
+
+/**
+ * @brief Constructs a CtrlCat room
+ * @param resource Memory resource for the room's containers
+ */
+CtrlCat::CtrlCat(std::pmr::memory_resource* resource) : ChatRoom(resource) {
+}
+
+/**
+ * @brief Registers a user with the CtrlCat room
+ * @param user Pointer to the user to register
+ * 
+ * Prevents duplicate registrations
+ */
+void CtrlCat::registerUser(User* user) {
+      if (user && std::find(users.begin(), users.end(), user) == users.end()) {
+        users.push_back(user);
+        memberHandles.push_back(user->getHandle());
+        UserTable::refresh(user);
+        mentionMatcher.add(user->getHandle(), user->getName());
+        // A user registered directly (not via joinChatRoom) must still learn of the room
+        user->restoreRoom(this, getHeadSequence());
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " joined CtrlCat room!");
+    }
+}
+
+/**
+ * @brief Removes a user from the CtrlCat room
+ * @param user Pointer to the user to remove
+ */
+void CtrlCat::removeUser(User* user) {
+     auto it = std::find(users.begin(), users.end(), user);
+    if (it != users.end()) {
+        memberHandles.erase(memberHandles.begin() + (it - users.begin()));
+        users.erase(it);
+        mentionMatcher.remove(user->getHandle(), user->getName());
+        mailboxShards.erase(user);
+        user->forgetRoom(this);
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " left CtrlCat room!");
+    }
+}
+
+/**
+ * @brief Sends a message to all users in the CtrlCat room
+ * @param message The message content
+ * @param fromUser Pointer to the user sending the message
+ * 
+ * Message is delivered to all users except the sender, mentioned users first
+ */
+void CtrlCat::sendMessage(const Message& message, User* fromUser) {
+    MessageEnvelope envelope(this, fromUser, message);
+    echoMessage(envelope);
+    deliverMessage(envelope);
+}
+
+/**
+ * @brief Saves a message to the CtrlCat room's history
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ */
+void CtrlCat::saveMessage(const Message& message, User* fromUser) {
+    appendHistory(message, fromUser);
+    PETSPACE_LOG(INFO, HISTORY, "[CtrlCat] Message saved to history: ", fromUser->getName(), ": ", message);
+}
+
+
+/**
+ * @brief Creates an iterator for the CtrlCat room's chat history
+ * @return Pointer to a new ChatHistoryIterator
+ */
+Iterator* CtrlCat::createIterator() {
+   return new ChatHistoryIterator(this);
+}
+
+/**
+ * @brief Gets the room's name
+ * @return String "CtrlCat"
+ */
+std::string CtrlCat::getRoomName() const {
+    return "CtrlCat";
+}
+
+// Dogorithm Implementation
+
+/**
+ * @brief Constructs a Dogorithm room
+ * @param resource Memory resource for the room's containers
+ */
+Dogorithm::Dogorithm(std::pmr::memory_resource* resource) : ChatRoom(resource) {
+}
+
+/**
+ * @brief Registers a user with the Dogorithm room
+ * @param user Pointer to the user to register
+ * 
+ * Prevents duplicate registrations
+ */
+void Dogorithm::registerUser(User* user) {
+    if (user && std::find(users.begin(), users.end(), user) == users.end()) {
+        users.push_back(user);
+        memberHandles.push_back(user->getHandle());
+        UserTable::refresh(user);
+        mentionMatcher.add(user->getHandle(), user->getName());
+        user->restoreRoom(this, getHeadSequence());
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " joined Dogorithm room!");
+    }
+}
+
+/**
+ * @brief Removes a user from the Dogorithm room
+ * @param user Pointer to the user to remove
+ */
+void Dogorithm::removeUser(User* user) {
+      auto it = std::find(users.begin(), users.end(), user);
+    if (it != users.end()) {
+        memberHandles.erase(memberHandles.begin() + (it - users.begin()));
+        users.erase(it);
+        mentionMatcher.remove(user->getHandle(), user->getName());
+        mailboxShards.erase(user);
+        user->forgetRoom(this);
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " left Dogorithm room!");
+    }
+}
+
+
+/**
+ * @brief Sends a message to all users in the Dogorithm room
+ * @param message The message content
+ * @param fromUser Pointer to the user sending the message
+ * 
+ * Message is delivered to all users except the sender, mentioned users first
+ */
+void Dogorithm::sendMessage(const Message& message, User* fromUser) {
+    MessageEnvelope envelope(this, fromUser, message);
+    echoMessage(envelope);
+    deliverMessage(envelope);
+}
+
+
+/**
+ * @brief Saves a message to the Dogorithm room's history
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ */
+void Dogorithm::saveMessage(const Message& message, User* fromUser) {
+    appendHistory(message, fromUser);
+    PETSPACE_LOG(INFO, HISTORY, "[Dogorithm] Message saved to history: ", fromUser->getName(), ": ", message);
+}
+
+/**
+ * @brief Creates an iterator for the Dogorithm room's chat history
+ * @return Pointer to a new ChatHistoryIterator
+ */
+Iterator* Dogorithm::createIterator() {
+    return new ChatHistoryIterator(this);
+}
+
+/**
+ * @brief Gets the room's name
+ * @return String "Dogorithm"
+ */
+std::string Dogorithm::getRoomName() const {
+    return "Dogorithm";
+}
+
+// ============= USER CLASS IMPLEMENTATIONS =============
+
+std::atomic<unsigned int> User::nextHandle(0);
+std::vector<unsigned int> User::freeHandles;
+std::mutex User::handleLock;
+
+/**
+ * @brief Constructs a User
+ * @param userName The user's display name
+ * @param admin Whether the user has admin privileges
+ * @param resource Memory resource for the name, room list and command queue
+ * 
+ * Initializes user with Online state by default
+ */
+User::User(const std::string& userName, bool admin, std::pmr::memory_resource* resource)
+    : handle(0), name(userName, resource), chatRooms(resource), readCursors(resource), commandQueue(resource), currentState(new Online()), isAdmin(admin),
+      rateLimiter(nullptr), maxQueuedCommands(0), backpressureCount(0), coalescedBytes(0), maxCoalescedBytes(64 * 1024), inbox(nullptr), mailbox(nullptr), queuedBytes(0), queueMemoryCap(0),
+      mailboxMemoryCap(0), memoryRejections(0), scheduled(false) {
+    // Reuse the most recently freed handle so the handle space stays dense
+    {
+        std::lock_guard<std::mutex> guard(handleLock);
+        if (freeHandles.empty()) {
+            handle = nextHandle++;
+        } else {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+        }
+    }
+    // The directory and user table only have slots for handles below the limit
+    assert(handle < UserDirectory::MAX_HANDLES);
+    UserDirectory::add(this);
+    UserTable::refresh(this);
+    if (isAdmin) {
+        PETSPACE_LOG(INFO, ADMIN, userName, " created as Admin user!");
+    }
+}
+/**
+ * @brief Destructs the User
+ * 
+ * Leaves every joined room, then cleans up state and all queued commands
+ */
+User::~User() {
+    // Leave quietly so no room keeps a pointer to this user
+    std::vector<ChatRoom*> joined(chatRooms.begin(), chatRooms.end());
+    chatRooms.clear();
+    readCursors.clear();
+    for (ChatRoom* room : joined) {
+        room->removeUser(this);
+    }
+    delete currentState;
+    currentState = nullptr;
+    delete rateLimiter;
+    while (!commandQueue.empty()) {
+        delete commandQueue.pop();
+    }
+    UserDirectory::remove(this);
+    if (CommandJournal* journal = CommandJournal::current()) {
+        journal->forget(this);
+    }
+    if (TraceRecorder* trace = TraceRecorder::current()) {
+        trace->forget(this);
+    }
+    if (PresenceHub* hub = PresenceHub::current()) {
+        hub->forget(this);
+    }
+    if (UserInbox* attached = getInbox()) {
+        attached->close();
+    }
+    if (mailbox) {
+        mailbox->detach();
+        mailbox = nullptr;
+    }
+    UserTable::remove(this);
+    // Release the handle only once nothing keyed by it refers to this user
+    {
+        std::lock_guard<std::mutex> guard(handleLock);
+        freeHandles.push_back(handle);
+    }
+}
+
+/**
+ * @brief Adds a command to the command queue
+ * @param command Pointer to the command to add
+ * @return true if the command was queued
+ * 
+ * A command that does not fit under the queue bound is deleted
+ */
+bool User::addCommand(Command* command) {
+    if (!command) {
+        return false;
+    }
+    if (!hasQueueRoom(1)) {
+        delete command;
+        return false;
+    }
+    queuedBytes += command->footprint();
+    std::lock_guard<std::mutex> guard(queueLock);
+    commandQueue.push(command);
+    return true;
+}
+
+/**
+ * @brief Checks that the command queue can take more commands
+ * @param commands Number of commands about to be queued
+ * @return true if they fit under the bound
+ */
+bool User::hasQueueRoom(std::size_t commands) {
+    if (maxQueuedCommands && getQueuedCommandCount() + commands > maxQueuedCommands) {
+        backpressureCount++;
+        PETSPACE_LOG(WARN, DELIVERY, name, "'s command queue is full; message refused");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Bounds the command queue
+ * @param maxCommands Maximum queued commands (0 = unbounded)
+ */
+void User::setMaxQueuedCommands(std::size_t maxCommands) {
+    maxQueuedCommands = maxCommands;
+}
+
+/**
+ * @brief Gets how often a producer hit the command queue bound
+ * @return The backpressure event count
+ */
+unsigned long long User::getBackpressureCount() const {
+    return backpressureCount;
+}
+
+/**
+ * @brief Bounds the text held back by RateLimitAction::Coalesce
+ * @param maxBytes Maximum held bytes across all rooms (0 = unbounded)
+ */
+void User::setMaxCoalescedBytes(std::size_t maxBytes) {
+    maxCoalescedBytes = maxBytes;
+}
+
+/**
+ * @brief Limits how fast this user may send messages
+ * @param messagesPerSecond Sustained message rate
+ * @param burst Maximum number of messages sent back to back
+ * @param action What to do with a message when the user is over its rate
+ * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+ */
+void User::setRateLimit(double messagesPerSecond, double burst, RateLimitAction action, double maxDelay) {
+    delete rateLimiter;
+    rateLimiter = new RateLimiter(messagesPerSecond, burst, action, maxDelay);
+}
+
+/**
+ * @brief Removes the user's rate limit
+ */
+void User::clearRateLimit() {
+    delete rateLimiter;
+    rateLimiter = nullptr;
+}
+
+/**
+ * @brief Gets the user's rate limiter
+ * @return Pointer to the limiter, or nullptr if unlimited
+ */
+RateLimiter* User::getRateLimiter() const {
+    return rateLimiter;
+}
+
+/**
+ * @brief Checks the user's and the room's rate limiters
+ * @param room The destination room
+ * @param action Receives the action of the limiter that refused
+ * @return true if the message may be queued now
+ * 
+ * Tokens are only taken once both limiters agree, so a refusal by the
+ * room never costs the user a token. With the Delay action the caller
+ * sleeps until both buckets have a token.
+ */
+bool User::admitMessage(ChatRoom* room, RateLimitAction& action, bool chargeUser) {
+    RateLimiter* limiters[2] = {chargeUser ? rateLimiter : nullptr, room ? room->getRateLimiter() : nullptr};
+    RateLimiter* blocking = nullptr;
+    double wait = 0.0;
+    for (RateLimiter* limiter : limiters) {
+        if (limiter) {
+            double needed = limiter->secondsUntilAvailable();
+            if (needed > 0 && !blocking) {
+                blocking = limiter;
+            }
+            wait = std::max(wait, needed);
+        }
+    }
+    bool waited = false;
+    if (blocking) {
+        action = blocking->getAction();
+        if (action != RateLimitAction::Delay || wait > blocking->getMaxDelay()) {
+            blocking->recordLimited();
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        waited = true;
+    }
+    for (RateLimiter* limiter : limiters) {
+        if (limiter) {
+            limiter->consume(waited);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Rate-limits a message and queues its send and log commands
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * @return true if commands were queued
+ */
+bool User::queueMessage(const std::string& message, ChatRoom* room) {
+    if (TraceRecorder* trace = TraceRecorder::current()) {
+        trace->recordSend(this, room, message);
+    }
+    std::string text;
+    if (!hasQueueRoom(2) || !admitQueueBytes(2 * sizeof(SendMessageCommand) + message.size()) ||
+        !admitText(message, room, text)) {
+        return false;
+    }
+    // Create commands for sending and logging message; both share one buffer, counted by the log
+    Message shared(text);
+    Command* send = new SendMessageCommand(room, this, shared);
+    send->shareText();
+    addCommand(send);
+    addCommand(new LogMessageCommand(room, this, shared));
+    return true;
+}
+
+/**
+ * @brief Applies rate limiting and coalescing to one message
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * @param text Receives the text to send, including any held text
+ * @return true if the message was admitted
+ */
+bool User::admitText(const std::string& message, ChatRoom* room, std::string& text) {
+    auto held = std::find_if(coalescedMessages.begin(), coalescedMessages.end(),
+                             [room](const std::pair<ChatRoom*, std::string>& entry) { return entry.first == room; });
+    RateLimitAction action = RateLimitAction::Reject;
+    if (!admitMessage(room, action)) {
+        bool joined = std::find(chatRooms.begin(), chatRooms.end(), room) != chatRooms.end();
+        if (action == RateLimitAction::Coalesce && !joined) {
+            PETSPACE_LOG(WARN, DELIVERY, name, " has not joined the room; message dropped instead of held");
+        } else if (action == RateLimitAction::Coalesce &&
+                   maxCoalescedBytes && coalescedBytes + message.size() + 1 > maxCoalescedBytes) {
+            PETSPACE_LOG(WARN, DELIVERY, name, " is holding too much text; message dropped");
+        } else if (action == RateLimitAction::Coalesce) {
+            if (held == coalescedMessages.end()) {
+                coalescedMessages.push_back(std::make_pair(room, message));
+                coalescedBytes += message.size();
+            } else {
+                held->second.append("\n").append(message);
+                coalescedBytes += message.size() + 1;
+            }
+        } else {
+            PETSPACE_LOG(WARN, DELIVERY, name, " is sending too fast; message dropped");
+        }
+        return false;
+    }
+    text = message;
+    if (held != coalescedMessages.end()) {
+        text = held->second + "\n" + message;
+        coalescedBytes -= held->second.size();
+        coalescedMessages.erase(held);
+    }
+    return true;
+}
+
+/**
+ * @brief Sends many messages to one chat room at once
+ * @param messages The messages, oldest first
+ * @param room Pointer to the destination chat room
+ * @return Number of messages that passed rate limiting and were sent
+ * 
+ * Each message is still rate limited on its own; the admitted ones travel
+ * together in a single send and a single log command.
+ */
+std::size_t User::sendBatch(const std::vector<std::string>& messages, ChatRoom* room) {
+    if (!room) {
+        return 0;
+    }
+    std::size_t bytes = 2 * (sizeof(SendBatchCommand) + messages.size() * sizeof(Message));
+    for (const std::string& message : messages) {
+        bytes += message.size();
+    }
+    if (!hasQueueRoom(2) || !admitQueueBytes(bytes)) {
+        return 0;
+    }
+    std::vector<Message> batch;
+    batch.reserve(messages.size());
+    std::string text;
+    for (const std::string& message : messages) {
+        if (admitText(message, room, text)) {
+            batch.emplace_back(text);
+        }
+    }
+    if (!batch.empty()) {
+        Command* send = new SendBatchCommand(room, this, batch);
+        send->shareText();
+        addCommand(send);
+        addCommand(new LogBatchCommand(room, this, batch));
+        executeAll();
+    }
+    return batch.size();
+}
+
+/**
+ * @brief Receives a message that mentions this user
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ * @param room Pointer to the chat room
+ * 
+ * The message goes through receive() like any other, then the current
+ * state is told it was a mention
+ */
+void User::receiveMention(const Message& message, User* fromUser, ChatRoom* room) {
+    deliverToInbox(message, fromUser, room, true);
+    receive(message, fromUser, room);
+    if (currentState && fromUser) {
+        currentState->handleMention(this, message);
+    }
+}
+
+/**
+ * @brief Receives a message in structured form
+ * @param envelope The message with its room and sender
+ */
+void User::receiveEnvelope(const MessageEnvelope& envelope) {
+    deliverToInbox(envelope.getPayload(), envelope.getSender(), envelope.getRoom());
+    receive(envelope.getPayload(), envelope.getSender(), envelope.getRoom());
+}
+
+/**
+ * @brief Receives a coalesced batch of roommate presence changes
+ * @param updates Final state of each user that changed since the last tick
+ */
+void User::receivePresence(const std::vector<PresenceUpdate>& updates) {
+    PETSPACE_LOG(INFO, PRESENCE, name, " sees presence:", describePresence(updates));
+}
+
+/**
+ * @brief Sends one message to every room the user has joined
+ * @param message The message content
+ * @return Number of distinct users the message was delivered to
+ */
+std::size_t User::broadcast(const std::string& message) {
+    return broadcast(message, std::vector<ChatRoom*>(chatRooms.begin(), chatRooms.end()));
+}
+
+/**
+ * @brief Sends one message to several rooms, once per recipient
+ * @param message The message content
+ * @param rooms The rooms to send to
+ * @return Number of distinct users the message was delivered to
+ * 
+ * Each room's limiter is consulted as for send(); coalescing does not
+ * apply, so a refusing room is simply skipped. The user's own token is
+ * only taken once some room has admitted the message.
+ */
+std::size_t User::broadcast(const std::string& message, const std::vector<ChatRoom*>& rooms) {
+    if (rooms.empty() || !hasQueueRoom(rooms.size() + 1) ||
+        !admitQueueBytes(sizeof(BroadcastCommand) + rooms.size() * sizeof(LogMessageCommand) + message.size())) {
+        return 0;
+    }
+    // Refuse early if the user's own limiter would, so no room token is spent
+    if (rateLimiter) {
+        double needed = rateLimiter->secondsUntilAvailable();
+        if (needed > 0 && (rateLimiter->getAction() != RateLimitAction::Delay || needed > rateLimiter->getMaxDelay())) {
+            rateLimiter->recordLimited();
+            PETSPACE_LOG(WARN, DELIVERY, name, " is sending too fast; broadcast dropped");
+            return 0;
+        }
+    }
+    RateLimitAction action = RateLimitAction::Reject;
+    std::vector<ChatRoom*> admitted;
+    admitted.reserve(rooms.size());
+    for (ChatRoom* room : rooms) {
+        if (!room || std::find(admitted.begin(), admitted.end(), room) != admitted.end()) {
+            continue;
+        }
+        if (admitMessage(room, action, false)) {
+            admitted.push_back(room);
+        } else {
+            PETSPACE_LOG(WARN, DELIVERY, name, " is sending too fast; broadcast skipped ", room->getRoomName());
+        }
+    }
+    if (admitted.empty() || !admitMessage(nullptr, action)) {
+        return 0;
+    }
+    Message shared(message);
+    std::size_t delivered = 0;
+    // Every command shares one buffer; the last log counts it
+    Command* send = new BroadcastCommand(admitted, this, shared, &delivered);
+    send->shareText();
+    addCommand(send);
+    for (ChatRoom* room : admitted) {
+        Command* log = new LogMessageCommand(room, this, shared);
+        if (room != admitted.back()) {
+            log->shareText();
+        }
+        addCommand(log);
+    }
+    executeAll();
+    return delivered;
+}
+
+/**
+ * @brief Sends a message straight to one user, without a room
+ * @param toHandle Handle of the receiving user
+ * @param message The message content
+ * @return true if the message was delivered to a live user
+ * 
+ * Only the sender's own rate limit applies.
+ */
+bool User::sendDirect(unsigned int toHandle, const std::string& message) {
+    User* toUser = UserDirectory::find(toHandle);
+    if (!toUser || toUser == this) {
+        PETSPACE_LOG(WARN, DELIVERY, "No user with handle ", toHandle, " to message directly");
+        return false;
+    }
+    RateLimitAction action = RateLimitAction::Reject;
+    if (!hasQueueRoom(1) || !admitQueueBytes(sizeof(DirectMessageCommand) + message.size())) {
+        return false;
+    }
+    if (!admitMessage(nullptr, action)) {
+        PETSPACE_LOG(WARN, DELIVERY, name, " is sending too fast; message dropped");
+        return false;
+    }
+    addCommand(new DirectMessageCommand(toHandle, this, Message(message)));
+    executeAll();
+    return true;
+}
+
+/**
+ * @brief Gets the direct conversation with another user
+ * @param other The other participant
+ * @return The conversation, or nullptr if none has been started
+ */
+const DirectConversation* User::getConversationWith(const User* other) const {
+    if (!other) {
+        return nullptr;
+    }
+    return UserDirectory::conversation(handle, other->getHandle());
+}
+
+/**
+ * @brief Gets the user's handle
+ * @return Dense ID, unique among live users
+ */
+unsigned int User::getHandle() const {
+    return handle;
+}
+
+/**
+ * @brief Gets an upper bound on the handles of live users
+ * @return One past the highest handle issued so far
+ */
+unsigned int User::getHandleLimit() {
+    return nextHandle;
+}
+
+/**
+ * @brief Receives a batch of messages from a chat room
+ * @param messages The messages, oldest first
+ * @param fromUser Pointer to the user who sent the messages
+ * @param room Pointer to the chat room
+ * 
+ * Passes each message to receive(), so a subclass that overrides
+ * receive() sees batched messages too
+ */
+void User::receiveBatch(const std::vector<Message>& messages, User* fromUser, ChatRoom* room) {
+    for (const Message& message : messages) {
+        deliverToInbox(message, fromUser, room);
+        receive(message, fromUser, room);
+    }
+}
+
+/**
+ * @brief Sends coalesced text that is still being held, if tokens allow
+ * @return Number of rooms whose held text was sent
+ */
+std::size_t User::flushCoalesced() {
+    std::size_t flushed = 0;
+    std::vector<std::pair<ChatRoom*, std::string>> held;
+    held.swap(coalescedMessages);
+    for (const std::pair<ChatRoom*, std::string>& entry : held) {
+        RateLimitAction action = RateLimitAction::Reject;
+        if (hasQueueRoom(2) && admitMessage(entry.first, action)) {
+            coalescedBytes -= entry.second.size();
+            Message shared(entry.second);
+            Command* send = new SendMessageCommand(entry.first, this, shared);
+            send->shareText();
+            addCommand(send);
+            addCommand(new LogMessageCommand(entry.first, this, shared));
+            flushed++;
+        } else {
+            coalescedMessages.push_back(entry);
+        }
+    }
+    executeAll();
+    return flushed;
+}
+
+/**
+ * @brief Checks whether coalesced text is held for a room
+ * @param room The room to check
+ * @return true if text is waiting to be sent
+ */
+bool User::hasCoalesced(ChatRoom* room) const {
+    for (const std::pair<ChatRoom*, std::string>& entry : coalescedMessages) {
+        if (entry.first == room) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Discards text held back for a room
+ * @param room The room
+ */
+void User::dropCoalesced(ChatRoom* room) {
+    auto held = std::find_if(coalescedMessages.begin(), coalescedMessages.end(),
+                             [room](const std::pair<ChatRoom*, std::string>& entry) { return entry.first == room; });
+    if (held != coalescedMessages.end()) {
+        coalescedBytes -= held->second.size();
+        coalescedMessages.erase(held);
+    }
+}
+
+/**
+ * @brief Drops everything the user keeps about a room being destroyed
+ * @param room The room
+ */
+void User::forgetRoom(ChatRoom* room) {
+    dropCoalesced(room);
+    auto it = std::find(chatRooms.begin(), chatRooms.end(), room);
+    if (it != chatRooms.end()) {
+        readCursors.erase(room);
+        chatRooms.erase(it);
+    }
+}
+
+/**
+ * @brief Records membership of a room that added the user itself
+ * @param room The room
+ * @param cursor The read cursor to start from (clamped to the room's head)
+ */
+void User::restoreRoom(ChatRoom* room, unsigned long long cursor) {
+    if (!readCursors.emplace(room, std::min(cursor, room->getHeadSequence())).second) {
+        return;
+    }
+    chatRooms.push_back(room);
+}
+
+/**
+ * @brief Moves a room's read cursor after the room replaced its history
+ * @param room The room
+ * @param cursor The new cursor
+ */
+void User::rebaseCursor(const ChatRoom* room, unsigned long long cursor) {
+    auto it = readCursors.find(room);
+    if (it != readCursors.end()) {
+        it->second = cursor;
+    }
+}
+
+
+/**
+ * @brief Executes all commands in the queue
+ * 
+ * Executes each command in priority order, deleting it once it has run
+ */
+void User::executeAll() {
+    drainCommands(static_cast<std::size_t>(-1));
+}
+
+/**
+ * @brief Executes up to a number of queued commands
+ * @param maxCommands Most commands to run
+ * @return Number of commands run
+ * 
+ * The queue lock is only held to take each command, so producers can
+ * keep queueing while commands run.
+ */
+std::size_t User::drainCommands(std::size_t maxCommands) {
+    std::lock_guard<std::mutex> running(executionLock);
+    std::size_t count = 0;
+    while (count < maxCommands) {
+        Command* command;
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            command = commandQueue.pop();
+        }
+        if (!command) {
+            break;
+        }
+        // Write-ahead: the record is appended before the command runs
+        if (CommandJournal* journal = CommandJournal::current()) {
+            journal->append(*command);
+        }
+        command->execute();
+        queuedBytes -= command->footprint();
+        // Clear executed command
+        delete command;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Queues a message and leaves its delivery to an executor
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * @param executor Executor that drains the user's queue
+ * @return true if the message was admitted
+ */
+bool User::sendAsync(const std::string& message, ChatRoom* room, WorkStealingExecutor& executor) {
+    if (!room || !queueMessage(message, room)) {
+        return false;
+    }
+    executor.schedule(this);
+    return true;
+}
+
+/**
+ * @brief Gets the number of commands waiting in the queue
+ * @return The queued command count
+ */
+std::size_t User::getQueuedCommandCount() const {
+    std::lock_guard<std::mutex> guard(queueLock);
+    return commandQueue.size();
+}
+
+/**
+ * @brief Executes several users' queued commands as one schedule
+ * @param users The users whose queues are drained
+ * @return Number of commands run
+ * 
+ * Keeps a heap of each queue's next command keyed by (priority, queueing
+ * order) and runs one command at a time from the top. A user that was idle
+ * when the call started is not picked up if commands arrive mid-drain.
+ */
+std::size_t User::executeAcross(const std::vector<User*>& users) {
+    typedef std::pair<std::pair<int, unsigned long long>, User*> Head;
+    auto headOf = [](User* user, Head& head) {
+        std::lock_guard<std::mutex> guard(user->queueLock);
+        Command* next = user->commandQueue.peek();
+        if (!next) {
+            return false;
+        }
+        head = Head(std::make_pair(static_cast<int>(next->getPriority()), next->getSequence()), user);
+        return true;
+    };
+    std::vector<Head> heap;
+    heap.reserve(users.size());
+    Head head;
+    for (User* user : users) {
+        if (user && headOf(user, head)) {
+            heap.push_back(head);
+        }
+    }
+    std::greater<Head> later;
+    std::make_heap(heap.begin(), heap.end(), later);
+    std::size_t count = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        User* user = heap.back().second;
+        heap.pop_back();
+        count += user->drainCommands(1);
+        if (headOf(user, head)) {
+            heap.push_back(head);
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Runs every member's queued commands as one schedule
+ * @return Number of commands run
+ */
+std::size_t ChatRoom::dispatchCommands() {
+    return User::executeAcross(std::vector<User*>(users.begin(), users.end()));
+}
+
+/**
+ * @brief Sets how often lower-priority commands may be passed over
+ * @param limit Bypasses tolerated before a waiting level is served
+ */
+void User::setStarvationLimit(std::size_t limit) {
+    commandQueue.setStarvationLimit(limit);
+}
+
+
+/**
+ * @brief Sets the user's state
+ * @param newState Pointer to the new state
+ * 
+ * Deletes the old state and replaces it with the new one
+ */
+void User::setState(UserState* newState) {
+    PresenceHub* hub = PresenceHub::current();
+    std::string previous = hub && currentState ? currentState->getStateName() : std::string();
+    if (currentState) {
+        delete currentState;
+    }
+    currentState = newState;
+    UserTable::refresh(this);
+    if (hub) {
+        hub->markChanged(this, previous);
+    }
+    if (TraceRecorder* trace = TraceRecorder::current()) {
+        trace->recordState(this, newState);
+    }
+}
+
+/**
+ * @brief Gets the user's current state
+ * @return Pointer to the current UserState
+ */
+UserState* User::getState() const {
+    return currentState;
+}
+
+/**
+ * @brief Gets the user's name
+ * @return The user's name string
+ */
+std::string User::getName() const {
+    return std::string(name.data(), name.size());
+}
+
+/**
+ * @brief Joins a chat room
+ * @param room Pointer to the chat room to join
+ * 
+ * Prevents joining the same room twice
+ */
+void User::joinChatRoom(ChatRoom* room) {
+    // Only messages sent after joining count as unread
+    if (room && readCursors.emplace(room, room->getHeadSequence()).second) {
+        chatRooms.push_back(room);
+        room->registerUser(this);
+        if (TraceRecorder* trace = TraceRecorder::current()) {
+            trace->recordJoin(this, room);
+        }
+        if (CommandJournal* journal = CommandJournal::current()) {
+            journal->appendMembership(JournalRecord::Join, this, room);
+        }
+    }
+}
+
+/**
+ * @brief Leaves a chat room
+ * @param room Pointer to the chat room to leave
+ */
+void User::leaveChatRoom(ChatRoom* room) {
+    auto it = std::find(chatRooms.begin(), chatRooms.end(), room);
+    if (it != chatRooms.end()) {
+        dropCoalesced(room);
+        readCursors.erase(room);
+        chatRooms.erase(it);
+        room->removeUser(this);
+        if (TraceRecorder* trace = TraceRecorder::current()) {
+            trace->recordLeave(this, room);
+        }
+        if (PresenceHub* hub = PresenceHub::current()) {
+            hub->unsubscribe(this, room);
+        }
+        if (CommandJournal* journal = CommandJournal::current()) {
+            journal->appendMembership(JournalRecord::Leave, this, room);
+        }
+    }
+}
+
+/**
+ * @brief Gets the list of chat rooms the user has joined
+ * @return Reference to the chat rooms vector
+ */
+std::pmr::vector<ChatRoom*>& User::getChatRooms() {
+    return chatRooms;
+}
+
+// User1 Implementation
+
+/**
+ * @brief Constructs a User1
+ * @param userName The user's name
+ * @param resource Memory resource for the user's containers
+ */
+User1::User1(const std::string& userName, std::pmr::memory_resource* resource) : User(userName, false, resource) {
+}
+
+
+/**
+ * @brief Sends a message to a chat room
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * 
+ * Creates SendMessageCommand and LogMessageCommand, then executes them.
+ * Nothing is queued if a rate limiter refuses the message.
+ */
+void User1::send(const std::string& message, ChatRoom* room) {
+    if (room && queueMessage(message, room)) {
+        // Execute all commands
+        executeAll();
+    }
+}
+
+/**
+ * @brief Receives a message from the chat room
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ * @param room Pointer to the chat room (unused)
+ * 
+ * Delegates message handling to the current state
+ */
+void User1::receive(const Message& message, User* fromUser, ChatRoom*) {
+    if (currentState && fromUser) {
+        currentState->handleMessage(this, message);
+    }
+}
+
+// User2 Implementation
+
+/**
+ * @brief Constructs a User2
+ * @param userName The user's name
+ * @param resource Memory resource for the user's containers
+ */
+User2::User2(const std::string& userName, std::pmr::memory_resource* resource) : User(userName, false, resource) {
+}
+
+
+/**
+ * @brief Sends a message to a chat room
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * 
+ * Creates SendMessageCommand and LogMessageCommand, then executes them.
+ * Nothing is queued if a rate limiter refuses the message.
+ */
+void User2::send(const std::string& message, ChatRoom* room) {
+    if (room && queueMessage(message, room)) {
+        // Execute all commands
+        executeAll();
+    }
+}
+
+/**
+ * @brief Receives a message from the chat room
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ * @param room Pointer to the chat room (unused)
+ * 
+ * Delegates message handling to the current state
+ */
+void User2::receive(const Message& message, User* fromUser, ChatRoom*) {
+    if (currentState && fromUser) {
+        currentState->handleMessage(this, message);
+    }
+}
+
+// User3 Implementation
+
+/**
+ * @brief Constructs a User3
+ * @param userName The user's name
+ * @param resource Memory resource for the user's containers
+ */
+User3::User3(const std::string& userName, std::pmr::memory_resource* resource) : User(userName, false, resource) {
+}
+
+/**
+ * @brief Sends a message to a chat room
+ * @param message The message content
+ * @param room Pointer to the destination chat room
+ * 
+ * Creates SendMessageCommand and LogMessageCommand, then executes them.
+ * Nothing is queued if a rate limiter refuses the message.
+ */
+void User3::send(const std::string& message, ChatRoom* room) {
+    if (room && queueMessage(message, room)) {
+        // Execute all commands
+        executeAll();
+    }
+}
+
+/**
+ * @brief Receives a message from the chat room
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ * @param room Pointer to the chat room (unused)
+ * 
+ * Delegates message handling to the current state
+ */
+void User3::receive(const Message& message, User* fromUser, ChatRoom*) {
+    if (currentState && fromUser) {
+        currentState->handleMessage(this, message);
+    }
+}
+
+// ============= ADMIN IMPLEMENTATIONS =============
+
+/**
+ * @brief Sets the user's admin status
+ * @param admin true to grant admin privileges, false to revoke
+ */
+void User::setAdmin(bool admin) {
+    isAdmin = admin;
+    UserTable::refresh(this);
+    if (admin) {
+        PETSPACE_LOG(INFO, ADMIN, name, " has been granted admin privileges!");
+    }
+}
+
+/**
+ * @brief Gets the user's admin status
+ * @return true if user is admin, false otherwise
+ */
+bool User::getAdmin() const {
+    return isAdmin;
+}
+
+/**
+ * @brief Creates a custom chat room (admin only)
+ * @param roomType The name/type of the room to create
+ * @param resource Memory resource for the new room's containers
+ * @return Pointer to the new CustomChatRoom, or nullptr if user lacks permissions
+ *         or a registered room already has that name
+ * 
+ * Only users with admin privileges can create chat rooms
+ */
+ChatRoom* User::createChatRoom(const std::string& roomType, std::pmr::memory_resource* resource) {
+    return createChatRoom(roomType, ChatRoomRegistry::global(), resource);
+}
+
+/**
+ * @brief Creates a new chat room in a given registry (admin only)
+ * @param roomType The type/name of the room to create
+ * @param registry Registry the name must be unique in and that tracks the room
+ * @param resource Memory resource for the new room's containers
+ * @return Pointer to the new ChatRoom, or nullptr if not admin or the name is taken
+ */
+ChatRoom* User::createChatRoom(const std::string& roomType, ChatRoomRegistry& registry,
+                               std::pmr::memory_resource* resource) {
+    if (!isAdmin) {
+        PETSPACE_LOG(WARN, ADMIN, name, " does not have permission to create chat rooms!");
+        return nullptr;
+    }
+    
+    // Create a custom room with any unused name
+    CustomChatRoom* room = registry.create(roomType, resource);
+    if (TraceRecorder* trace = TraceRecorder::current()) {
+        trace->recordCreateRoom(this, roomType, room);
+    }
+    if (room) {
+        PETSPACE_LOG(INFO, ADMIN, "Chat room created by admin");
+    }
+    return room;
+}
+
+// ============= Custom CLASS IMPLEMENTATIONS =============
+
+/**
+ * @brief Constructs a CustomChatRoom
+ * @param name The custom name for the room
+ * @param resource Memory resource for the room's containers
+ */
+CustomChatRoom::CustomChatRoom(const std::string& name, std::pmr::memory_resource* resource)
+    : ChatRoom(resource), roomName(name, resource), registry(nullptr) {
+}
+
+/**
+ * @brief Destructs the room, dropping it from its registry if any
+ */
+CustomChatRoom::~CustomChatRoom() {
+    if (registry) {
+        registry->forget(this);
+    }
+}
+
+/**
+ * @brief Gets the slab custom rooms are allocated from
+ * @return The shared room slab
+ * 
+ * The slab is never destroyed, so rooms freed during static destruction
+ * (e.g. by the global registry) can still return their slots.
+ */
+ObjectSlab& CustomChatRoom::slab() {
+    static ObjectSlab* rooms = new ObjectSlab(sizeof(CustomChatRoom));
+    return *rooms;
+}
+
+/**
+ * @brief Allocates a room from the shared room slab
+ * @param size Requested size
+ * @return Storage for the room
+ */
+void* CustomChatRoom::operator new(std::size_t size) {
+    if (size != sizeof(CustomChatRoom)) {
+        return ::operator new(size);
+    }
+    return slab().allocate();
+}
+
+/**
+ * @brief Returns a room's storage to the shared room slab
+ * @param pointer Storage from operator new
+ * @param size Size of the room
+ */
+void CustomChatRoom::operator delete(void* pointer, std::size_t size) {
+    if (!pointer) {
+        return;
+    }
+    if (size != sizeof(CustomChatRoom)) {
+        ::operator delete(pointer);
+        return;
+    }
+    slab().deallocate(pointer);
+}
+
+
+/**
+ * @brief Registers a user with the custom chat room
+ * @param user Pointer to the user to register
+ * 
+ * Prevents duplicate registrations
+ */
+void CustomChatRoom::registerUser(User* user) {
+    if (user && std::find(users.begin(), users.end(), user) == users.end()) {
+        users.push_back(user);
+        memberHandles.push_back(user->getHandle());
+        UserTable::refresh(user);
+        mentionMatcher.add(user->getHandle(), user->getName());
+        user->restoreRoom(this, getHeadSequence());
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " joined ", roomName, " room!");
+    }
+}
+
+
+/**
+ * @brief Removes a user from the custom chat room
+ * @param user Pointer to the user to remove
+ */
+void CustomChatRoom::removeUser(User* user) {
+    auto it = std::find(users.begin(), users.end(), user);
+    if (it != users.end()) {
+        memberHandles.erase(memberHandles.begin() + (it - users.begin()));
+        users.erase(it);
+        mentionMatcher.remove(user->getHandle(), user->getName());
+        mailboxShards.erase(user);
+        user->forgetRoom(this);
+        PETSPACE_LOG(INFO, MEMBERSHIP, user->getName(), " left ", roomName, " room!");
+    }
+}
+
+/**
+ * @brief Sends a message to all users in the custom chat room
+ * @param message The message content
  * @param fromUser Pointer to the user sending the message
  * 
- * Message is delivered to all users except the sender
+ * Message is delivered to all users except the sender, mentioned users first
+ */
+void CustomChatRoom::sendMessage(const Message& message, User* fromUser) {
+    MessageEnvelope envelope(this, fromUser, message);
+    echoMessage(envelope);
+    deliverMessage(envelope);
+}
+
+/**
+ * @brief Saves a message to the custom chat room's history
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ */
+void CustomChatRoom::saveMessage(const Message& message, User* fromUser) {
+    appendHistory(message, fromUser);
+    PETSPACE_LOG(INFO, HISTORY, "[", roomName, "] Message saved to history: ", fromUser->getName(), ": ", message);
+}
+
+/**
+ * @brief Creates an iterator for the custom chat room's history
+ * @return Pointer to a new ChatHistoryIterator
+ */
+Iterator* CustomChatRoom::createIterator() {
+    return new ChatHistoryIterator(this);
+}
+
+/**
+ * @brief Gets the room's name
+ * @return The custom room name string
+ */
+std::string CustomChatRoom::getRoomName() const {
+    return std::string(roomName.data(), roomName.size());
+}
+
+// ============= extra : DIRECT MESSAGING IMPLEMENTATIONS =============
+
+/**
+ * @brief Constructs an empty conversation between two users
+ * @param handleA Handle of one participant
+ * @param handleB Handle of the other participant
+ */
+DirectConversation::DirectConversation(unsigned int handleA, unsigned int handleB)
+    : first(std::min(handleA, handleB)), second(std::max(handleA, handleB)) {
+}
+
+/**
+ * @brief Records a message
+ * @param fromHandle Handle of the sender
+ * @param message The message content (its buffer is shared, not copied)
+ */
+void DirectConversation::append(unsigned int fromHandle, const Message& message) {
+    entries.push_back(DirectEntry{message, fromHandle == first});
+}
+
+/**
+ * @brief Gets the number of messages exchanged
+ * @return The conversation length
+ */
+std::size_t DirectConversation::size() const {
+    return entries.size();
+}
+
+/**
+ * @brief Gets a conversation line by position
+ * @param position Position in the conversation (0 = oldest)
+ * @return "sender: text", or empty string if out of range
+ */
+std::string DirectConversation::at(std::size_t position) const {
+    if (position >= entries.size()) {
+        return "";
+    }
+    const DirectEntry& entry = entries[position];
+    User* sender = UserDirectory::find(entry.fromFirst ? first : second);
+    std::string line = sender ? sender->getName() : std::string("?");
+    return line.append(": ").append(entry.text.data(), entry.text.size());
+}
+
+/**
+ * @brief Checks whether a user takes part in the conversation
+ * @param handle The user's handle
+ * @return true if the user is a participant
+ */
+bool DirectConversation::involves(unsigned int handle) const {
+    return handle == first || handle == second;
+}
+
+std::atomic<User*> UserDirectory::users[UserDirectory::MAX_HANDLES];
+std::atomic<std::size_t> UserDirectory::live(0);
+UserDirectory::ConversationTable UserDirectory::conversations;
+
+/**
+ * @brief Deletes every conversation still held
+ */
+UserDirectory::ConversationTable::~ConversationTable() {
+    for (auto& entry : byPair) {
+        delete entry.second;
+    }
+    byPair.clear();
+    byHandle.clear();
+}
+
+/**
+ * @brief Builds the map key for a pair of handles, independent of order
+ * @param handleA Handle of one participant
+ * @param handleB Handle of the other participant
+ * @return The pair key
+ */
+unsigned long long UserDirectory::pairKey(unsigned int handleA, unsigned int handleB) {
+    unsigned long long low = std::min(handleA, handleB);
+    unsigned long long high = std::max(handleA, handleB);
+    return (high << 32) | low;
+}
+
+/**
+ * @brief Adds a user under its handle
+ * @param user The user to add
+ */
+void UserDirectory::add(User* user) {
+    if (!user || user->getHandle() >= MAX_HANDLES) {
+        return;
+    }
+    if (!users[user->getHandle()].exchange(user, std::memory_order_acq_rel)) {
+        live.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Removes a user and every conversation it took part in
+ * @param user The user to remove
+ * 
+ * Conversations are dropped so a later user given the same handle does
+ * not inherit them. Only the user's own conversations are visited.
+ */
+void UserDirectory::remove(User* user) {
+    User* expected = user;
+    if (!user || user->getHandle() >= MAX_HANDLES ||
+        !users[user->getHandle()].compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+        return;
+    }
+    live.fetch_sub(1, std::memory_order_relaxed);
+    unsigned int handle = user->getHandle();
+    if (handle >= conversations.byHandle.size()) {
+        return;
+    }
+    std::vector<unsigned long long> keys;
+    keys.swap(conversations.byHandle[handle]);
+    for (unsigned long long key : keys) {
+        auto it = conversations.byPair.find(key);
+        if (it == conversations.byPair.end()) {
+            continue;
+        }
+        unsigned int high = static_cast<unsigned int>(key >> 32);
+        unsigned int other = high == handle ? static_cast<unsigned int>(key & 0xFFFFFFFFu) : high;
+        if (other != handle && other < conversations.byHandle.size()) {
+            std::vector<unsigned long long>& peer = conversations.byHandle[other];
+            peer.erase(std::remove(peer.begin(), peer.end(), key), peer.end());
+        }
+        delete it->second;
+        conversations.byPair.erase(it);
+    }
+}
+
+/**
+ * @brief Looks up a live user by handle
+ * @param handle The user's handle
+ * @return The user, or nullptr if no live user has that handle
+ */
+User* UserDirectory::find(unsigned int handle) {
+    return handle < MAX_HANDLES ? users[handle].load(std::memory_order_acquire) : nullptr;
+}
+
+/**
+ * @brief Gets the number of live users
+ * @return The live user count
+ */
+std::size_t UserDirectory::size() {
+    return live.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Gets the conversation between two users
+ * @param handleA Handle of one participant
+ * @param handleB Handle of the other participant
+ * @param create Whether to start the conversation if it does not exist
+ * @return The conversation, or nullptr if absent and not created
+ */
+DirectConversation* UserDirectory::conversation(unsigned int handleA, unsigned int handleB, bool create) {
+    unsigned long long key = pairKey(handleA, handleB);
+    auto it = conversations.byPair.find(key);
+    if (it != conversations.byPair.end()) {
+        return it->second;
+    }
+    if (!create) {
+        return nullptr;
+    }
+    DirectConversation* started = new DirectConversation(handleA, handleB);
+    conversations.byPair[key] = started;
+    if (std::max(handleA, handleB) >= conversations.byHandle.size()) {
+        conversations.byHandle.resize(std::max(handleA, handleB) + 1);
+    }
+    conversations.byHandle[handleA].push_back(key);
+    if (handleB != handleA) {
+        conversations.byHandle[handleB].push_back(key);
+    }
+    return started;
+}
+
+// ============= extra : ROOM REGISTRY IMPLEMENTATIONS =============
+
+/**
+ * @brief Constructs an empty slab
+ * @param objectSize Size of each object
+ * @param blockSlots Number of objects per block
+ */
+ObjectSlab::ObjectSlab(std::size_t objectSize, std::size_t blockSlots)
+    : slotSize(0), slotsPerBlock(std::max<std::size_t>(1, blockSlots)), freeList(nullptr), live(0) {
+    const std::size_t align = alignof(std::max_align_t);
+    slotSize = (std::max(objectSize, sizeof(void*)) + align - 1) / align * align;
+}
+
+/**
+ * @brief Destructs the slab, releasing every block
+ */
+ObjectSlab::~ObjectSlab() {
+    for (void* block : blocks) {
+        ::operator delete(block);
+    }
+}
+
+/**
+ * @brief Takes a free slot, growing by one block if none is left
+ * @return Storage for one object
+ */
+void* ObjectSlab::allocate() {
+    if (!freeList) {
+        char* block = static_cast<char*>(::operator new(slotSize * slotsPerBlock));
+        blocks.push_back(block);
+        // Thread the new slots onto the free list, first slot at the head
+        for (std::size_t i = slotsPerBlock; i-- > 0;) {
+            void* slot = block + i * slotSize;
+            *static_cast<void**>(slot) = freeList;
+            freeList = slot;
+        }
+    }
+    void* slot = freeList;
+    freeList = *static_cast<void**>(slot);
+    live++;
+    return slot;
+}
+
+/**
+ * @brief Returns a slot to the free list
+ * @param pointer Storage from allocate()
+ */
+void ObjectSlab::deallocate(void* pointer) {
+    if (pointer) {
+        *static_cast<void**>(pointer) = freeList;
+        freeList = pointer;
+        live--;
+    }
+}
+
+/**
+ * @brief Gets the number of blocks the slab has taken
+ * @return The block count
+ */
+std::size_t ObjectSlab::blockCount() const {
+    return blocks.size();
+}
+
+/**
+ * @brief Gets the number of slots currently handed out
+ * @return The live object count
+ */
+std::size_t ObjectSlab::liveCount() const {
+    return live;
+}
+
+/**
+ * @brief Deletes every room still registered
+ */
+ChatRoomRegistry::~ChatRoomRegistry() {
+    std::unordered_map<std::string, CustomChatRoom*> remaining;
+    remaining.swap(rooms);
+    for (const std::pair<const std::string, CustomChatRoom*>& entry : remaining) {
+        entry.second->registry = nullptr;
+        delete entry.second;
+    }
+}
+
+/**
+ * @brief Gets the registry used by User::createChatRoom()
+ * @return The process-wide registry
+ */
+ChatRoomRegistry& ChatRoomRegistry::global() {
+    static ChatRoomRegistry registry;
+    return registry;
+}
+
+/**
+ * @brief Creates and registers a custom room
+ * @param name The room name (must not be taken)
+ * @param resource Memory resource for the room's containers
+ * @return The new room, or nullptr if the name is taken
+ */
+CustomChatRoom* ChatRoomRegistry::create(const std::string& name, std::pmr::memory_resource* resource) {
+    if (rooms.count(name)) {
+        PETSPACE_LOG(WARN, ADMIN, "A chat room named ", name, " already exists; use find() to reach it");
+        return nullptr;
+    }
+    CustomChatRoom* room = new CustomChatRoom(name, resource);
+    room->registry = this;
+    rooms[name] = room;
+    return room;
+}
+
+/**
+ * @brief Looks up a room by name
+ * @param name The room name
+ * @return The room, or nullptr if none has that name
+ */
+CustomChatRoom* ChatRoomRegistry::find(const std::string& name) const {
+    auto it = rooms.find(name);
+    return it == rooms.end() ? nullptr : it->second;
+}
+
+/**
+ * @brief Removes every member from a room and deletes it
+ * @param room The room (already removed from the map)
+ */
+void ChatRoomRegistry::release(CustomChatRoom* room) {
+    // Copy the member list, since leaving a room edits it
+    std::vector<User*> members(room->getUsers().begin(), room->getUsers().end());
+    for (User* member : members) {
+        member->leaveChatRoom(room);
+    }
+    room->registry = nullptr;
+    delete room;
+}
+
+/**
+ * @brief Removes every member from a room and deletes it
+ * @param name The room name
+ * @return true if the room existed
+ */
+bool ChatRoomRegistry::destroy(const std::string& name) {
+    auto it = rooms.find(name);
+    if (it == rooms.end()) {
+        return false;
+    }
+    CustomChatRoom* room = it->second;
+    rooms.erase(it);
+    release(room);
+    return true;
+}
+
+/**
+ * @brief Removes every member from every room and deletes them all
+ * @return Number of rooms deleted
+ */
+std::size_t ChatRoomRegistry::teardown() {
+    std::unordered_map<std::string, CustomChatRoom*> remaining;
+    remaining.swap(rooms);
+    for (const std::pair<const std::string, CustomChatRoom*>& entry : remaining) {
+        release(entry.second);
+    }
+    return remaining.size();
+}
+
+/**
+ * @brief Gets the number of registered rooms
+ * @return The room count
+ */
+std::size_t ChatRoomRegistry::size() const {
+    return rooms.size();
+}
+
+/**
+ * @brief Stops tracking a room that is being deleted elsewhere
+ * @param room The room
+ */
+void ChatRoomRegistry::forget(CustomChatRoom* room) {
+    auto it = rooms.find(room->getRoomName());
+    if (it != rooms.end() && it->second == room) {
+        rooms.erase(it);
+    }
+}
+
+// ============= extra : SNAPSHOT IMPLEMENTATIONS =============
+
+namespace {
+
+const char SNAPSHOT_MAGIC[4] = {'P', 'S', 'S', 'N'};
+const unsigned int SNAPSHOT_VERSION = 2;
+
+enum SnapshotUserKind { SNAPSHOT_USER1 = 1, SNAPSHOT_USER2 = 2, SNAPSHOT_USER3 = 3 };
+enum SnapshotRoomKind { SNAPSHOT_CTRLCAT = 0, SNAPSHOT_DOGORITHM = 1, SNAPSHOT_CUSTOM = 2 };
+enum SnapshotState { SNAPSHOT_ONLINE = 0, SNAPSHOT_OFFLINE = 1, SNAPSHOT_BUSY = 2 };
+
+/**
+ * @brief Gets the snapshot tag for a user's concrete type
+ * @param user The user
+ * @return The SnapshotUserKind, or 0 if the user is none of the built-in types
+ */
+unsigned long long snapshotUserKind(const User* user) {
+    return dynamic_cast<const User1*>(user) ? SNAPSHOT_USER1 :
+           dynamic_cast<const User2*>(user) ? SNAPSHOT_USER2 :
+           dynamic_cast<const User3*>(user) ? SNAPSHOT_USER3 : 0;
+}
+
+/**
+ * @brief Gets the snapshot tag for a room's concrete type
+ * @param room The room
+ * @return The SnapshotRoomKind
+ */
+unsigned long long snapshotRoomKind(const ChatRoom* room) {
+    return dynamic_cast<const CtrlCat*>(room) ? SNAPSHOT_CTRLCAT :
+           dynamic_cast<const Dogorithm*>(room) ? SNAPSHOT_DOGORITHM : SNAPSHOT_CUSTOM;
+}
+
+/**
+ * @brief Appends a user's (kind, name, admin, state) record
+ * @param out Buffer to append to
+ * @param user The user
+ */
+void writeSnapshotUser(std::vector<unsigned char>& out, const User* user) {
+    std::string state = user->getState() ? user->getState()->getStateName() : "Online";
+    putVarint(out, snapshotUserKind(user));
+    writeString(out, user->getName());
+    putVarint(out, user->getAdmin() ? 1 : 0);
+    putVarint(out, state == "Offline" ? SNAPSHOT_OFFLINE : state == "Busy" ? SNAPSHOT_BUSY : SNAPSHOT_ONLINE);
+}
+
+/**
+ * @brief Builds a user of the recorded concrete type
+ * @param kind The recorded SnapshotUserKind
+ * @param name The user's name
+ * @return The new user, or nullptr for an unknown kind
+ */
+User* makeSnapshotUser(unsigned long long kind, const std::string& name) {
+    switch (kind) {
+        case SNAPSHOT_USER1: return new User1(name);
+        case SNAPSHOT_USER2: return new User2(name);
+        case SNAPSHOT_USER3: return new User3(name);
+        default: return nullptr;
+    }
+}
+
+/**
+ * @brief Builds a room of the recorded concrete type
+ * @param kind The recorded SnapshotRoomKind
+ * @param name The room name (used by custom rooms)
+ * @param registry Registry custom rooms are created in
+ * @return The new room, or nullptr for an unknown kind or a taken custom name
+ */
+ChatRoom* makeSnapshotRoom(unsigned long long kind, const std::string& name,
+                           ChatRoomRegistry& registry = ChatRoomRegistry::global()) {
+    switch (kind) {
+        case SNAPSHOT_CTRLCAT: return new CtrlCat();
+        case SNAPSHOT_DOGORITHM: return new Dogorithm();
+        case SNAPSHOT_CUSTOM: return registry.create(name);
+        default: return nullptr;
+    }
+}
+
+/**
+ * @brief Appends a room's retention policy and memory cap
+ * @param out Buffer to append to
+ * @param room The room
+ */
+void writeSnapshotRetention(std::vector<unsigned char>& out, const ChatRoom* room) {
+    HistoryRetention policy;
+    bool enabled = room->getHistoryRetention(policy);
+    putVarint(out, enabled ? 1 : 0);
+    if (enabled) {
+        putVarint(out, policy.maxMessages);
+        putVarint(out, policy.maxBytes);
+        putVarint(out, policy.blockMessages);
+        writeString(out, policy.coldDirectory);
+    }
+    putVarint(out, room->getMemoryCap());
+}
+
+/**
+ * @brief Reads a room's retention policy and memory cap and applies them
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param pos Read position, advanced past the record
+ * @param room The room to apply them to
+ * @return false if the record is malformed
+ */
+bool readSnapshotRetention(const unsigned char* data, std::size_t size, std::size_t& pos, ChatRoom* room) {
+    unsigned long long enabled = 0;
+    unsigned long long messages = 0;
+    unsigned long long bytes = 0;
+    unsigned long long block = 0;
+    unsigned long long cap = 0;
+    std::string directory;
+    if (!getVarint(data, size, pos, enabled) ||
+        (enabled && (!getVarint(data, size, pos, messages) || !getVarint(data, size, pos, bytes) ||
+                     !getVarint(data, size, pos, block) || !readString(data, size, pos, directory))) ||
+        !getVarint(data, size, pos, cap)) {
+        return false;
+    }
+    if (enabled) {
+        room->setHistoryRetention(HistoryRetention(static_cast<std::size_t>(messages), static_cast<std::size_t>(bytes),
+                                                   static_cast<std::size_t>(block), directory));
+    }
+    if (cap) {
+        room->setMemoryCap(static_cast<std::size_t>(cap));
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a (kind, name, admin, state) record and builds the user
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param pos Read position, advanced past the record
+ * @return The new user, or nullptr if the record is malformed
+ */
+User* readSnapshotUser(const unsigned char* data, std::size_t size, std::size_t& pos) {
+    unsigned long long kind = 0;
+    unsigned long long admin = 0;
+    unsigned long long state = 0;
+    std::string name;
+    if (!getVarint(data, size, pos, kind) || !readString(data, size, pos, name) ||
+        !getVarint(data, size, pos, admin) || !getVarint(data, size, pos, state)) {
+        return nullptr;
+    }
+    User* user = makeSnapshotUser(kind, name);
+    if (!user) {
+        return nullptr;
+    }
+    if (admin) {
+        user->setAdmin(true);
+    }
+    if (state == SNAPSHOT_OFFLINE) {
+        user->setState(new Offline());
+    } else if (state == SNAPSHOT_BUSY) {
+        user->setState(new Busy());
+    }
+    return user;
+}
+
+} // namespace
+
+/**
+ * @brief Encodes users and rooms into a buffer
+ * @param out Buffer to append to
+ * @param users The users to capture
+ * @param rooms The rooms to capture
+ * @return false if a user is not a User1, User2 or User3 (or subclass)
+ * 
+ * Layout: magic, version, then each user as (kind, name, admin, state)
+ * and each room as (kind, name, retention, memory cap, (member index,
+ * read cursor) pairs, history).
+ */
+bool PetSpaceSnapshot::encode(std::vector<unsigned char>& out, const std::vector<User*>& users,
+                              const std::vector<ChatRoom*>& rooms) {
+    for (const User* user : users) {
+        if (!snapshotUserKind(user)) {
+            PETSPACE_LOG(WARN, ADMIN, user->getName(), " is not a built-in user type; snapshot not written");
+            return false;
+        }
+    }
+    out.insert(out.end(), SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + 4);
+    putVarint(out, SNAPSHOT_VERSION);
+    std::unordered_map<const User*, std::size_t> indexOf;
+    putVarint(out, users.size());
+    for (User* user : users) {
+        std::size_t index = indexOf.size();
+        indexOf[user] = index;
+        writeSnapshotUser(out, user);
+    }
+    putVarint(out, rooms.size());
+    for (ChatRoom* room : rooms) {
+        putVarint(out, snapshotRoomKind(room));
+        writeString(out, room->getRoomName());
+        writeSnapshotRetention(out, room);
+        std::vector<std::pair<std::size_t, unsigned long long>> members;
+        for (User* member : room->getUsers()) {
+            auto it = indexOf.find(member);
+            if (it != indexOf.end()) {
+                members.push_back(std::make_pair(it->second, member->getReadCursor(room)));
+            }
+        }
+        putVarint(out, members.size());
+        for (const auto& member : members) {
+            putVarint(out, member.first);
+            putVarint(out, member.second);
+        }
+        room->encodeHistory(out);
+    }
+    return true;
+}
+
+/**
+ * @brief Rebuilds users and rooms from a buffer
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param users Receives the restored users
+ * @param rooms Receives the restored rooms
+ * @return true on success; nothing is added on failure
+ */
+bool PetSpaceSnapshot::decode(const unsigned char* data, std::size_t size, std::vector<User*>& users,
+                              std::vector<ChatRoom*>& rooms) {
+    if (size < 4 || !std::equal(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + 4, data)) {
+        return false;
+    }
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    unsigned long long userCount = 0;
+    if (!getVarint(data, size, pos, version) || version != SNAPSHOT_VERSION ||
+        !getVarint(data, size, pos, userCount)) {
+        return false;
+    }
+    std::vector<User*> newUsers;
+    std::vector<ChatRoom*> newRooms;
+    // Undo everything built so far; deleting a room drops it from its members
+    auto fail = [&newUsers, &newRooms]() {
+        for (ChatRoom* room : newRooms) {
+            delete room;
+        }
+        for (User* user : newUsers) {
+            delete user;
+        }
+        return false;
+    };
+    for (unsigned long long i = 0; i < userCount; i++) {
+        User* user = readSnapshotUser(data, size, pos);
+        if (!user) {
+            return fail();
+        }
+        newUsers.push_back(user);
+    }
+    unsigned long long roomCount = 0;
+    if (!getVarint(data, size, pos, roomCount)) {
+        return fail();
+    }
+    for (unsigned long long i = 0; i < roomCount; i++) {
+        unsigned long long kind = 0;
+        unsigned long long memberCount = 0;
+        std::string name;
+        if (!getVarint(data, size, pos, kind) || !readString(data, size, pos, name)) {
+            return fail();
+        }
+        ChatRoom* room = makeSnapshotRoom(kind, name);
+        if (!room) {
+            return fail();
+        }
+        newRooms.push_back(room);
+        if (!readSnapshotRetention(data, size, pos, room) || !getVarint(data, size, pos, memberCount) ||
+            memberCount > newUsers.size()) {
+            return fail();
+        }
+        std::vector<std::pair<User*, unsigned long long>> members;
+        std::vector<bool> seen(newUsers.size(), false);
+        members.reserve(static_cast<std::size_t>(memberCount));
+        for (unsigned long long m = 0; m < memberCount; m++) {
+            unsigned long long member = 0;
+            unsigned long long cursor = 0;
+            if (!getVarint(data, size, pos, member) || !getVarint(data, size, pos, cursor) ||
+                member >= newUsers.size() || seen[member]) {
+                return fail();
+            }
+            seen[member] = true;
+            members.push_back(std::make_pair(newUsers[member], cursor));
+        }
+        // History first, so cursors are clamped against the restored head
+        if (!room->decodeHistory(data, size, pos)) {
+            return fail();
+        }
+        room->restoreMembers(members);
+    }
+    users.insert(users.end(), newUsers.begin(), newUsers.end());
+    rooms.insert(rooms.end(), newRooms.begin(), newRooms.end());
+    return true;
+}
+
+/**
+ * @brief Writes a snapshot file
+ * @param path File path
+ * @param users The users to capture
+ * @param rooms The rooms to capture
+ * @return true on success, false otherwise
+ */
+bool PetSpaceSnapshot::save(const std::string& path, const std::vector<User*>& users,
+                            const std::vector<ChatRoom*>& rooms) {
+    std::vector<unsigned char> out;
+    return encode(out, users, rooms) && writeFile(path, out);
+}
+
+/**
+ * @brief Restores users and rooms from a snapshot file
+ * @param path File path written by save()
+ * @param users Receives the restored users
+ * @param rooms Receives the restored rooms
+ * @return true on success, false if the file is missing, malformed or of another version
+ */
+bool PetSpaceSnapshot::load(const std::string& path, std::vector<User*>& users, std::vector<ChatRoom*>& rooms) {
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        return false;
+    }
+    return decode(file.data(), file.size(), users, rooms);
+}
+
+// ============= extra : COMMAND JOURNAL IMPLEMENTATIONS =============
+
+namespace {
+
+const char JOURNAL_MAGIC[4] = {'P', 'S', 'J', 'L'};
+const unsigned int JOURNAL_VERSION = 2;
+
+/**
+ * @brief Computes the FNV-1a hash of a buffer
+ * @param data The buffer
+ * @param size Size of the buffer
+ * @param hash Hash to continue from (the FNV offset basis to start fresh)
+ * @return The 32-bit hash
+ */
+std::uint32_t fnv1a(const unsigned char* data, std::size_t size, std::uint32_t hash = 2166136261u) {
+    for (std::size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Appends (type, user, room) to a record payload
+ * @param out Buffer to append to
+ * @param type The record type
+ * @param journal Journal whose catalog maps users and rooms to indexes
+ * @param user The user
+ * @param room The room
+ * @return false, after logging a warning, if either is not in the catalog
+ */
+bool writeRecordHeader(std::vector<unsigned char>& out, JournalRecord type, const CommandJournal& journal,
+                       const User* user, const ChatRoom* room) {
+    unsigned long long userIndex = 0;
+    unsigned long long roomIndex = 0;
+    if (!journal.indexOf(user, userIndex) || !journal.indexOf(room, roomIndex)) {
+        PETSPACE_LOG(WARN, HISTORY, "Not journaled: ", user ? user->getName() : std::string("(no user)"), " in ",
+                     room ? room->getRoomName() : std::string("(no room)"), " is outside the journal catalog");
+        return false;
+    }
+    putVarint(out, static_cast<unsigned long long>(type));
+    putVarint(out, userIndex);
+    putVarint(out, roomIndex);
+    return true;
+}
+
+/**
+ * @brief Appends a count followed by each message
+ * @param out Buffer to append to
+ * @param messages The messages
+ */
+void writeMessages(std::vector<unsigned char>& out, const std::vector<Message>& messages) {
+    putVarint(out, messages.size());
+    for (const Message& message : messages) {
+        writeString(out, message.view());
+    }
+}
+
+/**
+ * @brief Writes a journal file header
+ * @param file The open journal file
+ * @param base Hash of the snapshot the journal continues (0 = none)
+ * @return true on success
+ */
+bool writeJournalHeader(std::FILE* file, std::uint32_t base) {
+    std::vector<unsigned char> header(JOURNAL_MAGIC, JOURNAL_MAGIC + 4);
+    putVarint(header, JOURNAL_VERSION);
+    putVarint(header, base);
+    return std::fwrite(header.data(), 1, header.size(), file) == header.size() && std::fflush(file) == 0;
+}
+
+/**
+ * @brief Forces a file's written data onto the disk
+ * @param file The file
+ * @return true on success
+ */
+bool syncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+/**
+ * @brief Replaces a file so it holds either the old or the new contents
+ * @param path The file to replace
+ * @param data The new contents
+ * @return true once the new contents are durable under the file's name
+ *
+ * The data goes to path + ".tmp", is synced, and is renamed over the file;
+ * on POSIX the directory is synced too so the rename itself survives.
+ */
+bool replaceFile(const std::string& path, const std::vector<unsigned char>& data) {
+    std::string temporary = path + ".tmp";
+    std::FILE* out = std::fopen(temporary.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    bool written = std::fwrite(data.data(), 1, data.size(), out) == data.size() && syncFile(out);
+    written = std::fclose(out) == 0 && written;
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(temporary, path, error);
+    }
+    if (!written || error) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+#ifndef _WIN32
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    int descriptor = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (descriptor >= 0) {
+        fsync(descriptor);
+        close(descriptor);
+    }
+#endif
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Default: the command is not journaled
+ * @param out Buffer to append to (unused)
+ * @param journal Journal catalog (unused)
+ * @return false
+ */
+bool Command::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    (void)out;
+    (void)journal;
+    return false;
+}
+
+/**
+ * @brief Appends a Send record: user, room, message
+ * @param out Buffer to append to
+ * @param journal Journal whose catalog maps users and rooms to indexes
+ * @return false if the user or room is not in the catalog
+ */
+bool SendMessageCommand::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    if (!writeRecordHeader(out, JournalRecord::Send, journal, fromUser, chatRoom)) {
+        return false;
+    }
+    writeString(out, message.view());
+    return true;
+}
+
+/**
+ * @brief Appends a Log record: user, room, message
+ * @param out Buffer to append to
+ * @param journal Journal whose catalog maps users and rooms to indexes
+ * @return false if the user or room is not in the catalog
+ */
+bool LogMessageCommand::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    if (!writeRecordHeader(out, JournalRecord::Log, journal, fromUser, chatRoom)) {
+        return false;
+    }
+    writeString(out, message.view());
+    return true;
+}
+
+/**
+ * @brief Appends a SendBatch record: user, room, messages
+ * @param out Buffer to append to
+ * @param journal Journal whose catalog maps users and rooms to indexes
+ * @return false if the user or room is not in the catalog
+ */
+bool SendBatchCommand::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    if (!writeRecordHeader(out, JournalRecord::SendBatch, journal, fromUser, chatRoom)) {
+        return false;
+    }
+    writeMessages(out, messages);
+    return true;
+}
+
+/**
+ * @brief Appends a LogBatch record: user, room, messages
+ * @param out Buffer to append to
+ * @param journal Journal whose catalog maps users and rooms to indexes
+ * @return false if the user or room is not in the catalog
+ */
+bool LogBatchCommand::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    if (!writeRecordHeader(out, JournalRecord::LogBatch, journal, fromUser, chatRoom)) {
+        return false;
+    }
+    writeMessages(out, messages);
+    return true;
+}
+
+/**
+ * @brief Appends a Direct record: sender, recipient, message
+ * @param out Buffer to append to
+ * @param journal Journal whose catalog maps users to indexes
+ * @return false if either user is not in the catalog
+ */
+bool DirectMessageCommand::serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const {
+    unsigned long long fromIndex = 0;
+    unsigned long long toIndex = 0;
+    if (!journal.indexOf(fromUser, fromIndex) || !journal.indexOf(UserDirectory::find(recipient), toIndex)) {
+        PETSPACE_LOG(WARN, HISTORY, "Not journaled: direct message from ", fromUser ? fromUser->getName() : std::string("(no user)"),
+                     " involves a user outside the journal catalog");
+        return false;
+    }
+    putVarint(out, static_cast<unsigned long long>(JournalRecord::Direct));
+    putVarint(out, fromIndex);
+    putVarint(out, toIndex);
+    writeString(out, message.view());
+    return true;
+}
+
+CommandJournal* CommandJournal::active = nullptr;
+
+/**
+ * @brief Opens (or creates) a journal file for appending
+ * @param journalPath File path
+ * @param group Records per group commit
+ * @param delay Longest a record may wait for its group, in seconds
+ */
+CommandJournal::CommandJournal(const std::string& journalPath, std::size_t group, double delay)
+    : path(journalPath), file(std::fopen(journalPath.c_str(), "ab")), pendingRecords(0),
+      groupSize(std::max<std::size_t>(1, group)), maxDelay(delay), nextUserIndex(0), nextRoomIndex(0),
+      records(0), syncs(0), skipped(0), stopping(false) {
+    if (!file) {
+        PETSPACE_LOG(ERROR, HISTORY, "Could not open journal ", path);
+        return;
+    }
+    std::fseek(file, 0, SEEK_END);
+    if (std::ftell(file) == 0) {
+        writeJournalHeader(file, 0);
+    }
+    flusher = std::thread(&CommandJournal::flushLoop, this);
+}
+
+/**
+ * @brief Commits pending records and closes the file
+ */
+CommandJournal::~CommandJournal() {
+    if (active == this) {
+        active = nullptr;
+    }
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+    if (file) {
+        sync();
+        std::fclose(file);
+    }
+}
+
+/**
+ * @brief Commits each group once its oldest record has waited maxDelay
+ *
+ * Sleeps until a group starts, then until its deadline; a group filled
+ * or synced earlier by appendRecord() just moves on to the next one.
+ */
+void CommandJournal::flushLoop() {
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    while (!stopping) {
+        if (pendingRecords == 0) {
+            wake.wait(guard);
+            continue;
+        }
+        std::chrono::steady_clock::time_point due =
+            oldestPending + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(maxDelay));
+        wake.wait_until(guard, due);
+        if (!stopping && pendingRecords > 0 && std::chrono::steady_clock::now() >= due) {
+            sync();
+        }
+    }
+}
+
+/**
+ * @brief Makes a journal the one User::executeAll() writes to
+ * @param journal The journal, or nullptr to stop journaling
+ */
+void CommandJournal::install(CommandJournal* journal) {
+    active = journal;
+}
+
+/**
+ * @brief Gets the installed journal
+ * @return The journal, or nullptr if none is installed
+ */
+CommandJournal* CommandJournal::current() {
+    return active;
+}
+
+/**
+ * @brief Checks whether the journal file is open
+ * @return true if records can be written
+ */
+bool CommandJournal::isOpen() const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return file != nullptr;
+}
+
+/**
+ * @brief Replaces the catalog of users and rooms
+ * @param users Users, indexed by position
+ * @param rooms Rooms, indexed by position
+ */
+void CommandJournal::setCatalog(const std::vector<User*>& users, const std::vector<ChatRoom*>& rooms) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    userIndex.clear();
+    roomIndex.clear();
+    for (std::size_t i = 0; i < users.size(); i++) {
+        userIndex[users[i]] = i;
+    }
+    for (std::size_t i = 0; i < rooms.size(); i++) {
+        roomIndex[rooms[i]] = i;
+    }
+    nextUserIndex = users.size();
+    nextRoomIndex = rooms.size();
+}
+
+/**
+ * @brief Adds a user to the catalog and journals its creation
+ * @param user The new user
+ * 
+ * Indexes are never reused, so a forgotten user's index stays unique.
+ */
+void CommandJournal::trackUser(User* user) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!file || !user || userIndex.count(user)) {
+        return;
+    }
+    std::vector<unsigned char> payload;
+    putVarint(payload, static_cast<unsigned long long>(JournalRecord::NewUser));
+    writeSnapshotUser(payload, user);
+    userIndex[user] = nextUserIndex++;
+    appendRecord(payload);
+}
+
+/**
+ * @brief Adds a room to the catalog and journals its creation
+ * @param room The new room
+ */
+void CommandJournal::trackRoom(ChatRoom* room) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!file || !room || roomIndex.count(room)) {
+        return;
+    }
+    std::vector<unsigned char> payload;
+    putVarint(payload, static_cast<unsigned long long>(JournalRecord::NewRoom));
+    putVarint(payload, snapshotRoomKind(room));
+    writeString(payload, room->getRoomName());
+    roomIndex[room] = nextRoomIndex++;
+    appendRecord(payload);
+}
+
+/**
+ * @brief Looks up a user's catalog index
+ * @param user The user
+ * @param index Receives the index
+ * @return true if the user is in the catalog
+ */
+bool CommandJournal::indexOf(const User* user, unsigned long long& index) const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto it = userIndex.find(user);
+    if (it == userIndex.end()) {
+        return false;
+    }
+    index = it->second;
+    return true;
+}
+
+/**
+ * @brief Looks up a room's catalog index
+ * @param room The room
+ * @param index Receives the index
+ * @return true if the room is in the catalog
+ */
+bool CommandJournal::indexOf(const ChatRoom* room, unsigned long long& index) const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto it = roomIndex.find(room);
+    if (it == roomIndex.end()) {
+        return false;
+    }
+    index = it->second;
+    return true;
+}
+
+/**
+ * @brief Drops a user that is being destroyed from the catalog
+ * @param user The user
+ * 
+ * Stops a later object at the same address inheriting its index.
+ */
+void CommandJournal::forget(const User* user) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    userIndex.erase(user);
+}
+
+/**
+ * @brief Drops a room that is being destroyed from the catalog
+ * @param room The room
+ */
+void CommandJournal::forget(const ChatRoom* room) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    roomIndex.erase(room);
+}
+
+/**
+ * @brief Frames a record and commits the group if it is full or old
+ * @param payload The record payload
+ * 
+ * Frame: varint record length, 32-bit FNV-1a checksum, record, where the
+ * record is the wall-clock time in milliseconds followed by the payload.
+ * The caller holds the lock.
+ */
+void CommandJournal::appendRecord(const std::vector<unsigned char>& payload) {
+    if (pendingRecords == 0) {
+        oldestPending = std::chrono::steady_clock::now();
+        wake.notify_one();
+    }
+    std::vector<unsigned char> stamp;
+    putVarint(stamp, static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count()));
+    putVarint(pending, stamp.size() + payload.size());
+    std::uint32_t checksum = fnv1a(payload.data(), payload.size(), fnv1a(stamp.data(), stamp.size()));
+    for (int shift = 0; shift < 32; shift += 8) {
+        pending.push_back(static_cast<unsigned char>(checksum >> shift));
+    }
+    pending.insert(pending.end(), stamp.begin(), stamp.end());
+    pending.insert(pending.end(), payload.begin(), payload.end());
+    pendingRecords++;
+    records++;
+    std::chrono::duration<double> waited = std::chrono::steady_clock::now() - oldestPending;
+    if (pendingRecords >= groupSize || waited.count() >= maxDelay) {
+        sync();
+    }
+}
+
+/**
+ * @brief Journals a command ahead of its execution
+ * @param command The command about to run
+ * @return true if a record was appended
+ */
+bool CommandJournal::append(const Command& command) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!file) {
+        return false;
+    }
+    std::vector<unsigned char> payload;
+    if (!command.serialize(payload, *this)) {
+        skipped++;
+        return false;
+    }
+    appendRecord(payload);
+    return true;
+}
+
+/**
+ * @brief Journals a membership change
+ * @param type JournalRecord::Join or JournalRecord::Leave
+ * @param user The user
+ * @param room The room
+ * @return true if a record was appended
+ */
+bool CommandJournal::appendMembership(JournalRecord type, const User* user, const ChatRoom* room) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    std::vector<unsigned char> payload;
+    if (!file) {
+        return false;
+    }
+    if (!writeRecordHeader(payload, type, *this, user, room)) {
+        skipped++;
+        return false;
+    }
+    appendRecord(payload);
+    return true;
+}
+
+/**
+ * @brief Writes and fsyncs every pending record
+ * @return true on success
+ */
+bool CommandJournal::sync() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!file) {
+        return false;
+    }
+    if (pending.empty()) {
+        return true;
+    }
+    long offset = std::ftell(file);
+    if (std::fwrite(pending.data(), 1, pending.size(), file) != pending.size() || !syncFile(file)) {
+        // Cut off any partial write so later groups are not stranded behind a torn record
+        std::clearerr(file);
+        std::error_code error;
+        if (offset >= 0) {
+            std::filesystem::resize_file(path, static_cast<std::uintmax_t>(offset), error);
+        }
+        oldestPending = std::chrono::steady_clock::now();
+        PETSPACE_LOG(ERROR, HISTORY, "Journal write failed; ", pendingRecords, " records kept pending in ", path);
+        return false;
+    }
+    pending.clear();
+    pendingRecords = 0;
+    syncs++;
+    return true;
+}
+
+/**
+ * @brief Saves a snapshot and starts a fresh journal on top of it
+ * @param snapshotPath Snapshot file path
+ * @param users Users to capture; also becomes the catalog
+ * @param rooms Rooms to capture; also becomes the catalog
+ * @return true on success
+ * 
+ * The snapshot replaces the old one atomically (temporary file, fsync,
+ * rename), so a crash leaves one complete snapshot or the other. The
+ * new journal's header carries the snapshot's hash. If a crash hits
+ * after the snapshot is renamed but before the journal is reset, the old
+ * journal no longer matches and recover() will not replay it twice.
+ */
+bool CommandJournal::checkpoint(const std::string& snapshotPath, const std::vector<User*>& users,
+                                const std::vector<ChatRoom*>& rooms) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!file || !sync()) {
+        return false;
+    }
+    std::vector<unsigned char> snapshot;
+    if (!PetSpaceSnapshot::encode(snapshot, users, rooms) || !replaceFile(snapshotPath, snapshot)) {
+        return false;
+    }
+    std::fclose(file);
+    file = std::fopen(path.c_str(), "wb");
+    if (!file || !writeJournalHeader(file, fnv1a(snapshot.data(), snapshot.size())) || !syncFile(file)) {
+        return false;
+    }
+    setCatalog(users, rooms);
+    return true;
+}
+
+/**
+ * @brief Gets the number of records appended since opening
+ * @return The record count
+ */
+unsigned long long CommandJournal::getRecordCount() const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return records;
+}
+
+/**
+ * @brief Gets the number of group commits performed
+ * @return The sync count
+ */
+unsigned long long CommandJournal::getSyncCount() const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return syncs;
+}
+
+/**
+ * @brief Gets the number of commands that could not be journaled
+ * @return The skipped command count
+ */
+unsigned long long CommandJournal::getSkippedCount() const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return skipped;
+}
+
+/**
+ * @brief Gets the number of records waiting for their group commit
+ * @return The pending record count
+ */
+std::size_t CommandJournal::getPendingCount() const {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return pendingRecords;
+}
+
+/**
+ * @brief Applies a journal to restored users and rooms
+ * @param journalPath Journal file path
+ * @param users Catalog users; users created by the journal are appended
+ * @param rooms Catalog rooms; rooms created by the journal are appended
+ * @return Number of records applied
+ * 
+ * Commands are rebuilt and executed directly, so nothing is journaled
+ * again while replaying. History saved by a record gets the record's
+ * time; journals written before records were timestamped still replay.
+ */
+std::size_t CommandJournal::replay(const std::string& journalPath, std::vector<User*>& users,
+                                   std::vector<ChatRoom*>& rooms) {
+    std::vector<unsigned char> data;
+    if (!readFile(journalPath, data) || data.size() < 4 || !std::equal(JOURNAL_MAGIC, JOURNAL_MAGIC + 4, data.begin())) {
+        return 0;
+    }
+    const unsigned char* bytes = data.data();
+    std::size_t size = data.size();
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    unsigned long long base = 0;
+    if (!getVarint(bytes, size, pos, version) || (version != 1 && version != JOURNAL_VERSION) ||
+        !getVarint(bytes, size, pos, base)) {
+        return 0;
+    }
+    CommandJournal* installed = active;
+    active = nullptr;
+    std::size_t applied = 0;
+    while (pos < size) {
+        unsigned long long length = 0;
+        if (!getVarint(bytes, size, pos, length) || size - pos < 4 || size - pos - 4 < length) {
+            break;
+        }
+        std::uint32_t checksum = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            checksum |= static_cast<std::uint32_t>(bytes[pos++]) << shift;
+        }
+        const unsigned char* record = bytes + pos;
+        std::size_t end = static_cast<std::size_t>(length);
+        pos += end;
+        if (fnv1a(record, end) != checksum) {
+            break;
+        }
+        std::size_t at = 0;
+        unsigned long long stamp = 0;
+        unsigned long long type = 0;
+        unsigned long long first = 0;
+        unsigned long long second = 0;
+        if ((version == JOURNAL_VERSION && !getVarint(record, end, at, stamp)) || !getVarint(record, end, at, type)) {
+            break;
+        }
+        ChatRoom::pinClock(static_cast<long long>(stamp));
+        bool ok = true;
+        switch (static_cast<JournalRecord>(type)) {
+            case JournalRecord::NewUser: {
+                User* user = readSnapshotUser(record, end, at);
+                ok = user != nullptr;
+                if (ok) {
+                    users.push_back(user);
+                }
+                break;
+            }
+            case JournalRecord::NewRoom: {
+                unsigned long long kind = 0;
+                std::string name;
+                ChatRoom* room = getVarint(record, end, at, kind) && readString(record, end, at, name)
+                                 ? makeSnapshotRoom(kind, name) : nullptr;
+                ok = room != nullptr;
+                if (ok) {
+                    rooms.push_back(room);
+                }
+                break;
+            }
+            case JournalRecord::Direct: {
+                std::string text;
+                ok = getVarint(record, end, at, first) && getVarint(record, end, at, second) &&
+                     readString(record, end, at, text) && first < users.size() && second < users.size();
+                if (ok) {
+                    DirectMessageCommand(users[second]->getHandle(), users[first], Message(text)).execute();
+                }
+                break;
+            }
+            case JournalRecord::Send:
+            case JournalRecord::Log:
+            case JournalRecord::SendBatch:
+            case JournalRecord::LogBatch:
+            case JournalRecord::Join:
+            case JournalRecord::Leave: {
+                ok = getVarint(record, end, at, first) && getVarint(record, end, at, second) &&
+                     first < users.size() && second < rooms.size();
+                if (!ok) {
+                    break;
+                }
+                User* user = users[first];
+                ChatRoom* room = rooms[second];
+                JournalRecord kind = static_cast<JournalRecord>(type);
+                if (kind == JournalRecord::Join) {
+                    user->joinChatRoom(room);
+                } else if (kind == JournalRecord::Leave) {
+                    user->leaveChatRoom(room);
+                } else if (kind == JournalRecord::Send || kind == JournalRecord::Log) {
+                    std::string text;
+                    ok = readString(record, end, at, text);
+                    if (ok && kind == JournalRecord::Send) {
+                        SendMessageCommand(room, user, Message(text)).execute();
+                    } else if (ok) {
+                        LogMessageCommand(room, user, Message(text)).execute();
+                    }
+                } else {
+                    unsigned long long count = 0;
+                    std::vector<Message> batch;
+                    ok = getVarint(record, end, at, count);
+                    for (unsigned long long i = 0; ok && i < count; i++) {
+                        std::string text;
+                        ok = readString(record, end, at, text);
+                        batch.emplace_back(text);
+                    }
+                    if (ok && kind == JournalRecord::SendBatch) {
+                        SendBatchCommand(room, user, batch).execute();
+                    } else if (ok) {
+                        LogBatchCommand(room, user, batch).execute();
+                    }
+                }
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            break;
+        }
+        applied++;
+    }
+    ChatRoom::pinClock(0);
+    active = installed;
+    return applied;
+}
+
+/**
+ * @brief Restores the last snapshot and replays the journal after it
+ * @param snapshotPath Snapshot file path
+ * @param journalPath Journal file path
+ * @param users Receives the recovered users (caller owns them)
+ * @param rooms Receives the recovered rooms (caller owns them)
+ * @return true if the snapshot was loaded
+ * 
+ * The journal is only replayed if its header names this snapshot.
+ */
+bool CommandJournal::recover(const std::string& snapshotPath, const std::string& journalPath,
+                             std::vector<User*>& users, std::vector<ChatRoom*>& rooms) {
+    MappedFile snapshot(snapshotPath);
+    if (!snapshot.isOpen()) {
+        return false;
+    }
+    CommandJournal* installed = active;
+    active = nullptr;
+    std::vector<User*> recoveredUsers;
+    std::vector<ChatRoom*> recoveredRooms;
+    bool loaded = PetSpaceSnapshot::decode(snapshot.data(), snapshot.size(), recoveredUsers, recoveredRooms);
+    active = installed;
+    if (!loaded) {
+        return false;
+    }
+    std::vector<unsigned char> header;
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    unsigned long long base = 0;
+    if (readFile(journalPath, header) && header.size() >= 4 &&
+        std::equal(JOURNAL_MAGIC, JOURNAL_MAGIC + 4, header.begin()) &&
+        getVarint(header.data(), header.size(), pos, version) &&
+        getVarint(header.data(), header.size(), pos, base) &&
+        base == fnv1a(snapshot.data(), snapshot.size())) {
+        replay(journalPath, recoveredUsers, recoveredRooms);
+    }
+    users.insert(users.end(), recoveredUsers.begin(), recoveredUsers.end());
+    rooms.insert(rooms.end(), recoveredRooms.begin(), recoveredRooms.end());
+    return true;
+}
+
+// ============= extra : TRACE RECORD AND REPLAY IMPLEMENTATIONS =============
+
+namespace {
+
+const char TRACE_MAGIC[4] = {'P', 'S', 'T', 'R'};
+const unsigned int TRACE_VERSION = 1;
+const std::size_t TRACE_FLUSH_BYTES = 64 * 1024; ///< Buffered bytes before a write
+
+/**
+ * @brief Gets the snapshot state tag for a state object
+ * @param state The state (nullptr counts as Online)
+ * @return The SnapshotState tag
+ */
+unsigned long long traceStateTag(const UserState* state) {
+    std::string name = state ? state->getStateName() : "Online";
+    return name == "Offline" ? SNAPSHOT_OFFLINE : name == "Busy" ? SNAPSHOT_BUSY : SNAPSHOT_ONLINE;
+}
+
+} // namespace
+
+TraceRecorder* TraceRecorder::active = nullptr;
+
+/**
+ * @brief Creates a trace file
+ * @param path File path (truncated if it exists)
+ */
+TraceRecorder::TraceRecorder(const std::string& path)
+    : file(std::fopen(path.c_str(), "wb")), nextUserId(0), nextRoomId(0),
+      last(std::chrono::steady_clock::now()), events(0) {
+    if (!file) {
+        PETSPACE_LOG(ERROR, HISTORY, "Could not open trace ", path);
+        return;
+    }
+    buffer.assign(TRACE_MAGIC, TRACE_MAGIC + 4);
+    putVarint(buffer, TRACE_VERSION);
+}
+
+/**
+ * @brief Writes buffered events and closes the file
+ */
+TraceRecorder::~TraceRecorder() {
+    if (active == this) {
+        active = nullptr;
+    }
+    if (file) {
+        flush();
+        std::fclose(file);
+    }
+}
+
+/**
+ * @brief Makes a recorder the one the User hooks feed
+ * @param recorder The recorder, or nullptr to stop recording
+ */
+void TraceRecorder::install(TraceRecorder* recorder) {
+    active = recorder;
+}
+
+/**
+ * @brief Gets the installed recorder
+ * @return The recorder, or nullptr if none is installed
+ */
+TraceRecorder* TraceRecorder::current() {
+    return active;
+}
+
+/**
+ * @brief Checks whether the trace file is open
+ * @return true if events can be written
+ */
+bool TraceRecorder::isOpen() const {
+    return file != nullptr;
+}
+
+/**
+ * @brief Writes buffered events to the file
+ * @return true on success
+ */
+bool TraceRecorder::flush() {
+    if (!file) {
+        return false;
+    }
+    bool written = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && std::fflush(file) == 0;
+    buffer.clear();
+    return written;
+}
+
+/**
+ * @brief Gets a user's trace ID, defining the user on first sight
+ * @param user The user
+ * @return The trace ID
+ */
+unsigned long long TraceRecorder::userId(const User* user) {
+    auto it = userIds.find(user);
+    if (it != userIds.end()) {
+        return it->second;
+    }
+    begin(TraceEvent::DefineUser);
+    writeSnapshotUser(buffer, user);
+    finish();
+    userIds[user] = nextUserId;
+    return nextUserId++;
+}
+
+/**
+ * @brief Gets a room's trace ID, defining the room on first sight
+ * @param room The room
+ * @return The trace ID
+ */
+unsigned long long TraceRecorder::roomId(const ChatRoom* room) {
+    auto it = roomIds.find(room);
+    if (it != roomIds.end()) {
+        return it->second;
+    }
+    begin(TraceEvent::DefineRoom);
+    putVarint(buffer, snapshotRoomKind(room));
+    writeString(buffer, room->getRoomName());
+    finish();
+    roomIds[room] = nextRoomId;
+    return nextRoomId++;
+}
+
+/**
+ * @brief Starts an event: its type and the time since the last event
+ * @param event The event type
+ */
+void TraceRecorder::begin(TraceEvent event) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    putVarint(buffer, static_cast<unsigned long long>(event));
+    putVarint(buffer, static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(now - last).count()));
+    last = now;
+}
+
+/**
+ * @brief Completes an event, writing the buffer out once it is large
+ */
+void TraceRecorder::finish() {
+    events++;
+    if (buffer.size() >= TRACE_FLUSH_BYTES) {
+        flush();
+    }
+}
+
+/**
+ * @brief Records a join
+ * @param user The user joining
+ * @param room The room joined
+ */
+void TraceRecorder::recordJoin(const User* user, const ChatRoom* room) {
+    if (!file || !user || !room) {
+        return;
+    }
+    unsigned long long userRef = userId(user);
+    unsigned long long roomRef = roomId(room);
+    begin(TraceEvent::Join);
+    putVarint(buffer, userRef);
+    putVarint(buffer, roomRef);
+    finish();
+}
+
+/**
+ * @brief Records a leave
+ * @param user The user leaving
+ * @param room The room left
+ */
+void TraceRecorder::recordLeave(const User* user, const ChatRoom* room) {
+    if (!file || !user || !room) {
+        return;
+    }
+    unsigned long long userRef = userId(user);
+    unsigned long long roomRef = roomId(room);
+    begin(TraceEvent::Leave);
+    putVarint(buffer, userRef);
+    putVarint(buffer, roomRef);
+    finish();
+}
+
+/**
+ * @brief Records a send
+ * @param user The sender
+ * @param room The destination room
+ * @param message The message text
+ */
+void TraceRecorder::recordSend(const User* user, const ChatRoom* room, std::string_view message) {
+    if (!file || !user || !room) {
+        return;
+    }
+    unsigned long long userRef = userId(user);
+    unsigned long long roomRef = roomId(room);
+    begin(TraceEvent::Send);
+    putVarint(buffer, userRef);
+    putVarint(buffer, roomRef);
+    writeString(buffer, message);
+    finish();
+}
+
+/**
+ * @brief Records a state change
+ * @param user The user
+ * @param state The new state
+ */
+void TraceRecorder::recordState(const User* user, const UserState* state) {
+    if (!file || !user) {
+        return;
+    }
+    unsigned long long userRef = userId(user);
+    begin(TraceEvent::SetState);
+    putVarint(buffer, userRef);
+    putVarint(buffer, traceStateTag(state));
+    finish();
+}
+
+/**
+ * @brief Records a room creation call
+ * @param user The user creating the room
+ * @param name The requested name
+ * @param room The created room, or nullptr if creation failed
+ * 
+ * A created room takes the next room ID without a separate definition.
+ */
+void TraceRecorder::recordCreateRoom(const User* user, const std::string& name, const ChatRoom* room) {
+    if (!file || !user) {
+        return;
+    }
+    unsigned long long userRef = userId(user);
+    begin(TraceEvent::CreateRoom);
+    putVarint(buffer, userRef);
+    writeString(buffer, name);
+    putVarint(buffer, room ? 1 : 0);
+    finish();
+    if (room) {
+        roomIds[room] = nextRoomId++;
+    }
+}
+
+/**
+ * @brief Forgets a user being destroyed, so its address can be reused
+ * @param user The user
+ */
+void TraceRecorder::forget(const User* user) {
+    userIds.erase(user);
+}
+
+/**
+ * @brief Forgets a room being destroyed, so its address can be reused
+ * @param room The room
+ */
+void TraceRecorder::forget(const ChatRoom* room) {
+    roomIds.erase(room);
+}
+
+/**
+ * @brief Gets the number of events recorded
+ * @return The event count
+ */
+unsigned long long TraceRecorder::getEventCount() const {
+    return events;
+}
+
+/**
+ * @brief Removes members from replayed rooms and deletes everything replayed
+ */
+TraceReplayer::~TraceReplayer() {
+    clear();
+}
+
+/**
+ * @brief Deletes the users and rooms of the previous run
+ */
+void TraceReplayer::clear() {
+    for (ChatRoom* room : rooms) {
+        if (dynamic_cast<CustomChatRoom*>(room)) {
+            registry.destroy(room->getRoomName());
+            continue;
+        }
+        std::vector<User*> members(room->getUsers().begin(), room->getUsers().end());
+        for (User* member : members) {
+            member->leaveChatRoom(room);
+        }
+        delete room;
+    }
+    for (User* user : users) {
+        delete user;
+    }
+    rooms.clear();
+    users.clear();
+}
+
+/**
+ * @brief Reads a trace file
+ * @param path File written by TraceRecorder
+ * @return true if the file has a valid trace header
+ */
+bool TraceReplayer::load(const std::string& path) {
+    data.clear();
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    if (!readFile(path, data) || data.size() < 4 || !std::equal(TRACE_MAGIC, TRACE_MAGIC + 4, data.begin()) ||
+        !getVarint(data.data(), data.size(), pos, version) || version != TRACE_VERSION) {
+        data.clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Replays the loaded trace
+ * @param originalSpeed true to wait out the recorded gaps between events
+ * @return Number of events applied (replay stops at a malformed event)
+ * 
+ * Objects from a previous run are deleted first. Recording and journaling
+ * are suspended so the replay does not feed back into them.
+ */
+std::size_t TraceReplayer::run(bool originalSpeed) {
+    clear();
+    if (data.empty()) {
+        return 0;
+    }
+    TraceRecorder* recorder = TraceRecorder::current();
+    CommandJournal* journal = CommandJournal::current();
+    TraceRecorder::install(nullptr);
+    CommandJournal::install(nullptr);
+    const unsigned char* bytes = data.data();
+    std::size_t size = data.size();
+    std::size_t pos = 4;
+    unsigned long long version = 0;
+    getVarint(bytes, size, pos, version);
+    std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now();
+    std::size_t applied = 0;
+    while (pos < size) {
+        unsigned long long type = 0;
+        unsigned long long gap = 0;
+        if (!getVarint(bytes, size, pos, type) || !getVarint(bytes, size, pos, gap)) {
+            break;
+        }
+        if (originalSpeed) {
+            due += std::chrono::microseconds(gap);
+            std::this_thread::sleep_until(due);
+        }
+        bool ok = true;
+        unsigned long long userRef = 0;
+        unsigned long long roomRef = 0;
+        switch (static_cast<TraceEvent>(type)) {
+            case TraceEvent::DefineUser: {
+                User* user = readSnapshotUser(bytes, size, pos);
+                ok = user != nullptr;
+                if (ok) {
+                    users.push_back(user);
+                }
+                break;
+            }
+            case TraceEvent::DefineRoom: {
+                unsigned long long kind = 0;
+                std::string name;
+                ChatRoom* room = getVarint(bytes, size, pos, kind) && readString(bytes, size, pos, name)
+                                 ? makeSnapshotRoom(kind, name, registry) : nullptr;
+                ok = room != nullptr;
+                if (ok) {
+                    rooms.push_back(room);
+                }
+                break;
+            }
+            case TraceEvent::Join:
+            case TraceEvent::Leave:
+            case TraceEvent::Send: {
+                std::string text;
+                TraceEvent event = static_cast<TraceEvent>(type);
+                ok = getVarint(bytes, size, pos, userRef) && getVarint(bytes, size, pos, roomRef) &&
+                     userRef < users.size() && roomRef < rooms.size() &&
+                     (event != TraceEvent::Send || readString(bytes, size, pos, text));
+                if (!ok) {
+                    break;
+                }
+                if (event == TraceEvent::Join) {
+                    users[userRef]->joinChatRoom(rooms[roomRef]);
+                } else if (event == TraceEvent::Leave) {
+                    users[userRef]->leaveChatRoom(rooms[roomRef]);
+                } else {
+                    users[userRef]->send(text, rooms[roomRef]);
+                }
+                break;
+            }
+            case TraceEvent::SetState: {
+                unsigned long long state = 0;
+                ok = getVarint(bytes, size, pos, userRef) && getVarint(bytes, size, pos, state) &&
+                     userRef < users.size();
+                if (ok) {
+                    users[userRef]->setState(state == SNAPSHOT_OFFLINE ? static_cast<UserState*>(new Offline()) :
+                                             state == SNAPSHOT_BUSY ? static_cast<UserState*>(new Busy()) :
+                                             static_cast<UserState*>(new Online()));
+                }
+                break;
+            }
+            case TraceEvent::CreateRoom: {
+                std::string name;
+                unsigned long long created = 0;
+                ok = getVarint(bytes, size, pos, userRef) && readString(bytes, size, pos, name) &&
+                     getVarint(bytes, size, pos, created) && userRef < users.size();
+                if (!ok) {
+                    break;
+                }
+                ChatRoom* room = users[userRef]->createChatRoom(name, registry);
+                if (created && !room) {
+                    PETSPACE_LOG(WARN, ADMIN, "Trace replay diverged: creating room ", name, " succeeded when recorded but failed now");
+                    ok = false;
+                } else if (created) {
+                    rooms.push_back(room);
+                } else if (room) {
+                    // The recorded attempt failed, so the room must not exist in the replay either
+                    registry.destroy(name);
+                }
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            break;
+        }
+        applied++;
+    }
+    TraceRecorder::install(recorder);
+    CommandJournal::install(journal);
+    return applied;
+}
+
+/**
+ * @brief Gets the users created by the last run
+ * @return Users in trace ID order
+ */
+const std::vector<User*>& TraceReplayer::getUsers() const {
+    return users;
+}
+
+/**
+ * @brief Gets the rooms created by the last run
+ * @return Rooms in trace ID order (nullptr where creation failed)
+ */
+const std::vector<ChatRoom*>& TraceReplayer::getRooms() const {
+    return rooms;
+}
+
+// ============= extra : PRESENCE IMPLEMENTATIONS =============
+
+PresenceHub* PresenceHub::active = nullptr;
+
+/**
+ * @brief Constructs a hub with no subscriptions
+ */
+PresenceHub::PresenceHub() : changes(0), delivered(0), suppressed(0) {
+}
+
+/**
+ * @brief Uninstalls the hub if it is still installed
+ */
+PresenceHub::~PresenceHub() {
+    if (active == this) {
+        active = nullptr;
+    }
+}
+
+/**
+ * @brief Makes a hub the one User::setState() reports to
+ * @param hub The hub, or nullptr to stop tracking presence
+ */
+void PresenceHub::install(PresenceHub* hub) {
+    active = hub;
+}
+
+/**
+ * @brief Gets the installed hub
+ * @return The hub, or nullptr if none is installed
+ */
+PresenceHub* PresenceHub::current() {
+    return active;
+}
+
+/**
+ * @brief Subscribes a user to the presence of a room's members
+ * @param subscriber The user to notify
+ * @param room The room to watch
+ */
+void PresenceHub::subscribe(User* subscriber, ChatRoom* room) {
+    if (!subscriber || !room) {
+        return;
+    }
+    std::vector<unsigned int>& watchers = subscribers[room];
+    if (std::find(watchers.begin(), watchers.end(), subscriber->getHandle()) == watchers.end()) {
+        watchers.push_back(subscriber->getHandle());
+        watching[subscriber->getHandle()].push_back(room);
+    }
+}
+
+namespace {
+
+/**
+ * @brief Removes one value from a vector-valued map entry, dropping the entry once empty
+ * @param map The map
+ * @param key The entry's key
+ * @param value The value to remove
+ */
+template <typename Map, typename Value>
+void eraseFromEntry(Map& map, const typename Map::key_type& key, const Value& value) {
+    auto it = map.find(key);
+    if (it == map.end()) {
+        return;
+    }
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), value), it->second.end());
+    if (it->second.empty()) {
+        map.erase(it);
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Cancels a subscription
+ * @param subscriber The subscribed user
+ * @param room The watched room
+ */
+void PresenceHub::unsubscribe(User* subscriber, ChatRoom* room) {
+    if (!subscriber) {
+        return;
+    }
+    eraseFromEntry(subscribers, room, subscriber->getHandle());
+    eraseFromEntry(watching, subscriber->getHandle(), static_cast<const ChatRoom*>(room));
+}
+
+/**
+ * @brief Records that a user's state changed
+ * @param user The user
+ * @param previous Name of the state the user left
+ * 
+ * Only the first change in a tick records a baseline, so any number of
+ * further flaps cost a single hash lookup each.
+ */
+void PresenceHub::markChanged(const User* user, const std::string& previous) {
+    if (!user) {
+        return;
+    }
+    changes++;
+    if (baseline.emplace(user->getHandle(), previous).second) {
+        dirty.push_back(user->getHandle());
+    }
+}
+
+/**
+ * @brief Delivers one coalesced batch to every affected subscriber
+ * @return Number of batches delivered
+ * 
+ * Subscribers are resolved by handle, so users deleted since they
+ * subscribed or changed state are skipped.
+ */
+std::size_t PresenceHub::tick() {
+    std::vector<unsigned int> changed;
+    std::unordered_map<unsigned int, std::string> started;
+    changed.swap(dirty);
+    started.swap(baseline);
+    std::unordered_map<unsigned int, std::vector<PresenceUpdate>> pending;
+    std::vector<unsigned int> order;
+    for (unsigned int handle : changed) {
+        User* user = UserDirectory::find(handle);
+        if (!user || !user->getState()) {
+            continue;
+        }
+        std::string state = user->getState()->getStateName();
+        if (state == started[handle]) {
+            suppressed++;
+            continue;
+        }
+        PresenceUpdate update{handle, user->getName(), state};
+        for (ChatRoom* room : user->getChatRooms()) {
+            auto it = subscribers.find(room);
+            if (it == subscribers.end()) {
+                continue;
+            }
+            for (unsigned int watcher : it->second) {
+                if (watcher == handle) {
+                    continue;
+                }
+                std::vector<PresenceUpdate>& batch = pending[watcher];
+                // A roommate sharing several rooms with the watcher is reported once
+                if (!batch.empty() && batch.back().handle == handle) {
+                    continue;
+                }
+                if (batch.empty()) {
+                    order.push_back(watcher);
+                }
+                batch.push_back(update);
+            }
+        }
+    }
+    std::size_t batches = 0;
+    for (unsigned int watcher : order) {
+        User* subscriber = UserDirectory::find(watcher);
+        if (subscriber) {
+            delivered += pending[watcher].size();
+            subscriber->receivePresence(pending[watcher]);
+            batches++;
+        }
+    }
+    return batches;
+}
+
+/**
+ * @brief Drops a room that is being destroyed
+ * @param room The room
+ */
+void PresenceHub::forget(const ChatRoom* room) {
+    auto it = subscribers.find(room);
+    if (it == subscribers.end()) {
+        return;
+    }
+    for (unsigned int watcher : it->second) {
+        eraseFromEntry(watching, watcher, room);
+    }
+    subscribers.erase(it);
+}
+
+/**
+ * @brief Drops a user that is being destroyed
+ * @param user The user
+ * 
+ * Handles are reused, so a later user must not inherit the old one's
+ * subscriptions or pending change. Only the user's own rooms are visited.
+ */
+void PresenceHub::forget(const User* user) {
+    unsigned int handle = user->getHandle();
+    auto rooms = watching.find(handle);
+    if (rooms != watching.end()) {
+        for (const ChatRoom* room : rooms->second) {
+            eraseFromEntry(subscribers, room, handle);
+        }
+        watching.erase(rooms);
+    }
+    if (baseline.erase(handle)) {
+        dirty.erase(std::remove(dirty.begin(), dirty.end(), handle), dirty.end());
+    }
+}
+
+/**
+ * @brief Gets the number of users waiting for the next tick
+ * @return The dirty user count
+ */
+std::size_t PresenceHub::getDirtyCount() const {
+    return dirty.size();
+}
+
+/**
+ * @brief Gets the number of state changes seen
+ * @return The change count
+ */
+unsigned long long PresenceHub::getChangeCount() const {
+    return changes;
+}
+
+/**
+ * @brief Gets the number of updates delivered to subscribers
+ * @return The delivered update count
+ */
+unsigned long long PresenceHub::getDeliveredCount() const {
+    return delivered;
+}
+
+/**
+ * @brief Gets the number of dirty users dropped for ending where they started
+ * @return The suppressed count
+ */
+unsigned long long PresenceHub::getSuppressedCount() const {
+    return suppressed;
+}
+
+// ============= extra : LAZY RENDERING IMPLEMENTATIONS =============
+
+/**
+ * @brief Wraps a message sent in a room
+ * @param room The room
+ * @param sender The sending user
+ * @param payload The message content
+ */
+MessageEnvelope::MessageEnvelope(ChatRoom* room, User* sender, const Message& payload)
+    : room(room), sender(sender), roomId(room ? room->getRoomId() : 0),
+      senderHandle(sender ? sender->getHandle() : 0), payload(payload), isRendered(false) {
+}
+
+/**
+ * @brief Gets the room the message was sent in
+ * @return The room
+ */
+ChatRoom* MessageEnvelope::getRoom() const {
+    return room;
+}
+
+/**
+ * @brief Gets the sender
+ * @return The sending user
+ */
+User* MessageEnvelope::getSender() const {
+    return sender;
+}
+
+/**
+ * @brief Gets the room's ID
+ * @return The room ID
+ */
+unsigned int MessageEnvelope::getRoomId() const {
+    return roomId;
+}
+
+/**
+ * @brief Gets the sender's handle
+ * @return The sender handle
+ */
+unsigned int MessageEnvelope::getSenderHandle() const {
+    return senderHandle;
+}
+
+/**
+ * @brief Gets the message content
+ * @return The payload
+ */
+const Message& MessageEnvelope::getPayload() const {
+    return payload;
+}
+
+/**
+ * @brief Writes the display form into a buffer
+ * @param buffer Destination (may be nullptr when capacity is 0)
+ * @param capacity Size of the buffer in bytes
+ * @return Length of the full display form, excluding the terminator
+ */
+std::size_t MessageEnvelope::render(char* buffer, std::size_t capacity) const {
+    std::string roomName = room ? room->getRoomName() : std::string();
+    std::string senderName = sender ? sender->getName() : std::string();
+    const std::string_view parts[] = {"[", roomName, "] ", senderName, ": ", payload.view()};
+    std::size_t length = 0;
+    for (std::string_view part : parts) {
+        if (length < capacity) {
+            std::size_t count = std::min(part.size(), capacity - 1 - length);
+            std::memcpy(buffer + length, part.data(), count);
+            if (count < part.size()) {
+                buffer[length + count] = '\0';
+                capacity = length + count;
+            }
+        }
+        length += part.size();
+    }
+    if (length < capacity) {
+        buffer[length] = '\0';
+    }
+    return length;
+}
+
+/**
+ * @brief Gets the display form, rendering it on first use
+ * @return "[Room] name: msg"
+ */
+std::string_view MessageEnvelope::view() const {
+    if (!isRendered) {
+        rendered.resize(render(nullptr, 0));
+        render(&rendered[0], rendered.size() + 1);
+        isRendered = true;
+    }
+    return rendered;
+}
+
+/**
+ * @brief Checks whether the display form has been built
+ * @return true once view() has rendered it
+ */
+bool MessageEnvelope::hasRendered() const {
+    return isRendered;
+}
+
+// ============= extra : LOGGING IMPLEMENTATIONS =============
+
+/**
+ * @brief Checks whether the console accepts output
+ * @return true unless std::cout is in a failed state
+ */
+bool Logger::enabled() {
+    return std::cout.good();
+}
+
+/**
+ * @brief Gets this thread's line buffer, emptied
+ * @return The buffer
+ */
+std::string& Logger::begin() {
+    thread_local std::string line;
+    line.clear();
+    return line;
+}
+
+/**
+ * @brief Terminates a line and writes it to the console
+ * @param line The finished line
+ */
+void Logger::end(std::string& line) {
+    line += '\n';
+    std::cout.write(line.data(), static_cast<std::streamsize>(line.size()));
+    std::cout.flush();
+}
+
+/**
+ * @brief Appends a signed integer in decimal
+ * @param line The line being built
+ * @param value The integer
+ */
+void Logger::appendSigned(std::string& line, long long value) {
+    char digits[24];
+    char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    line.append(digits, static_cast<std::size_t>(end - digits));
+}
+
+/**
+ * @brief Appends an unsigned integer in decimal
+ * @param line The line being built
+ * @param value The integer
+ */
+void Logger::appendUnsigned(std::string& line, unsigned long long value) {
+    char digits[24];
+    char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    line.append(digits, static_cast<std::size_t>(end - digits));
+}
+
+// ============= extra : INBOX IMPLEMENTATIONS =============
+
+/**
+ * @brief Attaches an inbox that is fed every message the user receives
+ * @param userInbox The inbox, or nullptr to detach
+ */
+void User::setInbox(UserInbox* userInbox) {
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        inbox = userInbox;
+    }
+    UserTable::refresh(this);
+}
+
+/**
+ * @brief Gets the attached inbox
+ * @return The inbox, or nullptr if none is attached
+ */
+UserInbox* User::getInbox() const {
+    std::lock_guard<std::mutex> guard(inboxLock);
+    return inbox;
+}
+
+/**
+ * @brief Queues a received message in the attached inbox, if any
+ * @param message The message content
+ * @param fromUser Pointer to the user who sent the message
+ * @param room Pointer to the chat room, or nullptr for a direct message
+ * @param mention Whether the message mentions this user
+ */
+void User::deliverToInbox(const Message& message, const User* fromUser, const ChatRoom* room, bool mention) {
+    if (!fromUser) {
+        return;
+    }
+    // Held across the push: lock order is User::inboxLock, then UserInbox::lock
+    std::lock_guard<std::mutex> guard(inboxLock);
+    if (inbox) {
+        inbox->push(InboxMessage{message, fromUser->getHandle(), room ? room->getRoomId() : 0, mention});
+    }
+}
+
+/**
+ * @brief Constructs an empty loop
+ */
+EventLoop::EventLoop() : completed(0) {
+}
+
+/**
+ * @brief Queues a continuation
+ * @param callback Function to call
+ * @param argument Argument passed to the function
+ */
+void EventLoop::post(Callback callback, void* argument) {
+    std::lock_guard<std::mutex> guard(lock);
+    ready.emplace_back(callback, argument);
+}
+
+/**
+ * @brief Runs one queued continuation
+ * @return false if nothing was queued
+ * 
+ * The continuation runs without the lock held, so it may post more work.
+ */
+bool EventLoop::runOne() {
+    std::pair<Callback, void*> next;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ready.empty()) {
+            return false;
+        }
+        next = ready.front();
+        ready.pop_front();
+        completed++;
+    }
+    next.first(next.second);
+    return true;
+}
+
+/**
+ * @brief Runs continuations until none are queued
+ * @return Number of continuations run
+ */
+std::size_t EventLoop::run() {
+    std::size_t count = 0;
+    while (runOne()) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Gets the number of queued continuations
+ * @return The queue length
+ */
+std::size_t EventLoop::pending() {
+    std::lock_guard<std::mutex> guard(lock);
+    return ready.size();
+}
+
+/**
+ * @brief Gets the number of continuations run so far
+ * @return The completed count
+ */
+unsigned long long EventLoop::getCompletedCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return completed;
+}
+
+/**
+ * @brief Attaches an inbox to a user
+ * @param user The user
+ * @param eventLoop Loop that resumes waiting consumers
+ */
+UserInbox::UserInbox(User* user, EventLoop& eventLoop)
+    : owner(user), loop(eventLoop), waiter(nullptr), waiterArgument(nullptr), closed(false), queuedBytes(0),
+      trimmed(0) {
+    if (owner) {
+        owner->setInbox(this);
+    }
+}
+
+/**
+ * @brief Detaches the inbox from its user
+ * 
+ * A waiting consumer is not woken; close() and run the loop first if one
+ * may still be suspended on this inbox.
+ */
+UserInbox::~UserInbox() {
+    User* user = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        user = owner;
+        owner = nullptr;
+    }
+    // Outside our lock (see User::deliverToInbox); waits out a push in progress
+    if (user) {
+        user->setInbox(nullptr);
+    }
+}
+
+/**
+ * @brief Posts the waiting consumer to the event loop
+ * @param held The inbox lock, released before posting
+ */
+void UserInbox::wake(std::unique_lock<std::mutex>& held) {
+    EventLoop::Callback callback = waiter;
+    void* argument = waiterArgument;
+    waiter = nullptr;
+    waiterArgument = nullptr;
+    held.unlock();
+    if (callback) {
+        loop.post(callback, argument);
+    }
+}
+
+/**
+ * @brief Queues a message and wakes the waiting consumer
+ * @param message The message
+ */
+void UserInbox::push(const InboxMessage& message) {
+    std::unique_lock<std::mutex> held(lock);
+    if (closed) {
+        return;
+    }
+    messages.push_back(message);
+    queuedBytes += sizeof(InboxMessage) + message.text.size();
+    // Keep the newest messages when the owner's mailbox cap is exceeded
+    std::size_t cap = owner ? owner->getMailboxMemoryCap() : 0;
+    while (cap && queuedBytes > cap && messages.size() > 1) {
+        queuedBytes -= sizeof(InboxMessage) + messages.front().text.size();
+        messages.pop_front();
+        trimmed++;
+    }
+    wake(held);
+}
+
+/**
+ * @brief Takes the oldest message without waiting
+ * @param out Receives the message
+ * @return false if the inbox is empty
+ */
+bool UserInbox::tryPop(InboxMessage& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (messages.empty()) {
+        return false;
+    }
+    out = std::move(messages.front());
+    messages.pop_front();
+    queuedBytes -= sizeof(InboxMessage) + out.text.size();
+    return true;
+}
+
+/**
+ * @brief Takes up to a number of messages without waiting
+ * @param out Receives the messages, oldest first
+ * @param max Most messages to take
+ * @return Number of messages taken
+ */
+std::size_t UserInbox::drain(std::vector<InboxMessage>& out, std::size_t max) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t count = std::min(max, messages.size());
+    for (std::size_t i = 0; i < count; i++) {
+        queuedBytes -= sizeof(InboxMessage) + messages[i].text.size();
+    }
+    std::move(messages.begin(), messages.begin() + count, std::back_inserter(out));
+    messages.erase(messages.begin(), messages.begin() + count);
+    return count;
+}
+
+/**
+ * @brief Takes up to max messages, or registers a continuation to run when one arrives
+ * @param out Receives the messages, oldest first
+ * @param max Most messages to take
+ * @param callback Continuation posted to the event loop on arrival or close
+ * @param argument Argument for the continuation
+ * @return true if messages were taken or the inbox is closed; false if the continuation was registered
+ * 
+ * Checking and registering happen under one lock, so a message pushed in
+ * between cannot be missed.
+ */
+bool UserInbox::drainOrWait(std::vector<InboxMessage>& out, std::size_t max, EventLoop::Callback callback,
+                            void* argument) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!messages.empty() && max > 0) {
+        std::size_t count = std::min(max, messages.size());
+        for (std::size_t i = 0; i < count; i++) {
+            queuedBytes -= sizeof(InboxMessage) + messages[i].text.size();
+        }
+        std::move(messages.begin(), messages.begin() + count, std::back_inserter(out));
+        messages.erase(messages.begin(), messages.begin() + count);
+        return true;
+    }
+    if (closed) {
+        return true;
+    }
+    waiter = callback;
+    waiterArgument = argument;
+    return false;
+}
+
+/**
+ * @brief Stops accepting messages and wakes the waiting consumer
+ */
+void UserInbox::close() {
+    User* user = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        user = owner;
+        owner = nullptr;
+        closed = true;
+    }
+    if (user) {
+        user->setInbox(nullptr);
+    }
+    std::unique_lock<std::mutex> held(lock);
+    wake(held);
+}
+
+/**
+ * @brief Checks whether the inbox was closed
+ * @return true once close() has been called
+ */
+bool UserInbox::isClosed() {
+    std::lock_guard<std::mutex> guard(lock);
+    return closed;
+}
+
+/**
+ * @brief Gets the number of queued messages
+ * @return The queue length
+ */
+std::size_t UserInbox::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return messages.size();
+}
+
+// ============= extra : WORK STEALING IMPLEMENTATIONS =============
+
+namespace {
+
+thread_local WorkStealingExecutor* workerExecutor = nullptr; ///< Executor the calling thread works for
+thread_local std::size_t workerIndex = 0;                    ///< The calling worker's deque
+
+}
+
+/**
+ * @brief Gets the lock held while a command sends or saves in this room
+ * @return The room's delivery lock
+ */
+std::mutex& ChatRoom::getDeliveryLock() {
+    return deliveryLock;
+}
+
+/**
+ * @brief Allocates a ring of empty slots
+ * @param size Slot count (a power of two)
+ */
+WorkStealingDeque::Ring::Ring(long long size) : capacity(size), slots(new std::atomic<User*>[size]) {
+    for (long long i = 0; i < size; i++) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Frees the slots
+ */
+WorkStealingDeque::Ring::~Ring() {
+    delete[] slots;
+}
+
+/**
+ * @brief Reads the slot for a position
+ * @param position Unbounded deque position
+ * @return The stored user
+ */
+User* WorkStealingDeque::Ring::get(long long position) const {
+    return slots[position & (capacity - 1)].load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Writes the slot for a position
+ * @param position Unbounded deque position
+ * @param user The user to store
+ */
+void WorkStealingDeque::Ring::put(long long position, User* user) {
+    slots[position & (capacity - 1)].store(user, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Constructs an empty deque
+ */
+WorkStealingDeque::WorkStealingDeque() : top(0), bottom(0), ring(new Ring(64)) {
+}
+
+/**
+ * @brief Frees the current and outgrown rings
+ */
+WorkStealingDeque::~WorkStealingDeque() {
+    delete ring.load(std::memory_order_relaxed);
+    for (Ring* old : retired) {
+        delete old;
+    }
+}
+
+/**
+ * @brief Pushes a user at the bottom (owner only)
+ * @param user The user
+ */
+void WorkStealingDeque::push(User* user) {
+    long long b = bottom.load(std::memory_order_relaxed);
+    long long t = top.load(std::memory_order_acquire);
+    Ring* current = ring.load(std::memory_order_relaxed);
+    if (b - t > current->capacity - 1) {
+        Ring* bigger = new Ring(current->capacity * 2);
+        for (long long i = t; i < b; i++) {
+            bigger->put(i, current->get(i));
+        }
+        retired.push_back(current);
+        ring.store(bigger, std::memory_order_release);
+        current = bigger;
+    }
+    current->put(b, user);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Pops the newest user from the bottom (owner only)
+ * @return The user, or nullptr if the deque is empty
+ * 
+ * Only the last entry can race with a thief; the CAS on top settles it.
  */
-void CtrlCat::sendMessage(const std::string& message, User* fromUser) {
-    std::cout << "[CtrlCat] " << fromUser->getName() << ": " << message << std::endl;
-    for (User* user : users) {
-        if (user != fromUser) {
-            user->receive(message, fromUser, this);
+User* WorkStealingDeque::pop() {
+    long long b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring* current = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    User* user = current->get(b);
+    if (t == b) {
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            user = nullptr;
         }
+        bottom.store(b + 1, std::memory_order_relaxed);
     }
+    return user;
 }
 
 /**
- * @brief Saves a message to the CtrlCat room's history
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
+ * @brief Steals the oldest user from the top (any thread)
+ * @return The user, or nullptr if the deque is empty or the race was lost
+ */
+User* WorkStealingDeque::steal() {
+    long long t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    User* user = ring.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return user;
+}
+
+/**
+ * @brief Gets an estimate of the number of queued users
+ * @return The approximate size
+ */
+std::size_t WorkStealingDeque::size() const {
+    long long b = bottom.load(std::memory_order_relaxed);
+    long long t = top.load(std::memory_order_relaxed);
+    return b > t ? static_cast<std::size_t>(b - t) : 0;
+}
+
+/**
+ * @brief Starts the worker threads
+ * @param workerCount Number of workers (at least one)
+ * @param commandsPerTask Most commands a task runs before yielding the user
+ */
+WorkStealingExecutor::WorkStealingExecutor(std::size_t workerCount, std::size_t commandsPerTask)
+    : batchSize(std::max<std::size_t>(1, commandsPerTask)), stopping(false), outstanding(0), queued(0),
+      sleeping(0), tasks(0), commands(0), steals(0) {
+    workerCount = std::max<std::size_t>(1, workerCount);
+    for (std::size_t i = 0; i < workerCount; i++) {
+        deques.push_back(new WorkStealingDeque());
+    }
+    for (std::size_t i = 0; i < workerCount; i++) {
+        workers.emplace_back(&WorkStealingExecutor::workerLoop, this, i);
+    }
+}
+
+/**
+ * @brief Finishes all queued work and stops the workers
+ */
+WorkStealingExecutor::~WorkStealingExecutor() {
+    waitIdle();
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (WorkStealingDeque* deque : deques) {
+        delete deque;
+    }
+}
+
+/**
+ * @brief Makes sure a task will drain the user's queue
+ * @param user The user with queued commands
+ * 
+ * Does nothing if the user already has a task queued or running; that
+ * task re-checks the queue before it lets the user go.
+ */
+void WorkStealingExecutor::schedule(User* user) {
+    if (!user || user->scheduled.exchange(true)) {
+        return;
+    }
+    outstanding++;
+    submit(user);
+}
+
+/**
+ * @brief Hands a scheduled user to a worker
+ * @param user The user
+ * 
+ * Workers push onto their own deque; other threads use the shared queue.
+ * The task is counted before it is pushed, so a parked worker's check of
+ * the count can never miss it. Only wakes a worker if one is parked.
+ */
+void WorkStealingExecutor::submit(User* user) {
+    queued++;
+    if (workerExecutor == this) {
+        deques[workerIndex]->push(user);
+    } else {
+        std::lock_guard<std::mutex> guard(injectLock);
+        injected.push_back(user);
+    }
+    if (sleeping.load() > 0) {
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+        }
+        wakeup.notify_one();
+    }
+}
+
+/**
+ * @brief Finds the next user for a worker
+ * @param index The worker
+ * @return A user, or nullptr if there is no work anywhere
+ * 
+ * Own deque first, then the shared queue, then the other workers.
+ */
+User* WorkStealingExecutor::findWork(std::size_t index) {
+    if (User* user = deques[index]->pop()) {
+        queued--;
+        return user;
+    }
+    {
+        std::lock_guard<std::mutex> guard(injectLock);
+        if (!injected.empty()) {
+            User* user = injected.front();
+            injected.pop_front();
+            queued--;
+            return user;
+        }
+    }
+    for (std::size_t i = 1; i < deques.size(); i++) {
+        if (User* user = deques[(index + i) % deques.size()]->steal()) {
+            queued--;
+            steals++;
+            return user;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Runs one task and reschedules the user if commands remain
+ * @param user The user
+ * 
+ * The flag is cleared before the queue is re-checked, so a command queued
+ * meanwhile is either seen here or schedules a fresh task.
+ */
+void WorkStealingExecutor::runTask(User* user) {
+    commands += user->drainCommands(batchSize);
+    tasks++;
+    user->scheduled.store(false);
+    if (user->getQueuedCommandCount() > 0 && !user->scheduled.exchange(true)) {
+        submit(user);
+        return;
+    }
+    if (--outstanding == 0) {
+        std::lock_guard<std::mutex> guard(idleLock);
+        idle.notify_all();
+    }
+}
+
+/**
+ * @brief Runs tasks until the executor stops
+ * @param index The worker
+ * 
+ * An idle worker registers as sleeping before it re-checks the queued
+ * count, and submit bumps the count before it looks for sleepers, so one
+ * of the two always sees the other and the worker can park indefinitely.
+ */
+void WorkStealingExecutor::workerLoop(std::size_t index) {
+    workerExecutor = this;
+    workerIndex = index;
+    for (;;) {
+        if (User* user = findWork(index)) {
+            runTask(user);
+            continue;
+        }
+        std::unique_lock<std::mutex> held(idleLock);
+        sleeping++;
+        wakeup.wait(held, [this]() { return stopping || queued.load() > 0; });
+        sleeping--;
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Blocks until no user has a task queued or running
+ */
+void WorkStealingExecutor::waitIdle() {
+    std::unique_lock<std::mutex> held(idleLock);
+    idle.wait(held, [this]() { return outstanding.load() == 0; });
+}
+
+/**
+ * @brief Gets the number of worker threads
+ * @return The worker count
+ */
+std::size_t WorkStealingExecutor::getWorkerCount() const {
+    return workers.size();
+}
+
+/**
+ * @brief Gets the number of tasks run
+ * @return The task count
+ */
+unsigned long long WorkStealingExecutor::getTaskCount() const {
+    return tasks.load();
+}
+
+/**
+ * @brief Gets the number of commands run
+ * @return The command count
+ */
+unsigned long long WorkStealingExecutor::getCommandCount() const {
+    return commands.load();
+}
+
+/**
+ * @brief Gets the number of tasks stolen from another worker
+ * @return The steal count
+ */
+unsigned long long WorkStealingExecutor::getStealCount() const {
+    return steals.load();
+}
+
+// ============= extra : RING MAILBOX IMPLEMENTATIONS =============
+
+std::atomic<unsigned long long> RingMailbox::nextId(1);
+
+namespace {
+
+const std::chrono::milliseconds MAILBOX_BLOCK_LIMIT(2); ///< Longest a room waits on a full ring under OverflowPolicy::Block
+
+}
+
+/**
+ * @brief Finds this room's ring in a member's mailbox
+ * @param user The member
+ * @param mailbox The member's mailbox
+ * @return The ring, created on first delivery
+ * 
+ * The cache is keyed by member and checked against the mailbox ID, so a
+ * replaced mailbox is never handed a stale ring.
+ */
+MailboxShard* ChatRoom::shardFor(const User* user, RingMailbox* mailbox) {
+    std::pair<unsigned long long, MailboxShard*>& cached = mailboxShards[user];
+    if (cached.first != mailbox->getId()) {
+        cached = std::make_pair(mailbox->getId(), mailbox->shardFor(this));
+    }
+    return cached.second;
+}
+
+/**
+ * @brief Switches room delivery to this user over to ring mailboxes
+ * @param userMailbox The mailbox, or nullptr to go back to synchronous delivery
+ */
+void User::setMailbox(RingMailbox* userMailbox) {
+    mailbox = userMailbox;
+    UserTable::refresh(this);
+}
+
+/**
+ * @brief Gets the attached ring mailbox
+ * @return The mailbox, or nullptr if none is attached
+ */
+RingMailbox* User::getMailbox() const {
+    return mailbox;
+}
+
+/**
+ * @brief Hands queued mailbox messages to the current state in one batch
+ * @param maxMessages Most messages to take
+ * @return Number of messages consumed
+ */
+std::size_t User::drainMailbox(std::size_t maxMessages) {
+    if (!mailbox) {
+        return 0;
+    }
+    std::vector<InboxMessage> taken;
+    mailbox->drain(taken, maxMessages);
+    std::vector<Message> batch;
+    for (std::size_t i = 0; i < taken.size();) {
+        unsigned int sender = taken[i].sender;
+        unsigned int roomId = taken[i].roomId;
+        User* fromUser = UserDirectory::find(sender);
+        ChatRoom* room = nullptr;
+        for (ChatRoom* joined : chatRooms) {
+            if (joined->getRoomId() == roomId) {
+                room = joined;
+            }
+        }
+        // A room left since the message was queued no longer delivers to this user
+        bool current = roomId == 0 || room;
+        if (taken[i].mention) {
+            if (current) {
+                receiveMention(taken[i].text, fromUser, room);
+            }
+            i++;
+            continue;
+        }
+        batch.clear();
+        while (i < taken.size() && !taken[i].mention && taken[i].sender == sender && taken[i].roomId == roomId) {
+            batch.push_back(std::move(taken[i].text));
+            i++;
+        }
+        if (current) {
+            receiveBatch(batch, fromUser, room);
+        }
+    }
+    return taken.size();
+}
+
+/**
+ * @brief Allocates the ring
+ * @param capacity Minimum number of slots (rounded up to a power of two)
+ */
+SpscRing::SpscRing(std::size_t capacity) : mask(0), slots(nullptr), head(0), cachedTail(0), tail(0), cachedHead(0) {
+    std::size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    mask = size - 1;
+    slots = new Slot[size];
+}
+
+/**
+ * @brief Frees the slots and any queued messages
+ */
+SpscRing::~SpscRing() {
+    delete[] slots;
+}
+
+/**
+ * @brief Appends a delivery (producer only)
+ * @param text The message
+ * @param sender Handle of the sender
+ * @param mention Whether the message mentions the receiver
+ * @return false if the ring is full
+ */
+bool SpscRing::tryPush(const Message& text, unsigned int sender, bool mention) {
+    std::size_t position = tail.load(std::memory_order_relaxed);
+    if (position - cachedHead > mask) {
+        cachedHead = head.load(std::memory_order_acquire);
+        if (position - cachedHead > mask) {
+            return false;
+        }
+    }
+    Slot& slot = slots[position & mask];
+    slot.text = text;
+    slot.sender = sender;
+    slot.mention = mention;
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Takes up to a number of deliveries (consumer only)
+ * @param out Receives the deliveries, oldest first
+ * @param max Most deliveries to take
+ * @param roomId Room ID stamped on each delivery
+ * @return Number of deliveries taken
+ * 
+ * Taken slots are cleared so their message buffers are released before
+ * head is published.
+ */
+std::size_t SpscRing::popBatch(std::vector<InboxMessage>& out, std::size_t max, unsigned int roomId) {
+    std::size_t position = head.load(std::memory_order_relaxed);
+    if (cachedTail - position < max) {
+        cachedTail = tail.load(std::memory_order_acquire);
+    }
+    std::size_t count = std::min(max, cachedTail - position);
+    for (std::size_t i = 0; i < count; i++) {
+        Slot& slot = slots[(position + i) & mask];
+        out.push_back(InboxMessage{std::move(slot.text), slot.sender, roomId, slot.mention});
+        slot.text = Message();
+    }
+    if (count) {
+        head.store(position + count, std::memory_order_release);
+    }
+    return count;
+}
+
+/**
+ * @brief Gets the number of queued deliveries
+ * @return The approximate size
+ */
+std::size_t SpscRing::size() const {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Gets the number of slots
+ * @return The capacity
+ */
+std::size_t SpscRing::capacity() const {
+    return mask + 1;
+}
+
+/**
+ * @brief Creates an empty shard
+ * @param room ID of the producing room
+ * @param capacity Slots in the ring
+ */
+MailboxShard::MailboxShard(unsigned int room, std::size_t capacity) : roomId(room), ring(capacity), spilling(false) {
+}
+
+/**
+ * @brief Attaches a mailbox to a user
+ * @param user The user
+ * @param capacity Slots per room ring
+ * @param overflow What to do when a ring is full
+ */
+RingMailbox::RingMailbox(User* user, std::size_t capacity, OverflowPolicy overflow)
+    : id(nextId++), owner(user), ringCapacity(std::max<std::size_t>(2, capacity)), policy(overflow),
+      shared(new MailboxShard(0, 2)), nextShard(0), delivered(0), rejected(0), spilled(0), blocked(0), queuedBytes(0) {
+    // Its ring stays empty, so drain() reads the list whenever it is flagged
+    shards.push_back(shared);
+    if (user) {
+        user->setMailbox(this);
+    }
+}
+
+/**
+ * @brief Detaches the mailbox and frees its rings
+ */
+RingMailbox::~RingMailbox() {
+    User* user = owner.load();
+    if (user && user->getMailbox() == this) {
+        user->setMailbox(nullptr);
+    }
+    for (MailboxShard* shard : shards) {
+        delete shard;
+    }
+}
+
+/**
+ * @brief Forgets the owner, which is being destroyed
+ */
+void RingMailbox::detach() {
+    owner = nullptr;
+}
+
+/**
+ * @brief Gets the mailbox's process-unique ID
+ * @return The ID
+ */
+unsigned long long RingMailbox::getId() const {
+    return id;
+}
+
+/**
+ * @brief Gets or creates the ring for a room
+ * @param room The producing room
+ * @return The ring
+ */
+MailboxShard* RingMailbox::shardFor(const ChatRoom* room) {
+    std::lock_guard<std::mutex> guard(shardLock);
+    for (MailboxShard* shard : shards) {
+        if (shard != shared && shard->roomId == room->getRoomId()) {
+            return shard;
+        }
+    }
+    shards.push_back(new MailboxShard(room->getRoomId(), ringCapacity));
+    return shards.back();
+}
+
+/**
+ * @brief Queues a delivery from a room (that room's thread only)
+ * @param shard The room's ring
+ * @param text The message
+ * @param sender Handle of the sender
+ * @param mention Whether the message mentions the owner
+ * @return false if the message was rejected
+ */
+bool RingMailbox::enqueue(MailboxShard* shard, const Message& text, unsigned int sender, bool mention) {
+    // Only the consumer may take from a ring, so the mailbox cap refuses new messages instead of trimming
+    User* user = owner.load();
+    std::size_t cap = user ? user->getMailboxMemoryCap() : 0;
+    if (cap && queuedBytes.load() + text.size() > cap) {
+        rejected++;
+        return false;
+    }
+    queuedBytes += text.size();
+    if (!shard->spilling.load(std::memory_order_acquire) && shard->ring.tryPush(text, sender, mention)) {
+        delivered++;
+        return true;
+    }
+    switch (policy) {
+    case OverflowPolicy::Reject:
+        queuedBytes -= text.size();
+        rejected++;
+        return false;
+    case OverflowPolicy::Block: {
+        // The room holds its delivery lock here, so never wait on a consumer that may not be running
+        blocked++;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + MAILBOX_BLOCK_LIMIT;
+        while (!shard->spilling.load(std::memory_order_acquire) && std::chrono::steady_clock::now() < deadline) {
+            if (shard->ring.tryPush(text, sender, mention)) {
+                delivered++;
+                return true;
+            }
+            std::this_thread::yield();
+        }
+    }
+        [[fallthrough]];
+    case OverflowPolicy::Spill: {
+        std::lock_guard<std::mutex> guard(shard->spillLock);
+        shard->spill.push_back(InboxMessage{text, sender, shard->roomId, mention});
+        shard->spilling.store(true, std::memory_order_release);
+        spilled++;
+        delivered++;
+        return true;
+    }
+    }
+    return false;
+}
+
+/**
+ * @brief Queues a direct message or broadcast (any thread)
+ * @param text The message
+ * @param sender Handle of the sender
+ * @param roomId ID of the room, or 0 for a direct message
+ * @return false if the message was rejected
+ */
+bool RingMailbox::enqueueShared(const Message& text, unsigned int sender, unsigned int roomId) {
+    User* user = owner.load();
+    std::size_t cap = user ? user->getMailboxMemoryCap() : 0;
+    if (cap && queuedBytes.load() + text.size() > cap) {
+        rejected++;
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(shared->spillLock);
+    if (policy == OverflowPolicy::Reject && shared->spill.size() >= ringCapacity) {
+        rejected++;
+        return false;
+    }
+    queuedBytes += text.size();
+    shared->spill.push_back(InboxMessage{text, sender, roomId, false});
+    shared->spilling.store(true, std::memory_order_release);
+    delivered++;
+    return true;
+}
+
+/**
+ * @brief Takes up to a number of messages across all rooms (consumer only)
+ * @param out Receives the messages, oldest first within each room
+ * @param max Most messages to take
+ * @return Number of messages taken
+ * 
+ * Rooms are visited round-robin from where the last drain stopped, so a
+ * busy room cannot starve the others. A room's overflow list is only read
+ * once its ring is empty, because everything spilled is newer.
+ */
+std::size_t RingMailbox::drain(std::vector<InboxMessage>& out, std::size_t max) {
+    std::vector<MailboxShard*> current;
+    {
+        std::lock_guard<std::mutex> guard(shardLock);
+        current = shards;
+    }
+    std::size_t first = out.size();
+    std::size_t taken = 0;
+    for (std::size_t visited = 0; visited < current.size() && taken < max; visited++) {
+        MailboxShard* shard = current[(nextShard + visited) % current.size()];
+        taken += shard->ring.popBatch(out, max - taken, shard->roomId);
+        if (taken < max && shard->spilling.load(std::memory_order_acquire) && shard->ring.size() == 0) {
+            std::lock_guard<std::mutex> guard(shard->spillLock);
+            std::size_t count = std::min(max - taken, shard->spill.size());
+            std::move(shard->spill.begin(), shard->spill.begin() + count, std::back_inserter(out));
+            shard->spill.erase(shard->spill.begin(), shard->spill.begin() + count);
+            taken += count;
+            if (shard->spill.empty()) {
+                shard->spilling.store(false, std::memory_order_release);
+            }
+        }
+    }
+    if (!current.empty()) {
+        nextShard = (nextShard + 1) % current.size();
+    }
+    for (std::size_t i = first; i < out.size(); i++) {
+        queuedBytes -= out[i].text.size();
+    }
+    return taken;
+}
+
+/**
+ * @brief Gets the number of messages queued so far
+ * @return The delivered count
+ */
+unsigned long long RingMailbox::getDeliveredCount() const {
+    return delivered.load();
+}
+
+/**
+ * @brief Gets the number of messages dropped under OverflowPolicy::Reject
+ * @return The rejected count
+ */
+unsigned long long RingMailbox::getRejectedCount() const {
+    return rejected.load();
+}
+
+/**
+ * @brief Gets the number of messages sent to an overflow list
+ * @return The spilled count
+ */
+unsigned long long RingMailbox::getSpilledCount() const {
+    return spilled.load();
+}
+
+/**
+ * @brief Gets the number of deliveries that waited under OverflowPolicy::Block
+ * @return The blocked count
  */
-void CtrlCat::saveMessage(const std::string& message, User* fromUser) {
-    std::string fullMessage = fromUser->getName() + ": " + message;
-    chatHistory.push_back(fullMessage);
-    std::cout << "[CtrlCat] Message saved to history: " << fullMessage << std::endl;
+unsigned long long RingMailbox::getBlockedCount() const {
+    return blocked.load();
 }
 
+// ============= extra : MEMORY ACCOUNTING IMPLEMENTATIONS =============
 
 /**
- * @brief Creates an iterator for the CtrlCat room's chat history
- * @return Pointer to a new ChatHistoryIterator
+ * @brief Estimates the memory held by the queued command
+ * @return Bytes, counting the message text unless it is shared
  */
-Iterator* CtrlCat::createIterator() {
-   return new ChatHistoryIterator(&chatHistory);
+std::size_t Command::footprint() const {
+    return sizeof(*this) + (textShared ? 0 : message.size());
 }
 
-// Dogorithm Implementation
+/**
+ * @brief Stops footprint() counting the message text
+ */
+void Command::shareText() {
+    textShared = true;
+}
 
 /**
- * @brief Registers a user with the Dogorithm room
- * @param user Pointer to the user to register
- * 
- * Prevents duplicate registrations
+ * @brief Estimates the memory held by the queued batch
+ * @return Bytes, counting every message's text unless it is shared
  */
-void Dogorithm::registerUser(User* user) {
-    if (user && std::find(users.begin(), users.end(), user) == users.end()) {
-        users.push_back(user);
-        std::cout << user->getName() << " joined Dogorithm room!" << std::endl;
+std::size_t SendBatchCommand::footprint() const {
+    std::size_t bytes = sizeof(*this) + messages.capacity() * sizeof(Message);
+    for (const Message& text : messages) {
+        bytes += textShared ? 0 : text.size();
     }
+    return bytes;
 }
 
 /**
- * @brief Removes a user from the Dogorithm room
- * @param user Pointer to the user to remove
+ * @brief Estimates the memory held by the queued batch
+ * @return Bytes, counting every message's text unless it is shared
  */
-void Dogorithm::removeUser(User* user) {
-      auto it = std::find(users.begin(), users.end(), user);
-    if (it != users.end()) {
-        users.erase(it);
-        std::cout << user->getName() << " left Dogorithm room!" << std::endl;
+std::size_t LogBatchCommand::footprint() const {
+    std::size_t bytes = sizeof(*this) + messages.capacity() * sizeof(Message);
+    for (const Message& text : messages) {
+        bytes += textShared ? 0 : text.size();
     }
+    return bytes;
 }
 
-
 /**
- * @brief Sends a message to all users in the Dogorithm room
- * @param message The message content
- * @param fromUser Pointer to the user sending the message
- * 
- * Message is delivered to all users except the sender
+ * @brief Gets the room's total
+ * @return history + index + membership
  */
-void Dogorithm::sendMessage(const std::string& message, User* fromUser) {
-    std::cout << "[Dogorithm] " << fromUser->getName() << ": " << message << std::endl;
-    for (User* user : users) {
-        if (user != fromUser) {
-            user->receive(message, fromUser, this);
-        }
-    }
+std::size_t RoomMemoryUsage::total() const {
+    return history + index + membership;
 }
 
+/**
+ * @brief Gets the user's total
+ * @return queue + mailbox + name
+ */
+std::size_t UserMemoryUsage::total() const {
+    return queue + mailbox + name;
+}
 
 /**
- * @brief Saves a message to the Dogorithm room's history
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
+ * @brief Gets the memory held by the history ring and its indexes
+ * @return The bytes the memory cap is enforced against
  */
-void Dogorithm::saveMessage(const std::string& message, User* fromUser) {
-    std::string fullMessage = fromUser->getName() + ": " + message;
-    chatHistory.push_back(fullMessage);
-    std::cout << "[Dogorithm] Message saved to history: " << fullMessage << std::endl;
+std::size_t ChatRoom::heldBytes() const {
+    std::size_t bytes = historyBytes + historyIndex.memoryUsage() +
+                        timeIndex.capacity() * sizeof(std::pair<long long, std::size_t>);
+    if (retentionEnabled) {
+        // Empty ring slots are allocated too
+        bytes += (chatHistory.size() - hotCount) * sizeof(HistoryEntry);
+    }
+    return bytes;
 }
 
 /**
- * @brief Creates an iterator for the Dogorithm room's chat history
- * @return Pointer to a new ChatHistoryIterator
+ * @brief Gets the memory attributed to the room
+ * @return Bytes held by the in-memory history, its indexes and the member lists
  */
-Iterator* Dogorithm::createIterator() {
-    return new ChatHistoryIterator(&chatHistory);
+RoomMemoryUsage ChatRoom::getMemoryUsage() const {
+    RoomMemoryUsage usage;
+    usage.index = historyIndex.memoryUsage() + timeIndex.capacity() * sizeof(std::pair<long long, std::size_t>);
+    usage.history = heldBytes() - usage.index;
+    usage.deduplicated = dedupBytes;
+    usage.membership = users.capacity() * sizeof(User*) + memberHandles.capacity() * sizeof(unsigned int) +
+                       mentionBits.capacity() * sizeof(std::uint64_t) +
+                       mailboxShards.size() * (sizeof(std::pair<const User*, std::pair<unsigned long long, MailboxShard*>>) + sizeof(void*));
+    return usage;
 }
 
-// ============= USER CLASS IMPLEMENTATIONS =============
+/**
+ * @brief Caps the memory held by the in-memory history
+ * @param bytes The cap (0 = unbounded)
+ */
+void ChatRoom::setMemoryCap(std::size_t bytes) {
+    memoryCap = bytes;
+    // Re-storing the history through the retention ring applies the cap now
+    setHistoryRetention(retention);
+}
 
 /**
- * @brief Constructs a User
- * @param userName The user's display name
- * @param admin Whether the user has admin privileges
- * 
- * Initializes user with Online state by default
+ * @brief Gets the cap on the memory held by the in-memory history
+ * @return The cap in bytes (0 = unbounded)
  */
-User::User(const std::string& userName, bool admin) : name(userName), currentState(new Online()), isAdmin(admin) {
-    if (isAdmin) {
-        std::cout << userName << " created as Admin user!" << std::endl;
-    }
+std::size_t ChatRoom::getMemoryCap() const {
+    return memoryCap;
 }
+
 /**
- * @brief Destructs the User
- * 
- * Cleans up state and all queued commands
+ * @brief Checks the queue memory cap before queueing a send
+ * @param bytes Estimated bytes the send will queue
+ * @return false, after counting the rejection, if the cap would be exceeded
  */
-User::~User() {
-    delete currentState;
-    for (Command* command : commandQueue) {
-        delete command;
+bool User::admitQueueBytes(std::size_t bytes) {
+    if (queueMemoryCap && queuedBytes.load() + bytes > queueMemoryCap) {
+        memoryRejections++;
+        PETSPACE_LOG(WARN, DELIVERY, name, " is over its queue memory cap; message rejected");
+        return false;
     }
+    return true;
 }
 
 /**
- * @brief Adds a command to the command queue
- * @param command Pointer to the command to add
+ * @brief Gets the memory attributed to the user
+ * @return Bytes held by the command queue, mailboxes and name
  */
-void User::addCommand(Command* command) {
-    if (command) {
-        commandQueue.push_back(command);
+UserMemoryUsage User::getMemoryUsage() const {
+    UserMemoryUsage usage;
+    usage.queue = queuedBytes.load();
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        usage.mailbox = inbox ? inbox->memoryUsage() : 0;
     }
+    usage.mailbox += mailbox ? mailbox->memoryUsage() : 0;
+    usage.name = name.capacity() + 1;
+    return usage;
 }
 
+/**
+ * @brief Caps the memory the user's queue and mailboxes may hold
+ * @param queueBytes Queue cap (0 = unbounded)
+ * @param mailboxBytes Mailbox cap (0 = unbounded)
+ */
+void User::setMemoryCaps(std::size_t queueBytes, std::size_t mailboxBytes) {
+    queueMemoryCap = queueBytes;
+    mailboxMemoryCap = mailboxBytes;
+}
 
 /**
- * @brief Executes all commands in the queue
- * 
- * Executes each command sequentially, then clears and deletes them
+ * @brief Gets the mailbox memory cap
+ * @return The cap in bytes (0 = unbounded)
  */
-void User::executeAll() {
-    for (Command* command : commandQueue) {
-        if (command) {
-            command->execute();
-        }
-    }
-    // Clear executed commands
-    for (Command* command : commandQueue) {
-        delete command;
-    }
-    commandQueue.clear();
+std::size_t User::getMailboxMemoryCap() const {
+    return mailboxMemoryCap;
 }
 
+/**
+ * @brief Gets the number of sends rejected by the queue memory cap
+ * @return The rejection count
+ */
+unsigned long long User::getMemoryRejectionCount() const {
+    return memoryRejections;
+}
 
 /**
- * @brief Sets the user's state
- * @param newState Pointer to the new state
- * 
- * Deletes the old state and replaces it with the new one
+ * @brief Gets the memory held by queued messages
+ * @return Bytes
  */
-void User::setState(UserState* newState) {
-    if (currentState) {
-        delete currentState;
-    }
-    currentState = newState;
+std::size_t UserInbox::memoryUsage() {
+    std::lock_guard<std::mutex> guard(lock);
+    return queuedBytes;
 }
 
 /**
- * @brief Gets the user's current state
- * @return Pointer to the current UserState
+ * @brief Gets the number of messages dropped by the mailbox cap
+ * @return The trimmed count
  */
-UserState* User::getState() const {
-    return currentState;
+unsigned long long UserInbox::getTrimmedCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return trimmed;
 }
 
 /**
- * @brief Gets the user's name
- * @return The user's name string
+ * @brief Gets the memory allocated for the slots
+ * @return Bytes
  */
-std::string User::getName() const {
-    return name;
+std::size_t SpscRing::footprint() const {
+    return (mask + 1) * sizeof(Slot);
 }
 
 /**
- * @brief Joins a chat room
- * @param room Pointer to the chat room to join
- * 
- * Prevents joining the same room twice
+ * @brief Gets the memory held by the mailbox
+ * @return Bytes allocated for rings plus queued message bytes
  */
-void User::joinChatRoom(ChatRoom* room) {
-    if (room && std::find(chatRooms.begin(), chatRooms.end(), room) == chatRooms.end()) {
-        chatRooms.push_back(room);
-        room->registerUser(this);
+std::size_t RingMailbox::memoryUsage() {
+    std::lock_guard<std::mutex> guard(shardLock);
+    std::size_t bytes = queuedBytes.load();
+    for (MailboxShard* shard : shards) {
+        bytes += sizeof(MailboxShard) + shard->ring.footprint();
     }
+    return bytes;
 }
 
+// ============= extra : USER TABLE IMPLEMENTATIONS =============
+
+// Zero-initialised: every slot starts Online with no flags
+std::atomic<StateTag> UserTable::states[UserTable::MAX_HANDLES];
+std::atomic<unsigned char> UserTable::flags[UserTable::MAX_HANDLES];
+
 /**
- * @brief Leaves a chat room
- * @param room Pointer to the chat room to leave
+ * @brief Re-reads a user's hot fields into the table
+ * @param user The user
+ *
+ * A user counts as Plain only once fully constructed, so the first
+ * refresh from the User constructor never marks it Passive.
  */
-void User::leaveChatRoom(ChatRoom* room) {
-    auto it = std::find(chatRooms.begin(), chatRooms.end(), room);
-    if (it != chatRooms.end()) {
-        chatRooms.erase(it);
-        room->removeUser(this);
+void UserTable::refresh(const User* user) {
+    if (!user) {
+        return;
+    }
+    unsigned int handle = user->getHandle();
+    if (handle >= MAX_HANDLES) {
+        PETSPACE_LOG(ERROR, PRESENCE, "User table has no slot for handle ", handle, "; ", user->getName(),
+                     " reads as Online");
+        return;
+    }
+    const UserState* state = user->getState();
+    StateTag tag = StateTag::Custom;
+    if (state && typeid(*state) == typeid(Online)) {
+        tag = StateTag::Online;
+    } else if (state && typeid(*state) == typeid(Offline)) {
+        tag = StateTag::Offline;
+    } else if (state && typeid(*state) == typeid(Busy)) {
+        tag = StateTag::Busy;
+    }
+    unsigned char bits = 0;
+    if (user->getAdmin()) {
+        bits |= Admin;
+    }
+    const std::type_info& type = typeid(*user);
+    if (type == typeid(User1) || type == typeid(User2) || type == typeid(User3)) {
+        bits |= Plain;
+    }
+    if (user->getInbox()) {
+        bits |= Inbox;
+    }
+    if (user->getMailbox()) {
+        bits |= Mailbox;
+    }
+    // Built-in states only print, so a plain user with nothing attached has no other side effects
+    if ((bits & (Plain | Inbox | Mailbox)) == Plain && tag != StateTag::Custom) {
+        bits |= Passive;
     }
+    states[handle].store(tag, std::memory_order_relaxed);
+    flags[handle].store(bits, std::memory_order_relaxed);
 }
 
 /**
- * @brief Gets the list of chat rooms the user has joined
- * @return Reference to the chat rooms vector
+ * @brief Clears a user's slot
+ * @param user The user
  */
-std::vector<ChatRoom*>& User::getChatRooms() {
-    return chatRooms;
+void UserTable::remove(const User* user) {
+    if (user && user->getHandle() < MAX_HANDLES) {
+        states[user->getHandle()].store(StateTag::Online, std::memory_order_relaxed);
+        flags[user->getHandle()].store(0, std::memory_order_relaxed);
+    }
 }
 
-// User1 Implementation
-
 /**
- * @brief Constructs a User1
- * @param userName The user's name
+ * @brief Gets the state tag for a handle
+ * @param handle The user's handle
+ * @return The tag (Online for unknown handles)
  */
-User1::User1(const std::string& userName) : User(userName, false) {
+StateTag UserTable::stateOf(unsigned int handle) {
+    return handle < MAX_HANDLES ? states[handle].load(std::memory_order_relaxed) : StateTag::Online;
 }
 
+/**
+ * @brief Gets the flag bits for a handle
+ * @param handle The user's handle
+ * @return The flags (0 for unknown handles)
+ */
+unsigned char UserTable::flagsOf(unsigned int handle) {
+    return handle < MAX_HANDLES ? flags[handle].load(std::memory_order_relaxed) : 0;
+}
 
 /**
- * @brief Sends a message to a chat room
- * @param message The message content
- * @param room Pointer to the destination chat room
- * 
- * Creates SendMessageCommand and LogMessageCommand, then executes them
+ * @brief Checks whether room deliveries currently produce console output
+ * @return false if DELIVERY lines are compiled out or the console is disabled
  */
-void User1::send(const std::string& message, ChatRoom* room) {
-    if (room) {
-        // Create commands for sending and logging message
-        addCommand(new SendMessageCommand(room, this, message));
-        addCommand(new LogMessageCommand(room, this, message));
-        
-        // Execute all commands
-        executeAll();
+bool UserTable::deliveryVisible() {
+    if constexpr (PETSPACE_LOG_INFO <= PETSPACE_LOG_LEVEL && (PETSPACE_LOG_DELIVERY & (PETSPACE_LOG_CATEGORIES)) != 0) {
+        return Logger::enabled();
     }
+    return false;
 }
 
 /**
- * @brief Receives a message from the chat room
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
- * @param room Pointer to the chat room (unused)
- * 
- * Delegates message handling to the current state
+ * @brief Counts the members of a handle list in a state
+ * @param handles Member handles
+ * @param tag The state to count
+ * @return Number of matching members
  */
-void User1::receive(const std::string& message, User* fromUser, ChatRoom*) {
-    if (currentState && fromUser) {
-        currentState->handleMessage(this, message);
+std::size_t UserTable::countInState(const std::pmr::vector<unsigned int>& handles, StateTag tag) {
+    std::size_t count = 0;
+    for (unsigned int handle : handles) {
+        count += stateOf(handle) == tag;
     }
+    return count;
 }
 
-// User2 Implementation
-
 /**
- * @brief Constructs a User2
- * @param userName The user's name
+ * @brief Counts members in a state with one scan of the user table
+ * @param tag The state to count
+ * @return Number of members in that state
  */
-User2::User2(const std::string& userName) : User(userName, false) {
+std::size_t ChatRoom::countMembersInState(StateTag tag) const {
+    return UserTable::countInState(memberHandles, tag);
 }
 
+// ============= extra : READ CURSORS IMPLEMENTATIONS =============
 
 /**
- * @brief Sends a message to a chat room
- * @param message The message content
- * @param room Pointer to the destination chat room
- * 
- * Creates SendMessageCommand and LogMessageCommand, then executes them
+ * @brief Marks a room's messages as read up to a sequence number
+ * @param room The room
+ * @param seq Last sequence number read (clamped to the room's head)
+ * @return false if the user is not a member of the room
  */
-void User2::send(const std::string& message, ChatRoom* room) {
-    if (room) {
-        // Create commands for sending and logging message
-        addCommand(new SendMessageCommand(room, this, message));
-        addCommand(new LogMessageCommand(room, this, message));
-        
-        // Execute all commands
-        executeAll();
+bool User::acknowledge(ChatRoom* room, unsigned long long seq) {
+    auto it = readCursors.find(room);
+    if (it == readCursors.end()) {
+        return false;
     }
+    it->second = std::max(it->second, std::min(seq, room->getHeadSequence()));
+    return true;
 }
 
 /**
- * @brief Receives a message from the chat room
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
- * @param room Pointer to the chat room (unused)
- * 
- * Delegates message handling to the current state
+ * @brief Marks every message currently in a room as read
+ * @param room The room
+ * @return false if the user is not a member of the room
  */
-void User2::receive(const std::string& message, User* fromUser, ChatRoom*) {
-    if (currentState && fromUser) {
-        currentState->handleMessage(this, message);
-    }
+bool User::acknowledge(ChatRoom* room) {
+    return room && acknowledge(room, room->getHeadSequence());
 }
 
-// User3 Implementation
-
 /**
- * @brief Constructs a User3
- * @param userName The user's name
+ * @brief Gets the last sequence number acknowledged in a room
+ * @param room The room
+ * @return The cursor, or 0 if the user is not a member
  */
-User3::User3(const std::string& userName) : User(userName, false) {
+unsigned long long User::getReadCursor(const ChatRoom* room) const {
+    auto it = readCursors.find(room);
+    return it == readCursors.end() ? 0 : it->second;
 }
 
 /**
- * @brief Sends a message to a chat room
- * @param message The message content
- * @param room Pointer to the destination chat room
- * 
- * Creates SendMessageCommand and LogMessageCommand, then executes them
+ * @brief Gets the number of messages past the read cursor
+ * @param room The room
+ * @return The room's head sequence minus the cursor (0 if not a member)
  */
-void User3::send(const std::string& message, ChatRoom* room) {
-    if (room) {
-        // Create commands for sending and logging message
-        addCommand(new SendMessageCommand(room, this, message));
-        addCommand(new LogMessageCommand(room, this, message));
-        
-        // Execute all commands
-        executeAll();
+unsigned long long User::getUnreadCount(const ChatRoom* room) const {
+    auto it = readCursors.find(room);
+    if (it == readCursors.end()) {
+        return 0;
     }
+    unsigned long long head = room->getHeadSequence();
+    return head > it->second ? head - it->second : 0;
 }
 
 /**
- * @brief Receives a message from the chat room
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
- * @param room Pointer to the chat room (unused)
- * 
- * Delegates message handling to the current state
+ * @brief Creates an iterator over the unread messages of a room
+ * @param room The room
+ * @return Iterator starting just after the read cursor (caller must delete),
+ *         or nullptr if the user is not a member
  */
-void User3::receive(const std::string& message, User* fromUser, ChatRoom*) {
-    if (currentState && fromUser) {
-        currentState->handleMessage(this, message);
+ChatHistoryIterator* User::fetchUnread(ChatRoom* room) {
+    auto it = readCursors.find(room);
+    if (it == readCursors.end()) {
+        return nullptr;
     }
+    return room->createIteratorSince(it->second);
 }
 
-// ============= ADMIN IMPLEMENTATIONS =============
+// ============= extra : PAYLOAD STORE IMPLEMENTATIONS =============
+
+PayloadStore* PayloadStore::active = nullptr;
 
 /**
- * @brief Sets the user's admin status
- * @param admin true to grant admin privileges, false to revoke
+ * @brief Constructs an empty store
  */
-void User::setAdmin(bool admin) {
-    isAdmin = admin;
-    if (admin) {
-        std::cout << name << " has been granted admin privileges!" << std::endl;
-    }
+PayloadStore::PayloadStore() : storedBytes(0), collectAt(1024), lookups(0), hits(0) {
 }
 
 /**
- * @brief Gets the user's admin status
- * @return true if user is admin, false otherwise
+ * @brief Uninstalls the store if it is still installed
+ *
+ * Histories keep their references, so saved messages stay valid.
  */
-bool User::getAdmin() const {
-    return isAdmin;
+PayloadStore::~PayloadStore() {
+    if (active == this) {
+        active = nullptr;
+    }
 }
 
 /**
- * @brief Creates a custom chat room (admin only)
- * @param roomType The name/type of the room to create
- * @return Pointer to the new CustomChatRoom, or nullptr if user lacks permissions
- * 
- * Only users with admin privileges can create chat rooms
+ * @brief Makes a store the one room histories save through
+ * @param store The store, or nullptr to stop de-duplicating
  */
-ChatRoom* User::createChatRoom(const std::string& roomType) {
-    if (!isAdmin) {
-        std::cout << name << " does not have permission to create chat rooms!" << std::endl;
-        return nullptr;
-    }
-    
-    std::cout << "Chat room created by admin" << std::endl;
-    
-    // Create a custom room with any name
-    return new CustomChatRoom(roomType);
+void PayloadStore::install(PayloadStore* store) {
+    active = store;
 }
 
-// ============= Custom CLASS IMPLEMENTATIONS =============
-
 /**
- * @brief Constructs a CustomChatRoom
- * @param name The custom name for the room
+ * @brief Gets the installed store
+ * @return The store, or nullptr if none is installed
  */
-CustomChatRoom::CustomChatRoom(const std::string& name) : roomName(name) {
+PayloadStore* PayloadStore::current() {
+    return active;
 }
 
-
 /**
- * @brief Registers a user with the custom chat room
- * @param user Pointer to the user to register
- * 
- * Prevents duplicate registrations
+ * @brief Hashes a payload
+ * @param bytes The payload
+ * @return 64-bit hash, computed eight bytes at a time
  */
-void CustomChatRoom::registerUser(User* user) {
-    if (user && std::find(users.begin(), users.end(), user) == users.end()) {
-        users.push_back(user);
-        std::cout << user->getName() << " joined " << roomName << " room!" << std::endl;
+std::uint64_t PayloadStore::hash(std::string_view bytes) {
+    std::uint64_t h = 0x9E3779B97F4A7C15ULL ^ bytes.size();
+    std::size_t at = 0;
+    for (; at + 8 <= bytes.size(); at += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes.data() + at, 8);
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
     }
+    if (at < bytes.size()) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, bytes.data() + at, bytes.size() - at);
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+    // Final avalanche so the low bits used for bucketing depend on every byte
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
 }
 
-
 /**
- * @brief Removes a user from the custom chat room
- * @param user Pointer to the user to remove
+ * @brief Gets the shared copy of a payload
+ * @param message The payload
+ * @param reused Set to true if an existing, different buffer was returned
+ * @return A Message sharing the stored buffer (the input if it is stored inline)
  */
-void CustomChatRoom::removeUser(User* user) {
-    auto it = std::find(users.begin(), users.end(), user);
-    if (it != users.end()) {
-        users.erase(it);
-        std::cout << user->getName() << " left " << roomName << " room!" << std::endl;
+Message PayloadStore::intern(const Message& message, bool& reused) {
+    reused = false;
+    // Inline messages live inside each holder; sharing them saves nothing
+    if (message.useCount() == 0) {
+        return message;
     }
+    std::uint64_t key = hash(message.view());
+    std::lock_guard<std::mutex> guard(lock);
+    lookups++;
+    auto range = blobs.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == message) {
+            if (it->second.data() != message.data()) {
+                reused = true;
+                hits++;
+            }
+            return it->second;
+        }
+    }
+    if (blobs.size() >= collectAt) {
+        collectLocked();
+        collectAt = std::max<std::size_t>(1024, blobs.size() * 2);
+    }
+    blobs.emplace(key, message);
+    storedBytes += message.size();
+    return message;
 }
 
 /**
- * @brief Sends a message to all users in the custom chat room
- * @param message The message content
- * @param fromUser Pointer to the user sending the message
- * 
- * Message is delivered to all users except the sender
+ * @brief Drops blobs that only the store still references
+ * @return Number of blobs dropped
  */
-void CustomChatRoom::sendMessage(const std::string& message, User* fromUser) {
-    std::cout << "[" << roomName << "] " << fromUser->getName() << ": " << message << std::endl;
-    for (User* user : users) {
-        if (user != fromUser) {
-            user->receive(message, fromUser, this);
+std::size_t PayloadStore::collect() {
+    std::lock_guard<std::mutex> guard(lock);
+    return collectLocked();
+}
+
+/**
+ * @brief Drops unreferenced blobs with the lock held
+ * @return Number of blobs dropped
+ */
+std::size_t PayloadStore::collectLocked() {
+    std::size_t dropped = 0;
+    for (auto it = blobs.begin(); it != blobs.end();) {
+        if (it->second.useCount() == 1) {
+            storedBytes -= it->second.size();
+            it = blobs.erase(it);
+            dropped++;
+        } else {
+            ++it;
         }
     }
+    return dropped;
 }
 
 /**
- * @brief Saves a message to the custom chat room's history
- * @param message The message content
- * @param fromUser Pointer to the user who sent the message
+ * @brief Gets the number of blobs held
+ * @return The blob count
  */
-void CustomChatRoom::saveMessage(const std::string& message, User* fromUser) {
-    std::string fullMessage = fromUser->getName() + ": " + message;
-    chatHistory.push_back(fullMessage);
-    std::cout << "[" << roomName << "] Message saved to history: " << fullMessage << std::endl;
+std::size_t PayloadStore::getBlobCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return blobs.size();
 }
 
 /**
- * @brief Creates an iterator for the custom chat room's history
- * @return Pointer to a new ChatHistoryIterator
+ * @brief Gets the payload bytes held by the table
+ * @return Sum of the blob sizes
  */
-Iterator* CustomChatRoom::createIterator() {
-    return new ChatHistoryIterator(&chatHistory);
+std::size_t PayloadStore::getStoredBytes() {
+    std::lock_guard<std::mutex> guard(lock);
+    return storedBytes;
 }
 
 /**
- * @brief Gets the room's name
- * @return The custom room name string
+ * @brief Gets the bytes currently saved by sharing
+ * @return Sum over blobs of size times (holders - 1), not counting the store
  */
-std::string CustomChatRoom::getRoomName() const {
-    return roomName;
-}
\ No newline at end of file
+std::size_t PayloadStore::getSavedBytes() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t saved = 0;
+    for (const auto& blob : blobs) {
+        std::size_t holders = blob.second.useCount() - 1;
+        if (holders > 1) {
+            saved += (holders - 1) * blob.second.size();
+        }
+    }
+    return saved;
+}
+
+/**
+ * @brief Gets the number of lookups answered with an existing blob
+ * @return The hit count
+ */
+unsigned long long PayloadStore::getHitCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return hits;
+}
+
+/**
+ * @brief Gets the number of lookups
+ * @return The lookup count
+ */
+unsigned long long PayloadStore::getLookupCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return lookups;
+}
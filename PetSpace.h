@@ -14,16 +14,133 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include <iosfwd>
+#include <string_view>
+#include <memory_resource>
+#include <chrono>
+#include <cstdio>
+#include <type_traits>
+#include <mutex>
+#include <deque>
+#include <optional>
+#include <thread>
+#include <condition_variable>
 
 
 
 // Forward declarations
 class User;
 class ChatRoom;
+class DirectConversation;
+class ChatRoomRegistry;
+class ObjectSlab;
+class CommandJournal;
+struct PresenceUpdate;
+class MessageEnvelope;
+class UserInbox;
+class WorkStealingExecutor;
+class RingMailbox;
+struct MailboxShard;
+struct RoomMemoryUsage;
+enum class StateTag : unsigned char;
+struct UserMemoryUsage;
 class Command;
 class UserState;
 class Iterator;
 
+// ============= extra : SHARED MESSAGE BUFFERS =============
+
+/**
+ * @class Message
+ * @brief Immutable, reference-counted message payload
+ *
+ * Short messages are stored inline in the object. Longer ones live in a
+ * single heap buffer shared by every copy through an atomic reference
+ * count, so fanning a message out to N recipients never copies the text.
+ */
+class Message {
+private:
+    /**
+     * @struct Buffer
+     * @brief Heap header for long messages; the characters follow it
+     */
+    struct Buffer {
+        std::atomic<std::size_t> refs; ///< Number of Messages sharing the buffer
+        char* bytes();
+    };
+
+    static const std::size_t INLINE_CAPACITY = 23; ///< Longest inline message
+
+    std::size_t length; ///< Message length in bytes
+    union {
+        char small[INLINE_CAPACITY + 1]; ///< Inline characters (NUL-terminated)
+        Buffer* shared;                  ///< Shared buffer for long messages
+    };
+
+    bool isInline() const;
+    void assign(const char* text, std::size_t size);
+    void release();
+
+public:
+    Message();
+    Message(const char* text);
+    Message(const char* text, std::size_t size);
+    Message(const std::string& text);
+    Message(std::string_view text);
+    Message(const Message& other);
+    Message(Message&& other) noexcept;
+    Message& operator=(const Message& other);
+    Message& operator=(Message&& other) noexcept;
+    ~Message();
+
+    /**
+     * @brief Gets the message characters (NUL-terminated)
+     * @return Pointer to the first character
+     */
+    const char* data() const;
+    /**
+     * @brief Gets the message length
+     * @return Length in bytes
+     */
+    std::size_t size() const;
+    /**
+     * @brief Checks whether the message is empty
+     * @return true if the message has no characters
+     */
+    bool empty() const;
+    /**
+     * @brief Gets a non-owning view of the message
+     * @return View over the message characters
+     */
+    std::string_view view() const;
+    /**
+     * @brief Copies the message into a std::string
+     * @return The message text
+     */
+    std::string str() const;
+    /**
+     * @brief Gets the number of Messages sharing this message's buffer
+     * @return The reference count, or 0 for inline messages
+     */
+    std::size_t useCount() const;
+
+    bool operator==(const Message& other) const;
+    bool operator!=(const Message& other) const;
+};
+
+/**
+ * @brief Streams the message text
+ * @param out The output stream
+ * @param message The message to write
+ * @return The output stream
+ */
+std::ostream& operator<<(std::ostream& out, const Message& message);
+
 // ============= STATE PATTERN =============
 
 
@@ -43,7 +160,25 @@ public:
      * @param user Pointer to the user receiving the message
      * @param message The message content
      */
-    virtual void handleMessage(User* user, const std::string& message) = 0;
+    virtual void handleMessage(User* user, const Message& message) = 0;
+    /**
+     * @brief Handles a batch of incoming messages based on current state
+     * @param user Pointer to the user receiving the messages
+     * @param messages The messages, oldest first
+     *
+     * The default handles each message in turn; states may override it to
+     * write the whole batch at once.
+     */
+    virtual void handleBatch(User* user, const std::vector<Message>& messages);
+    /**
+     * @brief Handles a message that mentions the user by name
+     * @param user Pointer to the mentioned user
+     * @param message The message content
+     *
+     * Called after the message itself was received. The default does
+     * nothing more.
+     */
+    virtual void handleMention(User* user, const Message& message);
      /**
      * @brief Changes the user's state
      * @param user Pointer to the user whose state is changing
@@ -66,7 +201,8 @@ public:
  */
 class Online : public UserState {
 public:
-    void handleMessage(User* user, const std::string& message) override;
+    void handleMessage(User* user, const Message& message) override;
+    void handleBatch(User* user, const std::vector<Message>& messages) override;
     void changeState(User* user, UserState* newState) override;
     std::string getStateName() const override;
 };
@@ -80,7 +216,7 @@ public:
 
 class Offline : public UserState {
 public:
-    void handleMessage(User* user, const std::string& message) override;
+    void handleMessage(User* user, const Message& message) override;
     void changeState(User* user, UserState* newState) override;
     std::string getStateName() const override;
 };
@@ -94,7 +230,8 @@ public:
 
 class Busy : public UserState {
 public:
-    void handleMessage(User* user, const std::string& message) override;
+    void handleMessage(User* user, const Message& message) override;
+    void handleMention(User* user, const Message& message) override;
     void changeState(User* user, UserState* newState) override;
     std::string getStateName() const override;
 };
@@ -127,6 +264,39 @@ public:
 };
 
 
+/**
+ * @struct HistoryEntry
+ * @brief A single saved chat message
+ *
+ * Sequence numbers are per room, start at 1 and increase by one per saved
+ * message, so sequence N is always at history position N - 1.
+ */
+struct HistoryEntry {
+    typedef std::pmr::polymorphic_allocator<char> allocator_type; ///< Allocator used for the sender name
+
+    unsigned long long seq; ///< Per-room sequence number (0 = invalid entry)
+    long long timestamp;    ///< Milliseconds since the epoch, non-decreasing per room
+    std::pmr::string sender; ///< Name of the sending user
+    Message text;           ///< The message content (shared with the sender)
+    bool deduplicated;      ///< true if the text was served from the payload store
+
+    HistoryEntry();
+    explicit HistoryEntry(const allocator_type& alloc);
+    HistoryEntry(unsigned long long sequence, long long time, std::string_view from, const Message& message,
+                 const allocator_type& alloc = allocator_type());
+    HistoryEntry(const HistoryEntry& other) = default;
+    HistoryEntry(HistoryEntry&& other) = default;
+    HistoryEntry(const HistoryEntry& other, const allocator_type& alloc);
+    HistoryEntry(HistoryEntry&& other, const allocator_type& alloc);
+    HistoryEntry& operator=(const HistoryEntry& other) = default;
+    HistoryEntry& operator=(HistoryEntry&& other) = default;
+    /**
+     * @brief Renders the entry in history display form
+     * @return "sender: text"
+     */
+    std::string str() const;
+};
+
 /**
  * @class ChatHistoryIterator
  * @brief Concrete iterator for traversing chat history
@@ -135,22 +305,81 @@ public:
  */
 class ChatHistoryIterator : public Iterator {
 private:
-    std::vector<std::string>* chatHistory;  ///< Pointer to the chat history vector
-    int currentIndex; ///< Current position in the iteration
+    std::pmr::vector<HistoryEntry>* chatHistory;  ///< Pointer to the chat history vector
+    ChatRoom* room; ///< Room whose (possibly tiered) history is traversed
+    std::size_t currentIndex; ///< Current position in the iteration
+
+    std::size_t size() const;
+    HistoryEntry entryAt(std::size_t position) const;
     
 public:
  /**
      * @brief Constructs a ChatHistoryIterator
      * @param history Pointer to the chat history vector
      */
-    ChatHistoryIterator(std::vector<std::string>* history);
+    ChatHistoryIterator(std::pmr::vector<HistoryEntry>* history);
+    /**
+     * @brief Constructs a ChatHistoryIterator over a room's full history
+     * @param room Pointer to the chat room
+     *
+     * Spans both the in-memory ring and the cold-storage tier.
+     */
+    ChatHistoryIterator(ChatRoom* room);
     bool hasNext() override;
     std::string next() override;
     void reset() override;
+    /**
+     * @brief Returns the next entry with its sequence number and timestamp
+     * @return The next entry, or an entry with seq 0 if none
+     */
+    HistoryEntry nextEntry();
+    /**
+     * @brief Checks if there are older messages before the current position
+     * @return true if previous() would return a message
+     */
+    bool hasPrevious();
+    /**
+     * @brief Steps backwards and returns the message before the current position
+     * @return The previous message string, or empty string if none
+     */
+    std::string previous();
+    /**
+     * @brief Steps backwards and returns the entry before the current position
+     * @return The previous entry, or an entry with seq 0 if none
+     */
+    HistoryEntry previousEntry();
+    /**
+     * @brief Positions the iterator so next() returns the given sequence
+     * @param seq Sequence number to seek to (clamped to the history end)
+     */
+    void seekSequence(unsigned long long seq);
+    /**
+     * @brief Positions the iterator at the first message at or after a time
+     * @param timestamp Milliseconds since the epoch
+     *
+     * Only supported for room iterators, which use the room's time index.
+     */
+    void seekTime(long long timestamp);
+    /**
+     * @brief Positions the iterator after the newest message
+     *
+     * Combine with previous() to page backwards ("load older messages").
+     */
+    void seekEnd();
 };
 
 // ============= COMMAND PATTERN =============
 
+/**
+ * @enum CommandPriority
+ * @brief Scheduling class of a command (lower value runs first)
+ */
+enum class CommandPriority {
+    System = 0, ///< System events and notices
+    Admin = 1,  ///< Commands issued by admin users
+    Normal = 2  ///< Ordinary user traffic
+};
+
 /**
  * @class Command
  * @brief Abstract base class for commands in the Command pattern
@@ -158,10 +387,15 @@ public:
  * Encapsulates a request as an object, allowing parameterization and queuing of requests
  */
 class Command {
+    friend class CommandScheduler;
+
 protected:
     ChatRoom* chatRoom;
     User* fromUser;
-    std::string message;
+    Message message;
+    CommandPriority priority; ///< Scheduling class, Admin for admin-issued commands
+    unsigned long long sequence; ///< Process-wide queueing order, stamped by CommandScheduler::push
+    bool textShared; ///< Text is counted by a later command holding the same buffer
     
 
 public:
@@ -171,9 +405,44 @@ public:
      * @param user Pointer to the user
      * @param msg The message string
      */
-    Command(ChatRoom* room, User* user, const std::string& msg);
+    Command(ChatRoom* room, User* user, const Message& msg);
     virtual ~Command() = default;
     virtual void execute() = 0;
+    /**
+     * @brief Appends the command's journal record payload to a buffer
+     * @param out Buffer to append to
+     * @param journal Journal whose catalog maps users and rooms to indexes
+     * @return false if the command cannot be journaled (the default)
+     */
+    virtual bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const;
+    /**
+     * @brief Estimates the memory held by the queued command
+     * @return Bytes, counting the message text unless it is shared
+     */
+    virtual std::size_t footprint() const;
+    /**
+     * @brief Stops footprint() counting the message text
+     *
+     * For a command whose buffer is also held by one queued after it, so
+     * the shared text is counted once, by the command that frees it.
+     * Call before the command is queued.
+     */
+    void shareText();
+    /**
+     * @brief Gets the command's scheduling class
+     * @return The command priority
+     */
+    CommandPriority getPriority() const;
+    /**
+     * @brief Overrides the command's scheduling class
+     * @param newPriority The priority to use, e.g. System for notices
+     */
+    void setPriority(CommandPriority newPriority);
+    /**
+     * @brief Gets when the command was queued relative to all others
+     * @return The queueing sequence number (0 if never queued)
+     */
+    unsigned long long getSequence() const;
 };
 
 
@@ -189,8 +458,9 @@ public:
      * @param user Pointer to the user
      * @param msg The message string
      */
-    SendMessageCommand(ChatRoom* room, User* user, const std::string& msg);
+    SendMessageCommand(ChatRoom* room, User* user, const Message& msg);
     void execute() override;
+    bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const override;
 };
 
 /**
@@ -206,262 +476,3416 @@ public:
      * @param msg The message string
      */
     
-    LogMessageCommand(ChatRoom* room, User* user, const std::string& msg);
+    LogMessageCommand(ChatRoom* room, User* user, const Message& msg);
     void execute() override;
+    bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const override;
 };
 
-// ============= MEDIATOR PATTERN =============
-
 /**
- * @class ChatRoom
- * @brief Abstract mediator class for managing user interactions
- * 
- * Centralizes communication between users, reducing coupling between them
+ * @class SendBatchCommand
+ * @brief Concrete command for delivering a batch of messages to a room
  */
-class ChatRoom {
-protected:
-    std::vector<User*> users;
-    std::vector<std::string> chatHistory;
-    
-public:
-    virtual ~ChatRoom() = default;
+class SendBatchCommand : public Command {
+private:
+    std::vector<Message> messages;
 
-      /**
-     * @brief Registers a user with the chat room
-     * @param user Pointer to the user to register
-     */
-    virtual void registerUser(User* user) = 0;
-      
-    /**
-     * @brief Removes a user from the chat room
-     * @param user Pointer to the user to remove
-     */
-    virtual void removeUser(User* user) = 0;
+public:
     /**
-     * @brief Sends a message to all users in the room
-     * @param message The message to send
-     * @param fromUser Pointer to the user sending the message
+     * @brief Constructs a SendBatchCommand
+     * @param room Pointer to the chat room
+     * @param user Pointer to the user
+     * @param batch The messages to send, oldest first
      */
-    virtual void sendMessage(const std::string& message, User* fromUser) = 0;
+    SendBatchCommand(ChatRoom* room, User* user, const std::vector<Message>& batch);
+    void execute() override;
+    bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const override;
+    std::size_t footprint() const override;
+};
 
-     /**
-     * @brief Saves a message to the chat history
-     * @param message The message to save
-     * @param fromUser Pointer to the user who sent the message
-     */
-    virtual void saveMessage(const std::string& message, User* fromUser) = 0;
+/**
+ * @class LogBatchCommand
+ * @brief Concrete command for logging a batch of messages to chat history
+ */
+class LogBatchCommand : public Command {
+private:
+    std::vector<Message> messages;
+
+public:
     /**
-     * @brief Creates an iterator for the chat history
-     * @return Pointer to a new Iterator object
+     * @brief Constructs a LogBatchCommand
+     * @param room Pointer to the chat room
+     * @param user Pointer to the user
+     * @param batch The messages to log, oldest first
      */
-    virtual Iterator* createIterator() = 0;
+    LogBatchCommand(ChatRoom* room, User* user, const std::vector<Message>& batch);
+    void execute() override;
+    bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const override;
+    std::size_t footprint() const override;
+};
 
-      /**
-     * @brief Gets the list of users in the chat room
-     * @return Reference to the users vector
+/**
+ * @class HandleMarks
+ * @brief Reusable bitmap of user handles that remembers which words it set
+ *
+ * clear() only zeroes the touched words, so reusing one set costs time in
+ * proportion to the handles marked, not to every handle ever issued.
+ */
+class HandleMarks {
+private:
+    std::vector<std::uint64_t> bits;   ///< One bit per handle
+    std::vector<std::size_t> touched;  ///< Indexes of the non-zero words in bits
+
+public:
+    /**
+     * @brief Marks a handle
+     * @param handle The user's handle
+     * @return true if the handle was not marked before
      */
-    std::vector<User*>& getUsers();
+    bool mark(unsigned int handle);
     /**
-     * @brief Gets the chat history
-     * @return Reference to the chat history vector
+     * @brief Unmarks every handle
      */
-    std::vector<std::string>& getChatHistory();
+    void clear();
 };
 
-
 /**
- * @class CtrlCat
- * @brief Concrete mediator for the CtrlCat themed chat room
+ * @class BroadcastCommand
+ * @brief Concrete command for delivering one message across several rooms
+ *
+ * Recipients are de-duplicated with a bitmap keyed by user handle, so a
+ * user who shares several of the rooms with the sender receives it once.
+ * Each room delivers under its own delivery lock and through its usual
+ * fan-out, so mentions, passive members and mailbox shards behave as for
+ * send().
  */
-class CtrlCat : public ChatRoom {
+class BroadcastCommand : public Command {
+private:
+    std::vector<ChatRoom*> rooms;
+    std::size_t delivered; ///< Distinct recipients reached by the last execute()
+    std::size_t* report;   ///< Where execute() also writes delivered (nullptr = nowhere)
+
 public:
-    void registerUser(User* user) override;
-    void removeUser(User* user) override;
-    void sendMessage(const std::string& message, User* fromUser) override;
-    void saveMessage(const std::string& message, User* fromUser) override;
-    Iterator* createIterator() override;
+    /**
+     * @brief Constructs a BroadcastCommand
+     * @param targets The rooms to deliver to
+     * @param user Pointer to the user broadcasting
+     * @param msg The message to deliver
+     * @param report Receives the recipient count when the command runs (optional)
+     */
+    BroadcastCommand(const std::vector<ChatRoom*>& targets, User* user, const Message& msg,
+                     std::size_t* report = nullptr);
+    void execute() override;
+    /**
+     * @brief Gets how many distinct users the broadcast reached
+     * @return The recipient count
+     */
+    std::size_t getDelivered() const;
 };
+
 /**
- * @class Dogorithm
- * @brief Concrete mediator for the Dogorithm themed chat room
+ * @class DirectMessageCommand
+ * @brief Concrete command for delivering a message to a single user
  */
-class Dogorithm : public ChatRoom {
+class DirectMessageCommand : public Command {
+private:
+    unsigned int recipient; ///< Handle of the receiving user
+
 public:
-    void registerUser(User* user) override;
-    void removeUser(User* user) override;
-    void sendMessage(const std::string& message, User* fromUser) override;
-    void saveMessage(const std::string& message, User* fromUser) override;
-    Iterator* createIterator() override;
+    /**
+     * @brief Constructs a DirectMessageCommand
+     * @param toHandle Handle of the receiving user
+     * @param user Pointer to the user sending the message
+     * @param msg The message to deliver
+     */
+    DirectMessageCommand(unsigned int toHandle, User* user, const Message& msg);
+    void execute() override;
+    bool serialize(std::vector<unsigned char>& out, const CommandJournal& journal) const override;
 };
 
-// ============= USER CLASSES =============
 /**
- * @class User
- * @brief Abstract base class for all users in the system
- * 
- * Manages user state, chat room membership, and command execution
+ * @class CommandScheduler
+ * @brief Multi-level priority queue for a user's pending commands
+ *
+ * System commands run before admin commands, which run before normal ones;
+ * each level is FIFO. To keep ordinary traffic moving, a waiting level
+ * that has been passed over starvationLimit times in a row is served next.
  */
-class User {
-protected:
-    std::string name;
-    std::vector<ChatRoom*> chatRooms;
-    std::list<Command*> commandQueue;
-    UserState* currentState;
-    // EXTRA :: Admin
-    bool isAdmin;  
-    
-public:
-/**
-     * @brief Constructs a User
-     * @param userName The user's name
-     * @param admin Whether the user is an admin (default: false)
-     */
-     User(const std::string& userName, bool admin = false);
-    virtual ~User();
+class CommandScheduler {
+private:
+    static const std::size_t LEVELS = 3;
+    static std::atomic<unsigned long long> nextSequence; ///< Next stamp handed out by push()
+    std::pmr::list<Command*> levels[LEVELS]; ///< One FIFO per priority
+    std::size_t bypassed[LEVELS]; ///< Consecutive dispatches that skipped a waiting level
+    std::size_t starvationLimit;  ///< Bypasses tolerated before a level is served
+    std::size_t count;            ///< Total queued commands
+
     /**
-     * @brief Sends a message to a chat room
-     * @param message The message content
-     * @param room Pointer to the destination chat room
+     * @brief Picks the level pop() would serve next
+     * @return The level index (LEVELS if the scheduler is empty)
      */
-    
-     virtual void send(const std::string& message, ChatRoom* room) = 0;
+    std::size_t nextLevel() const;
+
+public:
     /**
-     * @brief Receives a message from a chat room
-     * @param message The message content
-     * @param fromUser Pointer to the user who sent the message
-     * @param room Pointer to the chat room
+     * @brief Constructs an empty scheduler
+     * @param resource Memory resource for the queues
+     * @param limit Bypasses tolerated before a lower level is served
      */
-     virtual void receive(const std::string& message, User* fromUser, ChatRoom* room) = 0;
+    explicit CommandScheduler(std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+                              std::size_t limit = 16);
     /**
-     * @brief Adds a command to the command queue
-     * @param command Pointer to the command to add
+     * @brief Queues a command at its priority level
+     * @param command The command to queue (ignored if nullptr)
      */
-    void addCommand(Command* command);
-     /**
-     * @brief Executes all commands in the queue
-     */
-    void executeAll();
+    void push(Command* command);
     /**
-     * @brief Sets the user's state
-     * @param newState Pointer to the new state
+     * @brief Removes the next command to run
+     * @return The command, or nullptr if the scheduler is empty
      */
-    void setState(UserState* newState);
+    Command* pop();
     /**
-     * @brief Gets the user's current state
-     * @return Pointer to the current UserState
+     * @brief Gets the command pop() would return, without removing it
+     * @return The command, or nullptr if the scheduler is empty
      */
-    UserState* getState() const;
-     
+    Command* peek() const;
     /**
-     * @brief Gets the user's name
-     * @return The user's name
-     */
-    std::string getName() const;
-     /**
-     * @brief Joins a chat room
-     * @param room Pointer to the chat room to join
+     * @brief Checks whether any command is queued
+     * @return true if no commands are queued
      */
-    void joinChatRoom(ChatRoom* room);
+    bool empty() const;
     /**
-     * @brief Leaves a chat room
-     * @param room Pointer to the chat room to leave
-     */
-    void leaveChatRoom(ChatRoom* room);
-     /**
-     * @brief Gets the list of chat rooms the user has joined
-     * @return Reference to the chat rooms vector
+     * @brief Gets the number of queued commands
+     * @return The queued command count
      */
-    std::vector<ChatRoom*>& getChatRooms();
+    std::size_t size() const;
     /**
-     * @brief Sets the user's admin status
-     * @param admin Whether the user should be an admin
+     * @brief Gets the number of queued commands at one priority
+     * @param level The priority level
+     * @return The queued command count for that level
      */
-    void setAdmin(bool admin);
-     /**
-     * @brief Gets the user's admin status
-     * @return true if user is admin, false otherwise
-     */
-    bool getAdmin() const;
+    std::size_t size(CommandPriority level) const;
     /**
-     * @brief Creates a new chat room (admin only)
-     * @param roomType The type/name of the room to create
-     * @return Pointer to the new ChatRoom, or nullptr if not admin
+     * @brief Sets how many bypasses a waiting level tolerates
+     * @param limit Bypass limit (0 disables starvation protection)
      */
-    ChatRoom* createChatRoom(const std::string& roomType);
+    void setStarvationLimit(std::size_t limit);
 };
 
+// ============= extra : CHAT HISTORY SEARCH INDEX =============
+
 /**
- * @class User1
- * @brief Concrete user implementation
+ * @class PostingList
+ * @brief Compressed, append-only list of history positions
+ *
+ * Positions are stored as variable-length encoded deltas, so a token that
+ * appears in consecutive messages costs a single byte per occurrence.
  */
-class User1 : public User {
+class PostingList {
+public:
+    typedef std::pmr::polymorphic_allocator<unsigned char> allocator_type; ///< Allocator used for the encoded bytes
+
+private:
+    std::pmr::vector<unsigned char> bytes; ///< Varint-encoded position deltas
+    std::size_t last;  ///< Last position appended
+    std::size_t count; ///< Number of positions in the list
+
 public:
+    PostingList();
+    explicit PostingList(const allocator_type& alloc);
+    PostingList(const PostingList& other) = default;
+    PostingList(PostingList&& other) = default;
+    PostingList(const PostingList& other, const allocator_type& alloc);
+    PostingList(PostingList&& other, const allocator_type& alloc);
+    PostingList& operator=(const PostingList& other) = default;
+    PostingList& operator=(PostingList&& other) = default;
     /**
-     * @brief Constructs a User1
-     * @param userName The user's name
+     * @brief Appends a position (ignored if not greater than the last one)
+     * @param position History position of the message
      */
-    User1(const std::string& userName);
-    void send(const std::string& message, ChatRoom* room) override;
-    void receive(const std::string& message, User* fromUser, ChatRoom* room) override;
+    void append(std::size_t position);
+    /**
+     * @brief Decodes the list into ascending history positions
+     * @return Vector of positions
+     */
+    std::vector<std::size_t> decode() const;
+    /**
+     * @brief Gets the number of positions in the list
+     * @return The position count
+     */
+    std::size_t size() const;
+    /**
+     * @brief Gets the size of the compressed representation
+     * @return Number of encoded bytes
+     */
+    std::size_t byteSize() const;
+
+    friend class ChatHistoryIndex;
 };
+
 /**
- * @class User2
- * @brief Concrete user implementation
+ * @class ChatHistoryIndex
+ * @brief Incrementally maintained inverted index over a room's chat history
+ *
+ * Maps lower-cased message tokens and sender names to posting lists of
+ * history positions, so lookups never have to walk the whole history.
+ * Positions below the floor have been dropped (rooms with retention drop
+ * cold blocks once they are written) and must be searched by the caller.
  */
-class User2 : public User {
+class ChatHistoryIndex {
 public:
-    /**
-     * @brief Constructs a User2
-     * @param userName The user's name
+    typedef std::pmr::unordered_map<std::pmr::string, PostingList> PostingMap; ///< Key -> positions
+
+private:
+    PostingMap tokens;  ///< Token -> positions
+    PostingMap senders; ///< Sender name -> positions
+    std::size_t indexedCount; ///< Number of messages indexed so far
+    std::size_t floor;        ///< First position still indexed
+    std::size_t entryBytes;   ///< Estimated bytes held by map nodes, keys and encoded postings
+
+    static std::vector<std::size_t> intersect(const std::vector<std::size_t>& a,
+                                              const std::vector<std::size_t>& b);
+    static void trimPostings(PostingMap& lists, std::size_t position);
+    static std::size_t footprintOf(const PostingMap::value_type& entry);
+    void appendPosting(PostingMap& lists, std::string_view key, std::size_t position);
+    void recount();
+
+public:
+    /**
+     * @brief Constructs an empty index
+     * @param resource Memory resource for the maps and posting lists
      */
-    User2(const std::string& userName);
-    void send(const std::string& message, ChatRoom* room) override;
-    void receive(const std::string& message, User* fromUser, ChatRoom* room) override;
+    explicit ChatHistoryIndex(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    /**
+     * @brief Indexes a newly saved message
+     * @param position History position of the message
+     * @param sender Name of the user who sent the message
+     * @param message The raw message content (without the sender prefix)
+     */
+    void addMessage(std::size_t position, std::string_view sender, std::string_view message);
+    /**
+     * @brief Finds messages containing every token of the given keywords
+     * @param keywords One or more whitespace/punctuation separated keywords
+     * @return Ascending history positions of matching messages
+     */
+    std::vector<std::size_t> findKeyword(const std::string& keywords) const;
+    /**
+     * @brief Finds messages sent by the given user
+     * @param sender The sender's name
+     * @return Ascending history positions of matching messages
+     */
+    std::vector<std::size_t> findSender(const std::string& sender) const;
+    /**
+     * @brief Combined query; an empty argument is ignored
+     * @param keywords Keywords that must all appear in the message
+     * @param sender Name of the sender the message must come from
+     * @return Ascending history positions of matching messages
+     */
+    std::vector<std::size_t> find(const std::string& keywords, const std::string& sender) const;
+    /**
+     * @brief Gets the number of messages indexed
+     * @return The indexed message count
+     */
+    std::size_t size() const;
+    /**
+     * @brief Removes every entry from the index
+     */
+    void clear();
+    /**
+     * @brief Drops every position below a history position
+     * @param position New floor; positions below it are no longer indexed
+     */
+    void dropBefore(std::size_t position);
+    /**
+     * @brief Gets the first position still indexed
+     * @return The floor (0 if nothing was dropped)
+     */
+    std::size_t getFloor() const;
+    /**
+     * @brief Estimates the memory held by the index
+     * @return Bytes for the bucket arrays, map nodes, keys and posting lists
+     */
+    std::size_t memoryUsage() const;
+    /**
+     * @brief Writes the index to a binary file
+     * @param path Destination file path
+     * @return true on success, false otherwise
+     */
+    bool save(const std::string& path) const;
+    /**
+     * @brief Replaces the index with the contents of a binary file
+     * @param path Source file path
+     * @return true on success, false if the file is missing or malformed
+     */
+    bool load(const std::string& path);
+    /**
+     * @brief Splits text into lower-cased alphanumeric tokens
+     * @param text The text to tokenize
+     * @return Vector of tokens in order of appearance
+     */
+    static std::vector<std::string> tokenize(std::string_view text);
 };
+
+// ============= extra : HISTORY RETENTION =============
+
 /**
- * @class User3
- * @brief Concrete user implementation
+ * @struct HistoryRetention
+ * @brief Retention limits for a room's in-memory history
+ *
+ * A limit of 0 means unbounded. Messages pushed out of the in-memory ring
+ * are compressed in blocks and spilled to a cold-storage file.
  */
+struct HistoryRetention {
+    std::size_t maxMessages;   ///< Maximum messages kept in memory
+    std::size_t maxBytes;      ///< Maximum message bytes kept in memory
+    std::size_t blockMessages; ///< Messages per compressed cold block
+    std::string coldDirectory; ///< Directory holding cold-storage files (named per process and room)
+
+    HistoryRetention(std::size_t messages = 0, std::size_t bytes = 0,
+                     std::size_t block = 64, const std::string& directory = ".");
+};
+
+/**
+ * @class HistoryColdStore
+ * @brief Cold tier holding evicted history in compressed blocks on disk
+ *
+ * Evicted messages collect in a pending block; once it is full it is
+ * compressed and appended to the room's cold file. Every block holds
+ * exactly blockMessages messages. The block's token and sender posting
+ * lists go to a postings file, and both offsets go to a directory file
+ * next to it, so only the pending and most recently read blocks are kept
+ * in memory and cold searches never decompress message text.
+ */
+class HistoryColdStore {
+private:
+    std::string path;              ///< Cold-storage file path
+    std::string directoryPath;     ///< File of 64-bit (block, postings) offset pairs
+    std::string postingsPath;      ///< File of per-block posting lists
+    std::size_t blockMessages;     ///< Messages per block
+    std::size_t blockCount;        ///< Blocks written to the cold file
+    std::pmr::vector<HistoryEntry> pending; ///< Evicted messages not yet written
+    unsigned long long fileBytes;  ///< Bytes written to the cold file
+    unsigned long long postingBytes; ///< Bytes written to the postings file
+    mutable std::size_t cachedBlock; ///< Index of the decoded block in cache
+    mutable std::pmr::vector<HistoryEntry> cache; ///< Most recently decoded block
+
+    void flushBlock();
+    bool appendBlock(const unsigned char* data, std::size_t size, const std::vector<unsigned char>& postings);
+    static bool unpackBlock(const unsigned char* data, std::size_t size, std::pmr::vector<HistoryEntry>& out);
 
-class User3 : public User {
 public:
     /**
-     * @brief Constructs a User3
-     * @param userName The user's name
+     * @brief Constructs a cold store backed by the given file
+     * @param filePath Path of the cold-storage file (truncated); offsets go to filePath + ".dir"
+     *        and posting lists to filePath + ".pst"
+     * @param block Number of messages per compressed block
+     * @param resource Memory resource for the pending and cached blocks
      */
-    User3(const std::string& userName);
-    void send(const std::string& message, ChatRoom* room) override;
-    void receive(const std::string& message, User* fromUser, ChatRoom* room) override;
+    HistoryColdStore(const std::string& filePath, std::size_t block,
+                     std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    /**
+     * @brief Destroys the store and removes its cold-storage files
+     */
+    ~HistoryColdStore();
+    HistoryColdStore(const HistoryColdStore&) = delete;
+    HistoryColdStore& operator=(const HistoryColdStore&) = delete;
+    /**
+     * @brief Appends an evicted message
+     * @param entry The history entry to store
+     */
+    void push(HistoryEntry&& entry);
+    /**
+     * @brief Gets the message at a cold position
+     * @param position Position within the cold tier
+     * @return The stored entry, or an entry with seq 0 if out of range
+     */
+    HistoryEntry at(std::size_t position) const;
+    /**
+     * @brief Finds written cold messages through their on-disk posting lists
+     * @param keywords Tokens that must all appear (empty to match any text)
+     * @param sender Sender name to match (empty to match any sender)
+     * @param limit Positions at or above this are left out
+     * @param out Receives ascending cold positions
+     * @return false if the postings could not be read; out is empty then
+     */
+    bool search(const std::vector<std::string>& keywords, const std::string& sender, std::size_t limit,
+                std::vector<std::size_t>& out) const;
+    /**
+     * @brief Gets the number of messages in the cold tier
+     * @return The cold message count
+     */
+    std::size_t size() const;
+    /**
+     * @brief Gets the number of messages in written blocks
+     * @return Messages no longer pending
+     */
+    std::size_t writtenSize() const;
+    /**
+     * @brief Gets the number of compressed bytes written to disk
+     * @return The cold file size
+     */
+    unsigned long long diskBytes() const;
+    /**
+     * @brief Gets the cold-storage file path
+     * @return The file path
+     */
+    std::string getPath() const;
+    /**
+     * @brief Gets the number of blocks written to the cold file
+     * @return The block count
+     */
+    std::size_t getBlockCount() const;
+    /**
+     * @brief Gets the number of messages per block
+     * @return Messages per block
+     */
+    std::size_t getBlockMessages() const;
+    /**
+     * @brief Appends a written block, still compressed, to a buffer
+     * @param block Block index
+     * @param out Buffer to append the block's header and bytes to
+     * @return false if the block could not be read
+     */
+    bool copyBlock(std::size_t block, std::vector<unsigned char>& out) const;
+    /**
+     * @brief Appends a block produced by copyBlock() to the cold file
+     * @param data The block's header and compressed bytes
+     * @param size Size of the block
+     * @return false if the block is malformed, messages are pending, or the write failed
+     */
+    bool adoptBlock(const unsigned char* data, std::size_t size);
 };
 
-// ============= extra : CustomChatRoom CLASSES =============
+// ============= extra : RATE LIMITING =============
 
+/**
+ * @enum RateLimitAction
+ * @brief What happens to a message when a rate limiter has no tokens
+ */
+enum class RateLimitAction {
+    Reject,   ///< Drop the message
+    Delay,    ///< Wait for a token (up to the limiter's maximum delay)
+    Coalesce  ///< Hold the text and send it with the next admitted message
+};
 
 /**
- * @class CustomChatRoom
- * @brief A customizable chat room with user-defined name
+ * @struct RateLimiterStats
+ * @brief Counters describing what a rate limiter has done
+ */
+struct RateLimiterStats {
+    unsigned long long allowed;   ///< Messages admitted without waiting
+    unsigned long long delayed;   ///< Messages admitted after waiting
+    unsigned long long rejected;  ///< Messages dropped
+    unsigned long long coalesced; ///< Messages held for coalescing
+};
+
+/**
+ * @class RateLimiter
+ * @brief Token-bucket limiter guarding a user's or a room's sends
+ *
+ * The bucket refills continuously at the configured rate and holds at
+ * most burst tokens. Each message costs one token.
+ */
+class RateLimiter {
+private:
+    double rate;   ///< Tokens added per second
+    double burst;  ///< Bucket capacity
+    double tokens; ///< Tokens currently available
+    RateLimitAction action;   ///< Behaviour when empty
+    double maxDelaySeconds;   ///< Longest wait for the Delay action
+    std::chrono::steady_clock::time_point lastRefill; ///< Time of the last refill
+    RateLimiterStats stats;   ///< Activity counters
+
+    void refill();
+
+public:
+    /**
+     * @brief Constructs a full token bucket
+     * @param messagesPerSecond Sustained message rate
+     * @param burstSize Maximum number of messages sent back to back
+     * @param onLimit What to do when the bucket is empty
+     * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+     */
+    RateLimiter(double messagesPerSecond, double burstSize,
+                RateLimitAction onLimit = RateLimitAction::Reject, double maxDelay = 1.0);
+    /**
+     * @brief Gets the time until a token is available
+     * @return Seconds to wait, 0 if a token is available now
+     */
+    double secondsUntilAvailable();
+    /**
+     * @brief Takes one token (the bucket may briefly go negative after a delay)
+     * @param waited Whether the caller waited for the token
+     */
+    void consume(bool waited = false);
+    /**
+     * @brief Records a message that was not admitted
+     */
+    void recordLimited();
+    /**
+     * @brief Gets the number of tokens available now
+     * @return The token count
+     */
+    double available();
+    /**
+     * @brief Gets the action applied when the bucket is empty
+     * @return The configured action
+     */
+    RateLimitAction getAction() const;
+    /**
+     * @brief Gets the longest wait for the Delay action
+     * @return Maximum delay in seconds
+     */
+    double getMaxDelay() const;
+    /**
+     * @brief Gets the limiter's counters
+     * @return Copy of the counters
+     */
+    RateLimiterStats getStats() const;
+};
+
+// ============= extra : MENTION MATCHING =============
+
+/**
+ * @class MentionMatcher
+ * @brief Aho-Corasick automaton over "@name" for every member of a room
+ *
+ * A message is scanned once, in time linear in its length no matter how
+ * many members the room has. A mention only counts if the name is not
+ * immediately followed by a letter, digit or underscore.
+ */
+class MentionMatcher {
+private:
+    struct Node {
+        std::vector<std::pair<unsigned char, int>> next; ///< Trie edges
+        int fail;                          ///< Longest proper suffix that is also a trie node
+        int outputLink;                    ///< Nearest node on the fail chain with outputs (-1 = none)
+        std::vector<unsigned int> outputs; ///< Handles of the members whose pattern ends here
+    };
+    std::vector<Node> nodes;
+    std::size_t patterns; ///< Names currently recognised
+    std::size_t removed;  ///< Names removed since the trie was last rebuilt
+    bool linked;          ///< Whether fail and output links cover every trie node
+
+    int child(int node, unsigned char c) const;
+    int find(const std::string& pattern) const;
+    void link();
+
+public:
+    /**
+     * @brief Constructs a matcher with no patterns
+     */
+    MentionMatcher();
+    /**
+     * @brief Rebuilds the automaton for a set of members
+     * @param users The room's members
+     */
+    void rebuild(const std::pmr::vector<User*>& users);
+    /**
+     * @brief Adds a member's name
+     * @param handle The member's handle
+     * @param name The member's name
+     *
+     * Only the new trie path is created; links are recomputed by the next
+     * match().
+     */
+    void add(unsigned int handle, const std::string& name);
+    /**
+     * @brief Removes a member's name
+     * @param handle The member's handle
+     * @param name The member's name
+     */
+    void remove(unsigned int handle, const std::string& name);
+    /**
+     * @brief Checks whether removals have left the trie mostly dead paths
+     * @return true if a rebuild() would reclaim more than it costs
+     */
+    bool isSparse() const;
+    /**
+     * @brief Finds the members mentioned in a message
+     * @param text The message text
+     * @return Handle of each mentioned member once, in order of first mention
+     */
+    std::vector<unsigned int> match(std::string_view text);
+    /**
+     * @brief Gets the number of names the automaton recognises
+     * @return The pattern count
+     */
+    std::size_t patternCount() const;
+};
+
+// ============= MEDIATOR PATTERN =============
+
+/**
+ * @class ChatRoom
+ * @brief Abstract mediator class for managing user interactions
  * 
- * Allows admins to create themed chat rooms with custom names
+ * Centralizes communication between users, reducing coupling between them
  */
-class CustomChatRoom : public ChatRoom {
+class ChatRoom {
 private:
-    std::string roomName;
+    static std::atomic<unsigned int> nextRoomId; ///< Source of unique room IDs
+    static thread_local long long pinnedTime; ///< Timestamp forced on new history entries (0 = wall clock)
+
+    void storeHistoryEntry(HistoryEntry&& entry);
+    void recordHistoryEntry(HistoryEntry&& entry);
+    void trimIndexes(bool underCap = false);
+    std::size_t heldBytes() const;
+    void resetHistory();
+    void rebaseCursors(unsigned long long cursor);
+    bool decodeRecords(const unsigned char* data, std::size_t size, std::size_t& pos, bool buildIndex, bool coldBlocks);
+
+protected:
+    unsigned int roomId; ///< Process-unique room ID
+    std::pmr::vector<User*> users;
+    std::pmr::vector<unsigned int> memberHandles; ///< Handle of each member, parallel to users
+    std::pmr::vector<HistoryEntry> chatHistory; ///< Full history, or the hot ring when retention is enabled
+    ChatHistoryIndex historyIndex; ///< Search index over the chat history
+    bool retentionEnabled;        ///< Whether chatHistory is used as a bounded ring
+    HistoryRetention retention;   ///< Active retention limits
+    std::size_t ringHead;         ///< Slot of the oldest in-memory message
+    std::size_t hotCount;         ///< Messages held in the ring
+    std::size_t hotBytes;         ///< Message bytes held in the ring
+    HistoryColdStore* coldStore;  ///< Tier for evicted messages (nullptr until needed)
+    RateLimiter* rateLimiter;     ///< Room-wide send limiter (nullptr = unlimited)
+    long long lastTimestamp;      ///< Timestamp of the newest message
+    std::pmr::vector<std::pair<long long, std::size_t>> timeIndex; ///< Sparse (timestamp, position) samples
+    MentionMatcher mentionMatcher; ///< "@name" automaton over the members
+    std::pmr::vector<std::uint64_t> mentionBits; ///< Handles mentioned by the message being delivered
+    std::mutex deliveryLock;       ///< Serialises sends and saves run by executor workers
+    std::unordered_map<const User*, std::pair<unsigned long long, MailboxShard*>> mailboxShards; ///< Each member's ring for this room, by mailbox ID
+    std::size_t historyBytes; ///< Memory held by in-memory history entries
+    std::size_t dedupBytes;   ///< Hot history text bytes served from the payload store
+    std::size_t memoryCap;    ///< Limit on heldBytes() (0 = unbounded)
+
+    /**
+     * @brief Finds this room's ring in a member's mailbox
+     * @param user The member
+     * @param mailbox The member's mailbox
+     * @return The ring, created on first delivery
+     */
+    MailboxShard* shardFor(const User* user, RingMailbox* mailbox);
+
+    /**
+     * @brief Delivers a message to every member except the sender
+     * @param envelope The message with its room and sender
+     * @param seen Handles already reached by the same broadcast (nullptr = none);
+     *        those members are skipped and the rest are marked
+     * @return Number of members reached, including passive ones
+     *
+     * Members mentioned as "@name" are delivered to first, through
+     * User::receiveMention(). The automaton is only rebuilt after a
+     * membership change, and only when a message contains '@'. Everyone
+     * else shares the one envelope, so its display form is rendered once.
+     */
+    std::size_t deliverMessage(const MessageEnvelope& envelope, HandleMarks* seen = nullptr);
+    /**
+     * @brief Writes a message's display form to the console
+     * @param envelope The message with its room and sender
+     *
+     * Nothing is rendered while delivery logging is disabled.
+     */
+    void echoMessage(const MessageEnvelope& envelope) const;
+
+    /**
+     * @brief Appends a message to the history and indexes it
+     * @param message The message content
+     * @param fromUser Pointer to the user who sent the message
+     *
+     * Assigns the next sequence number and a timestamp to the message. The
+     * stored entry shares the message buffer rather than copying it.
+     */
+    void appendHistory(const Message& message, User* fromUser);
+    /**
+     * @brief Appends a message to the history under a sender name
+     * @param message The message content
+     * @param sender Name of the user who sent the message
+     */
+    void appendHistory(const Message& message, std::string_view sender);
+    /**
+     * @brief Makes room for a number of upcoming history entries
+     * @param count Number of entries about to be appended
+     *
+     * Only the unbounded history is reserved; the retention ring manages
+     * its own capacity.
+     */
+    void reserveHistory(std::size_t count);
     
 public:
+    /**
+     * @brief Constructs a ChatRoom
+     * @param resource Memory resource for the member list, history, search index and cold-tier buffers
+     *
+     * Giving each room its own monotonic or pool resource keeps its memory
+     * together and lets the whole room be released at once. Message text is
+     * the exception: long messages live in shared buffers on the global heap,
+     * because other rooms, inboxes and queues may hold them after the room
+     * is gone.
+     */
+    explicit ChatRoom(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    virtual ~ChatRoom();
+    ChatRoom(const ChatRoom&) = delete;
+    ChatRoom& operator=(const ChatRoom&) = delete;
+
+      /**
+     * @brief Registers a user with the chat room
+     * @param user Pointer to the user to register
+     */
+    virtual void registerUser(User* user) = 0;
+      
+    /**
+     * @brief Removes a user from the chat room
+     * @param user Pointer to the user to remove
+     */
+    virtual void removeUser(User* user) = 0;
+    /**
+     * @brief Sends a message to all users in the room
+     * @param message The message to send
+     * @param fromUser Pointer to the user sending the message
+     */
+    virtual void sendMessage(const Message& message, User* fromUser) = 0;
+
      /**
-     * @brief Constructs a CustomChatRoom
-     * @param name The name for the custom room
+     * @brief Saves a message to the chat history
+     * @param message The message to save
+     * @param fromUser Pointer to the user who sent the message
      */
-    CustomChatRoom(const std::string& name);
-    void registerUser(User* user) override;
-    void removeUser(User* user) override;
-    void sendMessage(const std::string& message, User* fromUser) override;
-    void saveMessage(const std::string& message, User* fromUser) override;
-    Iterator* createIterator() override;
+    virtual void saveMessage(const Message& message, User* fromUser) = 0;
     /**
-     * @brief Gets the room's name
+     * @brief Creates an iterator for the chat history
+     * @return Pointer to a new Iterator object
+     */
+    virtual Iterator* createIterator() = 0;
+    /**
+     * @brief Gets the name shown in the room's output
      * @return The room name
      */
-    std::string getRoomName() const;
+    virtual std::string getRoomName() const = 0;
+    /**
+     * @brief Sends a batch of messages to all users in the room
+     * @param messages The messages to send, oldest first
+     * @param fromUser Pointer to the user sending the messages
+     *
+     * Members are snapshotted once and each receives the whole batch
+     * through User::receiveBatch(); the room's output is written once.
+     */
+    virtual void sendBatch(const std::vector<Message>& messages, User* fromUser);
+    /**
+     * @brief Delivers one leg of a multi-room broadcast
+     * @param message The message content
+     * @param fromUser Pointer to the user broadcasting
+     * @param seen Handles reached by earlier rooms of the broadcast; updated
+     * @return Number of members reached that no earlier room had reached
+     *
+     * Goes through the same fan-out as sendMessage(), without echoing the
+     * message; the caller holds the delivery lock.
+     */
+    std::size_t deliverBroadcast(const Message& message, User* fromUser, HandleMarks& seen);
+    /**
+     * @brief Saves a batch of messages to the chat history
+     * @param messages The messages to save, oldest first
+     * @param fromUser Pointer to the user who sent the messages
+     */
+    virtual void saveBatch(const std::vector<Message>& messages, User* fromUser);
+
+      /**
+     * @brief Gets the list of users in the chat room
+     * @return Reference to the users vector
+     */
+    std::pmr::vector<User*>& getUsers();
+    /**
+     * @brief Gets the lock held while a command sends or saves in this room
+     * @return The room's delivery lock
+     */
+    std::mutex& getDeliveryLock();
+    /**
+     * @brief Gets the memory attributed to the room
+     * @return Bytes held by the in-memory history and the member lists
+     */
+    RoomMemoryUsage getMemoryUsage() const;
+    /**
+     * @brief Caps the memory held by the in-memory history and its indexes
+     * @param bytes The cap (0 = unbounded)
+     *
+     * Turns on history retention if needed; entries over the cap are
+     * evicted oldest first to the cold tier. The cap covers the history
+     * ring, including empty slots, and the search and time indexes.
+     */
+    void setMemoryCap(std::size_t bytes);
+    /**
+     * @brief Counts members in a state with one scan of the user table
+     * @param tag The state to count
+     * @return Number of members in that state
+     */
+    std::size_t countMembersInState(StateTag tag) const;
+    /**
+     * @brief Runs every member's queued commands as one schedule
+     * @return Number of commands run
+     *
+     * Admin and system commands from any member run before ordinary
+     * traffic from the others; see User::executeAcross().
+     */
+    std::size_t dispatchCommands();
+    /**
+     * @brief Gets the chat history
+     * @return Reference to the chat history vector
+     *
+     * With retention enabled this is the raw in-memory ring; use
+     * historyAt() or createIterator() for ordered access to all tiers.
+     */
+    std::pmr::vector<HistoryEntry>& getChatHistory();
+    /**
+     * @brief Limits how fast messages may be sent to this room by anyone
+     * @param messagesPerSecond Sustained message rate
+     * @param burst Maximum number of messages sent back to back
+     * @param action What to do with a message when the room is over its rate
+     * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+     */
+    void setRateLimit(double messagesPerSecond, double burst,
+                      RateLimitAction action = RateLimitAction::Reject, double maxDelay = 1.0);
+    /**
+     * @brief Removes the room's rate limit
+     */
+    void clearRateLimit();
+    /**
+     * @brief Gets the room's rate limiter
+     * @return Pointer to the limiter, or nullptr if unlimited
+     */
+    RateLimiter* getRateLimiter() const;
+    /**
+     * @brief Gets the memory resource backing the room's containers
+     * @return The room's memory resource
+     */
+    std::pmr::memory_resource* getMemoryResource() const;
+    /**
+     * @brief Gets the room's unique ID
+     * @return The room ID
+     */
+    unsigned int getRoomId() const;
+    /**
+     * @brief Bounds the in-memory history, spilling older messages to disk
+     * @param policy The retention limits to apply
+     *
+     * Existing messages are moved into the ring and evicted if over limit.
+     */
+    void setHistoryRetention(const HistoryRetention& policy);
+    /**
+     * @brief Stamps history saved on this thread with a fixed time
+     * @param millis Milliseconds since the epoch, or 0 to use the wall clock again
+     *
+     * Used when replaying a journal, so restored messages keep their
+     * original times. Timestamps still never go backwards within a room.
+     */
+    static void pinClock(long long millis);
+    /**
+     * @brief Gets the active retention limits
+     * @param policy Receives the limits
+     * @return true if retention is enabled
+     */
+    bool getHistoryRetention(HistoryRetention& policy) const;
+    /**
+     * @brief Gets the cap on the memory held by the in-memory history and its indexes
+     * @return The cap in bytes (0 = unbounded)
+     */
+    std::size_t getMemoryCap() const;
+    /**
+     * @brief Adds members restored from a snapshot in one pass
+     * @param members Each member with its read cursor; none may already be in the room
+     *
+     * Unlike joining, nothing is printed, traced or journaled.
+     */
+    void restoreMembers(const std::vector<std::pair<User*, unsigned long long>>& members);
+    /**
+     * @brief Gets the total number of messages ever saved (all tiers)
+     * @return The history length
+     */
+    std::size_t historySize() const;
+    /**
+     * @brief Gets a history line by position, from whichever tier holds it
+     * @param position Position in the history (0 = oldest)
+     * @return The history line, or empty string if out of range
+     */
+    std::string historyAt(std::size_t position) const;
+    /**
+     * @brief Gets a history entry by position, from whichever tier holds it
+     * @param position Position in the history (0 = oldest)
+     * @return The entry, or an entry with seq 0 if out of range
+     */
+    HistoryEntry entryAt(std::size_t position) const;
+    /**
+     * @brief Gets the sequence number of the newest message
+     * @return The head sequence, or 0 if the history is empty
+     */
+    unsigned long long getHeadSequence() const;
+    /**
+     * @brief Finds the first history position at or after a time
+     * @param timestamp Milliseconds since the epoch
+     * @return The position, or historySize() if every message is older
+     *
+     * Binary searches the sparse time index, then scans at most one stride.
+     */
+    std::size_t findTimePosition(long long timestamp) const;
+    /**
+     * @brief Gets every message newer than a sequence number
+     * @param seq Last sequence the caller has seen (0 for everything)
+     * @return Entries with seq greater than the given one, oldest first
+     */
+    std::vector<HistoryEntry> getHistorySince(unsigned long long seq) const;
+    /**
+     * @brief Gets the messages saved within a time range
+     * @param fromTime Inclusive start, in milliseconds since the epoch
+     * @param toTime Inclusive end, in milliseconds since the epoch
+     * @return Matching entries, oldest first
+     */
+    std::vector<HistoryEntry> getHistoryBetween(long long fromTime, long long toTime) const;
+    /**
+     * @brief Creates an iterator whose next() is the first message after seq
+     * @param seq Last sequence the caller has seen (0 for everything)
+     * @return Pointer to a new ChatHistoryIterator
+     */
+    ChatHistoryIterator* createIteratorSince(unsigned long long seq);
+    /**
+     * @brief Gets the number of messages held in memory
+     * @return The in-memory message count
+     */
+    std::size_t getHotHistoryCount() const;
+    /**
+     * @brief Gets the number of messages spilled to cold storage
+     * @return The cold message count
+     */
+    std::size_t getColdHistoryCount() const;
+    /**
+     * @brief Gets the cold-storage file path
+     * @return The path, or an empty string if nothing has gone cold
+     */
+    std::string getColdPath() const;
+    /**
+     * @brief Gets the search index over the chat history
+     * @return Reference to the history index
+     */
+    ChatHistoryIndex& getHistoryIndex();
+    /**
+     * @brief Searches the chat history by keywords and/or sender
+     * @param keywords Keywords that must all appear (empty to ignore)
+     * @param sender Sender name to match (empty to ignore)
+     * @return Ascending positions into the chat history
+     */
+    std::vector<std::size_t> searchHistory(const std::string& keywords, const std::string& sender = "") const;
+    /**
+     * @brief Writes the chat history to a file and its index next to it
+     * @param path History file path; the index is written to path + ".idx"
+     * @return true on success, false otherwise
+     */
+    bool saveHistory(const std::string& path) const;
+    /**
+     * @brief Replaces the chat history with the contents of a history file
+     * @param path History file path written by saveHistory()
+     * @return true on success, false otherwise
+     *
+     * The index is loaded from path + ".idx" when it matches the history,
+     * and rebuilt from the history otherwise.
+     */
+    bool loadHistory(const std::string& path);
+    /**
+     * @brief Appends the history's binary records to a buffer
+     * @param out Buffer to append to
+     *
+     * Blocks already in the cold tier are copied still compressed, followed
+     * by a count and (timestamp, sender, text) for every later message; this
+     * is the same layout saveHistory() writes after its header.
+     */
+    void encodeHistory(std::vector<unsigned char>& out) const;
+    /**
+     * @brief Replaces the history with records read from a buffer
+     * @param data The buffer
+     * @param size Size of the buffer
+     * @param pos Read position, advanced past the records
+     * @param buildIndex Whether to rebuild the search index from the records
+     * @return true on success; the history is unchanged if the buffer is malformed
+     *
+     * The records are checked in one pass and stored straight into the
+     * room in a second, so no copy of the whole history is made.
+     */
+    bool decodeHistory(const unsigned char* data, std::size_t size, std::size_t& pos, bool buildIndex = true);
+};
+
+
+/**
+ * @class CtrlCat
+ * @brief Concrete mediator for the CtrlCat themed chat room
+ */
+class CtrlCat : public ChatRoom {
+public:
+    /**
+     * @brief Constructs a CtrlCat room
+     * @param resource Memory resource for the room's containers
+     */
+    explicit CtrlCat(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    void registerUser(User* user) override;
+    void removeUser(User* user) override;
+    void sendMessage(const Message& message, User* fromUser) override;
+    void saveMessage(const Message& message, User* fromUser) override;
+    Iterator* createIterator() override;
+    std::string getRoomName() const override;
+};
+/**
+ * @class Dogorithm
+ * @brief Concrete mediator for the Dogorithm themed chat room
+ */
+class Dogorithm : public ChatRoom {
+public:
+    /**
+     * @brief Constructs a Dogorithm room
+     * @param resource Memory resource for the room's containers
+     */
+    explicit Dogorithm(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    void registerUser(User* user) override;
+    void removeUser(User* user) override;
+    void sendMessage(const Message& message, User* fromUser) override;
+    void saveMessage(const Message& message, User* fromUser) override;
+    Iterator* createIterator() override;
+    std::string getRoomName() const override;
+};
+
+// ============= USER CLASSES =============
+/**
+ * @class User
+ * @brief Abstract base class for all users in the system
+ * 
+ * Manages user state, chat room membership, and command execution
+ */
+class User {
+    friend class WorkStealingExecutor;
+
+private:
+    static std::atomic<unsigned int> nextHandle;  ///< One past the highest handle issued
+    static std::vector<unsigned int> freeHandles; ///< Handles released by destroyed users
+    static std::mutex handleLock;                 ///< Guards freeHandles and handle issue
+
+protected:
+    unsigned int handle; ///< Dense process-unique ID, reused after the user is destroyed
+    std::pmr::string name;
+    std::pmr::vector<ChatRoom*> chatRooms;
+    std::pmr::unordered_map<const ChatRoom*, unsigned long long> readCursors; ///< Last acknowledged sequence per joined room
+    CommandScheduler commandQueue; ///< Pending commands, served by priority
+    UserState* currentState;
+    // EXTRA :: Admin
+    bool isAdmin;  
+    RateLimiter* rateLimiter;         ///< Per-user send limiter (nullptr = unlimited)
+    std::size_t maxQueuedCommands;    ///< Command queue bound (0 = unbounded)
+    unsigned long long backpressureCount; ///< Commands refused because the queue was full
+    std::vector<std::pair<ChatRoom*, std::string>> coalescedMessages; ///< Held text per joined room
+    std::size_t coalescedBytes;       ///< Text bytes held in coalescedMessages
+    std::size_t maxCoalescedBytes;    ///< Limit on coalescedBytes (0 = unbounded)
+    UserInbox* inbox;                 ///< Queue fed alongside receive() (nullptr = none)
+    RingMailbox* mailbox;             ///< Rings that replace synchronous room delivery (nullptr = none)
+    std::atomic<std::size_t> queuedBytes; ///< Memory held by queued commands
+    std::size_t queueMemoryCap;       ///< Limit on queuedBytes before sends are rejected (0 = unbounded)
+    std::size_t mailboxMemoryCap;     ///< Limit on inbox and ring mailbox bytes (0 = unbounded)
+    unsigned long long memoryRejections; ///< Sends rejected by the queue cap
+
+    /**
+     * @brief Checks the queue memory cap before queueing a send
+     * @param bytes Estimated bytes the send will queue
+     * @return false, after counting the rejection, if the cap would be exceeded
+     */
+    bool admitQueueBytes(std::size_t bytes);
+    mutable std::mutex queueLock;     ///< Guards commandQueue
+    mutable std::mutex inboxLock;     ///< Guards inbox, so a delivery never races the inbox detaching
+    std::mutex executionLock;         ///< Held while commands run, so they never run on two threads at once
+    std::atomic<bool> scheduled;      ///< Whether an executor task for this user is queued or running
+
+    /**
+     * @brief Checks the user's and the room's rate limiters
+     * @param room The destination room
+     * @param action Receives the action of the limiter that refused
+     * @param chargeUser false to consult only the room's limiter
+     * @return true if the message may be queued now
+     */
+    bool admitMessage(ChatRoom* room, RateLimitAction& action, bool chargeUser = true);
+    /**
+     * @brief Rate-limits a message and queues its send and log commands
+     * @param message The message content
+     * @param room Pointer to the destination chat room
+     * @return true if commands were queued
+     *
+     * Text held back by RateLimitAction::Coalesce is prepended to the next
+     * admitted message for the same room.
+     */
+    bool queueMessage(const std::string& message, ChatRoom* room);
+    /**
+     * @brief Applies rate limiting and coalescing to one message
+     * @param message The message content
+     * @param room Pointer to the destination chat room
+     * @param text Receives the text to send, including any held text
+     * @return true if the message was admitted
+     */
+    bool admitText(const std::string& message, ChatRoom* room, std::string& text);
+    /**
+     * @brief Checks that the command queue can take more commands
+     * @param commands Number of commands about to be queued
+     * @return true if they fit under the bound; otherwise the refusal is counted
+     */
+    bool hasQueueRoom(std::size_t commands);
+    /**
+     * @brief Discards text held back for a room
+     * @param room The room
+     */
+    void dropCoalesced(ChatRoom* room);
+    
+public:
+/**
+     * @brief Constructs a User
+     * @param userName The user's name
+     * @param admin Whether the user is an admin (default: false)
+     * @param resource Memory resource for the name, room list and command queue
+     */
+     User(const std::string& userName, bool admin = false,
+          std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    virtual ~User();
+    /**
+     * @brief Sends a message to a chat room
+     * @param message The message content
+     * @param room Pointer to the destination chat room
+     */
+    
+     virtual void send(const std::string& message, ChatRoom* room) = 0;
+    /**
+     * @brief Receives a message from a chat room
+     * @param message The message content
+     * @param fromUser Pointer to the user who sent the message
+     * @param room Pointer to the chat room
+     */
+     virtual void receive(const Message& message, User* fromUser, ChatRoom* room) = 0;
+    /**
+     * @brief Receives a batch of messages from a chat room
+     * @param messages The messages, oldest first
+     * @param fromUser Pointer to the user who sent the messages
+     * @param room Pointer to the chat room
+     *
+     * By default each message goes through receive(); override to handle
+     * the batch as a whole.
+     */
+    virtual void receiveBatch(const std::vector<Message>& messages, User* fromUser, ChatRoom* room);
+    /**
+     * @brief Receives a message that mentions this user
+     * @param message The message content
+     * @param fromUser Pointer to the user who sent the message
+     * @param room Pointer to the chat room
+     *
+     * Passes the message to receive(), then lets the current state react
+     * to the mention, which reaches the user even when Busy.
+     */
+    virtual void receiveMention(const Message& message, User* fromUser, ChatRoom* room);
+    /**
+     * @brief Receives a message in structured form
+     * @param envelope The message with its room and sender
+     *
+     * Forwards to receive(). Override to consume the rendered display form,
+     * which is cached on the envelope and shared by every recipient.
+     */
+    virtual void receiveEnvelope(const MessageEnvelope& envelope);
+    /**
+     * @brief Receives a coalesced batch of roommate presence changes
+     * @param updates Final state of each user that changed since the last tick
+     */
+    virtual void receivePresence(const std::vector<PresenceUpdate>& updates);
+    /**
+     * @brief Sends many messages to one chat room at once
+     * @param messages The messages, oldest first
+     * @param room Pointer to the destination chat room
+     * @return Number of messages that passed rate limiting and were sent
+     *
+     * The whole batch travels in one send and one log command, so members
+     * are snapshotted, history is reserved and output is flushed once.
+     */
+    std::size_t sendBatch(const std::vector<std::string>& messages, ChatRoom* room);
+    /**
+     * @brief Sends one message to every room the user has joined
+     * @param message The message content
+     * @return Number of distinct users the message was delivered to
+     */
+    std::size_t broadcast(const std::string& message);
+    /**
+     * @brief Sends one message to several rooms, once per recipient
+     * @param message The message content
+     * @param rooms The rooms to send to
+     * @return Number of distinct users the message was delivered to
+     *
+     * Every room that admits the message records it in its history, but
+     * a user who is a member of several of them receives it only once.
+     * The broadcast costs the sender one rate-limit token; each room's
+     * own limiter is still charged, and rooms that refuse are skipped.
+     */
+    std::size_t broadcast(const std::string& message, const std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Gets the user's handle
+     * @return Dense ID, unique among live users
+     */
+    unsigned int getHandle() const;
+    /**
+     * @brief Gets an upper bound on the handles of live users
+     * @return One past the highest handle issued so far
+     */
+    static unsigned int getHandleLimit();
+    /**
+     * @brief Attaches an inbox that is fed every message the user receives
+     * @param userInbox The inbox, or nullptr to detach
+     *
+     * Detaching waits for a delivery in progress on another thread, so the
+     * old inbox may be destroyed as soon as this returns.
+     */
+    void setInbox(UserInbox* userInbox);
+    /**
+     * @brief Gets the attached inbox
+     * @return The inbox, or nullptr if none is attached
+     */
+    UserInbox* getInbox() const;
+    /**
+     * @brief Queues a received message in the attached inbox, if any
+     * @param message The message content
+     * @param fromUser Pointer to the user who sent the message
+     * @param room Pointer to the chat room, or nullptr for a direct message
+     * @param mention Whether the message mentions this user
+     */
+    void deliverToInbox(const Message& message, const User* fromUser, const ChatRoom* room, bool mention = false);
+    /**
+     * @brief Switches room delivery to this user over to ring mailboxes
+     * @param userMailbox The mailbox, or nullptr to go back to synchronous delivery
+     */
+    void setMailbox(RingMailbox* userMailbox);
+    /**
+     * @brief Gets the attached ring mailbox
+     * @return The mailbox, or nullptr if none is attached
+     */
+    RingMailbox* getMailbox() const;
+    /**
+     * @brief Hands queued mailbox messages to the user's receive path
+     * @param maxMessages Most messages to take
+     * @return Number of messages consumed
+     *
+     * Runs from one sender in one room go through receiveBatch() together
+     * and mentions through receiveMention(). Call from the user's single
+     * consumer thread.
+     */
+    std::size_t drainMailbox(std::size_t maxMessages);
+    /**
+     * @brief Gets the memory attributed to the user
+     * @return Bytes held by the command queue, mailboxes and name
+     */
+    UserMemoryUsage getMemoryUsage() const;
+    /**
+     * @brief Caps the memory the user's queue and mailboxes may hold
+     * @param queueBytes Queue cap; sends that would exceed it are rejected (0 = unbounded)
+     * @param mailboxBytes Mailbox cap; the inbox drops its oldest messages and
+     *        ring mailboxes refuse new ones to stay under it (0 = unbounded)
+     */
+    void setMemoryCaps(std::size_t queueBytes, std::size_t mailboxBytes);
+    /**
+     * @brief Gets the mailbox memory cap
+     * @return The cap in bytes (0 = unbounded)
+     */
+    std::size_t getMailboxMemoryCap() const;
+    /**
+     * @brief Gets the number of sends rejected by the queue memory cap
+     * @return The rejection count
+     */
+    unsigned long long getMemoryRejectionCount() const;
+    /**
+     * @brief Marks a room's messages as read up to a sequence number
+     * @param room The room
+     * @param seq Last sequence number read (clamped to the room's head)
+     * @return false if the user is not a member of the room
+     *
+     * The cursor never moves backwards.
+     */
+    bool acknowledge(ChatRoom* room, unsigned long long seq);
+    /**
+     * @brief Marks every message currently in a room as read
+     * @param room The room
+     * @return false if the user is not a member of the room
+     */
+    bool acknowledge(ChatRoom* room);
+    /**
+     * @brief Gets the last sequence number acknowledged in a room
+     * @param room The room
+     * @return The cursor, or 0 if the user is not a member
+     */
+    unsigned long long getReadCursor(const ChatRoom* room) const;
+    /**
+     * @brief Gets the number of messages past the read cursor
+     * @param room The room
+     * @return The room's head sequence minus the cursor (0 if not a member)
+     */
+    unsigned long long getUnreadCount(const ChatRoom* room) const;
+    /**
+     * @brief Creates an iterator over the unread messages of a room
+     * @param room The room
+     * @return Iterator starting just after the read cursor (caller must delete),
+     *         or nullptr if the user is not a member
+     */
+    ChatHistoryIterator* fetchUnread(ChatRoom* room);
+    /**
+     * @brief Sends a message straight to one user, without a room
+     * @param toHandle Handle of the receiving user
+     * @param message The message content
+     * @return true if the message was delivered to a live user
+     *
+     * The recipient's state decides how the message is handled, and the
+     * message is kept in the pair's conversation history.
+     */
+    bool sendDirect(unsigned int toHandle, const std::string& message);
+    /**
+     * @brief Gets the direct conversation with another user
+     * @param other The other participant
+     * @return The conversation, or nullptr if none has been started
+     */
+    const DirectConversation* getConversationWith(const User* other) const;
+    /**
+     * @brief Adds a command to the command queue
+     * @param command Pointer to the command to add
+     * @return true if the command was queued
+     *
+     * If the queue is at its bound the command is refused and deleted, so a
+     * caller outpacing execution sees the failure instead of growing memory.
+     */
+    bool addCommand(Command* command);
+    /**
+     * @brief Bounds the command queue
+     * @param maxCommands Maximum queued commands (0 = unbounded)
+     */
+    void setMaxQueuedCommands(std::size_t maxCommands);
+    /**
+     * @brief Gets how often a producer hit the command queue bound
+     * @return The number of refused sends and commands
+     */
+    unsigned long long getBackpressureCount() const;
+    /**
+     * @brief Bounds the text held back by RateLimitAction::Coalesce
+     * @param maxBytes Maximum held bytes across all rooms (0 = unbounded)
+     */
+    void setMaxCoalescedBytes(std::size_t maxBytes);
+    /**
+     * @brief Limits how fast this user may send messages
+     * @param messagesPerSecond Sustained message rate
+     * @param burst Maximum number of messages sent back to back
+     * @param action What to do with a message when the user is over its rate
+     * @param maxDelay Longest wait in seconds for RateLimitAction::Delay
+     */
+    void setRateLimit(double messagesPerSecond, double burst,
+                      RateLimitAction action = RateLimitAction::Reject, double maxDelay = 1.0);
+    /**
+     * @brief Removes the user's rate limit
+     */
+    void clearRateLimit();
+    /**
+     * @brief Gets the user's rate limiter
+     * @return Pointer to the limiter, or nullptr if unlimited
+     */
+    RateLimiter* getRateLimiter() const;
+    /**
+     * @brief Sends coalesced text that is still being held, if tokens allow
+     * @return Number of rooms whose held text was sent
+     */
+    std::size_t flushCoalesced();
+    /**
+     * @brief Checks whether coalesced text is held for a room
+     * @param room The room to check
+     * @return true if text is waiting to be sent
+     */
+    bool hasCoalesced(ChatRoom* room) const;
+    /**
+     * @brief Drops everything the user keeps about a room being destroyed
+     * @param room The room
+     *
+     * Called by ~ChatRoom for each member; the room is not called back.
+     */
+    void forgetRoom(ChatRoom* room);
+    /**
+     * @brief Records membership of a room that added the user itself
+     * @param room The room
+     * @param cursor The read cursor to start from (clamped to the room's head)
+     *
+     * Called by ChatRoom::restoreMembers() and by registerUser() when the
+     * user did not join through joinChatRoom(); the room is not called
+     * back. Does nothing if the room is already recorded.
+     */
+    void restoreRoom(ChatRoom* room, unsigned long long cursor);
+    /**
+     * @brief Moves a room's read cursor after the room replaced its history
+     * @param room The room
+     * @param cursor The new cursor
+     *
+     * Called by the room; unlike acknowledge() the cursor may move back.
+     */
+    void rebaseCursor(const ChatRoom* room, unsigned long long cursor);
+     /**
+     * @brief Executes all commands in the queue
+     *
+     * Commands run in priority order: System, then Admin, then Normal.
+     */
+    void executeAll();
+    /**
+     * @brief Executes up to a number of queued commands
+     * @param maxCommands Most commands to run
+     * @return Number of commands run
+     */
+    std::size_t drainCommands(std::size_t maxCommands);
+    /**
+     * @brief Executes several users' queued commands as one schedule
+     * @param users The users whose queues are drained
+     * @return Number of commands run
+     *
+     * The most urgent head across all queues runs next, and equal
+     * priorities run in the order they were queued, so one user's admin
+     * command overtakes another user's flood.
+     */
+    static std::size_t executeAcross(const std::vector<User*>& users);
+    /**
+     * @brief Queues a message and leaves its delivery to an executor
+     * @param message The message content
+     * @param room Pointer to the destination chat room
+     * @param executor Executor that drains the user's queue
+     * @return true if the message was admitted
+     *
+     * One thread at a time may send for a given user.
+     */
+    bool sendAsync(const std::string& message, ChatRoom* room, WorkStealingExecutor& executor);
+    /**
+     * @brief Gets the number of commands waiting in the queue
+     * @return The queued command count
+     */
+    std::size_t getQueuedCommandCount() const;
+    /**
+     * @brief Sets how often lower-priority commands may be passed over
+     * @param limit Bypasses tolerated before a waiting level is served
+     */
+    void setStarvationLimit(std::size_t limit);
+    /**
+     * @brief Sets the user's state
+     * @param newState Pointer to the new state
+     */
+    void setState(UserState* newState);
+    /**
+     * @brief Gets the user's current state
+     * @return Pointer to the current UserState
+     */
+    UserState* getState() const;
+     
+    /**
+     * @brief Gets the user's name
+     * @return The user's name
+     */
+    std::string getName() const;
+     /**
+     * @brief Joins a chat room
+     * @param room Pointer to the chat room to join
+     */
+    void joinChatRoom(ChatRoom* room);
+    /**
+     * @brief Leaves a chat room
+     * @param room Pointer to the chat room to leave
+     */
+    void leaveChatRoom(ChatRoom* room);
+     /**
+     * @brief Gets the list of chat rooms the user has joined
+     * @return Reference to the chat rooms vector
+     */
+    std::pmr::vector<ChatRoom*>& getChatRooms();
+    /**
+     * @brief Sets the user's admin status
+     * @param admin Whether the user should be an admin
+     */
+    void setAdmin(bool admin);
+     /**
+     * @brief Gets the user's admin status
+     * @return true if user is admin, false otherwise
+     */
+    bool getAdmin() const;
+    /**
+     * @brief Creates a new chat room (admin only)
+     * @param roomType The type/name of the room to create
+     * @param resource Memory resource for the new room's containers
+     * @return Pointer to the new ChatRoom, or nullptr if not admin or the name is taken
+     *
+     * The room is tracked by ChatRoomRegistry::global(), which can find it
+     * by name and deletes it at shutdown if nobody else does. Room names
+     * are unique: asking for a name already in use logs a warning and
+     * returns nullptr rather than a second room of that name, so callers
+     * that used to create same-named rooms must pick distinct names or
+     * look the existing room up with ChatRoomRegistry::find().
+     */
+    ChatRoom* createChatRoom(const std::string& roomType,
+                             std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    /**
+     * @brief Creates a new chat room in a given registry (admin only)
+     * @param roomType The type/name of the room to create
+     * @param registry Registry the name must be unique in and that tracks the room
+     * @param resource Memory resource for the new room's containers
+     * @return Pointer to the new ChatRoom, or nullptr if not admin or the name is taken
+     */
+    ChatRoom* createChatRoom(const std::string& roomType, ChatRoomRegistry& registry,
+                             std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+};
+
+/**
+ * @class User1
+ * @brief Concrete user implementation
+ */
+class User1 : public User {
+public:
+    /**
+     * @brief Constructs a User1
+     * @param userName The user's name
+     * @param resource Memory resource for the user's containers
+     */
+    User1(const std::string& userName, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    void send(const std::string& message, ChatRoom* room) override;
+    void receive(const Message& message, User* fromUser, ChatRoom* room) override;
+};
+/**
+ * @class User2
+ * @brief Concrete user implementation
+ */
+class User2 : public User {
+public:
+    /**
+     * @brief Constructs a User2
+     * @param userName The user's name
+     * @param resource Memory resource for the user's containers
+     */
+    User2(const std::string& userName, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    void send(const std::string& message, ChatRoom* room) override;
+    void receive(const Message& message, User* fromUser, ChatRoom* room) override;
+};
+/**
+ * @class User3
+ * @brief Concrete user implementation
+ */
+
+class User3 : public User {
+public:
+    /**
+     * @brief Constructs a User3
+     * @param userName The user's name
+     * @param resource Memory resource for the user's containers
+     */
+    User3(const std::string& userName, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    void send(const std::string& message, ChatRoom* room) override;
+    void receive(const Message& message, User* fromUser, ChatRoom* room) override;
+};
+
+// ============= extra : CustomChatRoom CLASSES =============
+
+
+/**
+ * @class CustomChatRoom
+ * @brief A customizable chat room with user-defined name
+ * 
+ * Allows admins to create themed chat rooms with custom names
+ */
+class CustomChatRoom : public ChatRoom {
+private:
+    friend class ChatRoomRegistry;
+    std::pmr::string roomName;
+    ChatRoomRegistry* registry; ///< Registry tracking this room (nullptr if untracked)
+
+    static ObjectSlab& slab();
+    
+public:
+     /**
+     * @brief Constructs a CustomChatRoom
+     * @param name The name for the custom room
+     * @param resource Memory resource for the room's containers
+     */
+    CustomChatRoom(const std::string& name, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    /**
+     * @brief Destructs the room, dropping it from its registry if any
+     */
+    ~CustomChatRoom() override;
+    /**
+     * @brief Allocates a room from the shared room slab
+     * @param size Requested size
+     * @return Storage for the room
+     */
+    static void* operator new(std::size_t size);
+    /**
+     * @brief Returns a room's storage to the shared room slab
+     * @param pointer Storage from operator new
+     * @param size Size of the room
+     */
+    static void operator delete(void* pointer, std::size_t size);
+    void registerUser(User* user) override;
+    void removeUser(User* user) override;
+    void sendMessage(const Message& message, User* fromUser) override;
+    void saveMessage(const Message& message, User* fromUser) override;
+    Iterator* createIterator() override;
+    /**
+     * @brief Gets the room's name
+     * @return The room name
+     */
+    std::string getRoomName() const override;
+};
+// ============= extra : DIRECT MESSAGING =============
+
+/**
+ * @struct DirectEntry
+ * @brief One message in a direct conversation
+ */
+struct DirectEntry {
+    Message text;       ///< Message content
+    bool fromFirst;     ///< true if sent by the conversation's first participant
+};
+
+/**
+ * @class DirectConversation
+ * @brief Compact history of the messages exchanged by two users
+ *
+ * Entries only record which side sent them; names are looked up through
+ * the user directory when a line is read.
+ */
+class DirectConversation {
+private:
+    unsigned int first;  ///< Lower participant handle
+    unsigned int second; ///< Higher participant handle
+    std::vector<DirectEntry> entries;
+
+public:
+    /**
+     * @brief Constructs an empty conversation between two users
+     * @param handleA Handle of one participant
+     * @param handleB Handle of the other participant
+     */
+    DirectConversation(unsigned int handleA, unsigned int handleB);
+    /**
+     * @brief Records a message
+     * @param fromHandle Handle of the sender (must be a participant)
+     * @param message The message content
+     */
+    void append(unsigned int fromHandle, const Message& message);
+    /**
+     * @brief Gets the number of messages exchanged
+     * @return The conversation length
+     */
+    std::size_t size() const;
+    /**
+     * @brief Gets a conversation line by position
+     * @param position Position in the conversation (0 = oldest)
+     * @return "sender: text", or empty string if out of range
+     */
+    std::string at(std::size_t position) const;
+    /**
+     * @brief Checks whether a user takes part in the conversation
+     * @param handle The user's handle
+     * @return true if the user is a participant
+     */
+    bool involves(unsigned int handle) const;
+};
+
+/**
+ * @class UserDirectory
+ * @brief Process-wide table of live users indexed by handle
+ *
+ * Users add themselves on construction and remove themselves on
+ * destruction, so lookups by handle are a single array index.
+ *
+ * The slot array is sized once for every handle and never reallocated,
+ * and the slots are atomic, so executor workers can look users up while
+ * another thread creates users. It is a zero-filled static, so only pages
+ * for handles in use are ever touched.
+ */
+class UserDirectory {
+public:
+    static const unsigned int MAX_HANDLES = 1u << 24; ///< Handles the directory has slots for
+
+private:
+    /**
+     * @struct ConversationTable
+     * @brief Owns the direct conversations, indexed by pair and by participant
+     */
+    struct ConversationTable {
+        std::unordered_map<unsigned long long, DirectConversation*> byPair; ///< Keyed by handle pair
+        std::vector<std::vector<unsigned long long>> byHandle; ///< Pair keys each handle takes part in
+        /**
+         * @brief Deletes every conversation still held
+         */
+        ~ConversationTable();
+    };
+
+    static std::atomic<User*> users[MAX_HANDLES]; ///< Slot per handle (nullptr = free)
+    static std::atomic<std::size_t> live;         ///< Number of occupied slots
+    static ConversationTable conversations;
+
+    static unsigned long long pairKey(unsigned int handleA, unsigned int handleB);
+
+public:
+    /**
+     * @brief Adds a user under its handle
+     * @param user The user to add
+     */
+    static void add(User* user);
+    /**
+     * @brief Removes a user and every conversation it took part in
+     * @param user The user to remove
+     */
+    static void remove(User* user);
+    /**
+     * @brief Looks up a live user by handle
+     * @param handle The user's handle
+     * @return The user, or nullptr if no live user has that handle
+     */
+    static User* find(unsigned int handle);
+    /**
+     * @brief Gets the number of live users
+     * @return The live user count
+     */
+    static std::size_t size();
+    /**
+     * @brief Gets the conversation between two users
+     * @param handleA Handle of one participant
+     * @param handleB Handle of the other participant
+     * @param create Whether to start the conversation if it does not exist
+     * @return The conversation, or nullptr if absent and not created
+     */
+    static DirectConversation* conversation(unsigned int handleA, unsigned int handleB, bool create = false);
+};
+// ============= extra : ROOM REGISTRY =============
+
+/**
+ * @class ObjectSlab
+ * @brief Fixed-size object allocator carving slots out of large blocks
+ *
+ * Freed slots go on a free list and are reused before a new block is
+ * taken, so memory is bounded by the peak number of live objects.
+ */
+class ObjectSlab {
+private:
+    std::size_t slotSize;      ///< Bytes per slot, rounded up for alignment
+    std::size_t slotsPerBlock; ///< Slots carved from each block
+    std::vector<void*> blocks; ///< Blocks owned by the slab
+    void* freeList;            ///< First free slot (each free slot links to the next)
+    std::size_t live;          ///< Slots currently handed out
+
+public:
+    /**
+     * @brief Constructs an empty slab
+     * @param objectSize Size of each object
+     * @param blockSlots Number of objects per block
+     */
+    ObjectSlab(std::size_t objectSize, std::size_t blockSlots = 64);
+    ~ObjectSlab();
+    ObjectSlab(const ObjectSlab&) = delete;
+    ObjectSlab& operator=(const ObjectSlab&) = delete;
+    /**
+     * @brief Takes a free slot, growing by one block if none is left
+     * @return Storage for one object
+     */
+    void* allocate();
+    /**
+     * @brief Returns a slot to the free list
+     * @param pointer Storage from allocate()
+     */
+    void deallocate(void* pointer);
+    /**
+     * @brief Gets the number of blocks the slab has taken
+     * @return The block count
+     */
+    std::size_t blockCount() const;
+    /**
+     * @brief Gets the number of slots currently handed out
+     * @return The live object count
+     */
+    std::size_t liveCount() const;
+};
+
+/**
+ * @class ChatRoomRegistry
+ * @brief Owns custom rooms and finds them by name
+ *
+ * Names are unique within a registry. Deleting a room directly is still
+ * allowed; the room removes itself from the registry on destruction.
+ */
+class ChatRoomRegistry {
+private:
+    std::unordered_map<std::string, CustomChatRoom*> rooms; ///< Rooms by name
+
+    void release(CustomChatRoom* room);
+
+public:
+    ChatRoomRegistry() = default;
+    /**
+     * @brief Deletes every room still registered
+     *
+     * Members still in a room are detached as it is deleted (see
+     * ~ChatRoom), but unlike teardown() no leave is journaled or traced,
+     * since those sinks may already be gone at shutdown.
+     */
+    ~ChatRoomRegistry();
+    ChatRoomRegistry(const ChatRoomRegistry&) = delete;
+    ChatRoomRegistry& operator=(const ChatRoomRegistry&) = delete;
+    /**
+     * @brief Gets the registry used by User::createChatRoom()
+     * @return The process-wide registry
+     */
+    static ChatRoomRegistry& global();
+    /**
+     * @brief Creates and registers a custom room
+     * @param name The room name (must not be taken)
+     * @param resource Memory resource for the room's containers
+     * @return The new room, or nullptr if the name is taken
+     */
+    CustomChatRoom* create(const std::string& name,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    /**
+     * @brief Looks up a room by name
+     * @param name The room name
+     * @return The room, or nullptr if none has that name
+     */
+    CustomChatRoom* find(const std::string& name) const;
+    /**
+     * @brief Removes every member from a room and deletes it
+     * @param name The room name
+     * @return true if the room existed
+     */
+    bool destroy(const std::string& name);
+    /**
+     * @brief Removes every member from every room and deletes them all
+     * @return Number of rooms deleted
+     */
+    std::size_t teardown();
+    /**
+     * @brief Gets the number of registered rooms
+     * @return The room count
+     */
+    std::size_t size() const;
+    /**
+     * @brief Stops tracking a room that is being deleted elsewhere
+     * @param room The room
+     */
+    void forget(CustomChatRoom* room);
+};
+// ============= extra : SNAPSHOTS =============
+
+/**
+ * @class PetSpaceSnapshot
+ * @brief Versioned binary snapshot of users, rooms, membership and history
+ *
+ * The whole state is encoded into memory first and written with a single
+ * write, so the file always describes one consistent moment. Restoring
+ * maps the file and rebuilds the objects from it as it is read. Custom
+ * rooms are restored into ChatRoomRegistry::global(), and each room gets
+ * back its retention policy and memory cap.
+ */
+class PetSpaceSnapshot {
+public:
+    /**
+     * @brief Encodes users and rooms into a buffer
+     * @param out Buffer to append to
+     * @param users The users to capture
+     * @param rooms The rooms to capture
+     * @return false if a user is not a User1, User2 or User3 (or subclass);
+     *         nothing is appended then
+     *
+     * Memberships of users outside the given list are not recorded.
+     * Subclasses of the built-in user types come back as their base type.
+     */
+    static bool encode(std::vector<unsigned char>& out, const std::vector<User*>& users,
+                       const std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Rebuilds users and rooms from a buffer
+     * @param data The buffer
+     * @param size Size of the buffer
+     * @param users Receives the restored users (caller owns them)
+     * @param rooms Receives the restored rooms (caller owns them)
+     * @return true on success; nothing is added on failure
+     *
+     * Fails if a custom room's name is already taken in the global registry.
+     */
+    static bool decode(const unsigned char* data, std::size_t size, std::vector<User*>& users,
+                       std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Writes a snapshot file
+     * @param path File path
+     * @param users The users to capture
+     * @param rooms The rooms to capture
+     * @return true on success, false otherwise
+     */
+    static bool save(const std::string& path, const std::vector<User*>& users, const std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Restores users and rooms from a snapshot file
+     * @param path File path written by save()
+     * @param users Receives the restored users (caller owns them)
+     * @param rooms Receives the restored rooms (caller owns them)
+     * @return true on success, false if the file is missing, malformed or of another version
+     */
+    static bool load(const std::string& path, std::vector<User*>& users, std::vector<ChatRoom*>& rooms);
+};
+// ============= extra : COMMAND JOURNAL =============
+
+/**
+ * @enum JournalRecord
+ * @brief Kind of a record in the command journal
+ */
+enum class JournalRecord : unsigned char {
+    Send = 1,      ///< SendMessageCommand
+    Log = 2,       ///< LogMessageCommand
+    SendBatch = 3, ///< SendBatchCommand
+    LogBatch = 4,  ///< LogBatchCommand
+    Direct = 5,    ///< DirectMessageCommand
+    NewUser = 6,   ///< User added to the catalog
+    NewRoom = 7,   ///< Room added to the catalog
+    Join = 8,      ///< User joined a room
+    Leave = 9      ///< User left a room
+};
+
+/**
+ * @class CommandJournal
+ * @brief Append-only write-ahead log of executed commands
+ *
+ * While installed, every command is serialized before it executes.
+ * Records are buffered and written with one flush and fsync per group
+ * (group commit), so durability costs one sync per batch rather than per
+ * message. A background thread commits a group whose oldest record has
+ * waited maxDelay, so an idle tail is never left unsynced. Each record
+ * carries its wall-clock time, which replay gives back to the history.
+ * Users and rooms are referred to by their index in a catalog
+ * that matches the user and room lists of the last snapshot, so
+ * recover() can load that snapshot and replay the journal on top.
+ *
+ * The journal may be appended to from several threads at once.
+ */
+class CommandJournal {
+private:
+    static CommandJournal* active; ///< Journal fed by User::executeAll()
+
+    std::string path;
+    std::FILE* file;
+    std::vector<unsigned char> pending; ///< Framed records not yet written
+    std::size_t pendingRecords;
+    std::size_t groupSize;              ///< Records per group commit
+    double maxDelay;                    ///< Longest a record may wait for its group, in seconds
+    std::chrono::steady_clock::time_point oldestPending;
+    std::unordered_map<const User*, unsigned long long> userIndex;
+    std::unordered_map<const ChatRoom*, unsigned long long> roomIndex;
+    unsigned long long nextUserIndex; ///< Index given to the next tracked user
+    unsigned long long nextRoomIndex; ///< Index given to the next tracked room
+    unsigned long long records;  ///< Records appended since opening
+    unsigned long long syncs;    ///< Group commits performed
+    unsigned long long skipped;  ///< Commands that could not be journaled
+    mutable std::recursive_mutex lock; ///< Guards the buffer, catalog and file (serialize() re-enters indexOf())
+    std::condition_variable_any wake;  ///< Wakes the flusher when a group starts or the journal closes
+    std::thread flusher;               ///< Commits groups whose delay has run out
+    bool stopping;                     ///< Tells the flusher to exit
+
+    void appendRecord(const std::vector<unsigned char>& payload);
+    void flushLoop();
+
+public:
+    /**
+     * @brief Opens (or creates) a journal file for appending
+     * @param journalPath File path
+     * @param group Records per group commit
+     * @param delay Longest a record may wait for its group, in seconds
+     */
+    CommandJournal(const std::string& journalPath, std::size_t group = 64, double delay = 0.01);
+    /**
+     * @brief Commits pending records and closes the file
+     */
+    ~CommandJournal();
+    CommandJournal(const CommandJournal&) = delete;
+    CommandJournal& operator=(const CommandJournal&) = delete;
+    /**
+     * @brief Makes a journal the one User::executeAll() writes to
+     * @param journal The journal, or nullptr to stop journaling
+     */
+    static void install(CommandJournal* journal);
+    /**
+     * @brief Gets the installed journal
+     * @return The journal, or nullptr if none is installed
+     */
+    static CommandJournal* current();
+    /**
+     * @brief Checks whether the journal file is open
+     * @return true if records can be written
+     */
+    bool isOpen() const;
+    /**
+     * @brief Replaces the catalog of users and rooms
+     * @param users Users, indexed by position
+     * @param rooms Rooms, indexed by position
+     */
+    void setCatalog(const std::vector<User*>& users, const std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Adds a user to the catalog and journals its creation
+     * @param user The new user
+     */
+    void trackUser(User* user);
+    /**
+     * @brief Adds a room to the catalog and journals its creation
+     * @param room The new room
+     */
+    void trackRoom(ChatRoom* room);
+    /**
+     * @brief Looks up a user's catalog index
+     * @param user The user
+     * @param index Receives the index
+     * @return true if the user is in the catalog
+     */
+    bool indexOf(const User* user, unsigned long long& index) const;
+    /**
+     * @brief Looks up a room's catalog index
+     * @param room The room
+     * @param index Receives the index
+     * @return true if the room is in the catalog
+     */
+    bool indexOf(const ChatRoom* room, unsigned long long& index) const;
+    /**
+     * @brief Drops a user that is being destroyed from the catalog
+     * @param user The user
+     */
+    void forget(const User* user);
+    /**
+     * @brief Drops a room that is being destroyed from the catalog
+     * @param room The room
+     */
+    void forget(const ChatRoom* room);
+    /**
+     * @brief Journals a command ahead of its execution
+     * @param command The command about to run
+     * @return true if a record was appended
+     *
+     * A command naming a user or room outside the catalog is logged as a
+     * warning and counted by getSkippedCount().
+     */
+    bool append(const Command& command);
+    /**
+     * @brief Journals a membership change
+     * @param type JournalRecord::Join or JournalRecord::Leave
+     * @param user The user
+     * @param room The room
+     * @return true if a record was appended
+     */
+    bool appendMembership(JournalRecord type, const User* user, const ChatRoom* room);
+    /**
+     * @brief Writes and fsyncs every pending record
+     * @return true on success; on failure the records stay pending
+     */
+    bool sync();
+    /**
+     * @brief Saves a snapshot and starts a fresh journal on top of it
+     * @param snapshotPath Snapshot file path
+     * @param users Users to capture; also becomes the catalog
+     * @param rooms Rooms to capture; also becomes the catalog
+     * @return true on success
+     *
+     * The snapshot is written to a temporary file, synced and renamed into
+     * place; the journal is only truncated once that has succeeded.
+     */
+    bool checkpoint(const std::string& snapshotPath, const std::vector<User*>& users,
+                    const std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Gets the number of records appended since opening
+     * @return The record count
+     */
+    unsigned long long getRecordCount() const;
+    /**
+     * @brief Gets the number of group commits performed
+     * @return The sync count
+     */
+    unsigned long long getSyncCount() const;
+    /**
+     * @brief Gets the number of commands that could not be journaled
+     * @return The skipped command count
+     */
+    unsigned long long getSkippedCount() const;
+    /**
+     * @brief Gets the number of records waiting for their group commit
+     * @return The pending record count
+     */
+    std::size_t getPendingCount() const;
+    /**
+     * @brief Applies a journal to restored users and rooms
+     * @param journalPath Journal file path
+     * @param users Catalog users; users created by the journal are appended
+     * @param rooms Catalog rooms; rooms created by the journal are appended
+     * @return Number of records applied
+     *
+     * Replay stops at the first torn or corrupt record.
+     */
+    static std::size_t replay(const std::string& journalPath, std::vector<User*>& users,
+                              std::vector<ChatRoom*>& rooms);
+    /**
+     * @brief Restores the last snapshot and replays the journal after it
+     * @param snapshotPath Snapshot file path
+     * @param journalPath Journal file path
+     * @param users Receives the recovered users (caller owns them)
+     * @param rooms Receives the recovered rooms (caller owns them)
+     * @return true if the snapshot was loaded
+     */
+    static bool recover(const std::string& snapshotPath, const std::string& journalPath,
+                        std::vector<User*>& users, std::vector<ChatRoom*>& rooms);
+};
+// ============= extra : TRACE RECORD AND REPLAY =============
+
+/**
+ * @enum TraceEvent
+ * @brief Kind of an event in a workload trace
+ */
+enum class TraceEvent : unsigned char {
+    DefineUser = 1, ///< First sighting of a user: kind, name, admin, state
+    DefineRoom = 2, ///< First sighting of a room: kind, name
+    Join = 3,       ///< User::joinChatRoom()
+    Leave = 4,      ///< User::leaveChatRoom()
+    Send = 5,       ///< User::send()
+    SetState = 6,   ///< User::setState()
+    CreateRoom = 7  ///< User::createChatRoom()
+};
+
+/**
+ * @class TraceRecorder
+ * @brief Captures public API calls into a compact binary trace
+ *
+ * While installed, joins, leaves, sends, state changes and room creation
+ * are recorded with the microseconds elapsed since the previous event.
+ * Users and rooms get small trace IDs the first time they appear.
+ */
+class TraceRecorder {
+private:
+    static TraceRecorder* active; ///< Recorder fed by the User hooks
+
+    std::FILE* file;
+    std::vector<unsigned char> buffer; ///< Events not yet written
+    std::unordered_map<const User*, unsigned long long> userIds;
+    std::unordered_map<const ChatRoom*, unsigned long long> roomIds;
+    unsigned long long nextUserId;
+    unsigned long long nextRoomId;
+    std::chrono::steady_clock::time_point last; ///< Time of the previous event
+    unsigned long long events;
+
+    unsigned long long userId(const User* user);
+    unsigned long long roomId(const ChatRoom* room);
+    void begin(TraceEvent event);
+    void finish();
+
+public:
+    /**
+     * @brief Creates a trace file
+     * @param path File path (truncated if it exists)
+     */
+    explicit TraceRecorder(const std::string& path);
+    /**
+     * @brief Writes buffered events and closes the file
+     */
+    ~TraceRecorder();
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    /**
+     * @brief Makes a recorder the one the User hooks feed
+     * @param recorder The recorder, or nullptr to stop recording
+     */
+    static void install(TraceRecorder* recorder);
+    /**
+     * @brief Gets the installed recorder
+     * @return The recorder, or nullptr if none is installed
+     */
+    static TraceRecorder* current();
+    /**
+     * @brief Checks whether the trace file is open
+     * @return true if events can be written
+     */
+    bool isOpen() const;
+    /**
+     * @brief Writes buffered events to the file
+     * @return true on success
+     */
+    bool flush();
+    /**
+     * @brief Records a join
+     * @param user The user joining
+     * @param room The room joined
+     */
+    void recordJoin(const User* user, const ChatRoom* room);
+    /**
+     * @brief Records a leave
+     * @param user The user leaving
+     * @param room The room left
+     */
+    void recordLeave(const User* user, const ChatRoom* room);
+    /**
+     * @brief Records a send
+     * @param user The sender
+     * @param room The destination room
+     * @param message The message text
+     */
+    void recordSend(const User* user, const ChatRoom* room, std::string_view message);
+    /**
+     * @brief Records a state change
+     * @param user The user
+     * @param state The new state
+     */
+    void recordState(const User* user, const UserState* state);
+    /**
+     * @brief Records a room creation call
+     * @param user The user creating the room
+     * @param name The requested name
+     * @param room The created room, or nullptr if creation failed
+     */
+    void recordCreateRoom(const User* user, const std::string& name, const ChatRoom* room);
+    /**
+     * @brief Forgets a user being destroyed, so its address can be reused
+     * @param user The user
+     */
+    void forget(const User* user);
+    /**
+     * @brief Forgets a room being destroyed, so its address can be reused
+     * @param room The room
+     */
+    void forget(const ChatRoom* room);
+    /**
+     * @brief Gets the number of events recorded
+     * @return The event count
+     */
+    unsigned long long getEventCount() const;
+};
+
+/**
+ * @class TraceReplayer
+ * @brief Feeds a recorded trace back through the public API
+ *
+ * The users and rooms the trace defines are created fresh and owned by
+ * the replayer. Custom rooms are created in a registry of the replayer's
+ * own, so recorded names never collide with rooms that are live in the
+ * process.
+ */
+class TraceReplayer {
+private:
+    std::vector<unsigned char> data;
+    std::vector<User*> users;
+    std::vector<ChatRoom*> rooms;
+    ChatRoomRegistry registry; ///< Replay-local namespace for custom rooms
+
+    void clear();
+
+public:
+    TraceReplayer() = default;
+    /**
+     * @brief Removes members from replayed rooms and deletes everything replayed
+     */
+    ~TraceReplayer();
+    TraceReplayer(const TraceReplayer&) = delete;
+    TraceReplayer& operator=(const TraceReplayer&) = delete;
+    /**
+     * @brief Reads a trace file
+     * @param path File written by TraceRecorder
+     * @return true if the file has a valid trace header
+     */
+    bool load(const std::string& path);
+    /**
+     * @brief Replays the loaded trace
+     * @param originalSpeed true to wait out the recorded gaps between events
+     * @return Number of events applied
+     *
+     * Replay stops at a malformed event, or at a room creation that
+     * succeeded when recorded but fails now.
+     */
+    std::size_t run(bool originalSpeed = false);
+    /**
+     * @brief Gets the users created by the last run
+     * @return Users in trace ID order
+     */
+    const std::vector<User*>& getUsers() const;
+    /**
+     * @brief Gets the rooms created by the last run
+     * @return Rooms in trace ID order
+     */
+    const std::vector<ChatRoom*>& getRooms() const;
+};
+// ============= extra : PRESENCE =============
+
+/**
+ * @struct PresenceUpdate
+ * @brief The state a user settled in during one presence tick
+ */
+struct PresenceUpdate {
+    unsigned int handle; ///< Handle of the user whose state changed
+    std::string name;    ///< The user's name
+    std::string state;   ///< Name of the user's final state
+};
+
+/**
+ * @class PresenceHub
+ * @brief Coalesces state changes into per-subscriber presence batches
+ *
+ * A state change only marks the user dirty, so a flap costs O(1) no
+ * matter how many rooms or subscribers the user has. On tick() each dirty
+ * user is fanned out once to the subscribers of its rooms, building a
+ * dirty set per subscriber; every subscriber then gets one batch holding
+ * each changed roommate's final state. Users that flapped back to where
+ * they started are dropped.
+ */
+class PresenceHub {
+private:
+    static PresenceHub* active; ///< Hub fed by User::setState()
+
+    std::unordered_map<const ChatRoom*, std::vector<unsigned int>> subscribers; ///< Subscriber handles per room
+    std::unordered_map<unsigned int, std::vector<const ChatRoom*>> watching;    ///< Rooms per subscriber handle
+    std::vector<unsigned int> dirty;                          ///< Users changed since the last tick
+    std::unordered_map<unsigned int, std::string> baseline;   ///< State each dirty user started the tick in
+    unsigned long long changes;    ///< State changes seen
+    unsigned long long delivered;  ///< Updates delivered
+    unsigned long long suppressed; ///< Dirty users that ended where they started
+
+public:
+    PresenceHub();
+    ~PresenceHub();
+    PresenceHub(const PresenceHub&) = delete;
+    PresenceHub& operator=(const PresenceHub&) = delete;
+    /**
+     * @brief Makes a hub the one User::setState() reports to
+     * @param hub The hub, or nullptr to stop tracking presence
+     */
+    static void install(PresenceHub* hub);
+    /**
+     * @brief Gets the installed hub
+     * @return The hub, or nullptr if none is installed
+     */
+    static PresenceHub* current();
+    /**
+     * @brief Subscribes a user to the presence of a room's members
+     * @param subscriber The user to notify
+     * @param room The room to watch
+     */
+    void subscribe(User* subscriber, ChatRoom* room);
+    /**
+     * @brief Cancels a subscription
+     * @param subscriber The subscribed user
+     * @param room The watched room
+     *
+     * Called by User::leaveChatRoom() for the room being left.
+     */
+    void unsubscribe(User* subscriber, ChatRoom* room);
+    /**
+     * @brief Records that a user's state changed
+     * @param user The user
+     * @param previous Name of the state the user left
+     */
+    void markChanged(const User* user, const std::string& previous);
+    /**
+     * @brief Delivers one coalesced batch to every affected subscriber
+     * @return Number of batches delivered
+     */
+    std::size_t tick();
+    /**
+     * @brief Drops a room that is being destroyed
+     * @param room The room
+     */
+    void forget(const ChatRoom* room);
+    /**
+     * @brief Drops a user that is being destroyed
+     * @param user The user
+     */
+    void forget(const User* user);
+    /**
+     * @brief Gets the number of users waiting for the next tick
+     * @return The dirty user count
+     */
+    std::size_t getDirtyCount() const;
+    /**
+     * @brief Gets the number of state changes seen
+     * @return The change count
+     */
+    unsigned long long getChangeCount() const;
+    /**
+     * @brief Gets the number of updates delivered to subscribers
+     * @return The delivered update count
+     */
+    unsigned long long getDeliveredCount() const;
+    /**
+     * @brief Gets the number of dirty users dropped for ending where they started
+     * @return The suppressed count
+     */
+    unsigned long long getSuppressedCount() const;
+};
+// ============= extra : LAZY RENDERING =============
+
+/**
+ * @class MessageEnvelope
+ * @brief A message in structured form, rendered only when displayed
+ *
+ * Rooms carry the room ID, sender handle and payload instead of a
+ * formatted line. The "[Room] name: msg" form is written into a caller's
+ * buffer with render(), or built once and cached by view(), so a message
+ * fanned out to many recipients is formatted at most once.
+ */
+class MessageEnvelope {
+private:
+    ChatRoom* room;            ///< Room the message was sent in
+    User* sender;              ///< User who sent the message
+    unsigned int roomId;       ///< ID of the room
+    unsigned int senderHandle; ///< Handle of the sender
+    Message payload;           ///< The message content (shared, not copied)
+    mutable std::string rendered; ///< Cached display form
+    mutable bool isRendered;      ///< Whether rendered holds the display form
+
+public:
+    /**
+     * @brief Wraps a message sent in a room
+     * @param room The room
+     * @param sender The sending user
+     * @param payload The message content
+     */
+    MessageEnvelope(ChatRoom* room, User* sender, const Message& payload);
+    MessageEnvelope(const MessageEnvelope&) = delete;
+    MessageEnvelope& operator=(const MessageEnvelope&) = delete;
+    /**
+     * @brief Gets the room the message was sent in
+     * @return The room
+     */
+    ChatRoom* getRoom() const;
+    /**
+     * @brief Gets the sender
+     * @return The sending user
+     */
+    User* getSender() const;
+    /**
+     * @brief Gets the room's ID
+     * @return The room ID
+     */
+    unsigned int getRoomId() const;
+    /**
+     * @brief Gets the sender's handle
+     * @return The sender handle
+     */
+    unsigned int getSenderHandle() const;
+    /**
+     * @brief Gets the message content
+     * @return The payload
+     */
+    const Message& getPayload() const;
+    /**
+     * @brief Writes the display form into a buffer
+     * @param buffer Destination (may be nullptr when capacity is 0)
+     * @param capacity Size of the buffer in bytes
+     * @return Length of the full display form, excluding the terminator
+     *
+     * Like snprintf, the output is truncated to fit and NUL-terminated
+     * whenever capacity is non-zero.
+     */
+    std::size_t render(char* buffer, std::size_t capacity) const;
+    /**
+     * @brief Gets the display form, rendering it on first use
+     * @return "[Room] name: msg"
+     */
+    std::string_view view() const;
+    /**
+     * @brief Checks whether the display form has been built
+     * @return true once view() has rendered it
+     */
+    bool hasRendered() const;
+};
+// ============= extra : LOGGING =============
+
+/*
+ * Console output goes through PETSPACE_LOG(level, category, args...).
+ * A line is kept only if its level is at or below PETSPACE_LOG_LEVEL and
+ * its category is set in PETSPACE_LOG_CATEGORIES; anything else is
+ * removed at compile time, arguments included. For example,
+ * -DPETSPACE_LOG_LEVEL=0 builds a silent library and
+ * -DPETSPACE_LOG_CATEGORIES=PETSPACE_LOG_ADMIN keeps only admin lines.
+ */
+
+#define PETSPACE_LOG_OFF 0   ///< No output
+#define PETSPACE_LOG_ERROR 1 ///< Failures the caller cannot see otherwise
+#define PETSPACE_LOG_WARN 2  ///< Refused or dropped operations
+#define PETSPACE_LOG_INFO 3  ///< Normal activity
+
+#define PETSPACE_LOG_PRESENCE 0x01u   ///< State changes and presence batches
+#define PETSPACE_LOG_MEMBERSHIP 0x02u ///< Room joins and leaves
+#define PETSPACE_LOG_DELIVERY 0x04u   ///< Sends, receives and rate limiting
+#define PETSPACE_LOG_HISTORY 0x08u    ///< History saves and storage files
+#define PETSPACE_LOG_ADMIN 0x10u      ///< Admin grants and room creation
+
+#ifndef PETSPACE_LOG_LEVEL
+#define PETSPACE_LOG_LEVEL PETSPACE_LOG_INFO
+#endif
+
+#ifndef PETSPACE_LOG_CATEGORIES
+#define PETSPACE_LOG_CATEGORIES 0xFFu
+#endif
+
+/**
+ * @brief Writes one console line if its level and category are compiled in
+ *
+ * Arguments are only evaluated when the line is compiled in and the
+ * console is enabled at run time.
+ */
+#define PETSPACE_LOG(level, category, ...)                                                              \
+    do {                                                                                                \
+        if constexpr (PETSPACE_LOG_##level <= PETSPACE_LOG_LEVEL &&                                     \
+                      (PETSPACE_LOG_##category & (PETSPACE_LOG_CATEGORIES)) != 0) {                     \
+            if (Logger::enabled()) {                                                                    \
+                Logger::write(__VA_ARGS__);                                                             \
+            }                                                                                           \
+        }                                                                                               \
+    } while (0)
+
+/**
+ * @class Logger
+ * @brief Formats log lines into a per-thread buffer and writes them out
+ *
+ * Each line is assembled with plain appends (integers via std::to_chars)
+ * and handed to the console in a single write.
+ */
+class Logger {
+private:
+    static std::string& begin();
+    static void end(std::string& line);
+    static void appendSigned(std::string& line, long long value);
+    static void appendUnsigned(std::string& line, unsigned long long value);
+
+public:
+    /**
+     * @brief Checks whether the console accepts output
+     * @return true unless std::cout is in a failed state
+     */
+    static bool enabled();
+    /**
+     * @brief Writes one line built from its arguments
+     * @param args Strings, characters, messages and integers, in order
+     */
+    template <typename... Args>
+    static void write(const Args&... args) {
+        std::string& line = begin();
+        (append(line, args), ...);
+        end(line);
+    }
+    /**
+     * @brief Appends one argument to a line
+     * @param line The line being built
+     * @param value A message, character, integer or anything convertible to std::string_view
+     */
+    template <typename T>
+    static void append(std::string& line, const T& value) {
+        if constexpr (std::is_same<T, Message>::value) {
+            line.append(value.data(), value.size());
+        } else if constexpr (std::is_same<T, char>::value) {
+            line += value;
+        } else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+            appendSigned(line, value);
+        } else if constexpr (std::is_integral<T>::value) {
+            appendUnsigned(line, value);
+        } else {
+            std::string_view text(value);
+            line.append(text.data(), text.size());
+        }
+    }
+};
+// ============= extra : INBOX =============
+
+/**
+ * @struct InboxMessage
+ * @brief A message waiting in a user's inbox
+ */
+struct InboxMessage {
+    Message text;        ///< The message content
+    unsigned int sender; ///< Handle of the sender
+    unsigned int roomId; ///< ID of the room, or 0 for a direct message
+    bool mention;        ///< Whether the message mentions the receiver
+};
+
+/**
+ * @class EventLoop
+ * @brief Runs posted continuations on whichever threads call run()
+ *
+ * Coroutines awaiting an inbox are resumed here rather than on the
+ * sender's stack, so a few threads can drive many consumers.
+ */
+class EventLoop {
+public:
+    typedef void (*Callback)(void* argument); ///< A posted continuation
+
+private:
+    std::mutex lock;
+    std::deque<std::pair<Callback, void*>> ready; ///< Continuations waiting to run
+    unsigned long long completed; ///< Continuations run so far
+
+public:
+    EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    /**
+     * @brief Queues a continuation
+     * @param callback Function to call
+     * @param argument Argument passed to the function
+     */
+    void post(Callback callback, void* argument);
+    /**
+     * @brief Runs one queued continuation
+     * @return false if nothing was queued
+     */
+    bool runOne();
+    /**
+     * @brief Runs continuations until none are queued
+     * @return Number of continuations run
+     */
+    std::size_t run();
+    /**
+     * @brief Gets the number of queued continuations
+     * @return The queue length
+     */
+    std::size_t pending();
+    /**
+     * @brief Gets the number of continuations run so far
+     * @return The completed count
+     */
+    unsigned long long getCompletedCount();
+};
+
+/**
+ * @class UserInbox
+ * @brief Queue of a user's incoming messages for asynchronous consumers
+ *
+ * Once attached, every room and direct message the user receives is also
+ * queued here; the user's receive() callback still runs as before. A
+ * consumer polls with tryPop()/drain(), or in C++20 suspends with
+ * co_await nextMessage(inbox) and is resumed on the event loop. Each
+ * inbox has at most one waiting consumer.
+ */
+class UserInbox {
+private:
+    User* owner;          ///< User feeding the inbox (nullptr once detached)
+    EventLoop& loop;      ///< Loop that resumes the waiting consumer
+    std::mutex lock;
+    std::deque<InboxMessage> messages; ///< Queued messages, oldest first
+    EventLoop::Callback waiter;        ///< Continuation of the waiting consumer
+    void* waiterArgument;              ///< Argument for the continuation
+    bool closed;                       ///< Whether the inbox stopped accepting messages
+    std::size_t queuedBytes;           ///< Memory held by queued messages
+    unsigned long long trimmed;        ///< Messages dropped to stay under the owner's mailbox cap
+
+    void wake(std::unique_lock<std::mutex>& held);
+
+public:
+    /**
+     * @brief Attaches an inbox to a user
+     * @param user The user
+     * @param eventLoop Loop that resumes waiting consumers
+     */
+    UserInbox(User* user, EventLoop& eventLoop);
+    /**
+     * @brief Detaches the inbox from its user
+     *
+     * A waiting consumer is not woken; close() and run the loop first if
+     * one may still be suspended on this inbox.
+     */
+    ~UserInbox();
+    UserInbox(const UserInbox&) = delete;
+    UserInbox& operator=(const UserInbox&) = delete;
+    /**
+     * @brief Queues a message and wakes the waiting consumer
+     * @param message The message
+     */
+    void push(const InboxMessage& message);
+    /**
+     * @brief Takes the oldest message without waiting
+     * @param out Receives the message
+     * @return false if the inbox is empty
+     */
+    bool tryPop(InboxMessage& out);
+    /**
+     * @brief Takes up to a number of messages without waiting
+     * @param out Receives the messages, oldest first
+     * @param max Most messages to take
+     * @return Number of messages taken
+     */
+    std::size_t drain(std::vector<InboxMessage>& out, std::size_t max);
+    /**
+     * @brief Takes up to max messages, or registers a continuation to run when one arrives
+     * @param out Receives the messages, oldest first
+     * @param max Most messages to take
+     * @param callback Continuation posted to the event loop on arrival or close
+     * @param argument Argument for the continuation
+     * @return true if messages were taken or the inbox is closed; false if the continuation was registered
+     */
+    bool drainOrWait(std::vector<InboxMessage>& out, std::size_t max, EventLoop::Callback callback, void* argument);
+    /**
+     * @brief Stops accepting messages and wakes the waiting consumer
+     *
+     * Queued messages can still be taken after the inbox is closed.
+     */
+    void close();
+    /**
+     * @brief Checks whether the inbox was closed
+     * @return true once close() has been called
+     */
+    bool isClosed();
+    /**
+     * @brief Gets the number of queued messages
+     * @return The queue length
+     */
+    std::size_t size();
+    /**
+     * @brief Gets the memory held by queued messages
+     * @return Bytes
+     */
+    std::size_t memoryUsage();
+    /**
+     * @brief Gets the number of messages dropped by the mailbox cap
+     * @return The trimmed count
+     */
+    unsigned long long getTrimmedCount();
+};
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+
+#define PETSPACE_HAS_COROUTINES 1
+
+/**
+ * @struct InboxTask
+ * @brief Fire-and-forget coroutine type for inbox consumers
+ *
+ * The coroutine starts running immediately and frees itself when it
+ * returns.
+ */
+struct InboxTask {
+    struct promise_type {
+        InboxTask get_return_object() { return InboxTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * @class InboxBatchAwaiter
+ * @brief Awaits up to a number of messages from an inbox
+ */
+class InboxBatchAwaiter {
+private:
+    UserInbox& inbox;
+    std::size_t max;
+    std::vector<InboxMessage> batch;
+
+    static void resume(void* frame) { std::coroutine_handle<>::from_address(frame).resume(); }
+
+public:
+    InboxBatchAwaiter(UserInbox& userInbox, std::size_t maxMessages) : inbox(userInbox), max(maxMessages) {}
+    bool await_ready() { return inbox.drain(batch, max) > 0; }
+    bool await_suspend(std::coroutine_handle<> consumer) {
+        return !inbox.drainOrWait(batch, max, &InboxBatchAwaiter::resume, consumer.address());
+    }
+    /**
+     * @brief Gets the awaited messages, taking them now if the consumer was woken
+     * @return The messages, or none once the inbox is closed and empty
+     */
+    std::vector<InboxMessage> await_resume() {
+        if (batch.empty()) {
+            inbox.drain(batch, max);
+        }
+        return std::move(batch);
+    }
+};
+
+/**
+ * @class InboxAwaiter
+ * @brief Awaits the next message from an inbox
+ */
+class InboxAwaiter {
+private:
+    InboxBatchAwaiter awaiter;
+
+public:
+    explicit InboxAwaiter(UserInbox& inbox) : awaiter(inbox, 1) {}
+    bool await_ready() { return awaiter.await_ready(); }
+    bool await_suspend(std::coroutine_handle<> consumer) { return awaiter.await_suspend(consumer); }
+    /**
+     * @brief Gets the awaited message
+     * @return The message, or nothing once the inbox is closed and empty
+     */
+    std::optional<InboxMessage> await_resume() {
+        std::vector<InboxMessage> batch = awaiter.await_resume();
+        if (batch.empty()) {
+            return std::nullopt;
+        }
+        return std::move(batch.front());
+    }
+};
+
+/**
+ * @brief Awaits the next message in an inbox
+ * @param inbox The inbox
+ * @return Awaiter yielding the message, or std::nullopt once the inbox is closed and empty
+ */
+inline InboxAwaiter nextMessage(UserInbox& inbox) {
+    return InboxAwaiter(inbox);
+}
+
+/**
+ * @brief Awaits a batch of messages from an inbox
+ * @param inbox The inbox
+ * @param max Most messages to take
+ * @return Awaiter yielding 1..max messages, or none once the inbox is closed and empty
+ */
+inline InboxBatchAwaiter nextBatch(UserInbox& inbox, std::size_t max) {
+    return InboxBatchAwaiter(inbox, max);
+}
+#endif
+// ============= extra : WORK STEALING =============
+
+/**
+ * @class WorkStealingDeque
+ * @brief Chase-Lev deque of users with pending commands
+ *
+ * The owning worker pushes and pops at the bottom without locking;
+ * other workers steal the oldest entry from the top. The ring doubles
+ * when full, and outgrown rings are kept until the deque is destroyed
+ * because a thief may still be reading one.
+ */
+class WorkStealingDeque {
+private:
+    /**
+     * @struct Ring
+     * @brief Circular slot array indexed by unbounded positions
+     */
+    struct Ring {
+        long long capacity;        ///< Slot count (a power of two)
+        std::atomic<User*>* slots; ///< The slots
+        explicit Ring(long long size);
+        ~Ring();
+        User* get(long long position) const;
+        void put(long long position, User* user);
+    };
+
+    std::atomic<long long> top;    ///< Next position to steal
+    std::atomic<long long> bottom; ///< Next position to push
+    std::atomic<Ring*> ring;       ///< Current ring
+    std::vector<Ring*> retired;    ///< Outgrown rings
+
+public:
+    WorkStealingDeque();
+    ~WorkStealingDeque();
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+    /**
+     * @brief Pushes a user at the bottom (owner only)
+     * @param user The user
+     */
+    void push(User* user);
+    /**
+     * @brief Pops the newest user from the bottom (owner only)
+     * @return The user, or nullptr if the deque is empty
+     */
+    User* pop();
+    /**
+     * @brief Steals the oldest user from the top (any thread)
+     * @return The user, or nullptr if the deque is empty or the race was lost
+     */
+    User* steal();
+    /**
+     * @brief Gets an estimate of the number of queued users
+     * @return The approximate size
+     */
+    std::size_t size() const;
+};
+
+/**
+ * @class WorkStealingExecutor
+ * @brief Drains users' command queues on a pool of worker threads
+ *
+ * A task is "run up to K commands from this user's queue". Each worker
+ * owns a WorkStealingDeque, takes submissions from other threads from a
+ * shared queue, and steals from busy workers when it runs dry. A user is
+ * in at most one deque or running on at most one worker at a time, so
+ * its commands still run in queue order; a user with more than K
+ * commands is put back for another turn.
+ *
+ * Rooms lock their delivery for each send or save. The journal, the trace
+ * recorder and the synchronous send paths still assume a single thread,
+ * and users must not be deleted while they have a task in flight; call
+ * waitIdle() first.
+ */
+class WorkStealingExecutor {
+private:
+    std::vector<WorkStealingDeque*> deques; ///< One deque per worker
+    std::vector<std::thread> workers;
+    std::size_t batchSize;                  ///< Commands run per task
+    std::mutex injectLock;
+    std::deque<User*> injected;             ///< Submissions from non-worker threads
+    std::mutex idleLock;
+    std::condition_variable wakeup;         ///< Signalled when work is submitted
+    std::condition_variable idle;           ///< Signalled when the last task finishes
+    std::atomic<bool> stopping;
+    std::atomic<std::size_t> outstanding;   ///< Users with a task queued or running
+    std::atomic<std::size_t> queued;        ///< Tasks submitted but not yet taken by a worker
+    std::atomic<std::size_t> sleeping;      ///< Workers parked on wakeup
+    std::atomic<unsigned long long> tasks;  ///< Tasks run
+    std::atomic<unsigned long long> commands; ///< Commands run
+    std::atomic<unsigned long long> steals;   ///< Tasks taken from another worker
+
+    void submit(User* user);
+    User* findWork(std::size_t index);
+    void runTask(User* user);
+    void workerLoop(std::size_t index);
+
+public:
+    /**
+     * @brief Starts the worker threads
+     * @param workerCount Number of workers (at least one)
+     * @param commandsPerTask Most commands a task runs before yielding the user
+     */
+    explicit WorkStealingExecutor(std::size_t workerCount, std::size_t commandsPerTask = 32);
+    /**
+     * @brief Finishes all queued work and stops the workers
+     */
+    ~WorkStealingExecutor();
+    WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+    WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+    /**
+     * @brief Makes sure a task will drain the user's queue
+     * @param user The user with queued commands
+     */
+    void schedule(User* user);
+    /**
+     * @brief Blocks until no user has a task queued or running
+     */
+    void waitIdle();
+    /**
+     * @brief Gets the number of worker threads
+     * @return The worker count
+     */
+    std::size_t getWorkerCount() const;
+    /**
+     * @brief Gets the number of tasks run
+     * @return The task count
+     */
+    unsigned long long getTaskCount() const;
+    /**
+     * @brief Gets the number of commands run
+     * @return The command count
+     */
+    unsigned long long getCommandCount() const;
+    /**
+     * @brief Gets the number of tasks stolen from another worker
+     * @return The steal count
+     */
+    unsigned long long getStealCount() const;
+};
+// ============= extra : RING MAILBOX =============
+
+/**
+ * @enum OverflowPolicy
+ * @brief What a room does when a member's ring is full
+ */
+enum class OverflowPolicy {
+    Reject, ///< Drop the new message and count it
+    Spill,  ///< Queue it in a locked overflow list, keeping order
+    Block   ///< Wait for the consumer to make room
+};
+
+/**
+ * @class SpscRing
+ * @brief Bounded lock-free ring for one producer and one consumer
+ *
+ * Slots hold Messages, so a push only bumps the shared buffer's
+ * reference count. Each side caches the other's index and only reloads it
+ * when the ring looks full or empty, and the two indices live on separate
+ * cache lines.
+ */
+class SpscRing {
+private:
+    /**
+     * @struct Slot
+     * @brief One queued delivery
+     */
+    struct Slot {
+        Message text;        ///< The message content
+        unsigned int sender; ///< Handle of the sender
+        bool mention;        ///< Whether the message mentions the receiver
+    };
+
+    std::size_t mask;  ///< Capacity - 1 (capacity is a power of two)
+    Slot* slots;       ///< The slots
+    alignas(64) std::atomic<std::size_t> head; ///< Next slot to read (consumer)
+    std::size_t cachedTail;                    ///< Consumer's copy of tail
+    alignas(64) std::atomic<std::size_t> tail; ///< Next slot to write (producer)
+    std::size_t cachedHead;                    ///< Producer's copy of head
+
+public:
+    /**
+     * @brief Allocates the ring
+     * @param capacity Minimum number of slots (rounded up to a power of two)
+     */
+    explicit SpscRing(std::size_t capacity);
+    ~SpscRing();
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+    /**
+     * @brief Appends a delivery (producer only)
+     * @param text The message
+     * @param sender Handle of the sender
+     * @param mention Whether the message mentions the receiver
+     * @return false if the ring is full
+     */
+    bool tryPush(const Message& text, unsigned int sender, bool mention = false);
+    /**
+     * @brief Takes up to a number of deliveries (consumer only)
+     * @param out Receives the deliveries, oldest first
+     * @param max Most deliveries to take
+     * @param roomId Room ID stamped on each delivery
+     * @return Number of deliveries taken
+     */
+    std::size_t popBatch(std::vector<InboxMessage>& out, std::size_t max, unsigned int roomId);
+    /**
+     * @brief Gets the number of queued deliveries
+     * @return The approximate size
+     */
+    std::size_t size() const;
+    /**
+     * @brief Gets the number of slots
+     * @return The capacity
+     */
+    std::size_t capacity() const;
+    /**
+     * @brief Gets the memory allocated for the slots
+     * @return Bytes
+     */
+    std::size_t footprint() const;
+};
+
+/**
+ * @struct MailboxShard
+ * @brief One room's ring in a member's mailbox
+ *
+ * The room is the only producer. Spilled messages are newer than anything
+ * in the ring, so while spilling the producer keeps writing to the
+ * overflow list until the consumer has emptied it.
+ */
+struct MailboxShard {
+    unsigned int roomId;               ///< The producing room
+    SpscRing ring;                     ///< Lock-free deliveries
+    std::mutex spillLock;              ///< Guards spill
+    std::deque<InboxMessage> spill;    ///< Overflow under OverflowPolicy::Spill
+    std::atomic<bool> spilling;        ///< Whether new deliveries must go to spill
+
+    MailboxShard(unsigned int room, std::size_t capacity);
+};
+
+/**
+ * @class RingMailbox
+ * @brief Per-user set of SPSC rings, one per room
+ *
+ * Rooms deliver to a member with a mailbox by pushing a message reference
+ * into that member's ring for the room, so a slow member never holds up
+ * the sender or the rest of the fan-out. The member's consumer drains
+ * all rings in batches with drain() or User::drainMailbox(). Mentions
+ * queue in the room's ring too, flagged. Direct messages and broadcasts
+ * can come from any thread, so they share one locked list instead.
+ */
+class RingMailbox {
+private:
+    static std::atomic<unsigned long long> nextId; ///< Source of mailbox IDs
+
+    unsigned long long id;   ///< Process-unique ID, so rooms can tell mailboxes apart
+    std::atomic<User*> owner; ///< User the mailbox is attached to (nullptr once detached)
+    std::size_t ringCapacity; ///< Slots per room ring
+    OverflowPolicy policy;
+    std::mutex shardLock;    ///< Guards shards
+    std::vector<MailboxShard*> shards;
+    MailboxShard* shared;    ///< Direct and broadcast deliveries, kept in its overflow list
+    std::size_t nextShard;   ///< Where the consumer resumes its round-robin
+    std::atomic<unsigned long long> delivered; ///< Messages queued
+    std::atomic<unsigned long long> rejected;  ///< Messages dropped under Reject
+    std::atomic<unsigned long long> spilled;   ///< Messages sent to an overflow list
+    std::atomic<unsigned long long> blocked;   ///< Deliveries that had to wait under Block
+    std::atomic<std::size_t> queuedBytes;      ///< Message bytes waiting in rings and overflow lists
+
+public:
+    /**
+     * @brief Attaches a mailbox to a user
+     * @param user The user
+     * @param capacity Slots per room ring
+     * @param overflow What to do when a ring is full
+     */
+    RingMailbox(User* user, std::size_t capacity, OverflowPolicy overflow);
+    /**
+     * @brief Detaches the mailbox and frees its rings
+     *
+     * Rooms must not be delivering to the user at the same time.
+     */
+    ~RingMailbox();
+    /**
+     * @brief Forgets the owner, which is being destroyed
+     */
+    void detach();
+    RingMailbox(const RingMailbox&) = delete;
+    RingMailbox& operator=(const RingMailbox&) = delete;
+    /**
+     * @brief Gets the mailbox's process-unique ID
+     * @return The ID
+     */
+    unsigned long long getId() const;
+    /**
+     * @brief Gets or creates the ring for a room
+     * @param room The producing room
+     * @return The ring
+     */
+    MailboxShard* shardFor(const ChatRoom* room);
+    /**
+     * @brief Queues a delivery from a room (that room's thread only)
+     * @param shard The room's ring
+     * @param text The message
+     * @param sender Handle of the sender
+     * @param mention Whether the message mentions the owner
+     * @return false if the message was rejected
+     *
+     * Under OverflowPolicy::Block the room waits a bounded time for the
+     * consumer, then spills the message rather than stall its other members.
+     */
+    bool enqueue(MailboxShard* shard, const Message& text, unsigned int sender, bool mention = false);
+    /**
+     * @brief Queues a direct message or broadcast (any thread)
+     * @param text The message
+     * @param sender Handle of the sender
+     * @param roomId ID of the room, or 0 for a direct message
+     * @return false if the message was rejected
+     *
+     * Under OverflowPolicy::Reject the shared list holds at most one ring's
+     * worth of messages; the other policies never make a sender wait here.
+     */
+    bool enqueueShared(const Message& text, unsigned int sender, unsigned int roomId);
+    /**
+     * @brief Takes up to a number of messages across all rooms (consumer only)
+     * @param out Receives the messages, oldest first within each room
+     * @param max Most messages to take
+     * @return Number of messages taken
+     */
+    std::size_t drain(std::vector<InboxMessage>& out, std::size_t max);
+    /**
+     * @brief Gets the number of messages queued so far
+     * @return The delivered count
+     */
+    unsigned long long getDeliveredCount() const;
+    /**
+     * @brief Gets the number of messages dropped under OverflowPolicy::Reject
+     * @return The rejected count
+     */
+    unsigned long long getRejectedCount() const;
+    /**
+     * @brief Gets the number of messages sent to an overflow list
+     * @return The spilled count
+     */
+    unsigned long long getSpilledCount() const;
+    /**
+     * @brief Gets the number of deliveries that waited under OverflowPolicy::Block
+     * @return The blocked count
+     */
+    unsigned long long getBlockedCount() const;
+    /**
+     * @brief Gets the memory held by the mailbox
+     * @return Bytes allocated for rings plus queued message bytes
+     */
+    std::size_t memoryUsage();
+};
+// ============= extra : MEMORY ACCOUNTING =============
+
+/**
+ * @struct RoomMemoryUsage
+ * @brief Memory attributed to a chat room
+ *
+ * Message text shared with other rooms or queues is counted in full by
+ * each holder, so totals are an upper bound.
+ */
+struct RoomMemoryUsage {
+    std::size_t history;      ///< In-memory history entries and their text
+    std::size_t index;        ///< Search index and sparse time index
+    std::size_t membership;   ///< Member list and per-member mailbox ring cache
+    std::size_t deduplicated; ///< History text shared through the payload store (already counted in history)
+
+    /**
+     * @brief Gets the room's total
+     * @return history + index + membership
+     *
+     * Deduplicated bytes are not subtracted, keeping the total an upper bound.
+     */
+    std::size_t total() const;
+};
+
+/**
+ * @struct UserMemoryUsage
+ * @brief Memory attributed to a user
+ */
+struct UserMemoryUsage {
+    std::size_t queue;   ///< Queued commands and their text
+    std::size_t mailbox; ///< Inbox and ring mailbox
+    std::size_t name;    ///< The user's name
+
+    /**
+     * @brief Gets the user's total
+     * @return queue + mailbox + name
+     */
+    std::size_t total() const;
+};
+// ============= extra : USER TABLE =============
+
+/**
+ * @enum StateTag
+ * @brief Compact tag for a user's current state
+ */
+enum class StateTag : unsigned char {
+    Online,  ///< Online
+    Offline, ///< Offline
+    Busy,    ///< Busy
+    Custom   ///< Any other UserState subclass
+};
+
+/**
+ * @class UserTable
+ * @brief Hot per-user fields packed into dense arrays indexed by handle
+ *
+ * Room fanout scans these arrays instead of dereferencing each member.
+ * Cold fields (name, rooms, command queue) stay on the User object, which
+ * keeps the table in sync whenever a hot field changes.
+ *
+ * The arrays are sized once for every handle and never reallocated, and
+ * the slots are atomic, so executor workers can read flags while another
+ * thread creates users. They are zero-filled statics, so only pages for
+ * handles in use are ever touched. The User constructor asserts that
+ * every handle it issues has a slot; refresh() logs an error otherwise.
+ */
+class UserTable {
+private:
+    static const unsigned int MAX_HANDLES = UserDirectory::MAX_HANDLES; ///< Handles the table has slots for
+
+    static std::atomic<StateTag> states[MAX_HANDLES];     ///< State tag per handle
+    static std::atomic<unsigned char> flags[MAX_HANDLES]; ///< Flag bits per handle
+
+public:
+    static const unsigned char Admin = 0x01;   ///< User has admin privileges
+    static const unsigned char Plain = 0x02;   ///< User is exactly a User1, User2 or User3
+    static const unsigned char Inbox = 0x04;   ///< User has an inbox attached
+    static const unsigned char Mailbox = 0x08; ///< User has ring mailboxes attached
+    static const unsigned char Passive = 0x10; ///< Delivery only writes console output
+
+    /**
+     * @brief Re-reads a user's hot fields into the table
+     * @param user The user
+     */
+    static void refresh(const User* user);
+    /**
+     * @brief Clears a user's slot
+     * @param user The user
+     */
+    static void remove(const User* user);
+    /**
+     * @brief Gets the state tag for a handle
+     * @param handle The user's handle
+     * @return The tag (Online for unknown handles)
+     */
+    static StateTag stateOf(unsigned int handle);
+    /**
+     * @brief Gets the flag bits for a handle
+     * @param handle The user's handle
+     * @return The flags (0 for unknown handles)
+     */
+    static unsigned char flagsOf(unsigned int handle);
+    /**
+     * @brief Checks whether room deliveries currently produce console output
+     * @return false if DELIVERY lines are compiled out or the console is disabled
+     */
+    static bool deliveryVisible();
+    /**
+     * @brief Counts the members of a handle list in a state
+     * @param handles Member handles
+     * @param tag The state to count
+     * @return Number of matching members
+     */
+    static std::size_t countInState(const std::pmr::vector<unsigned int>& handles, StateTag tag);
+};
+// ============= extra : PAYLOAD STORE =============
+
+/**
+ * @class PayloadStore
+ * @brief Content-addressed store that lets room histories share identical messages
+ *
+ * While a store is installed, every message saved to a history is looked
+ * up by a hash of its bytes. If an identical payload is already held, the
+ * history keeps another reference to that buffer instead of its own copy.
+ * Blobs are reference counted by Message itself; the store drops the ones
+ * no history uses any more whenever its table doubles, or on collect().
+ * Short messages are stored inline and are left alone.
+ */
+class PayloadStore {
+private:
+    static PayloadStore* active; ///< Store used by ChatRoom history saves
+
+    std::unordered_multimap<std::uint64_t, Message> blobs; ///< Shared payloads by content hash
+    std::mutex lock;               ///< Guards the table and statistics
+    std::size_t storedBytes;       ///< Bytes of payload held by the table
+    std::size_t collectAt;         ///< Table size that triggers the next collect
+    unsigned long long lookups;    ///< Messages passed to intern()
+    unsigned long long hits;       ///< Lookups answered with another buffer
+
+    std::size_t collectLocked();
+
+public:
+    PayloadStore();
+    ~PayloadStore();
+    PayloadStore(const PayloadStore&) = delete;
+    PayloadStore& operator=(const PayloadStore&) = delete;
+    /**
+     * @brief Makes a store the one room histories save through
+     * @param store The store, or nullptr to stop de-duplicating
+     */
+    static void install(PayloadStore* store);
+    /**
+     * @brief Gets the installed store
+     * @return The store, or nullptr if none is installed
+     */
+    static PayloadStore* current();
+    /**
+     * @brief Hashes a payload
+     * @param bytes The payload
+     * @return 64-bit hash, computed eight bytes at a time
+     */
+    static std::uint64_t hash(std::string_view bytes);
+    /**
+     * @brief Gets the shared copy of a payload
+     * @param message The payload
+     * @param reused Set to true if an existing, different buffer was returned
+     * @return A Message sharing the stored buffer (the input if it is stored inline)
+     */
+    Message intern(const Message& message, bool& reused);
+    /**
+     * @brief Drops blobs that only the store still references
+     * @return Number of blobs dropped
+     */
+    std::size_t collect();
+    /**
+     * @brief Gets the number of blobs held
+     * @return The blob count
+     */
+    std::size_t getBlobCount();
+    /**
+     * @brief Gets the payload bytes held by the table
+     * @return Sum of the blob sizes
+     */
+    std::size_t getStoredBytes();
+    /**
+     * @brief Gets the bytes currently saved by sharing
+     * @return Sum over blobs of size times (holders - 1), not counting the store
+     */
+    std::size_t getSavedBytes();
+    /**
+     * @brief Gets the number of lookups answered with an existing blob
+     * @return The hit count
+     */
+    unsigned long long getHitCount();
+    /**
+     * @brief Gets the number of lookups
+     * @return The lookup count
+     */
+    unsigned long long getLookupCount();
 };
 #endif // PETSPACE_H
\ No newline at end of file
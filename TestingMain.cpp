@@ -4,6 +4,13 @@
 #include "PetSpace.h"
 #include <iostream>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory_resource>
+#include <thread>
+#include <chrono>
+#include <sstream>
 
 
 
@@ -279,6 +286,7 @@ void testEdgeCases() {
     // Test registering same user twice
     testRoom->registerUser(testUser);
     testRoom->registerUser(testUser); // Should not add duplicate
+    assert(testRoom->getUsers().size() == 1 && testUser->getChatRooms().size() == 1);
     
     // Test removing user not in room
     User2* notInRoom = new User2("NotInRoom");
@@ -538,8 +546,8 @@ void testUncoveredCodePaths() {
     User1* user = new User1("BaseClassTest");
     
     // Test getUsers() and getChatHistory() methods
-    std::vector<User*>& users = room->getUsers();
-    std::vector<std::string>& history = room->getChatHistory();
+    std::pmr::vector<User*>& users = room->getUsers();
+    std::pmr::vector<HistoryEntry>& history = room->getChatHistory();
     
     std::cout << "Initial users count: " << users.size() << std::endl;
     std::cout << "Initial history count: " << history.size() << std::endl;
@@ -600,21 +608,21 @@ void testUserClassComprehensive() {
     
     std::cout << "\n--- Testing Chat Room Management ---" << std::endl;
     // Test getChatRooms() when empty
-    std::vector<ChatRoom*>& emptyRooms = user->getChatRooms();
+    std::pmr::vector<ChatRoom*>& emptyRooms = user->getChatRooms();
     std::cout << "Chat rooms when empty: " << emptyRooms.size() << std::endl;
     
     // Test joining multiple rooms
     user->joinChatRoom(room1);
     user->joinChatRoom(room2);
     
-    std::vector<ChatRoom*>& rooms = user->getChatRooms();
+    std::pmr::vector<ChatRoom*>& rooms = user->getChatRooms();
     std::cout << "Chat rooms after joining: " << rooms.size() << std::endl;
     
     // Test leaving all rooms
     user->leaveChatRoom(room1);
     user->leaveChatRoom(room2);
     
-    std::vector<ChatRoom*>& finalRooms = user->getChatRooms();
+    std::pmr::vector<ChatRoom*>& finalRooms = user->getChatRooms();
     std::cout << "Chat rooms after leaving all: " << finalRooms.size() << std::endl;
     
     delete user;
@@ -756,6 +764,2017 @@ void testCustomChatRoomComprehensive() {
     std::cout << "Custom ChatRoom Comprehensive Test Completed!\n" << std::endl;
 }
 
+void testHistorySearch() {
+    std::cout << "\n=== TESTING HISTORY SEARCH INDEX ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* alice = new User1("Alice");
+    User2* bob = new User2("Bob");
+    
+    alice->joinChatRoom(room);
+    bob->joinChatRoom(room);
+    
+    alice->send("Design patterns are fun", room);
+    bob->send("Which patterns?", room);
+    alice->send("The Mediator pattern, mostly", room);
+    bob->send("design PATTERNS again!", room);
+    
+    std::cout << "\n--- Testing Keyword Queries ---" << std::endl;
+    std::vector<std::size_t> hits = room->searchHistory("patterns");
+    assert(hits.size() == 3);
+    assert(hits[0] == 0 && hits[1] == 1 && hits[2] == 3);
+    assert(room->searchHistory("design patterns").size() == 2);
+    assert(room->searchHistory("nonexistent").empty());
+    for (std::size_t position : hits) {
+        std::cout << "Match at " << position << ": " << room->getChatHistory()[position].str() << std::endl;
+    }
+    
+    std::cout << "\n--- Testing Sender And Combined Queries ---" << std::endl;
+    assert(room->searchHistory("", "Alice").size() == 2);
+    hits = room->searchHistory("patterns", "Bob");
+    assert(hits.size() == 2 && hits[0] == 1 && hits[1] == 3);
+    assert(room->searchHistory("", "Nobody").empty());
+    
+    std::cout << "\n--- Testing Index Persistence ---" << std::endl;
+    assert(room->saveHistory("search_test.hist"));
+    CtrlCat* restored = new CtrlCat();
+    assert(restored->loadHistory("search_test.hist"));
+    assert(restored->getChatHistory().size() == 4);
+    assert(restored->searchHistory("mediator", "Alice").size() == 1);
+    
+    // A missing index is rebuilt from the history
+    std::remove("search_test.hist.idx");
+    CtrlCat* rebuilt = new CtrlCat();
+    assert(rebuilt->loadHistory("search_test.hist"));
+    assert(rebuilt->searchHistory("design", "Bob").size() == 1);
+    assert(!rebuilt->loadHistory("missing_file.hist"));
+    std::remove("search_test.hist");
+    
+    delete alice;
+    delete bob;
+    delete room;
+    delete restored;
+    delete rebuilt;
+    
+    std::cout << "History Search Index Test Completed!\n" << std::endl;
+}
+
+void testHistoryRetention() {
+    std::cout << "\n=== TESTING HISTORY RETENTION ===" << std::endl;
+    
+    Dogorithm* room = new Dogorithm();
+    User1* user = new User1("Retainer");
+    user->joinChatRoom(room);
+    
+    user->send("Before retention", room);
+    room->setHistoryRetention(HistoryRetention(5, 0, 4));
+    
+    std::cout << "\n--- Testing Message Limit ---" << std::endl;
+    for (int i = 1; i <= 22; i++) {
+        user->send("Retained message " + std::to_string(i), room);
+    }
+    assert(room->historySize() == 23);
+    assert(room->getHotHistoryCount() == 5);
+    assert(room->getColdHistoryCount() == 18);
+    assert(room->getChatHistory().size() == 5);
+    std::string coldFile = room->getColdPath();
+    assert(coldFile.find("_" + std::to_string(room->getRoomId()) + ".cold") != std::string::npos);
+    assert(std::ifstream(coldFile).good());
+    assert(std::ifstream(coldFile + ".dir").good());
+    assert(std::ifstream(coldFile + ".pst").good());
+    // The search index only keeps unwritten history; written blocks have their own postings
+    assert(room->getHistoryIndex().getFloor() > 0);
+    assert(room->getHistoryIndex().getFloor() <= 16);
+    
+    std::cout << "\n--- Testing Iteration Across Tiers ---" << std::endl;
+    Iterator* iter = room->createIterator();
+    assert(iter->next() == "Retainer: Before retention");
+    for (int i = 1; i <= 22; i++) {
+        assert(iter->hasNext());
+        assert(iter->next() == "Retainer: Retained message " + std::to_string(i));
+    }
+    assert(!iter->hasNext());
+    iter->reset();
+    std::cout << "Oldest message after reset: " << iter->next() << std::endl;
+    delete iter;
+    
+    // Search results stay valid positions across tiers
+    std::vector<std::size_t> hits = room->searchHistory("3");
+    assert(hits.size() == 1);
+    assert(room->historyAt(hits[0]) == "Retainer: Retained message 3");
+    assert(room->searchHistory("retained message", "Retainer").size() == 22);
+    assert(room->searchHistory("", "Retainer").size() == 23);
+    assert(room->searchHistory("before", "Nobody").empty());
+    
+    std::cout << "\n--- Testing Cold Postings ---" << std::endl;
+    // Cold searches read only the postings, never the compressed text
+    std::ofstream(coldFile, std::ios::binary | std::ios::trunc).close();
+    hits = room->searchHistory("retained 2");
+    assert(hits.size() == 1 && hits[0] == 2);
+    assert(room->searchHistory("before").size() == 1);
+    
+    std::cout << "\n--- Testing Corrupt Cold Block ---" << std::endl;
+    {
+        // One literal, then a match of 2^40 bytes claimed by a 16-byte block
+        std::vector<unsigned char> body = {0x01, 'a', 0x80, 0x80, 0x80, 0x80, 0x80, 0x20, 0x01};
+        std::uint32_t header[2] = {16, static_cast<std::uint32_t>(body.size())};
+        std::vector<unsigned char> block(sizeof(header));
+        std::memcpy(block.data(), header, sizeof(header));
+        block.insert(block.end(), body.begin(), body.end());
+        HistoryColdStore corrupt(coldFile + ".corrupt", 1);
+        assert(!corrupt.adoptBlock(block.data(), block.size()));
+        assert(corrupt.size() == 0);
+    }
+    
+    std::cout << "\n--- Testing Byte Limit ---" << std::endl;
+    CustomChatRoom* byteRoom = new CustomChatRoom("ByteLimited");
+    byteRoom->setHistoryRetention(HistoryRetention(0, 64, 2));
+    user->joinChatRoom(byteRoom);
+    for (int i = 0; i < 10; i++) {
+        user->send("Sixteen bytes!" + std::to_string(i), byteRoom);
+    }
+    assert(byteRoom->historySize() == 10);
+    assert(byteRoom->getHotHistoryCount() == 2);
+    assert(byteRoom->historyAt(0) == "Retainer: Sixteen bytes!0");
+    assert(byteRoom->historyAt(9) == "Retainer: Sixteen bytes!9");
+    assert(byteRoom->historyAt(10).empty());
+    
+    delete user;
+    delete room;
+    delete byteRoom;
+    assert(!std::ifstream(coldFile).good());
+    assert(!std::ifstream(coldFile + ".dir").good());
+    assert(!std::ifstream(coldFile + ".pst").good());
+    
+    std::cout << "History Retention Test Completed!\n" << std::endl;
+}
+
+void testHistoryPaging() {
+    std::cout << "\n=== TESTING HISTORY PAGING ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* user = new User1("Pager");
+    user->joinChatRoom(room);
+    room->setHistoryRetention(HistoryRetention(16, 0, 8));
+    
+    for (int i = 1; i <= 100; i++) {
+        user->send("Page message " + std::to_string(i), room);
+    }
+    
+    std::cout << "\n--- Testing Sequence Numbers ---" << std::endl;
+    assert(room->getHeadSequence() == 100);
+    for (std::size_t position = 0; position < room->historySize(); position++) {
+        HistoryEntry entry = room->entryAt(position);
+        assert(entry.seq == position + 1);
+        assert(position == 0 || entry.timestamp >= room->entryAt(position - 1).timestamp);
+    }
+    assert(room->entryAt(100).seq == 0);
+    
+    std::cout << "\n--- Testing Seek And Backwards Iteration ---" << std::endl;
+    ChatHistoryIterator* iter = new ChatHistoryIterator(room);
+    iter->seekSequence(42);
+    assert(iter->nextEntry().seq == 42);
+    assert(iter->previousEntry().seq == 42);
+    assert(iter->previousEntry().seq == 41);
+    
+    iter->seekEnd();
+    assert(!iter->hasNext());
+    int older = 0;
+    while (iter->hasPrevious() && older < 10) {
+        std::cout << "Older: " << iter->previous() << std::endl;
+        older++;
+    }
+    assert(iter->nextEntry().seq == 91);
+    delete iter;
+    
+    std::cout << "\n--- Testing Since Sequence ---" << std::endl;
+    std::vector<HistoryEntry> missed = room->getHistorySince(95);
+    assert(missed.size() == 5);
+    assert(missed.front().seq == 96 && missed.back().seq == 100);
+    assert(room->getHistorySince(100).empty());
+    ChatHistoryIterator* since = room->createIteratorSince(97);
+    assert(since->next() == "Pager: Page message 98");
+    delete since;
+    since = room->createIteratorSince(100);
+    assert(!since->hasNext());
+    delete since;
+    since = room->createIteratorSince(~0ULL);
+    assert(!since->hasNext() && since->hasPrevious());
+    delete since;
+    
+    std::cout << "\n--- Testing Time Seek ---" << std::endl;
+    HistoryEntry middle = room->entryAt(60);
+    std::size_t found = room->findTimePosition(middle.timestamp);
+    assert(found <= 60);
+    assert(room->entryAt(found).timestamp == middle.timestamp);
+    assert(found == 0 || room->entryAt(found - 1).timestamp < middle.timestamp);
+    assert(room->findTimePosition(room->entryAt(99).timestamp + 1) == 100);
+    std::vector<HistoryEntry> range = room->getHistoryBetween(middle.timestamp, middle.timestamp);
+    assert(!range.empty() && range.front().seq == found + 1);
+    
+    delete user;
+    delete room;
+    
+    std::cout << "History Paging Test Completed!\n" << std::endl;
+}
+
+void testSharedMessages() {
+    std::cout << "\n=== TESTING SHARED MESSAGE BUFFERS ===" << std::endl;
+    
+    std::cout << "\n--- Testing Inline And Shared Storage ---" << std::endl;
+    Message shortMsg("hi there");
+    assert(shortMsg.useCount() == 0);
+    assert(shortMsg.str() == "hi there");
+    
+    Message longMsg(std::string(200, 'L'));
+    assert(longMsg.useCount() == 1);
+    Message copy = longMsg;
+    assert(copy.useCount() == 2);
+    assert(copy.data() == longMsg.data());
+    Message moved = std::move(copy);
+    assert(moved.useCount() == 2);
+    assert(copy.empty());
+    
+    std::cout << "\n--- Testing Buffer Sharing Through Commands And History ---" << std::endl;
+    CustomChatRoom* room = new CustomChatRoom("SharedBuffers");
+    User1* sender = new User1("Sharer");
+    User2* receiver = new User2("Listener");
+    sender->joinChatRoom(room);
+    receiver->joinChatRoom(room);
+    
+    Command* logCmd = new LogMessageCommand(room, sender, longMsg);
+    assert(longMsg.useCount() == 3);
+    logCmd->execute();
+    delete logCmd;
+    assert(room->getChatHistory()[0].text.data() == longMsg.data());
+    assert(longMsg.useCount() == 3);
+    
+    Command* sendCmd = new SendMessageCommand(room, sender, longMsg);
+    sendCmd->execute();
+    delete sendCmd;
+    assert(longMsg.useCount() == 3);
+    
+    delete sender;
+    delete receiver;
+    delete room;
+    assert(longMsg.useCount() == 2);
+    
+    std::cout << "Shared Message Buffers Test Completed!\n" << std::endl;
+}
+
+// Memory resource that counts what passes through it
+class CountingResource : public std::pmr::memory_resource {
+public:
+    std::size_t allocated = 0;
+    std::size_t outstanding = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        allocated += bytes;
+        outstanding += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        outstanding -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+void testAllocatorPlumbing() {
+    std::cout << "\n=== TESTING POLYMORPHIC ALLOCATORS ===" << std::endl;
+    
+    std::cout << "\n--- Testing Room And User Resources ---" << std::endl;
+    CountingResource roomMemory;
+    CountingResource userMemory;
+    CtrlCat* room = new CtrlCat(&roomMemory);
+    User1* user = new User1("A user name that is too long for SSO", &userMemory);
+    User2* other = new User2("Other", &userMemory);
+    assert(room->getMemoryResource() == &roomMemory);
+    
+    user->joinChatRoom(room);
+    other->joinChatRoom(room);
+    user->send("Allocated from the room's resource", room);
+    user->send("Again", room);
+    assert(roomMemory.allocated > 0);
+    assert(userMemory.allocated > 0);
+    assert(room->getChatHistory()[0].sender.get_allocator().resource() == &roomMemory);
+    CountingResource indexMemory;
+    ChatHistoryIndex index(&indexMemory);
+    index.addMessage(0, "A sender name long enough to allocate", "tokens land in the index resource");
+    assert(indexMemory.allocated > 0);
+    assert(index.find("index", "").size() == 1);
+    
+    delete user;
+    delete other;
+    assert(userMemory.outstanding == 0);
+    delete room;
+    assert(roomMemory.outstanding == 0);
+    
+    std::cout << "\n--- Testing Monotonic Room Arena ---" << std::endl;
+    std::pmr::monotonic_buffer_resource arena(64 * 1024);
+    User1* admin = new User1("ArenaAdmin");
+    admin->setAdmin(true);
+    ChatRoom* arenaRoom = admin->createChatRoom("ArenaRoom", &arena);
+    assert(arenaRoom->getMemoryResource() == &arena);
+    arenaRoom->setHistoryRetention(HistoryRetention(32));
+    admin->joinChatRoom(arenaRoom);
+    for (int i = 0; i < 100; i++) {
+        admin->send("Arena message " + std::to_string(i), arenaRoom);
+    }
+    assert(arenaRoom->historyAt(99) == "ArenaAdmin: Arena message 99");
+    admin->leaveChatRoom(arenaRoom);
+    delete arenaRoom;
+    arena.release();
+    delete admin;
+    
+    std::cout << "Polymorphic Allocators Test Completed!\n" << std::endl;
+}
+
+/**
+ * @brief Busy state that counts the mentions it is notified of
+ */
+class CountingBusy : public Busy {
+public:
+    static int mentions;
+    void handleMention(User* user, const Message& message) override {
+        mentions++;
+        Busy::handleMention(user, message);
+    }
+};
+
+int CountingBusy::mentions = 0;
+
+class EnvelopeReader : public User1 {
+public:
+    std::vector<bool> alreadyRendered;
+    std::vector<const char*> lines;
+    EnvelopeReader(const std::string& name) : User1(name) {}
+    void receiveEnvelope(const MessageEnvelope& envelope) override {
+        alreadyRendered.push_back(envelope.hasRendered());
+        lines.push_back(envelope.view().data());
+        User1::receiveEnvelope(envelope);
+    }
+};
+
+class PresenceWatcher : public User1 {
+public:
+    std::vector<std::vector<PresenceUpdate>> batches;
+    PresenceWatcher(const std::string& name) : User1(name) {}
+    void receivePresence(const std::vector<PresenceUpdate>& updates) override {
+        batches.push_back(updates);
+        User1::receivePresence(updates);
+    }
+};
+
+class QueueingUser : public User1 {
+public:
+    QueueingUser(const std::string& name) : User1(name) {}
+    using User::queueMessage;
+};
+
+class CountingReader : public User2 {
+public:
+    int received;
+    CountingReader(const std::string& name) : User2(name), received(0) {}
+    void receive(const Message& message, User* fromUser, ChatRoom* room) override {
+        received++;
+        User2::receive(message, fromUser, room);
+    }
+};
+
+class ListenerUser : public User {
+public:
+    ListenerUser(const std::string& name) : User(name) {}
+    void send(const std::string&, ChatRoom*) override {}
+    void receive(const Message&, User*, ChatRoom*) override {}
+};
+
+void testRateLimiting() {
+    std::cout << "\n=== TESTING RATE LIMITING ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* bot = new User1("ChattyBot");
+    User2* human = new User2("Human");
+    bot->joinChatRoom(room);
+    human->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Reject ---" << std::endl;
+    bot->setRateLimit(0.001, 3);
+    for (int i = 0; i < 5; i++) {
+        bot->send("Spam " + std::to_string(i), room);
+    }
+    assert(room->historySize() == 3);
+    RateLimiterStats stats = bot->getRateLimiter()->getStats();
+    assert(stats.allowed == 3 && stats.rejected == 2);
+    
+    std::cout << "\n--- Testing Room Limit ---" << std::endl;
+    bot->clearRateLimit();
+    room->setRateLimit(0.001, 1);
+    human->send("Room allows one", room);
+    bot->send("Room is full", room);
+    assert(room->historySize() == 4);
+    assert(room->getRateLimiter()->getStats().rejected == 1);
+    room->clearRateLimit();
+    
+    std::cout << "\n--- Testing Delay ---" << std::endl;
+    bot->setRateLimit(200, 1, RateLimitAction::Delay, 0.5);
+    bot->send("Immediate", room);
+    bot->send("After a short wait", room);
+    stats = bot->getRateLimiter()->getStats();
+    assert(stats.allowed == 1 && stats.delayed == 1);
+    assert(room->historySize() == 6);
+    
+    std::cout << "\n--- Testing Coalesce ---" << std::endl;
+    bot->setRateLimit(50, 1, RateLimitAction::Coalesce);
+    bot->send("Part one", room);
+    bot->send("Part two", room);
+    bot->send("Part three", room);
+    assert(room->historySize() == 7);
+    assert(bot->hasCoalesced(room));
+    assert(bot->getRateLimiter()->getStats().coalesced == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    assert(bot->flushCoalesced() == 1);
+    assert(!bot->hasCoalesced(room));
+    assert(room->historyAt(7) == "ChattyBot: Part two\nPart three");
+    
+    std::cout << "\n--- Testing Held Text Cleanup ---" << std::endl;
+    CtrlCat* side = new CtrlCat();
+    CtrlCat* doomed = new CtrlCat();
+    bot->joinChatRoom(side);
+    bot->joinChatRoom(doomed);
+    bot->setRateLimit(0.001, 1, RateLimitAction::Coalesce);
+    bot->send("Spends the token", side);
+    bot->send("Held for side", side);
+    bot->send("Held for doomed", doomed);
+    assert(bot->hasCoalesced(side) && bot->hasCoalesced(doomed));
+    bot->leaveChatRoom(side);
+    assert(!bot->hasCoalesced(side));
+    delete doomed;
+    assert(!bot->hasCoalesced(doomed));
+    assert(bot->getChatRooms().size() == 1);
+    bot->send("Not a member", side);
+    assert(!bot->hasCoalesced(side));
+    bot->setMaxCoalescedBytes(16);
+    bot->send("0123456789", room);
+    bot->send("0123456789", room);
+    assert(bot->hasCoalesced(room));
+    bot->clearRateLimit();
+    assert(bot->flushCoalesced() == 1);
+    assert(room->historyAt(room->historySize() - 1) == "ChattyBot: 0123456789");
+    delete side;
+    
+    std::cout << "\n--- Testing Command Queue Backpressure ---" << std::endl;
+    std::size_t before = room->historySize();
+    bot->setMaxQueuedCommands(4);
+    for (int i = 0; i < 6; i++) {
+        bot->addCommand(new LogMessageCommand(room, bot, "Queued " + std::to_string(i)));
+    }
+    assert(bot->getBackpressureCount() == 2);
+    assert(room->historySize() == before);
+    bot->executeAll();
+    assert(room->historySize() == before + 4);
+    
+    delete bot;
+    delete human;
+    delete room;
+    
+    std::cout << "Rate Limiting Test Completed!\n" << std::endl;
+}
+
+void testCommandPriority() {
+    std::cout << "\n=== TESTING COMMAND PRIORITY ===" << std::endl;
+    
+    Dogorithm* room = new Dogorithm();
+    User1* member = new User1("Member");
+    User1* moderator = new User1("Moderator");
+    moderator->setAdmin(true);
+    member->joinChatRoom(room);
+    moderator->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Default Priorities ---" << std::endl;
+    LogMessageCommand* normal = new LogMessageCommand(room, member, "Normal");
+    LogMessageCommand* admin = new LogMessageCommand(room, moderator, "Admin");
+    assert(normal->getPriority() == CommandPriority::Normal);
+    assert(admin->getPriority() == CommandPriority::Admin);
+    
+    std::cout << "\n--- Testing Dispatch Order ---" << std::endl;
+    member->addCommand(normal);
+    member->addCommand(new LogMessageCommand(room, member, "Normal again"));
+    member->addCommand(admin);
+    LogMessageCommand* notice = new LogMessageCommand(room, moderator, "Notice");
+    notice->setPriority(CommandPriority::System);
+    member->addCommand(notice);
+    assert(member->getQueuedCommandCount() == 4);
+    member->executeAll();
+    assert(member->getQueuedCommandCount() == 0);
+    assert(room->historyAt(0) == "Moderator: Notice");
+    assert(room->historyAt(1) == "Moderator: Admin");
+    assert(room->historyAt(2) == "Member: Normal");
+    assert(room->historyAt(3) == "Member: Normal again");
+    
+    std::cout << "\n--- Testing Starvation Protection ---" << std::endl;
+    CommandScheduler scheduler;
+    scheduler.setStarvationLimit(2);
+    LogMessageCommand* waiting = new LogMessageCommand(room, member, "Waiting");
+    scheduler.push(waiting);
+    for (int i = 0; i < 4; i++) {
+        scheduler.push(new LogMessageCommand(room, moderator, "Flood " + std::to_string(i)));
+    }
+    assert(scheduler.size() == 5);
+    assert(scheduler.size(CommandPriority::Admin) == 4);
+    std::size_t served = 0;
+    while (Command* command = scheduler.pop()) {
+        served++;
+        if (command == waiting) {
+            assert(served == 3);
+        }
+        delete command;
+    }
+    assert(served == 5 && scheduler.empty());
+    assert(scheduler.pop() == nullptr);
+    assert(scheduler.peek() == nullptr);
+    
+    std::cout << "\n--- Testing Dispatch Across Members ---" << std::endl;
+    for (int i = 0; i < 3; i++) {
+        member->addCommand(new LogMessageCommand(room, member, "Flood " + std::to_string(i)));
+    }
+    moderator->addCommand(new LogMessageCommand(room, moderator, "Slow down"));
+    member->addCommand(new LogMessageCommand(room, member, "Flood 3"));
+    assert(room->dispatchCommands() == 5);
+    assert(room->historyAt(4) == "Moderator: Slow down");
+    assert(room->historyAt(5) == "Member: Flood 0");
+    assert(room->historyAt(8) == "Member: Flood 3");
+    assert(member->getQueuedCommandCount() == 0 && moderator->getQueuedCommandCount() == 0);
+    
+    delete member;
+    delete moderator;
+    delete room;
+    
+    std::cout << "Command Priority Test Completed!\n" << std::endl;
+}
+
+void testBatchSend() {
+    std::cout << "\n=== TESTING BATCH SEND ===" << std::endl;
+    
+    CustomChatRoom* room = new CustomChatRoom("Bridge");
+    User1* bridge = new User1("BridgeBot");
+    User2* reader = new User2("Reader");
+    User3* sleeper = new User3("Sleeper");
+    bridge->joinChatRoom(room);
+    reader->joinChatRoom(room);
+    sleeper->joinChatRoom(room);
+    sleeper->setState(new Busy());
+    CountingReader* counter = new CountingReader("Counter");
+    counter->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Batch Delivery ---" << std::endl;
+    std::vector<std::string> batch;
+    for (int i = 0; i < 5; i++) {
+        batch.push_back("Relayed line " + std::to_string(i));
+    }
+    assert(bridge->sendBatch(batch, room) == 5);
+    assert(room->historySize() == 5);
+    assert(room->historyAt(0) == "BridgeBot: Relayed line 0");
+    assert(room->historyAt(4) == "BridgeBot: Relayed line 4");
+    assert(room->entryAt(4).seq == 5);
+    assert(room->searchHistory("relayed", "BridgeBot").size() == 5);
+    assert(bridge->getQueuedCommandCount() == 0);
+    assert(counter->received == 5);
+    
+    std::cout << "\n--- Testing Batch Edge Cases ---" << std::endl;
+    assert(bridge->sendBatch(std::vector<std::string>(), room) == 0);
+    assert(bridge->sendBatch(batch, nullptr) == 0);
+    assert(room->historySize() == 5);
+    
+    std::cout << "\n--- Testing Batch Rate Limiting ---" << std::endl;
+    bridge->setRateLimit(0.001, 2);
+    assert(bridge->sendBatch(batch, room) == 2);
+    assert(room->historySize() == 7);
+    bridge->clearRateLimit();
+    
+    delete bridge;
+    delete reader;
+    delete sleeper;
+    delete counter;
+    delete room;
+    
+    std::cout << "Batch Send Test Completed!\n" << std::endl;
+}
+
+void testBroadcast() {
+    std::cout << "\n=== TESTING BROADCAST ===" << std::endl;
+    
+    CtrlCat* cats = new CtrlCat();
+    Dogorithm* dogs = new Dogorithm();
+    CustomChatRoom* lounge = new CustomChatRoom("Lounge");
+    User1* announcer = new User1("Announcer");
+    User2* everywhere = new User2("Everywhere");
+    User3* catsOnly = new User3("CatsOnly");
+    for (ChatRoom* room : std::vector<ChatRoom*>{cats, dogs, lounge}) {
+        announcer->joinChatRoom(room);
+        everywhere->joinChatRoom(room);
+    }
+    catsOnly->joinChatRoom(cats);
+    
+    std::cout << "\n--- Testing User Handles ---" << std::endl;
+    assert(announcer->getHandle() != everywhere->getHandle());
+    assert(everywhere->getHandle() != catsOnly->getHandle());
+    assert(catsOnly->getHandle() < User::getHandleLimit());
+    unsigned int freed = catsOnly->getHandle();
+    User1* temporary = new User1("Temporary");
+    unsigned int limit = User::getHandleLimit();
+    delete temporary;
+    User1* reused = new User1("Reused");
+    assert(User::getHandleLimit() == limit);
+    assert(reused->getHandle() != freed);
+    delete reused;
+    
+    std::cout << "\n--- Testing De-duplicated Delivery ---" << std::endl;
+    assert(announcer->broadcast("Maintenance at noon") == 2);
+    assert(cats->historySize() == 1);
+    assert(dogs->historySize() == 1);
+    assert(lounge->historySize() == 1);
+    assert(lounge->historyAt(0) == "Announcer: Maintenance at noon");
+    
+    std::cout << "\n--- Testing Explicit Room List ---" << std::endl;
+    assert(announcer->broadcast("Dogs and lounge only", {dogs, lounge, dogs, nullptr}) == 1);
+    assert(dogs->historySize() == 2);
+    assert(cats->historySize() == 1);
+    assert(catsOnly->broadcast("Nobody else", {}) == 0);
+    
+    std::cout << "\n--- Testing Rate Limited Rooms ---" << std::endl;
+    cats->setRateLimit(0.001, 1);
+    cats->getRateLimiter()->consume(false);
+    assert(announcer->broadcast("Cats are limited") == 1);
+    assert(cats->historySize() == 1);
+    assert(lounge->historySize() == 3);
+    cats->clearRateLimit();
+    
+    std::cout << "\n--- Testing One Token Per Broadcast ---" << std::endl;
+    announcer->setRateLimit(0.001, 1);
+    assert(announcer->broadcast("Costs one token") == 2);
+    assert(cats->historySize() == 2 && dogs->historySize() == 4 && lounge->historySize() == 4);
+    assert(announcer->broadcast("Over the limit") == 0);
+    assert(lounge->historySize() == 4);
+    assert(announcer->getRateLimiter()->getStats().allowed == 1);
+    assert(announcer->getQueuedCommandCount() == 0);
+    announcer->clearRateLimit();
+    
+    std::cout << "\n--- Testing Refused Rooms Cost No Token ---" << std::endl;
+    announcer->setRateLimit(0.001, 1);
+    cats->setRateLimit(0.001, 1);
+    cats->getRateLimiter()->consume(false);
+    assert(announcer->broadcast("Cats only", {cats}) == 0);
+    assert(announcer->getRateLimiter()->available() >= 1.0);
+    assert(announcer->broadcast("Lounge instead", {lounge}) == 1);
+    assert(lounge->historySize() == 5);
+    cats->clearRateLimit();
+    announcer->clearRateLimit();
+    
+    std::cout << "\n--- Testing Broadcast Queue Memory Cap ---" << std::endl;
+    announcer->setMemoryCaps(16, 0);
+    assert(announcer->broadcast("Too big for the queue cap") == 0);
+    assert(lounge->historySize() == 5);
+    assert(announcer->getMemoryRejectionCount() == 1);
+    announcer->setMemoryCaps(0, 0);
+    
+    std::cout << "\n--- Testing Mentions In A Broadcast ---" << std::endl;
+    everywhere->setState(new CountingBusy());
+    int mentionsBefore = CountingBusy::mentions;
+    assert(announcer->broadcast("Ping @Everywhere") == 2);
+    assert(CountingBusy::mentions == mentionsBefore + 1);
+    CountingBusy::mentions = mentionsBefore;
+    
+    delete announcer;
+    delete everywhere;
+    delete catsOnly;
+    delete cats;
+    delete dogs;
+    delete lounge;
+    
+    std::cout << "Broadcast Test Completed!\n" << std::endl;
+}
+
+void testDirectMessaging() {
+    std::cout << "\n=== TESTING DIRECT MESSAGING ===" << std::endl;
+    
+    User1* alice = new User1("Alice");
+    User2* bob = new User2("Bob");
+    User3* carol = new User3("Carol");
+    
+    std::cout << "\n--- Testing Directory Lookup ---" << std::endl;
+    assert(UserDirectory::find(alice->getHandle()) == alice);
+    assert(UserDirectory::find(bob->getHandle()) == bob);
+    assert(UserDirectory::find(User::getHandleLimit() + 10) == nullptr);
+    
+    std::cout << "\n--- Testing Point-to-Point Delivery ---" << std::endl;
+    assert(alice->getConversationWith(bob) == nullptr);
+    assert(alice->sendDirect(bob->getHandle(), "Lunch?"));
+    assert(bob->sendDirect(alice->getHandle(), "Sure"));
+    const DirectConversation* chat = alice->getConversationWith(bob);
+    assert(chat != nullptr && chat == bob->getConversationWith(alice));
+    assert(chat->size() == 2);
+    assert(chat->at(0) == "Alice: Lunch?");
+    assert(chat->at(1) == "Bob: Sure");
+    assert(chat->at(2) == "");
+    assert(alice->getConversationWith(carol) == nullptr);
+    
+    std::cout << "\n--- Testing Recipient State ---" << std::endl;
+    carol->setState(new Offline());
+    assert(alice->sendDirect(carol->getHandle(), "Are you there?"));
+    assert(alice->getConversationWith(carol)->size() == 1);
+    
+    std::cout << "\n--- Testing Invalid Recipients ---" << std::endl;
+    assert(!alice->sendDirect(alice->getHandle(), "Note to self"));
+    assert(!alice->sendDirect(User::getHandleLimit() + 10, "Nobody"));
+    assert(alice->getConversationWith(nullptr) == nullptr);
+    alice->setRateLimit(0.001, 1);
+    assert(alice->sendDirect(bob->getHandle(), "Allowed"));
+    assert(!alice->sendDirect(bob->getHandle(), "Too fast"));
+    assert(chat->size() == 3);
+    alice->clearRateLimit();
+    
+    std::cout << "\n--- Testing Departure ---" << std::endl;
+    unsigned int bobHandle = bob->getHandle();
+    delete bob;
+    assert(UserDirectory::find(bobHandle) == nullptr);
+    assert(!alice->sendDirect(bobHandle, "Gone?"));
+    User1* dave = new User1("Dave");
+    assert(dave->getHandle() == bobHandle);
+    assert(alice->getConversationWith(dave) == nullptr);
+    assert(alice->getConversationWith(carol)->size() == 1);
+    assert(alice->sendDirect(dave->getHandle(), "Welcome"));
+    unsigned int carolHandle = carol->getHandle();
+    delete carol;
+    assert(UserDirectory::conversation(alice->getHandle(), carolHandle) == nullptr);
+    assert(alice->getConversationWith(dave)->size() == 1);
+    
+    delete alice;
+    delete dave;
+    
+    std::cout << "Direct Messaging Test Completed!\n" << std::endl;
+}
+
+void testMentions() {
+    std::cout << "\n=== TESTING MENTIONS ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* alice = new User1("Alice");
+    User2* al = new User2("Al");
+    User3* bob = new User3("Bob");
+    User1* carol = new User1("Carol");
+    for (User* user : std::vector<User*>{alice, al, bob, carol}) {
+        user->joinChatRoom(room);
+    }
+    bob->setState(new CountingBusy());
+    
+    std::cout << "\n--- Testing Matcher ---" << std::endl;
+    MentionMatcher matcher;
+    assert(matcher.match("@Alice").empty());
+    matcher.rebuild(room->getUsers());
+    assert(matcher.patternCount() == 4);
+    std::vector<unsigned int> found = matcher.match("@Bob, @Al and @Alice: ping @Bob");
+    assert(found.size() == 3);
+    assert(found[0] == bob->getHandle() && found[1] == al->getHandle() && found[2] == alice->getHandle());
+    assert(matcher.match("@Alicea @Bob_ no mentions @ all").empty());
+    assert(matcher.match("email bob@Carol.") == std::vector<unsigned int>{carol->getHandle()});
+    
+    std::cout << "\n--- Testing Incremental Updates ---" << std::endl;
+    matcher.remove(al->getHandle(), al->getName());
+    assert(matcher.patternCount() == 3);
+    assert(matcher.match("@Al and @Alice") == std::vector<unsigned int>{alice->getHandle()});
+    matcher.add(al->getHandle(), al->getName());
+    matcher.add(1000, "Ali");
+    assert(matcher.match("@Ali @Al") == (std::vector<unsigned int>{1000, al->getHandle()}));
+    assert(!matcher.isSparse());
+    
+    std::cout << "\n--- Testing Busy Notification ---" << std::endl;
+    CountingReader* reader = new CountingReader("Reader");
+    reader->joinChatRoom(room);
+    alice->send("@Bob can you review this?", room);
+    assert(CountingBusy::mentions == 1);
+    alice->send("@Reader this reaches receive() too", room);
+    assert(reader->received == 2);
+    alice->send("No mention for Bob here", room);
+    assert(CountingBusy::mentions == 1);
+    
+    std::cout << "\n--- Testing Membership Changes ---" << std::endl;
+    bob->leaveChatRoom(room);
+    carol->send("@Bob are you still here?", room);
+    assert(CountingBusy::mentions == 1);
+    bob->joinChatRoom(room);
+    carol->send("Welcome back @Bob", room);
+    assert(CountingBusy::mentions == 2);
+    assert(room->historySize() == 5);
+    
+    delete alice;
+    delete al;
+    delete bob;
+    delete carol;
+    delete reader;
+    delete room;
+    
+    std::cout << "Mentions Test Completed!\n" << std::endl;
+}
+
+void testRoomRegistry() {
+    std::cout << "\n=== TESTING ROOM REGISTRY ===" << std::endl;
+    
+    User1* admin = new User1("RegistryAdmin");
+    User2* member = new User2("RegistryMember");
+    admin->setAdmin(true);
+    ChatRoomRegistry& global = ChatRoomRegistry::global();
+    std::size_t before = global.size();
+    
+    std::cout << "\n--- Testing Lookup By Name ---" << std::endl;
+    ChatRoom* lobby = admin->createChatRoom("RegistryLobby");
+    assert(lobby != nullptr);
+    assert(global.find("RegistryLobby") == lobby);
+    assert(global.find("NoSuchRoom") == nullptr);
+    assert(global.size() == before + 1);
+    assert(admin->createChatRoom("RegistryLobby") == nullptr);
+    
+    std::cout << "\n--- Testing Direct Delete ---" << std::endl;
+    delete lobby;
+    assert(global.find("RegistryLobby") == nullptr);
+    assert(global.size() == before);
+    lobby = admin->createChatRoom("RegistryLobby");
+    assert(lobby != nullptr);
+    
+    std::cout << "\n--- Testing Destroy ---" << std::endl;
+    member->joinChatRoom(lobby);
+    admin->joinChatRoom(lobby);
+    assert(global.destroy("RegistryLobby"));
+    assert(!global.destroy("RegistryLobby"));
+    assert(member->getChatRooms().empty());
+    assert(admin->getChatRooms().empty());
+    
+    std::cout << "\n--- Testing Bulk Teardown ---" << std::endl;
+    ChatRoomRegistry* local = new ChatRoomRegistry();
+    for (int i = 0; i < 1000; i++) {
+        CustomChatRoom* room = local->create("Room " + std::to_string(i));
+        assert(room != nullptr);
+        if (i % 100 == 0) {
+            member->joinChatRoom(room);
+        }
+    }
+    assert(local->size() == 1000);
+    assert(local->find("Room 500")->getRoomName() == "Room 500");
+    assert(member->getChatRooms().size() == 10);
+    assert(local->teardown() == 1000);
+    assert(local->size() == 0);
+    assert(member->getChatRooms().empty());
+    member->joinChatRoom(local->create("Left for the destructor"));
+    assert(member->getChatRooms().size() == 1);
+    delete local;
+    assert(member->getChatRooms().empty());
+    
+    std::cout << "\n--- Testing Object Slab ---" << std::endl;
+    ObjectSlab slab(24, 4);
+    std::vector<void*> slots;
+    for (int i = 0; i < 6; i++) {
+        slots.push_back(slab.allocate());
+    }
+    assert(slab.blockCount() == 2 && slab.liveCount() == 6);
+    for (void* slot : slots) {
+        slab.deallocate(slot);
+    }
+    for (int i = 0; i < 8; i++) {
+        slab.allocate();
+    }
+    assert(slab.blockCount() == 2 && slab.liveCount() == 8);
+    
+    delete admin;
+    delete member;
+    
+    std::cout << "Room Registry Test Completed!\n" << std::endl;
+}
+
+void testSnapshots() {
+    std::cout << "\n=== TESTING SNAPSHOTS ===" << std::endl;
+    
+    User1* owner = new User1("SnapOwner");
+    User2* guest = new User2("SnapGuest");
+    User3* idle = new User3("SnapIdle");
+    owner->setAdmin(true);
+    guest->setState(new Busy());
+    idle->setState(new Offline());
+    CtrlCat* cats = new CtrlCat();
+    CustomChatRoom* garden = new CustomChatRoom("Garden");
+    owner->joinChatRoom(cats);
+    guest->joinChatRoom(cats);
+    owner->joinChatRoom(garden);
+    idle->joinChatRoom(garden);
+    owner->send("Snapshot me", cats);
+    guest->send("And me", cats);
+    owner->send("Plants need water", garden);
+    
+    std::cout << "\n--- Testing Save And Restore ---" << std::endl;
+    const std::string path = "petspace_test.snap";
+    std::vector<User*> users = {owner, guest, idle};
+    std::vector<ChatRoom*> rooms = {cats, garden};
+    assert(PetSpaceSnapshot::save(path, users, rooms));
+    
+    std::vector<User*> restoredUsers;
+    std::vector<ChatRoom*> restoredRooms;
+    assert(PetSpaceSnapshot::load(path, restoredUsers, restoredRooms));
+    assert(restoredUsers.size() == 3 && restoredRooms.size() == 2);
+    assert(restoredUsers[0]->getName() == "SnapOwner" && restoredUsers[0]->getAdmin());
+    assert(dynamic_cast<User2*>(restoredUsers[1]) != nullptr);
+    assert(restoredUsers[1]->getState()->getStateName() == "Busy");
+    assert(restoredUsers[2]->getState()->getStateName() == "Offline");
+    assert(dynamic_cast<CtrlCat*>(restoredRooms[0]) != nullptr);
+    assert(restoredRooms[1]->getRoomName() == "Garden");
+    assert(restoredRooms[0]->getUsers().size() == 2);
+    assert(restoredUsers[0]->getChatRooms().size() == 2);
+    assert(restoredRooms[0]->historySize() == 2);
+    assert(restoredRooms[0]->historyAt(1) == "SnapGuest: And me");
+    assert(restoredRooms[0]->entryAt(1).timestamp == cats->entryAt(1).timestamp);
+    assert(restoredRooms[1]->searchHistory("water").size() == 1);
+    assert(ChatRoomRegistry::global().find("Garden") == restoredRooms[1]);
+    assert(restoredUsers[0]->getReadCursor(restoredRooms[0]) == owner->getReadCursor(cats));
+    
+    std::cout << "\n--- Testing Cold History Snapshot ---" << std::endl;
+    cats->setHistoryRetention(HistoryRetention(3, 0, 2));
+    for (int i = 0; i < 6; i++) {
+        owner->send("Cold line " + std::to_string(i), cats);
+    }
+    std::vector<User*> coldUsers;
+    std::vector<ChatRoom*> coldRooms;
+    std::vector<unsigned char> coldBuffer;
+    assert(PetSpaceSnapshot::encode(coldBuffer, users, {cats}));
+    assert(PetSpaceSnapshot::decode(coldBuffer.data(), coldBuffer.size(), coldUsers, coldRooms));
+    HistoryRetention kept;
+    assert(coldRooms[0]->getHistoryRetention(kept) && kept.maxMessages == 3 && kept.blockMessages == 2);
+    assert(coldRooms[0]->historySize() == 8 && coldRooms[0]->getColdHistoryCount() == 5);
+    assert(coldRooms[0]->historyAt(0) == "SnapOwner: Snapshot me");
+    assert(coldRooms[0]->historyAt(4) == "SnapOwner: Cold line 2");
+    assert(coldRooms[0]->entryAt(7).seq == 8);
+    assert(!coldRooms[0]->searchHistory("line").empty());
+    delete coldRooms[0];
+    for (User* user : coldUsers) {
+        delete user;
+    }
+    
+    std::cout << "\n--- Testing Rejected Snapshots ---" << std::endl;
+    std::vector<User*> none;
+    std::vector<ChatRoom*> noRooms;
+    // Garden is still restored and registered, so a second copy is refused
+    assert(!PetSpaceSnapshot::load(path, none, noRooms));
+    ListenerUser* listener = new ListenerUser("SnapListener");
+    std::vector<unsigned char> refused;
+    assert(!PetSpaceSnapshot::encode(refused, {owner, listener}, {}) && refused.empty());
+    delete listener;
+    std::vector<unsigned char> buffer;
+    assert(PetSpaceSnapshot::encode(buffer, users, {cats}));
+    assert(!PetSpaceSnapshot::decode(buffer.data(), buffer.size() - 3, none, noRooms));
+    buffer[4] = 99;
+    assert(!PetSpaceSnapshot::decode(buffer.data(), buffer.size(), none, noRooms));
+    assert(none.empty() && noRooms.empty());
+    assert(!PetSpaceSnapshot::load("no_such_snapshot.snap", none, noRooms));
+    std::remove(path.c_str());
+    
+    for (ChatRoom* room : restoredRooms) {
+        delete room;
+    }
+    for (User* user : restoredUsers) {
+        delete user;
+    }
+    delete cats;
+    delete garden;
+    delete owner;
+    delete guest;
+    delete idle;
+    
+    std::cout << "Snapshots Test Completed!\n" << std::endl;
+}
+
+void testCommandJournal() {
+    std::cout << "\n=== TESTING COMMAND JOURNAL ===" << std::endl;
+    
+    const std::string snapshotPath = "journal_test.snap";
+    const std::string journalPath = "journal_test.wal";
+    std::remove(journalPath.c_str());
+    User1* writer = new User1("JournalWriter");
+    User2* reader = new User2("JournalReader");
+    Dogorithm* room = new Dogorithm();
+    writer->joinChatRoom(room);
+    reader->joinChatRoom(room);
+    writer->send("Before the checkpoint", room);
+    
+    std::cout << "\n--- Testing Group Commit ---" << std::endl;
+    CommandJournal* journal = new CommandJournal(journalPath, 4, 60.0);
+    assert(journal->isOpen());
+    assert(journal->checkpoint(snapshotPath, {writer, reader}, {room}));
+    std::FILE* leftover = std::fopen((snapshotPath + ".tmp").c_str(), "rb");
+    assert(leftover == nullptr);
+    CommandJournal::install(journal);
+    assert(CommandJournal::current() == journal);
+    writer->send("First after checkpoint", room);
+    reader->send("Second after checkpoint", room);
+    assert(journal->getRecordCount() == 4);
+    assert(journal->getSyncCount() == 1 && journal->getPendingCount() == 0);
+    User3* late = new User3("LateJoiner");
+    journal->trackUser(late);
+    late->joinChatRoom(room);
+    late->sendBatch({"Batch one", "Batch two"}, room);
+    writer->sendDirect(reader->getHandle(), "Private hello");
+    User1* untracked = new User1("Untracked");
+    untracked->joinChatRoom(room);
+    untracked->send("Not journaled", room);
+    // The join, the send and its log command are each reported
+    assert(journal->getSkippedCount() == 3);
+    assert(journal->getPendingCount() > 0);
+    assert(journal->sync());
+    assert(journal->getPendingCount() == 0);
+    CommandJournal::install(nullptr);
+    delete journal;
+    
+    std::cout << "\n--- Testing Idle Journal Tail ---" << std::endl;
+    const std::string idlePath = "journal_idle.wal";
+    CommandJournal* idle = new CommandJournal(idlePath, 64, 0.01);
+    idle->setCatalog({writer}, {room});
+    assert(idle->appendMembership(JournalRecord::Leave, writer, room));
+    for (int wait = 0; wait < 200 && idle->getPendingCount() > 0; wait++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(idle->getPendingCount() == 0 && idle->getSyncCount() == 1);
+    delete idle;
+    std::remove(idlePath.c_str());
+    
+    std::cout << "\n--- Testing Crash Recovery ---" << std::endl;
+    std::FILE* torn = std::fopen(journalPath.c_str(), "ab");
+    assert(torn != nullptr);
+    std::fputs("\x20torn", torn);
+    std::fclose(torn);
+    std::vector<User*> users;
+    std::vector<ChatRoom*> rooms;
+    assert(CommandJournal::recover(snapshotPath, journalPath, users, rooms));
+    assert(users.size() == 3 && rooms.size() == 1);
+    assert(users[2]->getName() == "LateJoiner");
+    assert(rooms[0]->getUsers().size() == 3);
+    assert(rooms[0]->historySize() == 5);
+    assert(rooms[0]->historyAt(0) == "JournalWriter: Before the checkpoint");
+    assert(rooms[0]->historyAt(4) == "LateJoiner: Batch two");
+    // Replayed messages keep the time they were journaled, not the time of recovery
+    for (std::size_t i = 1; i < 5; i++) {
+        assert(rooms[0]->entryAt(i).timestamp <= room->entryAt(i).timestamp);
+        assert(room->entryAt(i).timestamp - rooms[0]->entryAt(i).timestamp < 1000);
+    }
+    assert(users[0]->getConversationWith(users[1])->at(0) == "JournalWriter: Private hello");
+    assert(CommandJournal::replay("no_such_journal.wal", users, rooms) == 0);
+    
+    std::cout << "\n--- Testing Stale Journal ---" << std::endl;
+    std::vector<unsigned char> snapshot;
+    PetSpaceSnapshot::encode(snapshot, {writer}, {});
+    std::FILE* other = std::fopen(snapshotPath.c_str(), "wb");
+    std::fwrite(snapshot.data(), 1, snapshot.size(), other);
+    std::fclose(other);
+    std::vector<User*> staleUsers;
+    std::vector<ChatRoom*> staleRooms;
+    assert(CommandJournal::recover(snapshotPath, journalPath, staleUsers, staleRooms));
+    assert(staleUsers.size() == 1 && staleRooms.empty());
+    delete staleUsers[0];
+    
+    for (ChatRoom* restored : rooms) {
+        std::vector<User*> members(restored->getUsers().begin(), restored->getUsers().end());
+        for (User* member : members) {
+            member->leaveChatRoom(restored);
+        }
+        delete restored;
+    }
+    for (User* user : users) {
+        delete user;
+    }
+    std::remove(snapshotPath.c_str());
+    std::remove(journalPath.c_str());
+    delete writer;
+    delete reader;
+    delete late;
+    delete untracked;
+    delete room;
+    
+    std::cout << "Command Journal Test Completed!\n" << std::endl;
+}
+
+void testTraceReplay() {
+    std::cout << "\n=== TESTING TRACE RECORD AND REPLAY ===" << std::endl;
+    
+    const std::string path = "workload_test.trace";
+    TraceRecorder* recorder = new TraceRecorder(path);
+    assert(recorder->isOpen());
+    TraceRecorder::install(recorder);
+    
+    std::cout << "\n--- Testing Capture ---" << std::endl;
+    User1* host = new User1("TraceHost");
+    User2* guest = new User2("TraceGuest");
+    host->setAdmin(true);
+    ChatRoom* room = host->createChatRoom("TraceRoom");
+    CtrlCat* cats = new CtrlCat();
+    host->joinChatRoom(room);
+    guest->joinChatRoom(room);
+    guest->joinChatRoom(cats);
+    host->send("Welcome to the trace", room);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    guest->setState(new Busy());
+    guest->send("Brb", room);
+    guest->leaveChatRoom(cats);
+    assert(recorder->getEventCount() == 11);
+    TraceRecorder::install(nullptr);
+    delete recorder;
+    
+    guest->leaveChatRoom(room);
+    host->leaveChatRoom(room);
+    delete cats;
+    delete host;
+    delete guest;
+    
+    std::cout << "\n--- Testing Fast Replay ---" << std::endl;
+    TraceReplayer replayer;
+    assert(!replayer.load("no_such_trace.trace"));
+    assert(replayer.run() == 0);
+    assert(replayer.load(path));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    assert(replayer.run() == 11);
+    std::chrono::steady_clock::duration fast = std::chrono::steady_clock::now() - start;
+    assert(replayer.getUsers().size() == 2 && replayer.getRooms().size() == 2);
+    ChatRoom* replayed = replayer.getRooms()[0];
+    assert(replayed->getRoomName() == "TraceRoom");
+    assert(replayed->historySize() == 2);
+    assert(replayed->historyAt(1) == "TraceGuest: Brb");
+    assert(replayer.getUsers()[1]->getState()->getStateName() == "Busy");
+    assert(replayer.getUsers()[1]->getChatRooms().size() == 1);
+    // The live TraceRoom keeps its name; the replayed one lives in the replayer's registry
+    assert(replayed != room && ChatRoomRegistry::global().find("TraceRoom") == room);
+    delete room;
+    
+    std::cout << "\n--- Testing Original Speed Replay ---" << std::endl;
+    start = std::chrono::steady_clock::now();
+    assert(replayer.run(true) == 11);
+    std::chrono::steady_clock::duration paced = std::chrono::steady_clock::now() - start;
+    assert(paced >= std::chrono::milliseconds(30));
+    assert(paced > fast);
+    assert(replayer.getRooms()[0]->historySize() == 2);
+    std::remove(path.c_str());
+    
+    std::cout << "Trace Replay Test Completed!\n" << std::endl;
+}
+
+void testPresence() {
+    std::cout << "\n=== TESTING PRESENCE NOTIFICATIONS ===" << std::endl;
+    
+    PresenceHub hub;
+    PresenceHub::install(&hub);
+    CtrlCat* cats = new CtrlCat();
+    Dogorithm* dogs = new Dogorithm();
+    PresenceWatcher* watcher = new PresenceWatcher("Watcher");
+    User2* flapper = new User2("Flapper");
+    User3* steady = new User3("Steady");
+    watcher->joinChatRoom(cats);
+    watcher->joinChatRoom(dogs);
+    flapper->joinChatRoom(cats);
+    flapper->joinChatRoom(dogs);
+    steady->joinChatRoom(dogs);
+    hub.subscribe(watcher, cats);
+    hub.subscribe(watcher, dogs);
+    hub.subscribe(watcher, dogs);
+    
+    std::cout << "\n--- Testing Coalescing ---" << std::endl;
+    for (int i = 0; i < 50; i++) {
+        flapper->setState(new Busy());
+        flapper->setState(new Offline());
+    }
+    steady->setState(new Busy());
+    assert(hub.getChangeCount() == 101);
+    assert(hub.getDirtyCount() == 2);
+    assert(hub.tick() == 1);
+    assert(watcher->batches.size() == 1);
+    assert(watcher->batches[0].size() == 2);
+    assert(watcher->batches[0][0].name == "Flapper");
+    assert(watcher->batches[0][0].state == "Offline");
+    assert(watcher->batches[0][1].state == "Busy");
+    assert(hub.getDeliveredCount() == 2);
+    assert(hub.tick() == 0);
+    
+    std::cout << "\n--- Testing Flap Suppression ---" << std::endl;
+    flapper->setState(new Online());
+    flapper->setState(new Offline());
+    watcher->setState(new Busy());
+    assert(hub.tick() == 0);
+    assert(hub.getSuppressedCount() == 1);
+    assert(watcher->batches.size() == 1);
+    
+    std::cout << "\n--- Testing Unsubscribe and Forget ---" << std::endl;
+    hub.unsubscribe(watcher, cats);
+    hub.unsubscribe(watcher, dogs);
+    steady->setState(new Online());
+    assert(hub.tick() == 0);
+    hub.subscribe(watcher, dogs);
+    steady->setState(new Offline());
+    steady->leaveChatRoom(dogs);
+    delete steady;
+    assert(hub.getDirtyCount() == 0);
+    unsigned int reused = watcher->getHandle();
+    watcher->leaveChatRoom(cats);
+    watcher->leaveChatRoom(dogs);
+    // Leaving dogs ended the watcher's subscription to it
+    flapper->setState(new Online());
+    assert(hub.tick() == 0);
+    delete watcher;
+    User1* newcomer = new User1("Newcomer");
+    assert(newcomer->getHandle() == reused);
+    newcomer->joinChatRoom(dogs);
+    flapper->setState(new Busy());
+    assert(hub.tick() == 0);
+    
+    flapper->leaveChatRoom(cats);
+    flapper->leaveChatRoom(dogs);
+    newcomer->leaveChatRoom(dogs);
+    PresenceHub::install(nullptr);
+    delete cats;
+    delete dogs;
+    delete flapper;
+    delete newcomer;
+    
+    std::cout << "\nPresence notification tests passed!" << std::endl;
+}
+
+void testLazyRendering() {
+    std::cout << "\n=== TESTING LAZY MESSAGE RENDERING ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* sender = new User1("Renderer");
+    EnvelopeReader* first = new EnvelopeReader("FirstReader");
+    EnvelopeReader* second = new EnvelopeReader("SecondReader");
+    sender->joinChatRoom(room);
+    first->joinChatRoom(room);
+    second->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Render Into Buffer ---" << std::endl;
+    MessageEnvelope envelope(room, sender, Message("hello"));
+    assert(envelope.getRoomId() == room->getRoomId());
+    assert(envelope.getSenderHandle() == sender->getHandle());
+    assert(!envelope.hasRendered());
+    char buffer[64];
+    assert(envelope.render(buffer, sizeof(buffer)) == 25);
+    assert(std::string(buffer) == "[CtrlCat] Renderer: hello");
+    char small[8];
+    assert(envelope.render(small, sizeof(small)) == 25);
+    assert(std::string(small) == "[CtrlCa");
+    assert(envelope.render(nullptr, 0) == 25);
+    assert(!envelope.hasRendered());
+    assert(envelope.view() == "[CtrlCat] Renderer: hello");
+    assert(envelope.hasRendered());
+    
+    std::cout << "\n--- Testing Shared Render ---" << std::endl;
+    sender->send("rendered once", room);
+    assert(first->lines.size() == 1 && second->lines.size() == 1);
+    assert(first->lines[0] == second->lines[0]);
+    assert(second->alreadyRendered[0]);
+    
+    std::cout << "\n--- Testing Disabled Console ---" << std::endl;
+    std::cout.setstate(std::ios::badbit);
+    sender->send("nobody is watching", room);
+    std::cout.clear();
+    assert(!first->alreadyRendered[1]);
+    assert(second->alreadyRendered[1]);
+    assert(room->historySize() == 2);
+    
+    sender->leaveChatRoom(room);
+    first->leaveChatRoom(room);
+    second->leaveChatRoom(room);
+    delete sender;
+    delete first;
+    delete second;
+    delete room;
+    
+    std::cout << "\nLazy rendering tests passed!" << std::endl;
+}
+
+void testLogging() {
+    std::cout << "\n=== TESTING LOGGING FACADE ===" << std::endl;
+    
+    std::ostringstream captured;
+    std::streambuf* console = std::cout.rdbuf(captured.rdbuf());
+    int evaluated = 0;
+    
+    // --- Formatting ---
+    PETSPACE_LOG(INFO, ADMIN, "x", 42, ' ', -7, std::size_t(3), Message("m"), std::string("!"));
+    assert(captured.str() == "x42 -73m!\n");
+    
+    // --- Disabled console skips argument evaluation ---
+    std::cout.setstate(std::ios::badbit);
+    PETSPACE_LOG(INFO, ADMIN, ++evaluated);
+    std::cout.clear();
+    assert(evaluated == 0);
+    
+    // --- Compiled-out categories and levels ---
+#pragma push_macro("PETSPACE_LOG_CATEGORIES")
+#pragma push_macro("PETSPACE_LOG_LEVEL")
+#undef PETSPACE_LOG_CATEGORIES
+#undef PETSPACE_LOG_LEVEL
+#define PETSPACE_LOG_CATEGORIES PETSPACE_LOG_ADMIN
+#define PETSPACE_LOG_LEVEL PETSPACE_LOG_WARN
+    PETSPACE_LOG(WARN, DELIVERY, ++evaluated);
+    PETSPACE_LOG(INFO, ADMIN, ++evaluated);
+    PETSPACE_LOG(WARN, ADMIN, "kept ", ++evaluated);
+#pragma pop_macro("PETSPACE_LOG_LEVEL")
+#pragma pop_macro("PETSPACE_LOG_CATEGORIES")
+    assert(evaluated == 1);
+    assert(captured.str() == "x42 -73m!\nkept 1\n");
+    
+    std::cout.rdbuf(console);
+    std::cout << "\nLogging facade tests passed!" << std::endl;
+}
+
+void countWakeup(void* counter) {
+    ++*static_cast<int*>(counter);
+}
+
+#ifdef PETSPACE_HAS_COROUTINES
+InboxTask consumeOneByOne(UserInbox& inbox, std::vector<std::string>& seen) {
+    while (std::optional<InboxMessage> message = co_await nextMessage(inbox)) {
+        seen.push_back(message->text.str());
+    }
+    seen.push_back("<closed>");
+}
+
+InboxTask consumeBatches(UserInbox& inbox, std::vector<std::size_t>& sizes) {
+    for (;;) {
+        std::vector<InboxMessage> batch = co_await nextBatch(inbox, 3);
+        if (batch.empty()) {
+            break;
+        }
+        sizes.push_back(batch.size());
+    }
+}
+#endif
+
+void testInbox() {
+    std::cout << "\n=== TESTING USER INBOX ===" << std::endl;
+    
+    EventLoop loop;
+    CtrlCat* room = new CtrlCat();
+    User1* sender = new User1("InboxSender");
+    User2* reader = new User2("InboxReader");
+    sender->joinChatRoom(room);
+    reader->joinChatRoom(room);
+    UserInbox* inbox = new UserInbox(reader, loop);
+    assert(reader->getInbox() == inbox);
+    
+    std::cout << "\n--- Testing Polling ---" << std::endl;
+    sender->send("first", room);
+    sender->send("hi @InboxReader", room);
+    sender->sendDirect(reader->getHandle(), "direct");
+    sender->broadcast("to everyone");
+    sender->sendBatch({"b1", "b2"}, room);
+    assert(inbox->size() == 6);
+    InboxMessage message;
+    assert(inbox->tryPop(message));
+    assert(message.text == Message("first"));
+    assert(message.sender == sender->getHandle());
+    assert(message.roomId == room->getRoomId());
+    std::vector<InboxMessage> drained;
+    assert(inbox->drain(drained, 2) == 2);
+    assert(drained[1].roomId == 0 && drained[1].text == Message("direct"));
+    assert(inbox->drain(drained, 10) == 3);
+    assert(!inbox->tryPop(message));
+    
+    std::cout << "\n--- Testing Wakeup On The Loop ---" << std::endl;
+    int wakeups = 0;
+    drained.clear();
+    assert(!inbox->drainOrWait(drained, 4, &countWakeup, &wakeups));
+    sender->send("wake up", room);
+    assert(wakeups == 0);
+    assert(loop.pending() == 1);
+    assert(loop.run() == 1);
+    assert(wakeups == 1);
+    sender->send("no waiter", room);
+    assert(loop.pending() == 0);
+    assert(inbox->drainOrWait(drained, 4, &countWakeup, &wakeups));
+    assert(drained.size() == 2);
+    
+#ifdef PETSPACE_HAS_COROUTINES
+    std::cout << "\n--- Testing co_await ---" << std::endl;
+    std::vector<std::string> seen;
+    consumeOneByOne(*inbox, seen);
+    assert(seen.empty());
+    sender->send("one", room);
+    sender->send("two", room);
+    assert(seen.empty());
+    loop.run();
+    assert(seen.size() == 2 && seen[0] == "one" && seen[1] == "two");
+    inbox->close();
+    assert(reader->getInbox() == nullptr);
+    loop.run();
+    assert(seen.back() == "<closed>");
+    delete inbox;
+    
+    inbox = new UserInbox(reader, loop);
+    std::vector<std::size_t> sizes;
+    consumeBatches(*inbox, sizes);
+    sender->sendBatch({"1", "2", "3", "4", "5"}, room);
+    loop.run();
+    assert(sizes.size() == 2 && sizes[0] == 3 && sizes[1] == 2);
+    inbox->close();
+    loop.run();
+#endif
+    
+    std::cout << "\n--- Testing Detach ---" << std::endl;
+    delete inbox;
+    assert(reader->getInbox() == nullptr);
+    sender->send("nobody queues this", room);
+    
+    std::cout << "\n--- Testing Detach During Delivery ---" << std::endl;
+    for (int round = 0; round < 20; round++) {
+        UserInbox* racing = new UserInbox(reader, loop);
+        std::atomic<bool> started(false);
+        std::thread deliverer([&]() {
+            started = true;
+            for (int i = 0; i < 200; i++) {
+                reader->deliverToInbox(Message("racing"), sender, room);
+            }
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        delete racing;
+        deliverer.join();
+        assert(reader->getInbox() == nullptr);
+    }
+    UserInbox orphan(reader, loop);
+    reader->leaveChatRoom(room);
+    delete reader;
+    assert(orphan.isClosed());
+    
+    sender->leaveChatRoom(room);
+    delete sender;
+    delete room;
+    
+    std::cout << "\nUser inbox tests passed!" << std::endl;
+}
+
+void testWorkStealing() {
+    std::cout << "\n=== TESTING WORK-STEALING EXECUTOR ===" << std::endl;
+    
+    std::cout << "\n--- Testing Deque ---" << std::endl;
+    WorkStealingDeque deque;
+    std::vector<User1*> tasks;
+    for (int i = 0; i < 100; i++) {
+        tasks.push_back(new User1("Task" + std::to_string(i)));
+        deque.push(tasks.back());
+    }
+    assert(deque.size() == 100);
+    assert(deque.steal() == tasks[0]);
+    assert(deque.pop() == tasks[99]);
+    assert(deque.steal() == tasks[1]);
+    for (int i = 98; i >= 2; i--) {
+        assert(deque.pop() == tasks[i]);
+    }
+    assert(deque.pop() == nullptr);
+    assert(deque.steal() == nullptr);
+    for (User1* task : tasks) {
+        delete task;
+    }
+    
+    std::cout << "\n--- Testing Uneven Load ---" << std::endl;
+    std::vector<ChatRoom*> rooms = {new CtrlCat(), new Dogorithm(), new CtrlCat(), new Dogorithm()};
+    std::vector<User*> users;
+    for (int i = 0; i < 12; i++) {
+        users.push_back(new User2("Worker" + std::to_string(i)));
+        users.back()->setState(new Offline());
+        for (ChatRoom* room : rooms) {
+            users.back()->joinChatRoom(room);
+        }
+    }
+    std::cout.setstate(std::ios::badbit);
+    {
+        WorkStealingExecutor executor(4, 8);
+        assert(executor.getWorkerCount() == 4);
+        for (int i = 0; i < 600; i++) {
+            // The first two users are bots and send most of the traffic
+            for (std::size_t u = 0; u < users.size(); u++) {
+                if (u < 2 || i % 50 == 0) {
+                    users[u]->sendAsync(std::to_string(i), rooms[(i + u) % rooms.size()], executor);
+                }
+            }
+        }
+        executor.waitIdle();
+        assert(executor.getCommandCount() == 2 * (2 * 600 + 10 * 12));
+        assert(executor.getTaskCount() >= executor.getCommandCount() / 8);
+    }
+    std::cout.clear();
+    std::size_t total = 0;
+    for (ChatRoom* room : rooms) {
+        total += room->historySize();
+        // Per-sender order must survive: each sender's numbers increase
+        std::unordered_map<std::string, int> last;
+        for (std::size_t position = 0; position < room->historySize(); position++) {
+            HistoryEntry entry = room->entryAt(position);
+            std::string sender(entry.sender.begin(), entry.sender.end());
+            int value = std::stoi(entry.text.str());
+            assert(!last.count(sender) || last[sender] < value);
+            last[sender] = value;
+        }
+    }
+    assert(total == 2 * 600 + 10 * 12);
+    for (User* user : users) {
+        assert(user->getQueuedCommandCount() == 0);
+        for (ChatRoom* room : rooms) {
+            user->leaveChatRoom(room);
+        }
+        delete user;
+    }
+    for (ChatRoom* room : rooms) {
+        delete room;
+    }
+    
+    std::cout << "\nWork-stealing executor tests passed!" << std::endl;
+}
+
+void testRingMailbox() {
+    std::cout << "\n=== TESTING RING MAILBOXES ===" << std::endl;
+    
+    std::cout << "\n--- Testing SPSC Ring ---" << std::endl;
+    SpscRing ring(5);
+    assert(ring.capacity() == 8);
+    Message shared(std::string(40, 'x'));
+    for (unsigned int i = 0; i < 8; i++) {
+        assert(ring.tryPush(shared, i));
+    }
+    assert(!ring.tryPush(shared, 8));
+    assert(shared.useCount() == 9);
+    std::vector<InboxMessage> taken;
+    assert(ring.popBatch(taken, 3, 7) == 3);
+    assert(taken[2].sender == 2 && taken[2].roomId == 7);
+    assert(ring.tryPush(shared, 8));
+    assert(ring.popBatch(taken, 100, 7) == 6);
+    assert(taken.back().sender == 8);
+    taken.clear();
+    assert(shared.useCount() == 1);
+    
+    std::cout << "\n--- Testing Overflow Policies ---" << std::endl;
+    CtrlCat* room = new CtrlCat();
+    User1* sender = new User1("RingSender");
+    User2* rejecting = new User2("RingRejecting");
+    User2* spilling = new User2("RingSpilling");
+    User3* direct = new User3("RingDirect");
+    sender->joinChatRoom(room);
+    rejecting->joinChatRoom(room);
+    spilling->joinChatRoom(room);
+    direct->joinChatRoom(room);
+    RingMailbox* rejectBox = new RingMailbox(rejecting, 4, OverflowPolicy::Reject);
+    RingMailbox* spillBox = new RingMailbox(spilling, 4, OverflowPolicy::Spill);
+    assert(spilling->getMailbox() == spillBox);
+    for (int i = 0; i < 6; i++) {
+        sender->send("m" + std::to_string(i), room);
+    }
+    assert(rejectBox->getDeliveredCount() == 4 && rejectBox->getRejectedCount() == 2);
+    assert(spillBox->getDeliveredCount() == 6 && spillBox->getSpilledCount() == 2);
+    assert(spillBox->drain(taken, 5) == 5);
+    sender->send("m6", room);
+    assert(spillBox->drain(taken, 10) == 2);
+    for (int i = 0; i < 7; i++) {
+        assert(taken[i].text == Message("m" + std::to_string(i)));
+    }
+    assert(rejecting->drainMailbox(100) == 4);
+    assert(rejecting->drainMailbox(100) == 0);
+    
+    std::cout << "\n--- Testing Replaced Mailbox ---" << std::endl;
+    delete rejectBox;
+    assert(rejecting->getMailbox() == nullptr);
+    rejectBox = new RingMailbox(rejecting, 4, OverflowPolicy::Reject);
+    sender->send("fresh", room);
+    assert(rejectBox->getDeliveredCount() == 1);
+    
+    std::cout << "\n--- Testing Block With A Concurrent Consumer ---" << std::endl;
+    RingMailbox blockBox(nullptr, 8, OverflowPolicy::Block);
+    MailboxShard* shard = blockBox.shardFor(room);
+    const unsigned int total = 20000;
+    std::thread producer([&]() {
+        for (unsigned int i = 0; i < total; i++) {
+            blockBox.enqueue(shard, Message("b"), i);
+        }
+    });
+    std::vector<InboxMessage> received;
+    while (received.size() < total) {
+        if (!blockBox.drain(received, 64)) {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    for (unsigned int i = 0; i < total; i++) {
+        assert(received[i].sender == i);
+    }
+    assert(blockBox.getDeliveredCount() == total);
+    
+    std::cout << "\n--- Testing Block Without A Consumer ---" << std::endl;
+    RingMailbox stalledBox(nullptr, 4, OverflowPolicy::Block);
+    MailboxShard* stalled = stalledBox.shardFor(room);
+    for (unsigned int i = 0; i < 10; i++) {
+        assert(stalledBox.enqueue(stalled, Message("s"), i));
+    }
+    assert(stalledBox.getSpilledCount() == 6 && stalledBox.getDeliveredCount() == 10);
+    received.clear();
+    assert(stalledBox.drain(received, 100) == 10);
+    for (unsigned int i = 0; i < 10; i++) {
+        assert(received[i].sender == i);
+    }
+    
+    std::cout << "\n--- Testing Every Path Uses The Mailbox ---" << std::endl;
+    CountingReader* routed = new CountingReader("RingRouted");
+    routed->joinChatRoom(room);
+    RingMailbox* routedBox = new RingMailbox(routed, 16, OverflowPolicy::Spill);
+    for (unsigned int round = 0; round < 2; round++) {
+        sender->send("plain", room);
+        sender->send("hey @RingRouted", room);
+        sender->sendBatch({"b1", "b2"}, room);
+        sender->sendDirect(routed->getHandle(), "psst");
+        sender->broadcast("all rooms");
+        assert(routed->received == 0);
+        assert(routedBox->getDeliveredCount() == 6 * (round + 1));
+        if (round == 0) {
+            received.clear();
+            assert(routedBox->drain(received, 100) == 6);
+            for (const InboxMessage& message : received) {
+                assert(message.mention == (message.text == Message("hey @RingRouted")));
+                assert(message.roomId == (message.text == Message("psst") ? 0 : room->getRoomId()));
+            }
+        }
+    }
+    assert(routed->drainMailbox(100) == 6);
+    assert(routed->received == 6);
+    
+    std::cout << "\n--- Testing Left Room Drops Queued Mentions ---" << std::endl;
+    sender->send("plain", room);
+    sender->send("hey @RingRouted", room);
+    routed->leaveChatRoom(room);
+    assert(routed->drainMailbox(100) == 2);
+    assert(routed->received == 6);
+    
+    std::cout << "\n--- Testing Owner Destroyed First ---" << std::endl;
+    delete routed;
+    delete routedBox;
+    
+    sender->leaveChatRoom(room);
+    rejecting->leaveChatRoom(room);
+    spilling->leaveChatRoom(room);
+    direct->leaveChatRoom(room);
+    delete rejectBox;
+    delete spillBox;
+    delete sender;
+    delete rejecting;
+    delete spilling;
+    delete direct;
+    delete room;
+    
+    std::cout << "\nRing mailbox tests passed!" << std::endl;
+}
+
+void testMemoryAccounting() {
+    std::cout << "\n=== TESTING MEMORY ACCOUNTING ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    QueueingUser* sender = new QueueingUser("MemorySender");
+    User2* reader = new User2("MemoryReader");
+    sender->joinChatRoom(room);
+    reader->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Room Counters ---" << std::endl;
+    RoomMemoryUsage before = room->getMemoryUsage();
+    assert(before.membership >= 2 * sizeof(User*));
+    std::string text(100, 'm');
+    sender->send(text, room);
+    RoomMemoryUsage after = room->getMemoryUsage();
+    assert(after.history - before.history >= text.size());
+    assert(after.index > before.index);
+    assert(after.total() == after.history + after.index + after.membership);
+    
+    std::cout << "\n--- Testing History Cap ---" << std::endl;
+    std::size_t cap = after.history * 3 + after.index * 2;
+    room->setMemoryCap(cap);
+    for (int i = 0; i < 10; i++) {
+        sender->send(text, room);
+        RoomMemoryUsage capped = room->getMemoryUsage();
+        assert(capped.history + capped.index <= cap);
+    }
+    assert(room->getHotHistoryCount() >= 1 && room->getHotHistoryCount() <= 3);
+    assert(room->historySize() == 11);
+    
+    std::cout << "\n--- Testing Cap Counts The Index ---" << std::endl;
+    CtrlCat* wordy = new CtrlCat();
+    sender->joinChatRoom(wordy);
+    wordy->setMemoryCap(64 * 1024);
+    for (int i = 0; i < 2000; i++) {
+        sender->send("unique token " + std::to_string(i) + " w" + std::to_string(i * 7), wordy);
+        if (i % 100 == 99) {
+            RoomMemoryUsage capped = wordy->getMemoryUsage();
+            assert(capped.history + capped.index <= 64 * 1024);
+        }
+    }
+    assert(wordy->getColdHistoryCount() > 0);
+    assert(wordy->searchHistory("unique").size() == 2000);
+    sender->leaveChatRoom(wordy);
+    delete wordy;
+    assert(room->historyAt(0) == "MemorySender: " + text);
+    
+    std::cout << "\n--- Testing Queue Cap ---" << std::endl;
+    UserMemoryUsage idle = sender->getMemoryUsage();
+    assert(idle.queue == 0 && idle.mailbox == 0);
+    assert(idle.name > std::string("MemorySender").size());
+    assert(sender->queueMessage(text, room));
+    // The send and log commands share one buffer, so its text is counted once
+    std::size_t perMessage = sender->getMemoryUsage().queue;
+    assert(perMessage == sizeof(SendMessageCommand) + sizeof(LogMessageCommand) + text.size());
+    sender->setMemoryCaps(2 * perMessage + perMessage / 2, 0);
+    assert(sender->queueMessage(text, room));
+    assert(!sender->queueMessage(text, room));
+    assert(sender->sendBatch({text, text}, room) == 0);
+    assert(!sender->sendDirect(reader->getHandle(), std::string(600, 'd')));
+    assert(sender->getMemoryRejectionCount() == 3);
+    sender->executeAll();
+    assert(sender->getMemoryUsage().queue == 0);
+    assert(sender->queueMessage(text, room));
+    sender->executeAll();
+    
+    std::cout << "\n--- Testing Inbox Trimming ---" << std::endl;
+    EventLoop loop;
+    UserInbox* inbox = new UserInbox(reader, loop);
+    reader->setMemoryCaps(0, 2 * (sizeof(InboxMessage) + 2));
+    for (int i = 0; i < 5; i++) {
+        sender->send("i" + std::to_string(i), room);
+    }
+    assert(inbox->size() == 2 && inbox->getTrimmedCount() == 3);
+    assert(reader->getMemoryUsage().mailbox == inbox->memoryUsage());
+    InboxMessage message;
+    assert(inbox->tryPop(message) && message.text == Message("i3"));
+    assert(inbox->tryPop(message) && message.text == Message("i4"));
+    assert(inbox->memoryUsage() == 0);
+    delete inbox;
+    
+    std::cout << "\n--- Testing Mailbox Rejection ---" << std::endl;
+    RingMailbox* mailbox = new RingMailbox(reader, 64, OverflowPolicy::Spill);
+    reader->setMemoryCaps(0, 10);
+    for (int i = 0; i < 4; i++) {
+        sender->send("four", room);
+    }
+    assert(mailbox->getDeliveredCount() == 2 && mailbox->getRejectedCount() == 2);
+    assert(reader->getMemoryUsage().mailbox == mailbox->memoryUsage());
+    assert(mailbox->memoryUsage() > 8);
+    assert(reader->drainMailbox(100) == 2);
+    sender->send("four", room);
+    assert(mailbox->getDeliveredCount() == 3);
+    reader->drainMailbox(100);
+    delete mailbox;
+    
+    sender->leaveChatRoom(room);
+    reader->leaveChatRoom(room);
+    delete sender;
+    delete reader;
+    delete room;
+    
+    std::cout << "\nMemory accounting tests passed!" << std::endl;
+}
+
+void testUserTable() {
+    std::cout << "\n=== TESTING USER TABLE ===" << std::endl;
+    
+    CtrlCat* room = new CtrlCat();
+    User1* sender = new User1("TableSender");
+    User2* quiet = new User2("TableQuiet");
+    User3* watcher = new User3("TableWatcher");
+    EnvelopeReader* reader = new EnvelopeReader("TableReader");
+    sender->joinChatRoom(room);
+    quiet->joinChatRoom(room);
+    watcher->joinChatRoom(room);
+    reader->joinChatRoom(room);
+    
+    std::cout << "\n--- Testing Hot Fields ---" << std::endl;
+    unsigned int handle = quiet->getHandle();
+    assert(UserTable::stateOf(handle) == StateTag::Online);
+    assert(UserTable::flagsOf(handle) == (UserTable::Plain | UserTable::Passive));
+    assert(!(UserTable::flagsOf(reader->getHandle()) & UserTable::Plain));
+    quiet->setState(new Offline());
+    watcher->setState(new CountingBusy());
+    assert(UserTable::stateOf(handle) == StateTag::Offline);
+    assert(UserTable::stateOf(watcher->getHandle()) == StateTag::Custom);
+    assert(!(UserTable::flagsOf(watcher->getHandle()) & UserTable::Passive));
+    quiet->setAdmin(true);
+    assert(UserTable::flagsOf(handle) & UserTable::Admin);
+    assert(room->countMembersInState(StateTag::Offline) == 1);
+    assert(room->countMembersInState(StateTag::Online) == 2);
+    
+    std::cout << "\n--- Testing Quiet Fanout ---" << std::endl;
+    EventLoop loop;
+    UserInbox* inbox = new UserInbox(quiet, loop);
+    assert((UserTable::flagsOf(handle) & (UserTable::Inbox | UserTable::Passive)) == UserTable::Inbox);
+    int mentionsBefore = CountingBusy::mentions;
+    std::cout.setstate(std::ios::badbit);
+    assert(!UserTable::deliveryVisible());
+    sender->send("quiet hello @TableWatcher", room);
+    sender->sendBatch({"q1", "q2"}, room);
+    std::cout.clear();
+    assert(UserTable::deliveryVisible());
+    assert(reader->lines.size() == 1);
+    assert(CountingBusy::mentions == mentionsBefore + 1);
+    assert(inbox->size() == 3);
+    delete inbox;
+    assert(UserTable::flagsOf(handle) & UserTable::Passive);
+    
+    std::cout << "\n--- Testing Handle Reuse ---" << std::endl;
+    quiet->leaveChatRoom(room);
+    delete quiet;
+    assert(UserTable::flagsOf(handle) == 0);
+    User2* next = new User2("TableNext");
+    assert(next->getHandle() == handle);
+    assert(!(UserTable::flagsOf(handle) & UserTable::Admin));
+    delete next;
+    
+    std::cout << "\n--- Testing Growth During Fanout ---" << std::endl;
+    std::vector<User*> crowd;
+    std::cout.setstate(std::ios::badbit);
+    {
+        WorkStealingExecutor executor(2, 4);
+        for (int i = 0; i < 200; i++) {
+            sender->sendAsync("growing " + std::to_string(i), room, executor);
+        }
+        // New handles are registered while the workers read member flags
+        for (int i = 0; i < 9000; i++) {
+            crowd.push_back(new User2("Crowd" + std::to_string(i)));
+        }
+        executor.waitIdle();
+    }
+    std::cout.clear();
+    unsigned int far = crowd.back()->getHandle();
+    assert(far >= 8192);
+    crowd.back()->setState(new Offline());
+    assert(UserTable::stateOf(far) == StateTag::Offline);
+    assert(UserTable::flagsOf(far) == (UserTable::Plain | UserTable::Passive));
+    for (User* user : crowd) {
+        delete user;
+    }
+    assert(UserTable::stateOf(far) == StateTag::Online && UserTable::flagsOf(far) == 0);
+    
+    sender->leaveChatRoom(room);
+    watcher->leaveChatRoom(room);
+    reader->leaveChatRoom(room);
+    delete sender;
+    delete watcher;
+    delete reader;
+    delete room;
+    
+    std::cout << "\nUser table tests passed!" << std::endl;
+}
+
+void testReadCursors() {
+    std::cout << "\n=== TESTING READ CURSORS ===" << std::endl;
+    
+    Dogorithm* room = new Dogorithm();
+    CtrlCat* other = new CtrlCat();
+    User1* sender = new User1("CursorSender");
+    User2* reader = new User2("CursorReader");
+    sender->joinChatRoom(room);
+    sender->send("before joining", room);
+    reader->joinChatRoom(room);
+    reader->joinChatRoom(other);
+    
+    std::cout << "\n--- Testing Unread Counts ---" << std::endl;
+    assert(reader->getReadCursor(room) == 1);
+    assert(reader->getUnreadCount(room) == 0);
+    for (int i = 1; i <= 5; i++) {
+        sender->send("unread " + std::to_string(i), room);
+    }
+    assert(reader->getUnreadCount(room) == 5);
+    assert(reader->getUnreadCount(other) == 0);
+    assert(reader->acknowledge(room, 3));
+    assert(reader->getUnreadCount(room) == 3);
+    assert(reader->acknowledge(room, 2));
+    assert(reader->getReadCursor(room) == 3);
+    assert(reader->acknowledge(room, 100));
+    assert(reader->getReadCursor(room) == 6);
+    CustomChatRoom stranger("Stranger");
+    assert(!reader->acknowledge(&stranger, 1));
+    assert(!reader->acknowledge(nullptr));
+    
+    std::cout << "\n--- Testing Fetch Unread ---" << std::endl;
+    sender->send("fresh 1", room);
+    sender->send("fresh 2", room);
+    ChatHistoryIterator* unread = reader->fetchUnread(room);
+    assert(unread->hasNext());
+    assert(unread->next() == "CursorSender: fresh 1");
+    assert(unread->next() == "CursorSender: fresh 2");
+    assert(!unread->hasNext());
+    delete unread;
+    assert(reader->acknowledge(room));
+    assert(reader->getUnreadCount(room) == 0);
+    unread = reader->fetchUnread(room);
+    assert(!unread->hasNext());
+    delete unread;
+    
+    std::cout << "\n--- Testing History Reload ---" << std::endl;
+    assert(room->saveHistory("cursor_test.hist"));
+    for (int i = 0; i < 3; i++) {
+        sender->send("dropped by reload", room);
+    }
+    assert(reader->acknowledge(room));
+    assert(reader->getReadCursor(room) == 11);
+    assert(room->loadHistory("cursor_test.hist"));
+    assert(room->getHeadSequence() == 8);
+    assert(reader->getReadCursor(room) == 8);
+    sender->send("after reload", room);
+    assert(reader->getUnreadCount(room) == 1);
+    unread = reader->fetchUnread(room);
+    assert(unread->next() == "CursorSender: after reload");
+    delete unread;
+    std::remove("cursor_test.hist.idx");
+    std::remove("cursor_test.hist");
+    
+    std::cout << "\n--- Testing Membership ---" << std::endl;
+    reader->leaveChatRoom(room);
+    assert(reader->fetchUnread(room) == nullptr);
+    assert(reader->getUnreadCount(room) == 0);
+    assert(reader->getReadCursor(other) == 0);
+    sender->send("while away", room);
+    reader->joinChatRoom(room);
+    assert(reader->getReadCursor(room) == room->getHeadSequence());
+    
+    reader->leaveChatRoom(room);
+    reader->leaveChatRoom(other);
+    sender->leaveChatRoom(room);
+    delete sender;
+    delete reader;
+    delete room;
+    delete other;
+    
+    std::cout << "\nRead cursor tests passed!" << std::endl;
+}
+
+void testPayloadStore() {
+    std::cout << "\n=== TESTING PAYLOAD STORE ===" << std::endl;
+    
+    std::cout << "\n--- Testing Hash ---" << std::endl;
+    std::string announcement = "Scheduled maintenance tonight at 22:00, expect short outages";
+    assert(PayloadStore::hash(announcement) == PayloadStore::hash(std::string(announcement)));
+    assert(PayloadStore::hash(announcement) != PayloadStore::hash(announcement + "!"));
+    assert(PayloadStore::hash("abcdefgh") != PayloadStore::hash(std::string_view("abcdefgh\0", 9)));
+    
+    PayloadStore store;
+    PayloadStore::install(&store);
+    CtrlCat* first = new CtrlCat();
+    Dogorithm* second = new Dogorithm();
+    User1* bot = new User1("AnnounceBot");
+    bot->joinChatRoom(first);
+    bot->joinChatRoom(second);
+    
+    std::cout << "\n--- Testing Shared Payloads ---" << std::endl;
+    bot->send(announcement, first);
+    bot->send(announcement, second);
+    bot->send(announcement, second);
+    bot->send("short one", first);
+    assert(store.getLookupCount() == 3);
+    assert(store.getHitCount() == 2);
+    assert(store.getBlobCount() == 1);
+    assert(store.getStoredBytes() == announcement.size());
+    HistoryEntry a = first->entryAt(0);
+    HistoryEntry b = second->entryAt(1);
+    assert(a.text.data() == b.text.data());
+    assert(a.text.useCount() == 6);
+    assert(store.getSavedBytes() == 2 * announcement.size() + 2 * announcement.size());
+    assert(first->getMemoryUsage().deduplicated == 0);
+    assert(second->getMemoryUsage().deduplicated == 2 * announcement.size());
+    assert(first->historyAt(0) == "AnnounceBot: " + announcement);
+    second->setHistoryRetention(HistoryRetention(1));
+    assert(second->getMemoryUsage().deduplicated == announcement.size());
+    bot->send("short two", second);
+    assert(second->getMemoryUsage().deduplicated == 0);
+    assert(second->historyAt(1) == "AnnounceBot: " + announcement);
+    
+    std::cout << "\n--- Testing Collection ---" << std::endl;
+    a = HistoryEntry();
+    b = HistoryEntry();
+    bot->leaveChatRoom(first);
+    bot->leaveChatRoom(second);
+    delete first;
+    delete second;
+    assert(store.getSavedBytes() == 0);
+    assert(store.collect() == 1);
+    assert(store.getBlobCount() == 0 && store.getStoredBytes() == 0);
+    
+    PayloadStore::install(nullptr);
+    CtrlCat* plain = new CtrlCat();
+    bot->joinChatRoom(plain);
+    bot->send(announcement, plain);
+    assert(store.getLookupCount() == 3);
+    bot->leaveChatRoom(plain);
+    delete plain;
+    delete bot;
+    
+    std::cout << "\nPayload store tests passed!" << std::endl;
+}
+
 int main() {
     std::cout << "========================================" << std::endl;
     std::cout << "    PETSPACE DESIGN PATTERNS TESTING   " << std::endl;
@@ -788,6 +2807,33 @@ int main() {
     testIteratorComprehensive();
     testCustomChatRoomComprehensive();
     
+    // EXTRA FEATURE TESTS
+    testHistorySearch();
+    testHistoryRetention();
+    testHistoryPaging();
+    testSharedMessages();
+    testAllocatorPlumbing();
+    testRateLimiting();
+    testCommandPriority();
+    testBatchSend();
+    testBroadcast();
+    testDirectMessaging();
+    testMentions();
+    testRoomRegistry();
+    testSnapshots();
+    testCommandJournal();
+    testTraceReplay();
+    testPresence();
+    testLazyRendering();
+    testLogging();
+    testInbox();
+    testWorkStealing();
+    testRingMailbox();
+    testMemoryAccounting();
+    testUserTable();
+    testReadCursors();
+    testPayloadStore();
+    
     std::cout << "========================================" << std::endl;
     std::cout << "         ALL TESTS COMPLETED!          " << std::endl;
     std::cout << "========================================" << std::endl;